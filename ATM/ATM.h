@@ -1,19 +1,7 @@
 #ifndef ATM_H
 #define ATM_H
 
-#include <iostream>
-#include <string>
-#include <QString>
-#include <QtSql>
-#include <exception>
-#include <cassert>
-
-
-// TODO: Move DB configuration data to a better place
-#define BANK_DATABASE_DRIVER "QSQLITE"
-#define BANK_DATABASE_NAME "bank.db"
-
-using namespace std;
+#include "ATMBase.h"
 
 // There may be many different options as for configuration of an ATM, such as:
 // - a window to be used as a display and input source, a window to show printer output
@@ -29,189 +17,18 @@ class IPrinter;     // Entities that provide or emulate printing capabilities mu
 // Terminal combines all the modules generaly found in ATMs
 class ITerminal;
 
-class ATM
-{
-public:
-    // Interface for everything that can be connected to an ATM: displays, printers, fingerprints scanners, etc.
-    class IConnectableModule;
-    class InputContainer;
-    //class CardState;
-
-    // Construct ATM from an all-inclusive terminal
-    explicit ATM(ITerminal* terminal);
-    // Construct ATM from any combination of modules (NULL means module is not available)
-    ATM(IDisplay* display, IKeyboard* keyboard, IPrinter* printer);
-    virtual ~ATM();
-
-    // Accept input from user
-    void processInput(QString input);
-
-    void powerOn();
-    void powerOff();
-
-    void cancelOperation();
-
-    inline bool isOn()
-    {
-        return (_state != POWER_OFF);
-    }
-
-private:
-    static const size_t MAX_PIN_ERRORS;     // 3
-
-    // Ejection messages
-    static const QString EJECT_SUCCESS;
-    static const QString EJECT_ERR_CONN;    // No connection to bank DB
-    static const QString EJECT_ERR_READ;    // Invalid or inexistant card number
-    static const QString EJECT_ERR_FAIL;    // Other error
-
-    // Seizure messages
-    static const QString SEIZE_INVALID_PIN; // You have stolen it, haven't you?
-    static const QString SEIZE_INACTIVE;    // The card is not yet or no longer active
-
-    void onCardInserted(QString cardNumber);
-    void onPinEntered(QString cardsPin);
-    void topMenu(QString selectedService);
-
-    void showBalanceOptions();
-    // TODO: String parameters here are just begging to be replaced with numerical codes.
-    void onCardEjected(QString message = EJECT_SUCCESS);
-    void onCardSeized(QString message);
-
-    // Perform common operations on card seizure/ejection
-    // (such as DB disconnection)
-    void finalizeCard();
-
-    // Query DB for currently inserted card's data
-    inline void updateCardData()
-    {
-        updateCardData(_current_card->_card_number);
-    }
-    bool cardExists(QString number);
-    // Query DB for card data by its number
-    void updateCardData(QString cardNumber);
-    // Mark currently inserted card as inactive in DB
-    void deactivateCard();
-
-    void showBalance();
-    void printBalance();
-    void requestPin(bool afterError = false);
-    void requestAmount();
-    void requestRecepient();
-
-    // Show text on display unless there is no display
-    void displayText(QString text);
-    // Draw main menu on the screen
-    void displayTopMenu();
-    // TODO: Something along the lines of...
-    // enum MenuType {MENU_MAIN = 0, MENU_CURRENCY = 1, MENU_AMOUNT_SELECTION = 2, ...};
-    // void displayMenu(MenuType menu = MENU_MAIN);
-
-    // Print text to printer, if it is connected
-    void printText(QString text);
-
-    // TODO: Separate from this class entirely?
-    void executeQuery(QString query);     // throws DatabaseQueryFailedException
-
-private:
-    // ATM errors
-    class InternalErrorException;               // Base class for all errors ATM may encounter
-    class DatabaseConnectionFailedException;    // Failed to open connection to the database
-    class DatabaseQueryFailedException;         // Failed to execute a query to the database
-    class FailedToReadCardException;            // Invalid card number read
-    class CardInactiveException;                // Inserted card is blocked or inactive,
-                                                // therefore no operations can be performed with it
-    class NotImplementedException;              // Feature is not yet implemented
-
-    struct Card
-    {
-        QString _card_number;
-        bool _is_active;
-        QString _pin;
-        QString _owner_last_name;
-        bool _owner_gender_male;    // For politeness :)
-        double _balance;
-        //etc.
-    };
-
-    Card* _current_card;
-
-    enum ATMState
-    {
-        POWER_OFF   = 0,
-        NO_CARD     = 1,
-        PENDING_PIN = 2,
-        TOP_MENU    = 3
-    };
-    enum MenuState
-    {
-        TOP                 = 0,
-        SHOW_BALANCE_METHOD = 1,
-        DISPLAY_BALANCE     = 2,
-        PRINT_BALANCE       = 3,
-        WITHDRAWAL_AMOUNT   = 4,
-        TRANSFER_AMOUNT     = 5,
-        TRANSFER_RECEPIENT  = 6,
-        MOBILE_AMOUNT       = 7,
-        MOBILE_RECEPIENT    = 8,
-        REPORT_RESULT       = 9
-    };
-    enum TransactionResult
-    {
-        TRANS_SUCCESS           = 0,
-        TRANS_FAIL              = 1,
-        TRANS_NOT_ENOUGH_FUNDS  = 2,
-        TRANS_INVALID_RECEPIENT = 3
-    };
-
-    ATMState _state;
-    MenuState _menu_state;
-    IDisplay* _display;
-    IPrinter* _printer;
-    IKeyboard* _keyboard;
-
-    // TODO: Move everything related to DB to a separate class
-    //==========
-    // Templates for common SQL queries
-    static const QString SELECT_CARD_BY_NUMBER;
-    static const QString DEACTIVATE_CARD;
-    static const QString WITHDRAW_FUNDS;
-    static const QString UPLOAD_FUNDS;
-    //etc.
-
-    QSqlDatabase _database; // Connection to DB
-
-    size_t _pin_attempts_left;
-
-    double _pending_transfer_amount;    // Used to save input
-
-private:
-    ATM::TransactionResult withdrawFunds(double amount);
-    ATM::TransactionResult transferFunds(QString targetCardNumber, double amount);
-};
-
-// Interface for everything that can be connected to ATM: displays, printers, fingerprints scanners, etc.
-class ATM::IConnectableModule
-{
-public:
-    // Called when ATM establishes connection to its module
-    virtual void connect(const ATM& atm) = 0;
-    // Called when ATM disconnects (e.g. when it is destroyed)
-    virtual void disconnect() = 0;
-};
-
 // Window that serves as ATM's display must implement this interface
-class IDisplay : public virtual ATM::IConnectableModule
+class IDisplay : public virtual ATMBase::IConnectableModule
 {
 public:
     // Output text to the display
-    virtual void showText(QString text) = 0;
-    virtual void showCardState(QString text) = 0;
-    virtual void appendText(QString text) = 0;
+    virtual void showText(const QString& text) = 0;
+    virtual void showCardState(const QString& text) = 0;
+    virtual void appendText(const QString& text) = 0;
 };
 
 // Entities responsible for user input must implement this interface
-class IKeyboard : public virtual ATM::IConnectableModule
+class IKeyboard : public virtual ATMBase::IConnectableModule
 {
 public:
     virtual void enableInput() = 0;
@@ -221,11 +38,11 @@ public:
 };
 
 // Entities that provide or emulate printing capabilities must implement this interface
-class IPrinter : public virtual ATM::IConnectableModule
+class IPrinter : public virtual ATMBase::IConnectableModule
 {
 public:
     // Output text to the printer
-    virtual void printText(QString text) = 0;
+    virtual void printText(const QString& text) = 0;
     virtual void enablePrinter() = 0;
     virtual void disablePrinter() = 0;
 };
@@ -234,83 +51,221 @@ public:
 class ITerminal : public virtual IDisplay, public virtual IKeyboard, public virtual IPrinter
 {};
 
-// Internal errors
+// Modules that are known at compile time not to be there.
+// Every call to them compiles to nothing.
+class NoDisplay
+{
+public:
+    template <class Owner> void connect(const Owner&) {}
+    void disconnect() {}
+    void showText(const QString&) {}
+    void showCardState(const QString&) {}
+    void appendText(const QString&) {}
+};
 
-// Base class for all internal errors of the ATM
-class ATM::InternalErrorException : public std::exception
+class NoKeyboard
 {
 public:
-    explicit InternalErrorException(QString message = "Unknown internal error."):
-        std::exception(message.toStdString().c_str())
-    {}
+    template <class Owner> void connect(const Owner&) {}
+    void disconnect() {}
+    void enableInput() {}
+    void disableInput() {}
+    void enableKeyboard() {}
+    void disableKeyboard() {}
 };
 
-// Failed to open connection to the database.
-class ATM::DatabaseConnectionFailedException : public ATM::InternalErrorException
+class NoPrinter
 {
 public:
-    explicit DatabaseConnectionFailedException(QString message = "Failed to connect to bank database."):
-        InternalErrorException(message)
-    {}
+    template <class Owner> void connect(const Owner&) {}
+    void disconnect() {}
+    void printText(const QString&) {}
+    void enablePrinter() {}
+    void disablePrinter() {}
 };
 
-// Failed to execute a query to the database.
-class ATM::DatabaseQueryFailedException : public ATM::InternalErrorException
+// Whether a module type stands for an actual module
+template <class Module> struct ModuleTraits { enum { INSTALLED = 1 }; };
+template <> struct ModuleTraits<NoDisplay> { enum { INSTALLED = 0 }; };
+template <> struct ModuleTraits<NoKeyboard> { enum { INSTALLED = 0 }; };
+template <> struct ModuleTraits<NoPrinter> { enum { INSTALLED = 0 }; };
+
+// Module the ATM talks to. Actual modules may still be missing at run time (NULL).
+template <class Module, bool Installed = ModuleTraits<Module>::INSTALLED>
+class ModuleSlot
 {
-private:
-    bool _seize_card;
 public:
-    explicit DatabaseQueryFailedException(bool seizeCard = false, QString message = "Query execution failed."):
-        InternalErrorException(message), _seize_card(seizeCard)
-    {}
-    inline bool mustSeizeCard() const
+    explicit ModuleSlot(Module* module): _module(module) {}
+
+    bool present() const
     {
-        return _seize_card;
+        return _module != NULL;
     }
-    inline void setSeizeCard(bool seize)
+
+    Module* operator->() const
     {
-        _seize_card = seize;
+        return _module;
     }
+
+private:
+    Module* _module;
 };
 
-// Inserted card number is invalid
-class ATM::FailedToReadCardException : public ATM::InternalErrorException
+// Missing module: presence check is a constant, so calls guarded by it are dropped
+template <class Module>
+class ModuleSlot<Module, false>
 {
 public:
-    explicit FailedToReadCardException(QString message = "Failed to read card."):
-        ATM::InternalErrorException(message)
-    {}
+    explicit ModuleSlot(Module*) {}
+
+    bool present() const
+    {
+        return false;
+    }
+
+    Module* operator->() const
+    {
+        return NULL;
+    }
 };
 
-// Inserted card is blocked or not activated, therefore no operations can be performed with it
-class ATM::CardInactiveException : public ATM::InternalErrorException
+// ATM whose module types are fixed at compile time.
+//
+// Calls to modules are not virtual unless module types themselves are interfaces,
+// so output paths of a concrete configuration get inlined, and No* modules vanish.
+// ATM is the configuration with modules pluggable at run time.
+//
+// Member functions are defined in ATM.tpp, included at the end of this file,
+// so any module configuration can be used without listing it anywhere.
+template <class Display, class Keyboard, class Printer>
+class BasicATM : public ATMBase
 {
 public:
-    explicit CardInactiveException(QString message = "Inserted card is inactive."):
-        InternalErrorException(message)
-    {}
+    // NULL means module is not available
+    explicit BasicATM(Display* display = NULL, Keyboard* keyboard = NULL, Printer* printer = NULL);
+    ~BasicATM();
+
+    // Accept input from user
+    void processInput(const QString& input);
+
+    void powerOn();
+    void powerOff();
+
+    void cancelOperation();
+
+    // Finish handling the entered PIN once its check is done (see setPinCheckWakeUp())
+    void completePinCheck();
+
+protected:
+    // Modules that need to know their ATM get it from the most derived class
+    template <class Owner>
+    void connectModules(const Owner& owner)
+    {
+        if(_display.present())
+        {
+            _display->connect(owner);
+        }
+        if(_keyboard.present())
+        {
+            _keyboard->connect(owner);
+        }
+        if(_printer.present())
+        {
+            _printer->connect(owner);
+        }
+    }
+
+    ModuleSlot<Display> _display;
+    ModuleSlot<Keyboard> _keyboard;
+    ModuleSlot<Printer> _printer;
+
+    void onCardInserted(QString cardNumber);
+    // Bring back the card of a session the last run died in, once it is read again
+    void resumeSession(const SessionRecord& session, const QString& cardNumber);
+    void onPinEntered(const QString& cardsPin);
+    void onPinChecked(CardStatus status, bool matched);
+    // Keypad stays off until completePinCheck()
+    void awaitPinCheck();
+    void topMenu(const QString& selectedService);
+
+    // Carry out pending operation and report its result
+    void completeWithdrawal();
+    void completeTransfer();
+    void completeMobileRecharge();
+    // Ask for PIN again before letting a suspicious operation through
+    void requestStepUp(FraudScorer::Operation operation);
+    void onStepUpPinEntered(const QString& cardsPin);
+    void onStepUpPinChecked(CardStatus status, bool matched);
+
+    void showBalanceOptions();
+    // TODO: String parameters here are just begging to be replaced with numerical codes.
+    void onCardEjected(const QString& message = EJECT_SUCCESS);
+    void onCardSeized(const QString& message);
+
+    // Eject or seize card according to the reason it cannot be served
+    void rejectCard(CardStatus status);
+
+    // All three return false if card had to be rejected
+    bool showBalance();
+    bool printBalance();
+    // Recent history of the card, streamed to the printer page by page
+    bool printStatement();
+    void requestPin(bool afterError = false);
+    void requestAmount();
+    void requestRecepient();
+
+    // Show text on display unless there is no display
+    void displayText(const QString& text);
+    void showCardState(const QString& state);
+    // Draw main menu on the screen
+    void displayTopMenu();
+    // TODO: Something along the lines of...
+    // enum MenuType {MENU_MAIN = 0, MENU_CURRENCY = 1, MENU_AMOUNT_SELECTION = 2, ...};
+    // void displayMenu(MenuType menu = MENU_MAIN);
+
+    // Print text to printer, if it is connected
+    void printText(const QString& text);
 };
 
-// Feature is not yet implemented
-class ATM::NotImplementedException : public ATM::InternalErrorException
+// ATM with modules pluggable at run time
+class ATM : public BasicATM<IDisplay, IKeyboard, IPrinter>
 {
 public:
-    explicit NotImplementedException(QString message = "This feature is not yet implemented."):
-        InternalErrorException(message)
-    {}
+    class InputContainer;
+
+    // Construct ATM from an all-inclusive terminal
+    explicit ATM(ITerminal* terminal);
+    // Construct ATM from any combination of modules (NULL means module is not available)
+    ATM(IDisplay* display, IKeyboard* keyboard, IPrinter* printer);
+    virtual ~ATM();
 };
 
-// ATM keyboard (so far only a PIN container)
+// ATM without any modules, for simulators and headless builds
+typedef BasicATM<NoDisplay, NoKeyboard, NoPrinter> HeadlessATM;
+
+// ATM keyboard: keypad queue and the digits typed so far
 //==========
 
+// Keys go through a KeypadQueue and are taken by the state machine in the
+// order they were pressed. A key that comes while the ATM is still busy with
+// an earlier one (e.g. from a module called back during a slow DB statement)
+// waits in the queue instead of being handled in the middle of it.
+//
+// Keys typed ahead of the screen they land on are:
+// - kept for menu selections, so that a customer who knows the menus can go
+//   through them without waiting for every screen;
+// - discarded for PIN, amount and recipient entry, which must not take
+//   digits meant for something else, and once the card is gone.
 class ATM::InputContainer {
 private:
     static const int _size_of_pin = 4;
     static const int _size_of_menu_option = 1;
     QString _pin;
     ATM& _atm;
+    KeypadQueue _keys;
+    bool _draining;
 public:
-    explicit InputContainer(ATM& atm):_atm(atm),_pin(){}
+    explicit InputContainer(ATM& atm):_pin(),_atm(atm),_draining(false){}
 
     ~InputContainer(){}
 
@@ -323,24 +278,15 @@ public:
         return _pin.size()==0;
     }
 
+    // Queue the key and handle whatever is queued, unless that is under way already.
+    // Keyboards that know when the key was pressed say so (SessionTracer::now() clock).
     void acceptInput(QChar input) {
-        if (_atm._state == ATM::PENDING_PIN ||
-                _atm._menu_state == WITHDRAWAL_AMOUNT ||
-                _atm._menu_state == TRANSFER_AMOUNT ||
-                _atm._menu_state == TRANSFER_RECEPIENT ||
-                _atm._menu_state == MOBILE_AMOUNT ||
-                _atm._menu_state == MOBILE_RECEPIENT)
-        {
-            addNextToArray(input);
-            _atm._display->appendText((_atm._state == ATM::PENDING_PIN) ? "*" : QString(input));
-        }
-        else if(_atm._state == ATM::TOP_MENU)
-        {
-           _atm.processInput(input);
-        }
-        else
+        acceptInput(input, SessionTracer::now());
+    }
+    void acceptInput(QChar input, qint64 pressedNs) {
+        if(_keys.push(input, pressedNs))
         {
-            assert(false && "FATAL: Unexpected call to ATM::InputContainer::acceptInput()!!!");
+            drain();
         }
     }
 
@@ -357,7 +303,83 @@ public:
         _pin.clear();
     }
 
+    // Handled, discarded and dropped keys, and how long they waited
+    const KeypadQueue::Stats& keypadStats() const {
+        return _keys.stats();
+    }
+
 private:
+    void drain() {
+        if(_draining)
+        {
+            // Key came from within the handling of an earlier one: it is next
+            return;
+        }
+        _draining = true;
+        KeypadQueue::Key key;
+        while(_keys.pop(key))
+        {
+            if(key._pressed_ns < _atm._state_changed_ns && !keepsTypeAhead())
+            {
+                _keys.recordDiscarded();
+                continue;
+            }
+            _keys.recordHandled(SessionTracer::now() - key._pressed_ns);
+            _atm._tracer.recordSpan("key", "input", _atm.stateName(), key._pressed_ns);
+            handle(key._key);
+        }
+        _draining = false;
+    }
+
+    bool keepsTypeAhead() const {
+        if(_atm._state != ATM::TOP_MENU)
+        {
+            return false;
+        }
+        switch(_atm._menu_state)
+        {
+        case TOP:
+        case SHOW_BALANCE_METHOD:
+        case DISPLAY_BALANCE:
+        case REPORT_RESULT:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    void handle(QChar input) {
+        if (_atm._state == ATM::PENDING_PIN ||
+                _atm._menu_state == CONFIRM_PIN ||
+                _atm._menu_state == WITHDRAWAL_AMOUNT ||
+                _atm._menu_state == TRANSFER_AMOUNT ||
+                _atm._menu_state == TRANSFER_RECEPIENT ||
+                _atm._menu_state == MOBILE_AMOUNT ||
+                _atm._menu_state == MOBILE_RECEPIENT)
+        {
+            const bool masked = (_atm._state == ATM::PENDING_PIN || _atm._menu_state == CONFIRM_PIN);
+            if(addNextToArray(input) && _atm._display.present())
+            {
+                _atm._display->appendText(masked ? ATM::PIN_MASK : ATM::DIGITS[input.digitValue()]);
+            }
+            if(masked && isPin())
+            {
+                // Hash check takes a while: let it run while the customer reaches for Enter
+                _atm.prefetchPinCheck(_pin);
+            }
+        }
+        else if(_atm._state == ATM::TOP_MENU)
+        {
+            // Menu keys are digits: reuse prebuilt strings
+            const int digit = input.digitValue();
+            _atm.processInput((digit >= 0) ? ATM::DIGITS[digit] : QString(input));
+        }
+        else
+        {
+            assert(false && "FATAL: Unexpected call to ATM::InputContainer::acceptInput()!!!");
+        }
+    }
+
     bool addNextToArray(QChar input){
         if(input.digitValue() == -1)
         {
@@ -369,4 +391,6 @@ private:
     }
 };
 
+#include "ATM.tpp"
+
 #endif // ATM_H
@@ -13,11 +13,12 @@ TEMPLATE = app
 
 
 SOURCES += main.cpp\
-        mainwindow.cpp \
-    ATM.cpp
+        mainwindow.cpp
 
-HEADERS  += mainwindow.h \
-    ATM.h
+HEADERS  += mainwindow.h
+
+# ATM itself and its subsystems
+include(ATMCore.pri)
 
 FORMS    += mainwindow.ui
 
@@ -0,0 +1,898 @@
+// BasicATM member definitions.
+// Included at the end of ATM.h, so that every configuration is instantiated
+// where it is used; not to be compiled on its own.
+
+#include <cassert>
+#include <QTime>
+#include <QDate>
+#include <QDateTime>
+
+// Printed statements cover this many days back from now
+static const qint64 STATEMENT_DAYS = 90;
+
+// Hands statement pages to the printer as they are formatted
+template <class Printer>
+class PrinterSink : public StatementExporter::ISink
+{
+public:
+    explicit PrinterSink(const ModuleSlot<Printer>& printer): _printer(printer) {}
+
+    void write(const QString& chunk)
+    {
+        _printer->printText(chunk);
+    }
+
+private:
+    const ModuleSlot<Printer>& _printer;
+};
+
+template <class Display, class Keyboard, class Printer>
+BasicATM<Display, Keyboard, Printer>::BasicATM(Display* display, Keyboard* keyboard, Printer* printer):
+    _display(display),
+    _keyboard(keyboard),
+    _printer(printer)
+{
+}
+
+template <class Display, class Keyboard, class Printer>
+BasicATM<Display, Keyboard, Printer>::~BasicATM()
+{
+    if(_state != POWER_OFF)
+    {
+        powerOff();
+    }
+    if(_display.present())
+    {
+        _display->disconnect();
+    }
+    if(_keyboard.present())
+    {
+        _keyboard->disconnect();
+    }
+    if(_printer.present())
+    {
+        _printer->disconnect();
+    }
+    // Do NOT delete connectable modules! We are not responsible for their cleanup.
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::processInput(const QString& input)
+{
+    auditTopUpRefunds();
+    auditMaintenance();
+    auditLimits();
+    refreshCardFilter();
+    // Keypad is off while the entered PIN is checked: nothing is taken until completePinCheck()
+    if(_pin_check != 0)
+    {
+        return;
+    }
+    SessionTracer::Scope span(_tracer, "processInput", "input", stateName());
+    try
+    {
+        // Interpret input according to current state
+        switch(_state)
+        {
+            case POWER_OFF:
+            case OUT_OF_SERVICE:
+            //case LOADING:
+                break;
+            case NO_CARD:
+                // User has stuck a card into us, let's process it
+                onCardInserted(input);
+                break;
+            case PENDING_PIN:
+                onPinEntered(input);
+                break;
+            case TOP_MENU:
+                switch(this->_menu_state)
+                {
+                default:
+                    topMenu(input);
+                    break;
+                // An operation keeps its ID until its result has been reported (see topMenu()):
+                // the same entry coming again is not applied twice
+                case WITHDRAWAL_AMOUNT:
+                    _pending_transfer_amount = input.toDouble();
+                    assignTransactionId();
+                    completeWithdrawal();
+                    break;
+                case TRANSFER_AMOUNT:
+                    setMenuState(TRANSFER_RECEPIENT);
+                    _pending_transfer_amount = input.toDouble();
+                    requestRecepient();
+                    break;
+                case TRANSFER_RECEPIENT:
+                    _pending_recepient = input;
+                    assignTransactionId();
+                    completeTransfer();
+                    break;
+                case MOBILE_AMOUNT:
+                    setMenuState(MOBILE_RECEPIENT);
+                    _pending_transfer_amount = input.toDouble();
+                    displayText(PROMPT_PHONE);
+                    break;
+                case MOBILE_RECEPIENT:
+                    _pending_recepient = input;
+                    assignTransactionId();
+                    completeMobileRecharge();
+                    break;
+                case CONFIRM_PIN:
+                    onStepUpPinEntered(input);
+                    break;
+                }
+                break;
+            default:
+                // WAT!?
+                assert(false && "FATAL: Unhandled ATM state in processInput()!!!");
+                break;
+        }
+    }
+    catch(const InternalErrorException& e)          // Something went really wrong
+    {
+        onCardEjected(QString(e.what()));
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::completeWithdrawal()
+{
+    setMenuState(REPORT_RESULT);
+    const TransactionResult result = withdrawCash(_pending_transaction_id, _pending_transfer_amount);
+    audit(AuditLog::EVENT_TRANSACTION, result, _pending_transfer_amount);
+    switch(result)
+    {
+    case TransactionResult::TRANS_SUCCESS:
+        displayText(MSG_TAKE_MONEY);
+        break;
+    case TransactionResult::TRANS_CANNOT_DISPENSE:
+        displayText(QString("Sorry! This amount cannot be dispensed. Available notes: %1. Press 0 to go back to main menu.").arg(_cash_dispenser.availableNotes()));
+        break;
+    case TransactionResult::TRANS_LIMIT_EXCEEDED:
+        displayText(LIMIT_EXCEEDED_MESSAGE);
+        break;
+    case TransactionResult::TRANS_DECLINED:
+        displayText(DECLINED_MESSAGE);
+        break;
+    case TransactionResult::TRANS_STEP_UP_REQUIRED:
+        requestStepUp(FraudScorer::OP_WITHDRAWAL);
+        break;
+    case TransactionResult::TRANS_FAIL:
+        rejectCard(CARD_DB_FAILED);
+        break;
+    case TransactionResult::TRANS_CARD_INACTIVE:
+        rejectCard(CARD_INACTIVE);
+        break;
+    case TransactionResult::TRANS_DUPLICATE:
+        displayText(MSG_ALREADY_PROCESSED);
+        break;
+    case TransactionResult::TRANS_NO_RATE:
+        displayText(MSG_NO_RATE);
+        break;
+    default:
+        displayText(MSG_NOT_ENOUGH_FUNDS);
+        break;
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::completeTransfer()
+{
+    setMenuState(REPORT_RESULT);
+    const TransactionResult result = transferFunds(_pending_transaction_id, _pending_recepient, _pending_transfer_amount);
+    audit(AuditLog::EVENT_TRANSACTION, result, _pending_transfer_amount);
+    switch(result)
+    {
+    case TransactionResult::TRANS_SUCCESS:
+        displayText(MSG_TRANSFER_COMPLETED);
+        break;
+    case TransactionResult::TRANS_INVALID_RECEPIENT:
+        displayText(QString("Account #%1 does not exist. Press 0 to go back to main menu.").arg(_pending_recepient));
+        break;
+    case TransactionResult::TRANS_NOT_ENOUGH_FUNDS:
+        displayText(MSG_NOT_ENOUGH_FUNDS);
+        break;
+    case TransactionResult::TRANS_LIMIT_EXCEEDED:
+        displayText(LIMIT_EXCEEDED_MESSAGE);
+        break;
+    case TransactionResult::TRANS_DECLINED:
+        displayText(DECLINED_MESSAGE);
+        break;
+    case TransactionResult::TRANS_STEP_UP_REQUIRED:
+        requestStepUp(FraudScorer::OP_TRANSFER);
+        break;
+    case TransactionResult::TRANS_FAIL:
+        rejectCard(CARD_DB_FAILED);
+        break;
+    case TransactionResult::TRANS_CARD_INACTIVE:
+        rejectCard(CARD_INACTIVE);
+        break;
+    case TransactionResult::TRANS_DUPLICATE:
+        displayText(MSG_ALREADY_PROCESSED);
+        break;
+    case TransactionResult::TRANS_NO_RATE:
+        displayText(MSG_NO_RATE);
+        break;
+    default:
+        throw InternalErrorException("Unknown error occured on transfer attempt");
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::completeMobileRecharge()
+{
+    setMenuState(REPORT_RESULT);
+    const TransactionResult result = rechargeMobile(_pending_transaction_id, _pending_transfer_amount, _pending_recepient);
+    audit(AuditLog::EVENT_TRANSACTION, result, _pending_transfer_amount);
+    switch(result)
+    {
+    case TransactionResult::TRANS_SUCCESS:
+        displayText(MSG_TOPUP_QUEUED.arg(QString::number(_pending_transfer_amount), _pending_recepient));
+        break;
+    case TransactionResult::TRANS_LIMIT_EXCEEDED:
+        displayText(LIMIT_EXCEEDED_MESSAGE);
+        break;
+    case TransactionResult::TRANS_DECLINED:
+        displayText(DECLINED_MESSAGE);
+        break;
+    case TransactionResult::TRANS_STEP_UP_REQUIRED:
+        requestStepUp(FraudScorer::OP_MOBILE);
+        break;
+    case TransactionResult::TRANS_FAIL:
+        rejectCard(CARD_DB_FAILED);
+        break;
+    case TransactionResult::TRANS_CARD_INACTIVE:
+        rejectCard(CARD_INACTIVE);
+        break;
+    case TransactionResult::TRANS_DUPLICATE:
+        displayText(MSG_ALREADY_PROCESSED);
+        break;
+    case TransactionResult::TRANS_NO_RATE:
+        displayText(MSG_NO_RATE);
+        break;
+    default:
+        displayText(MSG_NOT_ENOUGH_FUNDS);
+        break;
+    }
+}
+
+// Fraud scorer wants customer to prove identity before the operation goes through
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::requestStepUp(FraudScorer::Operation operation)
+{
+    setMenuState(CONFIRM_PIN);
+    _pending_operation = operation;
+    displayText(PROMPT_STEP_UP_PIN);
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::onStepUpPinEntered(const QString& cardsPin)
+{
+    bool answered = false;
+    bool matched = false;
+    const CardStatus status = beginPinCheck(cardsPin, answered, matched);
+    if(!answered)
+    {
+        awaitPinCheck();
+        return;
+    }
+    onStepUpPinChecked(status, matched);
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::onStepUpPinChecked(CardStatus status, bool matched)
+{
+    if(status != CARD_OK)
+    {
+        // Not the customer's mistake: no attempt is taken
+        rejectCard(CARD_DB_FAILED);
+        return;
+    }
+    if(!matched)
+    {
+        --_pin_attempts_left;
+        // A crash must not give the customer their attempts back
+        checkpointSession();
+        if(_pin_attempts_left == 0)
+        {
+            // Card is seized even if DB failed to block it
+            deactivateCard();
+            onCardSeized(SEIZE_INVALID_PIN);
+        }
+        else
+        {
+            displayText(invalidPinMessage(_pin_attempts_left));
+        }
+        return;
+    }
+    // Identity confirmed: repeat the operation without scoring it again
+    _step_up_confirmed = true;
+    switch(_pending_operation)
+    {
+    case FraudScorer::OP_WITHDRAWAL:
+        completeWithdrawal();
+        break;
+    case FraudScorer::OP_TRANSFER:
+        completeTransfer();
+        break;
+    case FraudScorer::OP_MOBILE:
+        completeMobileRecharge();
+        break;
+    }
+    _step_up_confirmed = false;
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::onCardInserted(QString cardNumber)
+{
+    // State stays NO_CARD while the card is looked up; maintenance must give way now
+    _maintenance.setIdle(false);
+    _tracer.beginSession(cardNumber);
+    audit(AuditLog::EVENT_CARD_INSERTED, 0, 0, cardNumber);
+    // Card reader may pass number with separators
+    cardNumber = CardNumberValidator::normalize(cardNumber);
+    if(CardNumberValidator::validate(cardNumber).status != CardNumberValidator::VALID)
+    {
+        rejectCard(CARD_UNREADABLE);
+        return;
+    }
+    if(_resume_pending)
+    {
+        _resume_pending = false;
+        if(_card_token.token(cardNumber) == _interrupted_session._card_token &&
+           SessionCheckpoint::isResumable(_interrupted_session, QDateTime::currentMSecsSinceEpoch()))
+        {
+            resumeSession(_interrupted_session, cardNumber);
+            return;
+        }
+    }
+    //==========
+    // TODO: DB connection logic should be externalized.
+    //==========
+    // Connection is established at power on and kept for every card,
+    // so that no card waits for the DB to be opened.
+    displayText(PROMPT_WAIT);
+
+    // Cards that are known to be bad are rejected before going to DB
+    if(_card_filter.isInactive(cardNumber))
+    {
+        rejectCard(CARD_INACTIVE);
+        return;
+    }
+    if(!_card_filter.mayExist(cardNumber))
+    {
+        rejectCard(CARD_UNREADABLE);
+        return;
+    }
+
+    // Reconnect if DB was not available at power on
+    if(!_database.isOpen() && !_database.open())
+    {
+        rejectCard(CARD_DB_UNAVAILABLE);
+        return;
+    }
+
+    const CardStatus status = updateCardData(cardNumber);
+    // Blocked since the filter was built
+    if(status == CARD_INACTIVE)
+    {
+        _card_filter.markInactive(cardNumber);
+    }
+    if(status != CARD_OK)
+    {
+        rejectCard(status);
+        return;
+    }
+
+    showCardState(CARD_STATE_INSERTED);
+    setState(PENDING_PIN);
+
+    // Ask for PIN
+    requestPin();
+}
+
+// Card was still in the reader and has been read again soon after: the customer keeps the
+// PIN attempts they had left, but proves who they are again whatever state the crash stopped them in
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::resumeSession(const SessionRecord& session, const QString& cardNumber)
+{
+    const CardStatus status = _database.isOpen() ? updateCardData(cardNumber) : CARD_DB_UNAVAILABLE;
+    if(status != CARD_OK)
+    {
+        rejectCard(status);
+        return;
+    }
+    _pin_attempts_left = qMin(static_cast<size_t>(session._pin_attempts_left), MAX_PIN_ERRORS);
+    showCardState(CARD_STATE_INSERTED);
+    if(_pin_attempts_left == 0)
+    {
+        // Died between the last wrong PIN and the seizure
+        deactivateCard();
+        onCardSeized(SEIZE_INVALID_PIN);
+        return;
+    }
+    setState(PENDING_PIN);
+    requestPin(_pin_attempts_left < MAX_PIN_ERRORS);
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::onPinEntered(const QString& cardsPin)
+{
+    bool answered = false;
+    bool matched = false;
+    const CardStatus status = beginPinCheck(cardsPin, answered, matched);
+    if(!answered)
+    {
+        awaitPinCheck();
+        return;
+    }
+    onPinChecked(status, matched);
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::onPinChecked(CardStatus status, bool matched)
+{
+    if(status != CARD_OK)
+    {
+        // Not the customer's mistake: no attempt is taken
+        rejectCard(CARD_DB_FAILED);
+        return;
+    }
+    // If pin is valid
+    if(matched)
+    {
+        setState(TOP_MENU);
+        displayTopMenu();
+    }
+    else
+    {
+        --_pin_attempts_left;
+        // A crash must not give the customer their attempts back
+        checkpointSession();
+        if(_pin_attempts_left == 0)
+        {
+            // Card is seized even if DB failed to block it
+            deactivateCard();
+            onCardSeized(SEIZE_INVALID_PIN);
+        }
+        else
+        {
+            requestPin(true);
+        }
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::awaitPinCheck()
+{
+    displayText(PROMPT_WAIT);
+    if(_keyboard.present())
+    {
+        _keyboard->disableKeyboard();
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::completePinCheck()
+{
+    // Woken for a check that has been cancelled since, or for one started before Enter
+    if(_pin_check == 0 || !_pin_verifier.isDone(_pin_check))
+    {
+        return;
+    }
+    bool matched = false;
+    const CardStatus status = takePinCheck(matched);
+    if(_keyboard.present())
+    {
+        _keyboard->enableKeyboard();
+    }
+    try
+    {
+        if(_state == PENDING_PIN)
+        {
+            onPinChecked(status, matched);
+        }
+        else
+        {
+            onStepUpPinChecked(status, matched);
+        }
+    }
+    catch(const InternalErrorException& e)          // Something went really wrong
+    {
+        onCardEjected(QString(e.what()));
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::onCardEjected(const QString& message)
+{
+    audit(AuditLog::EVENT_CARD_EJECTED);
+    displayText(message);
+    showCardState(CARD_STATE_EJECTED);
+    finalizeCard();
+    if(_keyboard.present())
+    {
+        _keyboard->enableInput();
+        _keyboard->disableKeyboard();
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::onCardSeized(const QString& message)
+{
+    // TODO: Place any additional seizure logic here
+    audit(AuditLog::EVENT_CARD_SEIZED);
+    displayText(message);
+    showCardState(CARD_STATE_SEIZED);
+    finalizeCard();
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::powerOn()
+{
+    // TODO: Add any initialization logic here.
+    _audit_log.start();
+    audit(AuditLog::EVENT_POWER_ON);
+    // Session the last run died in, if it did with a card in
+    SessionRecord interrupted;
+    const bool resume = _checkpoint.open() && _checkpoint.load(interrupted) &&
+                        (interrupted._state == PENDING_PIN || interrupted._state == TOP_MENU);
+    // First card is served as fast as any other: nothing is left for it to warm up
+    if(!warmStart())
+    {
+        // Audited by warmStart(). Input is ignored until the ATM is powered on again.
+        setState(OUT_OF_SERVICE);
+        displayText(MSG_OUT_OF_SERVICE);
+        if(_keyboard.present())
+        {
+            _keyboard->disableInput();
+        }
+        showCardState(CARD_STATE_ABSENT);
+        return;
+    }
+    if(resume)
+    {
+        settleInterruptedDebit(interrupted);
+    }
+    setState(NO_CARD);
+    setMenuState(TOP);
+    displayText(PROMPT_INSERT_CARD);
+    if(_keyboard.present())
+    {
+        _keyboard->enableInput();
+    }
+    showCardState(CARD_STATE_ABSENT);
+    // Checkpoint does not know the card number: the session waits for the reader to read it again
+    if(resume)
+    {
+        _interrupted_session = interrupted;
+        _resume_pending = true;
+    }
+}
+
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::powerOff()
+{
+    // TODO: Add any finalization logic here.
+    displayText(MSG_NO_POWER);
+    _current_card = NULL;
+    _session_arena.reset();
+    _resume_pending = false;
+    // Checks are failed by the verifier's stop below; nobody is left to take their answers
+    _pin_ticket = 0;
+    _pin_ticket_pin.clear();
+    _pin_check = 0;
+    // Prepared statements must go before their connections
+    _select_card = QSqlQuery();
+    _select_card_prepared = false;
+    _read_card = QSqlQuery();
+    _read_card_prepared = false;
+    _select_pin_hash = QSqlQuery();
+    _select_pin_hash_prepared = false;
+    _select_currency = QSqlQuery();
+    _select_currency_prepared = false;
+    _reader.close();
+    if(_database.isOpen())
+    {
+        _database.close();
+    }
+    _velocity_limits.stop();
+    auditLimits();
+    _topup_gateway.stop();
+    auditTopUpRefunds();
+    _hot_accounts.stop();
+    _maintenance.stop();
+    auditMaintenance();
+    _pin_verifier.stop();
+    _exchange_rates.stop();
+    _tracer.stop();
+    setState(POWER_OFF);
+    _checkpoint.close();
+    audit(AuditLog::EVENT_POWER_OFF);
+    _audit_log.stop();
+    if(_keyboard.present())
+    {
+        _keyboard->disableInput();
+    }
+    showCardState(CARD_STATE_NONE);
+}
+
+template <class Display, class Keyboard, class Printer>
+bool BasicATM<Display, Keyboard, Printer>::showBalance()
+{
+    const CardStatus status = readCardData();
+    if(status != CARD_OK)
+    {
+        rejectCard(status);
+        return false;
+    }
+    // Currency is only shown once it is known
+    const QString balance = (QString::number(_current_card->_balance) + " " + currencyCode()).trimmed();
+    displayText(QString("Your balance: %1 \n\nPress 0 to return to Main menu").arg(balance));
+    return true;
+}
+
+// Print text to display unless there is no display
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::displayText(const QString& text)
+{
+    if(_display.present())
+    {
+        SessionTracer::Scope span(_tracer, "showText", "display");
+        _display->showText(text);
+    }
+}
+
+// Show card state unless there is no display
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::showCardState(const QString& state)
+{
+    if(_display.present())
+    {
+        SessionTracer::Scope span(_tracer, "showCardState", "display");
+        _display->showCardState(state);
+    }
+}
+
+// Draw main menu on the screen
+//==========
+// TODO: Generalize this function so that it could draw any menu
+// depending on passed parameters.
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::displayTopMenu()
+{
+    if(!_display.present())
+    {
+        // Display where?
+        return;
+    }
+    displayText(PROMPT_TOP_MENU);
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::printText(const QString& text)
+{
+    if(_printer.present())
+    {
+        SessionTracer::Scope span(_tracer, "printText", "printer");
+        _printer->printText(text);
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+bool BasicATM<Display, Keyboard, Printer>::printBalance()
+{
+    const CardStatus status = readCardData();
+    if(status != CARD_OK)
+    {
+        rejectCard(status);
+        return false;
+    }
+    if(_printer.present())
+    {
+        QDate cd = QDate::currentDate();
+        QTime ct = QTime::currentTime();
+
+        const QString balance = (QString::number(_current_card->_balance) + " " + currencyCode()).trimmed();
+        SessionTracer::Scope span(_tracer, "printBalance", "printer");
+        _printer->enablePrinter();
+        _printer->printText(
+                    QString("Bank: PrivatBank \nAddress: 2 Skovorody vul., Kyiv \nPhone: +38 044 463-6985 \nClient: %2 \nBalance: %1 \nCard number: %3 \n" + ct.toString() + "\n" + cd.toString("dd.MM.yyyy")).arg(balance,
+                                                                                                                                                        _current_card->_owner_last_name,
+                                                                                                                                                        _current_card->_card_number)
+        );
+    }
+    return true;
+}
+
+template <class Display, class Keyboard, class Printer>
+bool BasicATM<Display, Keyboard, Printer>::printStatement()
+{
+    const CardStatus status = readCardData();
+    if(status != CARD_OK)
+    {
+        rejectCard(status);
+        return false;
+    }
+    if(_printer.present())
+    {
+        const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+        SessionTracer::Scope span(_tracer, "printStatement", "printer");
+        PrinterSink<Printer> sink(_printer);
+        _printer->enablePrinter();
+        // Same snapshot as the balance that heads the statement
+        const bool read = _statement_exporter.exportStatement(_reader.isOpen() ? _reader.database() : _database,
+                                                              _current_card->_card_number,
+                                                              now - STATEMENT_DAYS * 24 * 3600,
+                                                              now + 1,
+                                                              StatementExporter::FORMAT_PRINT,
+                                                              sink) >= 0;
+        auditStatement(AuditLog::STMT_SELECT_HISTORY, read);
+    }
+    return true;
+}
+
+// Ask for PIN
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::requestPin(bool afterError)
+{
+    if(!afterError)
+    {
+        // Formatted on every request, which is once per card unless the session is resumed
+        displayText(PIN_REQUEST_TEMPLATE.arg(_current_card->_owner_gender_male ? "Mr" : "Ms",
+                                         _current_card->_owner_last_name));
+    }
+    else
+    {
+        displayText(invalidPinMessage(_pin_attempts_left));
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::topMenu(const QString& selectedService)
+{
+    int selected = selectedService.toInt();
+    switch(_menu_state)
+    {
+        case TOP:
+        {
+            switch (selected)
+            {
+            case 0:
+                setMenuState(TOP);
+                onCardEjected();
+                // eject card
+                break;
+
+            case 1:
+                setMenuState(SHOW_BALANCE_METHOD);
+                showBalanceOptions();
+                break;
+
+            case 2:
+                setMenuState(WITHDRAWAL_AMOUNT);
+                requestAmount();
+                break;
+            case 3:
+                setMenuState(TRANSFER_AMOUNT);
+                requestAmount();
+               break;
+            case 4:
+                setMenuState(MOBILE_AMOUNT);
+                requestAmount();
+               break;
+            default: break;
+            }
+        }
+        break;
+
+    case SHOW_BALANCE_METHOD:
+    {
+        switch(selected)
+        {
+        case 0:
+            setMenuState(TOP);
+            displayTopMenu();
+            break;
+        case 1:
+            setMenuState(DISPLAY_BALANCE);
+            showBalance();
+            break;
+        case 2:
+            setMenuState(PRINT_BALANCE);
+            if(printBalance())
+            {
+                setMenuState(TOP);
+                displayTopMenu();
+            }
+            break;
+        case 3:
+            setMenuState(PRINT_BALANCE);
+            if(printStatement())
+            {
+                setMenuState(TOP);
+                displayTopMenu();
+            }
+            break;
+        default: break;
+        }
+    }
+        break;
+    case DISPLAY_BALANCE:
+        if(selected == 0)
+        {
+             setMenuState(TOP);
+            displayTopMenu();
+        }
+        break;
+    case REPORT_RESULT:
+        if(selected == 0)
+        {
+            // Result is reported: the next operation is a new one
+            _pending_transaction_id.clear();
+            setMenuState(TOP);
+            displayTopMenu();
+        }
+        break;
+    default: break;
+    }
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::showBalanceOptions()
+{
+    displayText(PROMPT_BALANCE_OPTIONS);
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::requestAmount()
+{
+    displayText(PROMPT_AMOUNT);
+}
+
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::requestRecepient()
+{
+    displayText(PROMPT_RECEPIENT);
+}
+
+// Eject or seize card that cannot be served
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::rejectCard(CardStatus status)
+{
+    switch(status)
+    {
+    case CARD_UNREADABLE:       // Invalid card inserted
+        onCardEjected(EJECT_ERR_READ);
+        break;
+    case CARD_INACTIVE:         // Inserted card is (or has become) blocked or inactive
+        onCardSeized(SEIZE_INACTIVE);
+        break;
+    case CARD_DB_UNAVAILABLE:   // Failed to connect to the database
+#ifndef NDEBUG
+        onCardEjected(
+            QString("ERROR: Failed to open a connection to "BANK_DATABASE_NAME": %1").arg(_database.lastError().text())
+        );
+#else
+        onCardEjected(EJECT_ERR_CONN);
+#endif
+        break;
+    case CARD_DB_FAILED:        // Failed to execute a query
+        onCardEjected(EJECT_ERR_CONN);
+        break;
+    default:
+        assert(false && "FATAL: Unexpected card status in rejectCard()!!!");
+        break;
+    }
+}
+
+// Process CANCEL button press
+template <class Display, class Keyboard, class Printer>
+void BasicATM<Display, Keyboard, Printer>::cancelOperation()
+{
+    if(_current_card != NULL) {
+        onCardEjected(EJECT_SUCCESS);
+    }
+}
@@ -0,0 +1,1426 @@
+#include "ATMBase.h"
+#include "BankSchema.h"
+
+#include <cassert>
+#include <QTime>
+#include <QDate>
+#include <QDateTime>
+#include <QCoreApplication>
+#include <QDir>
+#include <cstring>
+#include <climits>
+
+const size_t ATMBase::MAX_PIN_ERRORS;
+
+// Ejection messages
+// No errors
+const QString ATMBase::EJECT_SUCCESS     = "Thank you for using our ATM! Good bye.";
+// No connection to bank DB
+const QString ATMBase::EJECT_ERR_CONN    = "Sorry! ATM failed to connect to bank. Please try again later.";
+// Invalid or inexistant
+const QString ATMBase::EJECT_ERR_READ    = "Failed to read the card. It may be damaged. Please contact our bank for a replacement.";
+// Unknown error
+const QString ATMBase::EJECT_ERR_FAIL    = "Sorry! An error occured during processing. Please try again.";
+
+// Prompts and messages that do not depend on card data.
+// They are built once, so showing them costs no allocations.
+const QString ATMBase::PROMPT_INSERT_CARD       = "Please insert your card";
+const QString ATMBase::PROMPT_WAIT              = "Please wait...";
+const QString ATMBase::PROMPT_TOP_MENU          = "TOP MENU: \n1. Show ledger.\n2. Withdraw money. \n3. Money transfer. \n4. Recharge your mobile. \n0. Complete work. \n ";
+const QString ATMBase::PROMPT_BALANCE_OPTIONS   = "1. Show ledger on screen. \n2. Print ledger. \n3. Print statement. \n0. Back to Main menu. \n";
+const QString ATMBase::PROMPT_AMOUNT            = "Please enter amount: ";
+const QString ATMBase::PROMPT_RECEPIENT         = "Please enter beneficiary account #: ";
+const QString ATMBase::PROMPT_PHONE             = "Please enter your phone number: ";
+const QString ATMBase::PROMPT_STEP_UP_PIN       = "For your security, please enter your PIN again: \n";
+const QString ATMBase::PIN_REQUEST_TEMPLATE     = "Hello, %1. %2! Please enter your PIN. \n";
+const QString ATMBase::MSG_TAKE_MONEY           = "Please take your money\n(press 0 to do so)";
+const QString ATMBase::MSG_NOT_ENOUGH_FUNDS     = "Sorry! Not enough funds on your account. Press 0 to go back to main menu.";
+const QString ATMBase::MSG_TRANSFER_COMPLETED   = "Transfer completed successfully. Press 0 to return to main menu.";
+const QString ATMBase::MSG_TOPUP_QUEUED         = "Top-up of %1 to mobile %2 is on its way. \nShould the operator refuse it, the money returns to your card. \n(press 0 to continue)";
+const QString ATMBase::MSG_ALREADY_PROCESSED    = "This operation has already been processed. Press 0 to go back to main menu.";
+const QString ATMBase::MSG_NO_RATE              = "This operation is not available in your card's currency. Press 0 to go back to main menu.";
+const QString ATMBase::MSG_NO_POWER             = "(no power)";
+const QString ATMBase::MSG_OUT_OF_SERVICE       = "Sorry! This ATM is temporarily out of service.";
+// Invalid PIN, indexed by number of attempts left
+const QString ATMBase::INVALID_PIN_MESSAGES[MAX_PIN_ERRORS] = {
+    "",
+    "Invalid PIN! You have 1 attempts left. Please try again. \n",
+    "Invalid PIN! You have 2 attempts left. Please try again. \n"
+};
+
+// Card states
+const QString ATMBase::CARD_STATE_INSERTED  = "Card is inserted";
+const QString ATMBase::CARD_STATE_EJECTED   = "Card is ejected";
+const QString ATMBase::CARD_STATE_SEIZED    = "Card is seized";
+const QString ATMBase::CARD_STATE_ABSENT    = "Card is absent";
+const QString ATMBase::CARD_STATE_NONE      = "";
+
+// Keypad input
+const QString ATMBase::DIGITS[10] = {"0", "1", "2", "3", "4", "5", "6", "7", "8", "9"};
+const QString ATMBase::PIN_MASK = "*";
+
+// Cassette set the ATM starts with: denomination, number of notes
+const CashDispenser::Cassette ATMBase::DEFAULT_CASSETTES[] = {
+    {500, 100},
+    {200, 200},
+    {100, 200},
+    {50,  200}
+};
+const int ATMBase::DEFAULT_CASSETTE_COUNT = sizeof(DEFAULT_CASSETTES) / sizeof(DEFAULT_CASSETTES[0]);
+
+// Debit would exceed hourly, daily or monthly limit
+const QString ATMBase::LIMIT_EXCEEDED_MESSAGE = "Sorry! This operation exceeds your card limits. Press 0 to go back to main menu.";
+
+// Fraud scoring refused the operation
+const QString ATMBase::DECLINED_MESSAGE = "Sorry! This operation has been declined. Please contact our bank's office. Press 0 to go back to main menu.";
+
+// Seizure messages
+// Invalid PIN
+const QString ATMBase::SEIZE_INVALID_PIN    = "Invalid PIN! Card will be seized. Please contact our bank's office, if you have any questions.";
+// Inactive or blocked card
+const QString ATMBase::SEIZE_INACTIVE       = "This card has been blocked or is not yet activated. Please contact our bank's office for details.";
+
+// TODO: Move everything related to DB to a separate class
+//==========
+// Templates for common SQL queries
+const QString ATMBase::SELECT_CARD_BY_NUMBER = \
+    "SELECT cards.active, cards.pin, cards.balance, clients.last_name, clients.gender_male \
+    FROM cards INNER JOIN clients ON cards.client_id=clients.id \
+    WHERE cards.card_number=?";
+const QString ATMBase::DEACTIVATE_CARD = "UPDATE cards SET active=0 WHERE card_number=\"%1\"";
+const QString ATMBase::WITHDRAW_FUNDS = "UPDATE cards SET balance=balance-(%2) WHERE card_number=\"%1\"";
+const QString ATMBase::UPLOAD_FUNDS = "UPDATE cards SET balance=balance+(%2) WHERE card_number=\"%1\"";
+//etc.
+
+// Audit trail and checkpoint files are named after the terminal id: it stays the same
+// from run to run, and no two ATMs use it at once, be they in this process or not.
+// The configured id is taken, or the lowest one free from 1 if none is; further ATMs
+// in the process take the next ones free.
+static quint16 claimAtmId(QLockFile*& lock)
+{
+    const int configuredId = ATMConfig::terminalId(ATM_CONFIG_FILE);
+    QDir().mkpath(ATM_CHECKPOINT_DIRECTORY);
+    for(int id = (configuredId > 0) ? configuredId : 1; id <= USHRT_MAX; ++id)
+    {
+        lock = new QLockFile(QDir(ATM_CHECKPOINT_DIRECTORY).filePath(QString("terminal-%1.lock").arg(id)));
+        // Held until the ATM goes away, however long that is
+        lock->setStaleLockTime(0);
+        if(lock->tryLock(0))
+        {
+            return static_cast<quint16>(id);
+        }
+        qint64 holder = 0;
+        assert((id != configuredId || !lock->getLockInfo(&holder, NULL, NULL) ||
+                holder == QCoreApplication::applicationPid()) &&
+               "FATAL: Terminal id is in use by another process!!!");
+        delete lock;
+        lock = NULL;
+    }
+    // No lock left to take: files are shared at worst
+    return static_cast<quint16>((configuredId > 0) ? configuredId : 1);
+}
+
+static QString connectionName(quint16 atmId)
+{
+    return QString("atm_%1").arg(atmId);
+}
+
+// Compensating credit is a transaction of its own, derived from the one it undoes
+static const QString REFUND_ID_SUFFIX = "/refund";
+
+ATMBase::ATMBase():
+    _state(POWER_OFF),
+    _terminal_lock(NULL),
+    _atm_id(claimAtmId(_terminal_lock)),
+    _database(QSqlDatabase::addDatabase(BANK_DATABASE_DRIVER, connectionName(_atm_id))),
+    _current_card(NULL),
+    _pin_attempts_left(MAX_PIN_ERRORS),
+    _menu_state(TOP),
+    _state_changed_ns(0),
+    _select_card_prepared(false),
+    _select_pin_hash_prepared(false),
+    _select_currency_prepared(false),
+    _reader(connectionName(_atm_id) + "_reader"),
+    _read_card_prepared(false),
+    _startup_us(0),
+    _step_up_confirmed(false),
+    _audit_log(_atm_id, ATM_AUDIT_DIRECTORY),
+    _tracer(_atm_id, ATM_TRACE_DIRECTORY),
+    _checkpoint(_atm_id, ATM_CHECKPOINT_DIRECTORY),
+    _resume_pending(false),
+    _pending_operation(FraudScorer::OP_WITHDRAWAL),
+    _debit_phase(SessionCheckpoint::DEBIT_NONE),
+    _pin_ticket(0),
+    _pin_check(0),
+    _pin_check_wake_up(false),
+    _pending_debit_amount(0)
+{
+    assert(_database.isValid() && "FATAL: Invalid database driver "BANK_DATABASE_DRIVER"!!!");
+    _database.setDatabaseName(BANK_DATABASE_NAME);
+    memset(&_pending_plan, 0, sizeof(_pending_plan));
+    loadCassettes(defaultCassettes());
+}
+
+ATMBase::~ATMBase()
+{
+    // Connection can only be removed once nothing refers to it
+    _select_card = QSqlQuery();
+    _read_card = QSqlQuery();
+    _select_pin_hash = QSqlQuery();
+    _select_currency = QSqlQuery();
+    _database = QSqlDatabase();
+    QSqlDatabase::removeDatabase(connectionName(_atm_id));
+    delete _terminal_lock;
+}
+
+void ATMBase::finalizeCard()
+{
+    // DB connection stays open for the next card.
+    // Everything allocated for the session goes away at once
+    _current_card = NULL;
+    _session_arena.reset();
+    _pin_attempts_left = MAX_PIN_ERRORS;
+    _step_up_confirmed = false;
+    if(_pin_ticket != 0)
+    {
+        _pin_verifier.cancel(_pin_ticket);
+        _pin_ticket = 0;
+    }
+    _pin_ticket_pin.clear();
+    if(_pin_check != 0)
+    {
+        _pin_verifier.cancel(_pin_check);
+        _pin_check = 0;
+    }
+    _pending_transaction_id.clear();
+    _pending_topup_key.clear();
+    _pending_debit_amount = 0;
+    memset(&_pending_plan, 0, sizeof(_pending_plan));
+    _debit_phase = SessionCheckpoint::DEBIT_NONE;
+    _reader.release();
+    // Customer has gone: the next one gets an up to date plan table
+    _cash_dispenser.refresh();
+    setState(NO_CARD);
+    setMenuState(TOP);
+    _tracer.endSession();
+}
+
+// Query DB for current card data by its number
+ATMBase::CardStatus ATMBase::updateCardData(QString cardNumber)
+{
+    assert(_database.isOpen() && "FATAL: Unexpected call to updateCardData()!!!");
+    // Let's load card data from the DB (if there is such a card)
+    const bool selected = selectCard(cardNumber);
+    auditStatement(AuditLog::STMT_SELECT_CARD, selected, 0, cardNumber);
+    if(!selected)
+    {
+        return CARD_DB_FAILED;
+    }
+    return takeCardData(_select_card, cardNumber, _database);
+}
+
+ATMBase::CardStatus ATMBase::readCardData()
+{
+    assert(_current_card && "FATAL: Unexpected call to readCardData()!!!");
+    const QString& cardNumber = _current_card->_card_number;
+    if(!_reader.acquire() || (!_read_card_prepared && !prepareReads()))
+    {
+        // Reader is not available: the writer's view is as good
+        return updateCardData();
+    }
+    bool selected = false;
+    {
+        SessionTracer::Scope span(_tracer, AuditLog::statementName(AuditLog::STMT_SELECT_CARD), "snapshot");
+        _read_card.bindValue(0, cardNumber);
+        selected = _read_card.exec();
+    }
+    auditStatement(AuditLog::STMT_SELECT_CARD, selected, 0, cardNumber);
+    if(!selected)
+    {
+        return updateCardData();
+    }
+    return takeCardData(_read_card, cardNumber, _reader.database());
+}
+
+ATMBase::CardStatus ATMBase::takeCardData(QSqlQuery& query, const QString& cardNumber, QSqlDatabase& database)
+{
+    // Attempt to retreive the first (and only) entry
+    if(!query.next())
+    {
+        // There is no such card.
+        query.finish();
+        return CARD_UNREADABLE;
+    }
+
+    if(!_current_card)
+    {
+        _current_card = _session_arena.create<Card>();
+        // Card's currency does not change while it is in: looked up once, not on every refresh
+        _current_card->_currency_loaded = false;
+    }
+
+    _current_card->_card_number = cardNumber;
+    _current_card->_is_active = query.value(0).toBool();  // cards.active
+    if(!_current_card->_is_active)
+    {
+        // Card exists but is not active.
+        query.finish();
+        return CARD_INACTIVE;
+    }
+
+    // So far so good.
+    // Such card exists and is active. Time to initialize _current_card with values from DB.
+
+    _current_card->_pin = query.value(1).toString();                // cards.pin
+    _current_card->_pin_hash.clear();
+    _current_card->_pin_hash_loaded = false;
+    _current_card->_balance = query.value(2).toDouble();            // cards.balance
+    _current_card->_owner_last_name = query.value(3).toString();    // clients.last_name
+    _current_card->_owner_gender_male = query.value(4).toBool();    // clients.gender_male
+    // Open statement would keep a read lock on the DB while the card is in
+    query.finish();
+    // Credits to a hot account may not be merged into cards.balance yet
+    if(_hot_accounts.isHot(cardNumber) && !HotAccounts::selectBalance(database, cardNumber, _current_card->_balance))
+    {
+        return CARD_DB_FAILED;
+    }
+    return CARD_OK;
+}
+
+bool ATMBase::deactivateCard()
+{
+    assert(_database.isOpen() && "FATAL: Unexpected call to deactivateCard()!!!");
+    // Block the card locally in any case: it is about to be seized
+    _card_filter.markInactive(_current_card->_card_number);
+    return executeQuery(DEACTIVATE_CARD.arg(_current_card->_card_number), AuditLog::STMT_DEACTIVATE_CARD);
+}
+
+bool ATMBase::prepareStatements()
+{
+    _select_card = QSqlQuery(_database);
+    _select_card.setForwardOnly(true);
+    _select_card_prepared = _select_card.prepare(SELECT_CARD_BY_NUMBER);
+    return _select_card_prepared;
+}
+
+bool ATMBase::prepareReads()
+{
+    _read_card = QSqlQuery(_reader.database());
+    _read_card.setForwardOnly(true);
+    _read_card_prepared = _reader.isOpen() && _read_card.prepare(SELECT_CARD_BY_NUMBER);
+    return _read_card_prepared;
+}
+
+bool ATMBase::selectCard(const QString& cardNumber)
+{
+    // Statement is prepared at power on; this only catches a DB that was not available then
+    if(!_select_card_prepared && !prepareStatements())
+    {
+        return false;
+    }
+    SessionTracer::Scope span(_tracer, AuditLog::statementName(AuditLog::STMT_SELECT_CARD), "db");
+    _select_card.bindValue(0, cardNumber);
+    return _select_card.exec();
+}
+
+ATMBase::CardStatus ATMBase::beginPinCheck(const QString& pin, bool& answered, bool& matched)
+{
+    SessionTracer::Scope span(_tracer, "checkPin", "pin");
+    answered = true;
+    // Check started on the fourth digit is only good for the PIN it was started for
+    PinVerifier::Ticket ticket = 0;
+    if(_pin_ticket != 0 && _pin_ticket_pin == pin)
+    {
+        ticket = _pin_ticket;
+    }
+    else if(_pin_ticket != 0)
+    {
+        _pin_verifier.cancel(_pin_ticket);
+    }
+    _pin_ticket = 0;
+    _pin_ticket_pin.clear();
+
+    // cards.pin may be what a card's hash replaced: it is no answer when the hash could not be read
+    if(!loadPinHash())
+    {
+        if(ticket != 0)
+        {
+            _pin_verifier.cancel(ticket);
+        }
+        return CARD_DB_FAILED;
+    }
+    if(_current_card->_pin_hash.isEmpty())
+    {
+        // Not migrated yet: cards.pin is all there is
+        return pinAnswer((pin == _current_card->_pin) ? PinVerifier::ANSWER_MATCH : PinVerifier::ANSWER_MISMATCH, matched);
+    }
+    if(ticket == 0)
+    {
+        ticket = _pin_verifier.submit(pin, _current_card->_pin_hash);
+    }
+    if(ticket == 0)
+    {
+        // Pool is full or stopped: checked on this thread
+        return pinAnswer(_pin_verifier.check(pin, _current_card->_pin_hash), matched);
+    }
+    _pin_check = ticket;
+    // Check started before Enter may be done already: its wake-up has come and gone
+    if(_pin_check_wake_up && !_pin_verifier.isDone(ticket))
+    {
+        answered = false;
+        return CARD_OK;
+    }
+    return takePinCheck(matched);
+}
+
+ATMBase::CardStatus ATMBase::takePinCheck(bool& matched)
+{
+    assert(_pin_check != 0 && "FATAL: Unexpected call to takePinCheck()!!!");
+    const PinVerifier::Answer answer = _pin_verifier.wait(_pin_check);
+    _pin_check = 0;
+    return pinAnswer(answer, matched);
+}
+
+ATMBase::CardStatus ATMBase::pinAnswer(PinVerifier::Answer answer, bool& matched)
+{
+    if(answer == PinVerifier::ANSWER_NONE)
+    {
+        // Verifier was stopped: the PIN is neither right nor wrong
+        return CARD_DB_FAILED;
+    }
+    matched = (answer == PinVerifier::ANSWER_MATCH);
+    if(!matched)
+    {
+        _fraud_scorer.onPinFailure(_current_card->_card_number, QDateTime::currentMSecsSinceEpoch() / 1000);
+    }
+    return CARD_OK;
+}
+
+void ATMBase::prefetchPinCheck(const QString& pin)
+{
+    if(!_current_card || !loadPinHash() || _current_card->_pin_hash.isEmpty())
+    {
+        // Plain comparison costs nothing: no need to start it early
+        return;
+    }
+    if(_pin_ticket != 0)
+    {
+        _pin_verifier.cancel(_pin_ticket);
+    }
+    _pin_ticket = _pin_verifier.submit(pin, _current_card->_pin_hash);
+    _pin_ticket_pin = (_pin_ticket != 0) ? pin : QString();
+}
+
+bool ATMBase::loadPinHash()
+{
+    assert(_current_card && "FATAL: Unexpected call to loadPinHash()!!!");
+    if(_current_card->_pin_hash_loaded)
+    {
+        return true;
+    }
+    // pin_hashes is made by a migration, which may still be running while statements are prepared at power on
+    if(!_select_pin_hash_prepared)
+    {
+        _select_pin_hash = QSqlQuery(_database);
+        _select_pin_hash.setForwardOnly(true);
+        _select_pin_hash_prepared = _select_pin_hash.prepare(PinVerifier::SELECT_HASH);
+    }
+    if(!_select_pin_hash_prepared)
+    {
+        return false;
+    }
+    SessionTracer::Scope span(_tracer, "selectPinHash", "db");
+    _select_pin_hash.bindValue(0, _current_card->_card_number);
+    if(!_select_pin_hash.exec())
+    {
+        return false;
+    }
+    _current_card->_pin_hash = _select_pin_hash.next() ? _select_pin_hash.value(0).toByteArray() : QByteArray();
+    _select_pin_hash.finish();
+    _current_card->_pin_hash_loaded = true;
+    return true;
+}
+
+bool ATMBase::selectCurrency(const QString& cardNumber, QString& currency)
+{
+    // card_currencies is made by a migration as well
+    if(!_select_currency_prepared)
+    {
+        _select_currency = QSqlQuery(_database);
+        _select_currency.setForwardOnly(true);
+        _select_currency_prepared = _select_currency.prepare(ExchangeRates::SELECT_CARD_CURRENCY);
+    }
+    if(!_select_currency_prepared)
+    {
+        return false;
+    }
+    SessionTracer::Scope span(_tracer, "selectCurrency", "db");
+    _select_currency.bindValue(0, cardNumber);
+    if(!_select_currency.exec())
+    {
+        return false;
+    }
+    currency = _select_currency.next() ? _select_currency.value(0).toString().trimmed().toUpper() : QString();
+    _select_currency.finish();
+    return true;
+}
+
+bool ATMBase::loadCardCurrency()
+{
+    assert(_current_card && "FATAL: Unexpected call to loadCardCurrency()!!!");
+    if(!_current_card->_currency_loaded)
+    {
+        _current_card->_currency_loaded = selectCurrency(_current_card->_card_number, _current_card->_currency);
+    }
+    return _current_card->_currency_loaded;
+}
+
+QString ATMBase::currencyCode()
+{
+    if(!loadCardCurrency())
+    {
+        return QString();
+    }
+    return _current_card->_currency.isEmpty() ? _exchange_rates.base() : _current_card->_currency;
+}
+
+// Phases that do not depend on each other run side by side:
+// the ATM's own connection on this thread, schema, cache and card filter,
+// and background engines with configuration on worker threads.
+bool ATMBase::warmStart()
+{
+    ATMConfig config;
+    bool cardFilterLoaded = false;
+    QVector<CashDispenser::Cassette> storedCassettes;
+    QString storedRefill;
+    bool cassettesSelected = false;
+
+    StartupPipeline pipeline(BANK_DATABASE_DRIVER, BANK_DATABASE_NAME);
+    pipeline.addPhase(StartupPipeline::CALLER_LANE, AuditLog::PHASE_OPEN_CONNECTION, [](QSqlDatabase& database) {
+        return database.isOpen() || database.open();
+    });
+    pipeline.addPhase(StartupPipeline::CALLER_LANE, AuditLog::PHASE_PREPARE_STATEMENTS, [this](QSqlDatabase& database) {
+        return database.isOpen() && prepareStatements();
+    });
+    pipeline.addPhase(StartupPipeline::CALLER_LANE, AuditLog::PHASE_OPEN_READER, [this](QSqlDatabase&) {
+        return _reader.open(BANK_DATABASE_DRIVER, BANK_DATABASE_NAME) && prepareReads();
+    });
+
+    // Schema changes first, then reads that take long on a cold cache
+    const int schema = pipeline.addLane(true);
+    pipeline.addPhase(schema, AuditLog::PHASE_VERIFY_SCHEMA, [](QSqlDatabase& database) {
+        return BankSchema::verify(database);
+    });
+    pipeline.addPhase(schema, AuditLog::PHASE_MIGRATE_SCHEMA, [](QSqlDatabase& database) {
+        return BankSchema::migrate(database);
+    });
+    pipeline.addPhase(schema, AuditLog::PHASE_LOAD_CASSETTES,
+                      [this, &storedCassettes, &storedRefill, &cassettesSelected](QSqlDatabase& database) {
+        cassettesSelected = selectCassettes(database, storedCassettes, storedRefill);
+        return cassettesSelected;
+    });
+    pipeline.addPhase(schema, AuditLog::PHASE_LOAD_TRANSACTION_IDS, [this](QSqlDatabase& database) {
+        return _applied_transactions.load(database);
+    });
+    pipeline.addPhase(schema, AuditLog::PHASE_WARM_CACHE, [](QSqlDatabase& database) {
+        return BankSchema::warm(database);
+    });
+
+    const int cards = pipeline.addLane(true);
+    pipeline.addPhase(cards, AuditLog::PHASE_LOAD_CARD_FILTER, [this, &cardFilterLoaded](QSqlDatabase& database) {
+        cardFilterLoaded = _card_filter.load(database);
+        return cardFilterLoaded;
+    });
+
+    // Engines open connections of their own, and read tables migrations create
+    const int engines = pipeline.addLane(false, schema);
+    pipeline.addPhase(engines, AuditLog::PHASE_START_LIMITS, [this](QSqlDatabase&) {
+        return _velocity_limits.start(BANK_DATABASE_DRIVER, BANK_DATABASE_NAME);
+    });
+    pipeline.addPhase(engines, AuditLog::PHASE_START_TOPUPS, [this](QSqlDatabase&) {
+        _topup_gateway.start(BANK_DATABASE_DRIVER, BANK_DATABASE_NAME, _atm_id);
+        return true;
+    });
+    pipeline.addPhase(engines, AuditLog::PHASE_START_MERGER, [this](QSqlDatabase&) {
+        _hot_accounts.start(BANK_DATABASE_DRIVER, BANK_DATABASE_NAME);
+        return true;
+    });
+    pipeline.addPhase(engines, AuditLog::PHASE_START_MAINTENANCE, [this](QSqlDatabase&) {
+        _maintenance.start(BANK_DATABASE_DRIVER, BANK_DATABASE_NAME);
+        return true;
+    });
+    pipeline.addPhase(engines, AuditLog::PHASE_START_PIN_VERIFIER, [this](QSqlDatabase&) {
+        _pin_verifier.start();
+        return true;
+    });
+    pipeline.addPhase(engines, AuditLog::PHASE_START_RATES, [this](QSqlDatabase&) {
+        _exchange_rates.start(ATM_RATES_FILE);
+        return true;
+    });
+    pipeline.addPhase(engines, AuditLog::PHASE_LOAD_CARD_KEY, [this](QSqlDatabase&) {
+        return _card_token.load(ATM_CARD_KEY_FILE);
+    });
+    pipeline.addPhase(engines, AuditLog::PHASE_LOAD_CONFIG, [&config](QSqlDatabase&) {
+        return config.load(ATM_CONFIG_FILE);
+    });
+
+    const bool started = pipeline.run(_database);
+    // First start on this DB may have switched it to WAL since the reader was opened
+    _reader.detectJournalMode();
+
+    // Configuration is applied here: limits and cassettes belong to this thread
+    for(int w = 0; w < VelocityLimits::WINDOW_COUNT; ++w)
+    {
+        if(config._has_limit[w])
+        {
+            _velocity_limits.setLimit(static_cast<VelocityLimits::Window>(w), config._limits[w]);
+        }
+    }
+    // Counts in the DB are what the cassettes hold, unless the configuration names a new refill
+    if(!storedCassettes.isEmpty() && (config._cassettes.isEmpty() || config._cassette_refill == storedRefill))
+    {
+        _cassette_refill = storedRefill;
+        _cash_dispenser.load(storedCassettes);
+    }
+    else if(cassettesSelected)
+    {
+        _cassette_refill = config._cassette_refill;
+        loadCassettes(config._cassettes.isEmpty() ? defaultCassettes() : config._cassettes);
+    }
+    else if(!config._cassettes.isEmpty())
+    {
+        // Without a DB the counts stay in memory: nothing is stored over what may be there
+        _cash_dispenser.load(config._cassettes);
+    }
+    if(config._trace_sample_every >= 0)
+    {
+        _tracer.setSampling(config._trace_sample_every);
+    }
+    if(config._max_staleness_ms >= 0)
+    {
+        _reader.setMaxStaleness(config._max_staleness_ms);
+    }
+    if(config._maintenance_interval_s >= 0)
+    {
+        _maintenance.setInterval(config._maintenance_interval_s);
+    }
+    if(config._maintenance_drop_backups >= 0)
+    {
+        _maintenance.setDropBackups(config._maintenance_drop_backups != 0);
+    }
+
+    // Audit trail is written from this thread only, so phases are audited once all are done
+    auditStatement(AuditLog::STMT_LOAD_CARDS, cardFilterLoaded);
+    _startup_timings = pipeline.timings();
+    _startup_us = pipeline.elapsedUs();
+    for(size_t i = 0; i < _startup_timings.size(); ++i)
+    {
+        AuditRecord record = auditRecord(AuditLog::EVENT_STARTUP_PHASE);
+        record._statement = static_cast<quint32>(_startup_timings[i]._phase);
+        record._result = _startup_timings[i]._succeeded ? 1 : 0;
+        record._amount = _startup_timings[i]._elapsed_us / 1000.0;
+        _audit_log.append(record);
+    }
+    if(started)
+    {
+        audit(AuditLog::EVENT_READY, 0, _startup_us / 1000.0);
+        return true;
+    }
+    AuditRecord record = auditRecord(AuditLog::EVENT_OUT_OF_SERVICE);
+    for(size_t i = 0; i < _startup_timings.size(); ++i)
+    {
+        if(!_startup_timings[i]._succeeded)
+        {
+            record._statement = static_cast<quint32>(_startup_timings[i]._phase);
+            break;
+        }
+    }
+    record._amount = _startup_us / 1000.0;
+    _audit_log.append(record);
+    return false;
+}
+
+// Entry follows the change it describes in the same transaction: statements and balances agree
+ATMBase::BalanceChange ATMBase::historyEntry(const QString& cardNumber, CardHistory::Entry entry, double amount, qint64 time,
+                                             const QString& counterparty, bool hot)
+{
+    BalanceChange change = {hot ? HotAccounts::RECORD_ENTRY : CardHistory::RECORD_ENTRY,
+                            AuditLog::STMT_RECORD_HISTORY, amount, cardNumber, QVariantList()};
+    change._values << time << static_cast<int>(entry) << amount << counterparty << cardNumber;
+    return change;
+}
+
+ATMBase::BalanceChange ATMBase::transferCredit(const QString& cardNumber, double amount, quint16 atmId, bool hot)
+{
+    if(!hot)
+    {
+        BalanceChange change = {UPLOAD_FUNDS.arg(cardNumber, QString::number(amount)), AuditLog::STMT_UPLOAD_FUNDS, amount,
+                                cardNumber, QVariantList()};
+        return change;
+    }
+    BalanceChange change = {HotAccounts::APPEND_CREDIT, AuditLog::STMT_APPEND_CREDIT, amount, cardNumber, QVariantList()};
+    change._values << cardNumber << atmId << amount;
+    return change;
+}
+
+// In the debit's transaction, the card is never charged for a top-up that nothing would send
+ATMBase::BalanceChange ATMBase::queuedTopUp(const TopUpGateway::Request& request, quint16 atmId)
+{
+    BalanceChange change = {TopUpGateway::QUEUE_TOPUP, AuditLog::STMT_QUEUE_TOPUP, request._amount, request._card_number,
+                            QVariantList()};
+    change._values << request._key << request._card_number << request._phone_number << request._amount << request._deadline
+                   << atmId;
+    return change;
+}
+
+ATMBase::TransactionResult ATMBase::withdrawFunds(const QString& transactionId, double amount,
+                                                  FraudScorer::Operation operation, QString beneficiary,
+                                                  const QVector<BalanceChange>& followUps)
+{
+    assert(_current_card && _database.isOpen() && "FATAL: Unexpected call to ATMBase::withdrawFunds()!!!");
+    // Retry of a transaction that went through is turned away before anything is read
+    if(_applied_transactions.contains(transactionId))
+    {
+        return TransactionResult::TRANS_DUPLICATE;
+    }
+    const CardStatus status = updateCardData();
+    if(status != CARD_OK)
+    {
+        return toTransactionResult(status);
+    }
+    if(!loadCardCurrency())
+    {
+        return TransactionResult::TRANS_FAIL;
+    }
+    // Amount is in the base currency; the card pays in its own.
+    // Limits and screening stay in the base currency.
+    double debitAmount = amount;
+    if(!_exchange_rates.convert(amount, QString(), _current_card->_currency, debitAmount))
+    {
+        return TransactionResult::TRANS_NO_RATE;
+    }
+    if(debitAmount > _current_card->_balance)
+    {
+        return TransactionResult::TRANS_NOT_ENOUGH_FUNDS;
+    }
+    const FraudScorer::Transaction transaction = makeTransaction(operation, amount, beneficiary);
+    // Debits made at other terminals count as well; without DB, this one's still do
+    _velocity_limits.refresh(_database, _current_card->_card_number);
+    if(!_velocity_limits.allows(_current_card->_card_number, amount, transaction._time))
+    {
+        return TransactionResult::TRANS_LIMIT_EXCEEDED;
+    }
+    const TransactionResult screening = screenTransaction(transaction);
+    if(screening != TRANS_SUCCESS)
+    {
+        return screening;
+    }
+    // Recovery must refund what the card paid, not what was asked for
+    _pending_debit_amount = (debitAmount != amount) ? debitAmount : 0;
+    checkpointSession();
+    // History entry and follow-ups commit or roll back with the debit
+    QVector<BalanceChange> changes;
+    changes.reserve(2 + followUps.size());
+    const BalanceChange debit = {WITHDRAW_FUNDS.arg(_current_card->_card_number, QString::number(debitAmount)),
+                                 AuditLog::STMT_WITHDRAW_FUNDS, debitAmount, _current_card->_card_number, QVariantList()};
+    changes.append(debit);
+    changes.append(historyEntry(_current_card->_card_number,
+                                (operation == FraudScorer::OP_MOBILE) ? CardHistory::ENTRY_MOBILE_RECHARGE
+                                                                      : CardHistory::ENTRY_WITHDRAWAL,
+                                -debitAmount, transaction._time, beneficiary, _hot_accounts.isHot(_current_card->_card_number)));
+    changes += followUps;
+    switch(applyOnce(transactionId, changes.constData(), changes.size()))
+    {
+    case APPLY_DUPLICATE:
+        return TransactionResult::TRANS_DUPLICATE;
+    case APPLY_FAILED:
+        return TransactionResult::TRANS_FAIL;
+    default:
+        break;
+    }
+    _velocity_limits.record(_current_card->_card_number, amount, transaction._time);
+    _fraud_scorer.onCommitted(_current_card->_card_number, transaction);
+    // Money is already debited: a failed refresh only leaves the cached balance stale
+    updateCardData();
+    return TransactionResult::TRANS_SUCCESS;
+}
+
+ATMBase::TransactionResult ATMBase::withdrawCash(const QString& transactionId, double amount)
+{
+    // Refuse amounts we cannot pay out before touching the account
+    CashDispenser::Plan plan;
+    if(!_cash_dispenser.plan(amount, plan))
+    {
+        return TransactionResult::TRANS_CANNOT_DISPENSE;
+    }
+    // Notes leave the cassettes' counts in the debit's transaction
+    QVector<BalanceChange> takeNotes;
+    for(int c = 0; c < _cash_dispenser.cassetteCount(); ++c)
+    {
+        if(plan._notes[c] == 0)
+        {
+            continue;
+        }
+        BalanceChange take = {CashDispenser::TAKE_NOTES, AuditLog::STMT_TAKE_NOTES,
+                              static_cast<double>(plan._notes[c]) * _cash_dispenser.cassette(c)._denomination,
+                              _current_card->_card_number, QVariantList()};
+        take._values << static_cast<int>(plan._notes[c]) << _atm_id << c;
+        takeNotes.append(take);
+    }
+    // Recovery puts these back in the cassettes' counts if it refunds
+    _pending_plan = plan;
+    setDebitPhase(SessionCheckpoint::DEBIT_ISSUED, FraudScorer::OP_WITHDRAWAL);
+    TransactionResult result = withdrawFunds(transactionId, amount, FraudScorer::OP_WITHDRAWAL, QString(), takeNotes);
+    if(result != TRANS_SUCCESS)
+    {
+        setDebitPhase(SessionCheckpoint::DEBIT_NONE, FraudScorer::OP_WITHDRAWAL);
+        return result;
+    }
+    // Recovery must not refund once notes may have left
+    setDebitPhase(SessionCheckpoint::DEBIT_DISPENSING, FraudScorer::OP_WITHDRAWAL);
+    _cash_dispenser.dispense(plan);
+    audit(AuditLog::EVENT_CASH_DISPENSED, 0, amount);
+    setDebitPhase(SessionCheckpoint::DEBIT_SETTLED, FraudScorer::OP_WITHDRAWAL);
+    return result;
+}
+
+// Operator is contacted in background: customer only waits for the debit
+ATMBase::TransactionResult ATMBase::rechargeMobile(const QString& transactionId, double amount, QString phoneNumber)
+{
+    // Operators are paid in the base currency, and the gateway refunds refused top-ups
+    // in the amount it was queued with: only cards in the base currency can pay for them
+    if(!loadCardCurrency())
+    {
+        return TransactionResult::TRANS_FAIL;
+    }
+    if(!_current_card->_currency.isEmpty() && _current_card->_currency != _exchange_rates.base())
+    {
+        return TransactionResult::TRANS_NO_RATE;
+    }
+    // Top-up is stored in the debit's transaction: a committed debit always has it queued
+    const TopUpGateway::Request request = TopUpGateway::makeRequest(_current_card->_card_number, phoneNumber, amount,
+                                                                    QDateTime::currentMSecsSinceEpoch() / 1000);
+    _pending_topup_key = request._key;
+    setDebitPhase(SessionCheckpoint::DEBIT_ISSUED, FraudScorer::OP_MOBILE);
+    const TransactionResult result = withdrawFunds(transactionId, amount, FraudScorer::OP_MOBILE, phoneNumber,
+                                                   QVector<BalanceChange>(1, queuedTopUp(request, _atm_id)));
+    if(result != TRANS_SUCCESS)
+    {
+        setDebitPhase(SessionCheckpoint::DEBIT_NONE, FraudScorer::OP_MOBILE);
+        return result;
+    }
+    setDebitPhase(SessionCheckpoint::DEBIT_SETTLED, FraudScorer::OP_MOBILE);
+    _topup_gateway.submit(request);
+    return result;
+}
+
+void ATMBase::setTopUpTransport(TopUpGateway::ITransport* transport)
+{
+    assert(_state == POWER_OFF && "FATAL: Top-up transport changed while ATM is on!!!");
+    _topup_gateway.setTransport(transport);
+}
+
+void ATMBase::setTraceSampling(int sampleEvery)
+{
+    _tracer.setSampling(sampleEvery);
+}
+
+void ATMBase::setPinCheckWakeUp(const PinVerifier::Completion& wakeUp)
+{
+    assert(_state == POWER_OFF && "FATAL: PIN check wake-up changed while ATM is on!!!");
+    _pin_verifier.setCompletion(wakeUp);
+    _pin_check_wake_up = static_cast<bool>(wakeUp);
+}
+
+// Refunds are committed by the gateway's thread, the audit trail is written from this one
+void ATMBase::auditTopUpRefunds()
+{
+    if(!_topup_gateway.hasRefunds())
+    {
+        return;
+    }
+    QVector<TopUpGateway::Refund> refunds;
+    _topup_gateway.takeRefunds(refunds);
+    // Balances the snapshot holds may be missing the refunds
+    _reader.invalidate();
+    for(int i = 0; i < refunds.size(); ++i)
+    {
+        auditStatement(AuditLog::STMT_UPLOAD_FUNDS, true, refunds[i]._amount, refunds[i]._card_number);
+    }
+}
+
+void ATMBase::refreshCardFilter()
+{
+    if(_maintenance.hasCardFilter())
+    {
+        // Knows the cards issued, blocked and reactivated since the last rebuild
+        _maintenance.takeCardFilter(_card_filter);
+    }
+}
+
+void ATMBase::auditLimits()
+{
+    if(_velocity_limits.hasFailedWrites())
+    {
+        auditStatement(AuditLog::STMT_STORE_COUNTERS, false, _velocity_limits.takeFailedWrites());
+    }
+}
+
+void ATMBase::auditMaintenance()
+{
+    if(!_maintenance.hasReports())
+    {
+        return;
+    }
+    QVector<MaintenanceScheduler::Report> reports;
+    _maintenance.takeReports(reports);
+    for(int i = 0; i < reports.size(); ++i)
+    {
+        AuditRecord record = auditRecord(AuditLog::EVENT_MAINTENANCE);
+        record._statement = static_cast<quint32>(reports[i]._task);
+        record._result = reports[i]._succeeded ? 1 : 0;
+        record._amount = reports[i]._amount;
+        _audit_log.append(record);
+    }
+}
+
+// Score operation that is about to be committed
+ATMBase::TransactionResult ATMBase::screenTransaction(const FraudScorer::Transaction& transaction)
+{
+    if(_step_up_confirmed)
+    {
+        // Customer has just re-entered PIN for this very operation
+        return TransactionResult::TRANS_SUCCESS;
+    }
+    switch(_fraud_scorer.score(_current_card->_card_number, transaction)._verdict)
+    {
+    case FraudScorer::DENY:
+        return TransactionResult::TRANS_DECLINED;
+    case FraudScorer::STEP_UP:
+        return TransactionResult::TRANS_STEP_UP_REQUIRED;
+    default:
+        return TransactionResult::TRANS_SUCCESS;
+    }
+}
+
+FraudScorer::Transaction ATMBase::makeTransaction(FraudScorer::Operation operation, double amount, const QString& beneficiary)
+{
+    FraudScorer::Transaction transaction;
+    transaction._operation = operation;
+    transaction._amount = amount;
+    transaction._beneficiary = beneficiary;
+    transaction._time = QDateTime::currentMSecsSinceEpoch() / 1000;
+    transaction._hour = QTime::currentTime().hour();
+    return transaction;
+}
+
+const QString& ATMBase::invalidPinMessage(size_t attemptsLeft)
+{
+    static_assert(sizeof(INVALID_PIN_MESSAGES) / sizeof(INVALID_PIN_MESSAGES[0]) == MAX_PIN_ERRORS,
+                  "One invalid PIN message for every number of attempts left");
+    // Too many messages do not compile; too few leave an empty one
+    assert(attemptsLeft > 0 && attemptsLeft < MAX_PIN_ERRORS && !INVALID_PIN_MESSAGES[attemptsLeft].isEmpty() &&
+           "FATAL: No message for this number of PIN attempts!!!");
+    return INVALID_PIN_MESSAGES[attemptsLeft];
+}
+
+void ATMBase::loadCassettes(const QVector<CashDispenser::Cassette>& cassettes)
+{
+    _cash_dispenser.load(cassettes);
+    if(_database.isOpen())
+    {
+        auditStatement(AuditLog::STMT_STORE_CASSETTES, storeCassettes());
+    }
+}
+
+bool ATMBase::selectCassettes(QSqlDatabase& database, QVector<CashDispenser::Cassette>& cassettes, QString& refill)
+{
+    QSqlQuery query(database);
+    if(!query.prepare(CashDispenser::SELECT_CASSETTES))
+    {
+        return false;
+    }
+    query.addBindValue(_atm_id);
+    if(!query.exec())
+    {
+        return false;
+    }
+    cassettes.clear();
+    while(query.next() && cassettes.size() < CashDispenser::MAX_CASSETTES)
+    {
+        const CashDispenser::Cassette cassette = {query.value(1).toInt(), query.value(2).toInt()};
+        cassettes.append(cassette);
+        refill = query.value(3).toString();
+    }
+    return true;
+}
+
+// Counts of the last refill are replaced as a whole
+bool ATMBase::storeCassettes()
+{
+    if(!_database.transaction())
+    {
+        return false;
+    }
+    QSqlQuery query(_database);
+    bool stored = query.prepare(CashDispenser::CLEAR_CASSETTES);
+    if(stored)
+    {
+        query.addBindValue(_atm_id);
+        stored = query.exec();
+    }
+    stored = stored && query.prepare(CashDispenser::STORE_CASSETTE);
+    for(int c = 0; stored && c < _cash_dispenser.cassetteCount(); ++c)
+    {
+        const CashDispenser::Cassette& cassette = _cash_dispenser.cassette(c);
+        query.addBindValue(_atm_id);
+        query.addBindValue(c);
+        query.addBindValue(cassette._denomination);
+        query.addBindValue(cassette._count);
+        query.addBindValue(cassette._count);
+        query.addBindValue(_cassette_refill);
+        stored = query.exec();
+    }
+    stored = stored && _database.commit();
+    if(!stored)
+    {
+        _database.rollback();
+    }
+    return stored;
+}
+
+QVector<CashDispenser::Cassette> ATMBase::defaultCassettes()
+{
+    QVector<CashDispenser::Cassette> cassettes;
+    for(int i = 0; i < DEFAULT_CASSETTE_COUNT; ++i)
+    {
+        cassettes.append(DEFAULT_CASSETTES[i]);
+    }
+    return cassettes;
+}
+
+// CARD_OK if card exists, CARD_UNREADABLE if it does not
+ATMBase::CardStatus ATMBase::cardExists(QString cardNumber)
+{
+    assert(_database.isOpen() && "FATAL: Did not establish DB connection before calling ATMBase::cardExists()!!!");
+    const bool selected = selectCard(cardNumber);
+    auditStatement(AuditLog::STMT_SELECT_CARD, selected, 0, cardNumber);
+    if(!selected)
+    {
+        return CARD_DB_FAILED;
+    }
+
+    // Attempt to retreive the first (and only) entry
+    const bool found = _select_card.next();
+    _select_card.finish();
+    return found ? CARD_OK : CARD_UNREADABLE;
+}
+
+ATMBase::TransactionResult ATMBase::transferFunds(const QString& transactionId, QString targetCardNumber, double amount)
+{
+    assert(_current_card && _database.isOpen() && "FATAL: Unexpected call to ATMBase::withdrawFunds()!!!");
+    if(_applied_transactions.contains(transactionId))
+    {
+        return TransactionResult::TRANS_DUPLICATE;
+    }
+    const CardStatus status = updateCardData();
+    if(status != CARD_OK)
+    {
+        return toTransactionResult(status);
+    }
+    if(amount > _current_card->_balance)
+    {
+        return TransactionResult::TRANS_NOT_ENOUGH_FUNDS;
+    }
+    targetCardNumber = CardNumberValidator::normalize(targetCardNumber);
+    if(CardNumberValidator::validate(targetCardNumber).status != CardNumberValidator::VALID ||
+       !_card_filter.mayExist(targetCardNumber))
+    {
+        return TransactionResult::TRANS_INVALID_RECEPIENT;
+    }
+    switch(cardExists(targetCardNumber))
+    {
+    case CARD_OK:
+        break;
+    case CARD_UNREADABLE:
+        return TransactionResult::TRANS_INVALID_RECEPIENT;
+    default:
+        return TransactionResult::TRANS_FAIL;
+    }
+    // Amount is in the payer's currency. Recipient is credited in theirs;
+    // limits and screening see it in the base currency.
+    QString targetCurrency;
+    if(!loadCardCurrency() || !selectCurrency(targetCardNumber, targetCurrency))
+    {
+        return TransactionResult::TRANS_FAIL;
+    }
+    double creditAmount = amount;
+    double baseAmount = amount;
+    if(!_exchange_rates.convert(amount, _current_card->_currency, targetCurrency, creditAmount) ||
+       !_exchange_rates.convert(amount, _current_card->_currency, QString(), baseAmount))
+    {
+        return TransactionResult::TRANS_NO_RATE;
+    }
+    const FraudScorer::Transaction transaction = makeTransaction(FraudScorer::OP_TRANSFER, baseAmount, targetCardNumber);
+    _velocity_limits.refresh(_database, _current_card->_card_number);
+    if(!_velocity_limits.allows(_current_card->_card_number, baseAmount, transaction._time))
+    {
+        return TransactionResult::TRANS_LIMIT_EXCEEDED;
+    }
+    const TransactionResult screening = screenTransaction(transaction);
+    if(screening != TRANS_SUCCESS)
+    {
+        return screening;
+    }
+    // Debit and credit commit together: a failed credit leaves nothing to roll back.
+    // Hot accounts are credited into this ATM's slot, not in their row
+    const bool hot = _hot_accounts.isHot(targetCardNumber);
+    const BalanceChange changes[] = {
+        {WITHDRAW_FUNDS.arg(_current_card->_card_number, QString::number(amount)),
+         AuditLog::STMT_WITHDRAW_FUNDS, amount, _current_card->_card_number, QVariantList()},
+        transferCredit(targetCardNumber, creditAmount, _atm_id, hot),
+        historyEntry(_current_card->_card_number, CardHistory::ENTRY_TRANSFER_OUT, -amount, transaction._time, targetCardNumber,
+                     _hot_accounts.isHot(_current_card->_card_number)),
+        historyEntry(targetCardNumber, CardHistory::ENTRY_TRANSFER_IN, creditAmount, transaction._time,
+                     _current_card->_card_number, hot)
+    };
+    TransactionResult result = TRANS_FAIL;
+    setDebitPhase(SessionCheckpoint::DEBIT_ISSUED, FraudScorer::OP_TRANSFER);
+    switch(applyOnce(transactionId, changes, sizeof(changes) / sizeof(changes[0])))
+    {
+    case APPLY_DONE:
+        _velocity_limits.record(_current_card->_card_number, baseAmount, transaction._time);
+        _fraud_scorer.onCommitted(_current_card->_card_number, transaction);
+        result = TRANS_SUCCESS;
+        break;
+    case APPLY_DUPLICATE:
+        result = TRANS_DUPLICATE;
+        break;
+    default:
+        break;
+    }
+    // Credit commits with the debit: nothing else has to follow
+    setDebitPhase((result == TRANS_SUCCESS) ? SessionCheckpoint::DEBIT_SETTLED : SessionCheckpoint::DEBIT_NONE,
+                  FraudScorer::OP_TRANSFER);
+    updateCardData();
+    return result;
+}
+
+ATMBase::ApplyResult ATMBase::applyOnce(const QString& transactionId, const BalanceChange* changes, int count)
+{
+    assert(count > 0 && _database.isOpen() && "FATAL: Unexpected call to ATMBase::applyOnce()!!!");
+    if(_applied_transactions.contains(transactionId))
+    {
+        return APPLY_DUPLICATE;
+    }
+    SessionTracer::Scope span(_tracer, "applyOnce", "db");
+    const ApplyResult result = commitOnce(_database, transactionId, changes, count);
+    if(result == APPLY_DUPLICATE)
+    {
+        // Too old for the index, but applied all the same
+        _applied_transactions.insert(transactionId);
+        return APPLY_DUPLICATE;
+    }
+    // Audited once the outcome is known: statements that were rolled back moved no funds
+    const bool applied = (result == APPLY_DONE);
+    auditStatement(AuditLog::STMT_RECORD_TRANSACTION, applied, changes[0]._amount, changes[0]._card_number);
+    for(int i = 0; i < count; ++i)
+    {
+        auditStatement(changes[i]._statement, applied, changes[i]._amount, changes[i]._card_number);
+    }
+    if(!applied)
+    {
+        return APPLY_FAILED;
+    }
+    _applied_transactions.insert(transactionId);
+    _reader.invalidate();
+    return APPLY_DONE;
+}
+
+ATMBase::ApplyResult ATMBase::commitOnce(QSqlDatabase& database, const QString& transactionId,
+                                         const BalanceChange* changes, int count)
+{
+    if(!database.transaction())
+    {
+        return APPLY_FAILED;
+    }
+    QSqlQuery query(database);
+    bool applied = query.prepare(IdempotencyIndex::RECORD_ID);
+    if(applied)
+    {
+        query.addBindValue(transactionId);
+        query.addBindValue(changes[0]._card_number);
+        query.addBindValue(changes[0]._amount);
+        query.addBindValue(QDateTime::currentMSecsSinceEpoch() / 1000);
+        applied = query.exec();
+    }
+    if(applied && query.numRowsAffected() == 0)
+    {
+        database.rollback();
+        return APPLY_DUPLICATE;
+    }
+    for(int i = 0; applied && i < count; ++i)
+    {
+        if(changes[i]._values.isEmpty())
+        {
+            applied = query.exec(changes[i]._query);
+            continue;
+        }
+        applied = query.prepare(changes[i]._query);
+        for(int v = 0; applied && v < changes[i]._values.size(); ++v)
+        {
+            query.addBindValue(changes[i]._values[v]);
+        }
+        applied = applied && query.exec();
+    }
+    applied = applied && database.commit();
+    if(!applied)
+    {
+        database.rollback();
+        return APPLY_FAILED;
+    }
+    return APPLY_DONE;
+}
+
+// TODO: Separate from this class entirely?
+bool ATMBase::executeQuery(QString sqlQuery, AuditLog::Statement statement, double amount, QString cardNumber)
+{
+    assert(_database.isOpen() && "FATAL: Did not establish DB connection before calling ATMBase::executeQuery()!!!");
+    SessionTracer::Scope span(_tracer, AuditLog::statementName(statement), "db");
+    // TODO: SQL injection protection?
+    QSqlQuery query(sqlQuery, _database);
+    auditStatement(statement, query.isActive(), amount, cardNumber);
+    if(query.isActive())
+    {
+        // Every statement run here writes: customer must see it in the next read
+        _reader.invalidate();
+    }
+    return query.isActive();
+}
+
+ATMBase::TransactionResult ATMBase::toTransactionResult(CardStatus status)
+{
+    return (status == CARD_INACTIVE) ? TransactionResult::TRANS_CARD_INACTIVE : TransactionResult::TRANS_FAIL;
+}
+
+void ATMBase::setState(ATMState state)
+{
+    AuditRecord record = auditRecord(AuditLog::EVENT_STATE_CHANGE);
+    _state = state;
+    _state_changed_ns = SessionTracer::now();
+    record._new_state = static_cast<quint8>(_state);
+    _audit_log.append(record);
+    checkpointSession();
+    _maintenance.setIdle(_state == NO_CARD);
+}
+
+void ATMBase::setMenuState(MenuState menuState)
+{
+    AuditRecord record = auditRecord(AuditLog::EVENT_STATE_CHANGE);
+    _menu_state = menuState;
+    _state_changed_ns = SessionTracer::now();
+    record._new_menu_state = static_cast<quint8>(_menu_state);
+    _audit_log.append(record);
+    checkpointSession();
+}
+
+void ATMBase::checkpointSession()
+{
+    // Out of service, the session the last run died in stays for the next power on
+    if(!_checkpoint.isOpen() || _state == OUT_OF_SERVICE)
+    {
+        return;
+    }
+    SessionRecord record;
+    memset(&record, 0, sizeof(record));
+    record._state = static_cast<quint8>(_state);
+    record._menu_state = static_cast<quint8>(_menu_state);
+    record._pin_attempts_left = static_cast<quint8>(_pin_attempts_left);
+    record._operation = static_cast<quint8>(_pending_operation);
+    record._debit_phase = static_cast<quint8>(_debit_phase);
+    record._amount = _pending_transfer_amount;
+    record._debit_amount = _pending_debit_amount;
+    memcpy(record._notes, _pending_plan._notes, sizeof(record._notes));
+    if(_current_card)
+    {
+        SessionCheckpoint::setText(record._card_mask, CardToken::mask(_current_card->_card_number));
+        record._card_token = _card_token.token(_current_card->_card_number);
+    }
+    SessionCheckpoint::setText(record._recepient, CardToken::mask(_pending_recepient));
+    SessionCheckpoint::setText(record._transaction_id, _pending_transaction_id);
+    SessionCheckpoint::setText(record._topup_key, _pending_topup_key);
+    _checkpoint.save(record);
+}
+
+void ATMBase::setDebitPhase(SessionCheckpoint::DebitPhase phase, FraudScorer::Operation operation)
+{
+    _debit_phase = phase;
+    _pending_operation = operation;
+    checkpointSession();
+}
+
+void ATMBase::assignTransactionId()
+{
+    if(_pending_transaction_id.isEmpty())
+    {
+        _pending_transaction_id = IdempotencyIndex::newId();
+        checkpointSession();
+    }
+}
+
+AuditLog::Recovery ATMBase::settleInterruptedDebit(const SessionRecord& session)
+{
+    // Checkpoint only has the card's token: the debit's record names the card
+    QString cardNumber;
+    const QString transactionId = SessionCheckpoint::text(session._transaction_id);
+    const FraudScorer::Operation operation = static_cast<FraudScorer::Operation>(session._operation);
+    AuditLog::Recovery recovery = AuditLog::RECOVERY_NO_DEBIT;
+    switch(session._debit_phase)
+    {
+    case SessionCheckpoint::DEBIT_SETTLED:
+        recovery = AuditLog::RECOVERY_DEBIT_KEPT;
+        break;
+    case SessionCheckpoint::DEBIT_DISPENSING:
+    {
+        // Neither refunded nor kept here: only the cassettes know whether the customer got the cash
+        recovery = AuditLog::RECOVERY_RECONCILE;
+        bool committed = false;
+        if(_database.isOpen())
+        {
+            IdempotencyIndex::isRecorded(_database, transactionId, committed, &cardNumber);
+        }
+        break;
+    }
+    case SessionCheckpoint::DEBIT_ISSUED:
+    {
+        // Whatever the DB cannot confirm is left as it is, for reconciliation
+        recovery = AuditLog::RECOVERY_FAILED;
+        bool committed = false;
+        if(!_database.isOpen() || !IdempotencyIndex::isRecorded(_database, transactionId, committed, &cardNumber))
+        {
+            break;
+        }
+        if(!committed)
+        {
+            recovery = AuditLog::RECOVERY_NOT_COMMITTED;
+            break;
+        }
+        // Transfer credits and top-ups are stored in the debit's own transaction;
+        // the gateway sends whatever top-ups are still pending when it starts
+        if(operation == FraudScorer::OP_TRANSFER || operation == FraudScorer::OP_MOBILE)
+        {
+            recovery = AuditLog::RECOVERY_DEBIT_KEPT;
+            break;
+        }
+        // Notes only leave once the phase says they may: no cash was handed out.
+        // Refund undoes all the debit did, under an ID of its own, so it cannot credit twice.
+        // Card is refunded in its own currency, at the rate it paid.
+        const double paid = (session._debit_amount != 0) ? session._debit_amount : session._amount;
+        QVector<BalanceChange> refund;
+        const BalanceChange upload = {UPLOAD_FUNDS.arg(cardNumber, QString::number(paid)),
+                                      AuditLog::STMT_UPLOAD_FUNDS, paid, cardNumber, QVariantList()};
+        refund.append(upload);
+        refund.append(historyEntry(cardNumber, CardHistory::ENTRY_WITHDRAWAL_REFUND, paid,
+                                   QDateTime::currentMSecsSinceEpoch() / 1000, QString(), _hot_accounts.isHot(cardNumber)));
+        CashDispenser::Plan notes;
+        memset(&notes, 0, sizeof(notes));
+        for(int c = 0; c < CashDispenser::MAX_CASSETTES; ++c)
+        {
+            if(session._notes[c] == 0)
+            {
+                continue;
+            }
+            notes._notes[c] = session._notes[c];
+            const double value = (c < _cash_dispenser.cassetteCount())
+                                 ? static_cast<double>(session._notes[c]) * _cash_dispenser.cassette(c)._denomination : 0;
+            BalanceChange returned = {CashDispenser::RETURN_NOTES, AuditLog::STMT_RETURN_NOTES, value, cardNumber,
+                                      QVariantList()};
+            returned._values << static_cast<int>(session._notes[c]) << _atm_id << c;
+            refund.append(returned);
+        }
+        switch(applyOnce(transactionId + REFUND_ID_SUFFIX, refund.constData(), refund.size()))
+        {
+        case APPLY_DONE:
+            // Counts were read before the refund
+            _cash_dispenser.putBack(notes);
+            recovery = AuditLog::RECOVERY_REFUNDED;
+            break;
+        case APPLY_DUPLICATE:
+            // Run that refunded died before it could say so: counts were read after it
+            recovery = AuditLog::RECOVERY_REFUNDED;
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    AuditRecord record = auditRecord(AuditLog::EVENT_SESSION_RECOVERED, cardNumber);
+    if(cardNumber.isEmpty())
+    {
+        memcpy(record._card_number, session._card_mask, qMin(sizeof(record._card_number), sizeof(session._card_mask)));
+        record._card_number[sizeof(record._card_number) - 1] = '\0';
+        record._card_token = session._card_token;
+    }
+    record._result = static_cast<quint8>(recovery);
+    record._amount = (recovery == AuditLog::RECOVERY_NO_DEBIT) ? 0 : session._amount;
+    _audit_log.append(record);
+    return recovery;
+}
+
+const char* ATMBase::stateName() const
+{
+    // Indexed by ATMState and MenuState
+    static const char* const STATE_NAMES[] = {"POWER_OFF", "NO_CARD", "PENDING_PIN", "TOP_MENU", "OUT_OF_SERVICE"};
+    static const char* const MENU_STATE_NAMES[] = {
+        "TOP", "SHOW_BALANCE_METHOD", "DISPLAY_BALANCE", "PRINT_BALANCE", "WITHDRAWAL_AMOUNT",
+        "TRANSFER_AMOUNT", "TRANSFER_RECEPIENT", "MOBILE_AMOUNT", "MOBILE_RECEPIENT", "REPORT_RESULT", "CONFIRM_PIN"
+    };
+    return (_state == TOP_MENU) ? MENU_STATE_NAMES[_menu_state] : STATE_NAMES[_state];
+}
+
+// Audit record describing current ATM state.
+// Card number defaults to the one of the inserted card.
+AuditRecord ATMBase::auditRecord(AuditLog::Event event, QString cardNumber) const
+{
+    AuditRecord record;
+    memset(&record, 0, sizeof(record));
+    record._event = event;
+    record._old_state = record._new_state = static_cast<quint8>(_state);
+    record._old_menu_state = record._new_menu_state = static_cast<quint8>(_menu_state);
+    if(cardNumber.isEmpty() && _current_card)
+    {
+        cardNumber = _current_card->_card_number;
+    }
+    if(cardNumber.isEmpty())
+    {
+        return record;
+    }
+    const QString masked = CardToken::mask(cardNumber);
+    const int length = qMin(masked.size(), static_cast<int>(sizeof(record._card_number)) - 1);
+    for(int i = 0; i < length; ++i)
+    {
+        record._card_number[i] = masked.at(i).toLatin1();
+    }
+    record._card_token = _card_token.token(cardNumber);
+    return record;
+}
+
+void ATMBase::audit(AuditLog::Event event, quint8 result, double amount, QString cardNumber)
+{
+    AuditRecord record = auditRecord(event, cardNumber);
+    record._result = result;
+    record._amount = amount;
+    _audit_log.append(record);
+}
+
+void ATMBase::auditStatement(AuditLog::Statement statement, bool succeeded, double amount, QString cardNumber)
+{
+    AuditRecord record = auditRecord(AuditLog::EVENT_DB_STATEMENT, cardNumber);
+    record._statement = statement;
+    record._result = succeeded ? 1 : 0;
+    record._amount = amount;
+    _audit_log.append(record);
+}
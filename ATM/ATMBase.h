@@ -0,0 +1,509 @@
+#ifndef ATMBASE_H
+#define ATMBASE_H
+
+#include <iostream>
+#include <string>
+#include <QString>
+#include <QtSql>
+#include <QLockFile>
+#include <exception>
+#include <cassert>
+
+#include "CardFilter.h"
+#include "CardNumberValidator.h"
+#include "CashDispenser.h"
+#include "VelocityLimits.h"
+#include "FraudScorer.h"
+#include "AuditLog.h"
+#include "CardHistory.h"
+#include "TopUpGateway.h"
+#include "StartupPipeline.h"
+#include "ATMConfig.h"
+#include "SessionTracer.h"
+#include "SnapshotReader.h"
+#include "HotAccounts.h"
+#include "IdempotencyIndex.h"
+#include "MaintenanceScheduler.h"
+#include "SessionCheckpoint.h"
+#include "PinVerifier.h"
+#include "ExchangeRates.h"
+#include "CardToken.h"
+#include "SessionArena.h"
+#include "KeypadQueue.h"
+
+
+// TODO: Move DB configuration data to a better place
+#define BANK_DATABASE_DRIVER "QSQLITE"
+#define BANK_DATABASE_NAME "bank.db"
+// Audit trail files are written here
+#define ATM_AUDIT_DIRECTORY "audit"
+// Session traces are written here
+#define ATM_TRACE_DIRECTORY "trace"
+// Session checkpoints are kept here (see SessionCheckpoint.h)
+#define ATM_CHECKPOINT_DIRECTORY "checkpoint"
+// Optional branch settings (see ATMConfig.h)
+#define ATM_CONFIG_FILE "atm.ini"
+// Exchange rates for cards in other currencies (see ExchangeRates.h)
+#define ATM_RATES_FILE "rates.ini"
+// Key card numbers are tokenized with in audit and checkpoint files (see CardToken.h)
+#define ATM_CARD_KEY_FILE "card.key"
+
+using namespace std;
+
+class ATM;
+
+// Part of the ATM that does not depend on its modules:
+// session data, bank DB access, cash, limits, fraud scoring and audit trail.
+// Customer session itself is driven by BasicATM (see ATM.h), which adds the modules.
+class ATMBase
+{
+public:
+    // Interface for everything that can be connected to an ATM: displays, printers, fingerprints scanners, etc.
+    class IConnectableModule;
+
+    // Replace contents of cash cassettes (e.g. after the ATM is refilled).
+    // Counts are stored in the bank DB once it is open.
+    void loadCassettes(const QVector<CashDispenser::Cassette>& cassettes);
+
+    // Way to reach the mobile operator; NULL means the built-in stub.
+    // Not owned. Takes effect at the next power on.
+    void setTopUpTransport(TopUpGateway::ITransport* transport);
+
+    // Trace one customer session in 'sampleEvery' (0: off).
+    // May be called from any thread; takes effect from the next card.
+    void setTraceSampling(int sampleEvery);
+    // Called on a verifier thread once a PIN check the ATM is waiting for is done.
+    // The frontend then has completePinCheck() run on the ATM's thread.
+    // Empty: the ATM blocks on its checks. Only to be changed while the ATM is off.
+    void setPinCheckWakeUp(const PinVerifier::Completion& wakeUp);
+    // Entered PIN is being checked; input is not taken meanwhile
+    inline bool isCheckingPin() const
+    {
+        return _pin_check != 0;
+    }
+
+    inline bool isOn()
+    {
+        return (_state != POWER_OFF);
+    }
+    // On, but startup failed
+    inline bool isOutOfService()
+    {
+        return (_state == OUT_OF_SERVICE);
+    }
+
+    // How long each phase of the last power on took
+    inline const std::vector<StartupPipeline::Timing>& startupTimings() const
+    {
+        return _startup_timings;
+    }
+    inline qint64 startupUs() const
+    {
+        return _startup_us;
+    }
+
+    // Cost of PIN hash checks and how long they queued for a worker
+    inline PinVerifier::Metrics pinMetrics() const
+    {
+        return _pin_verifier.metrics();
+    }
+
+    // TODO: Move everything related to DB to a separate class
+    //==========
+    // Templates for common SQL queries
+    static const QString SELECT_CARD_BY_NUMBER;
+    static const QString DEACTIVATE_CARD;
+    static const QString WITHDRAW_FUNDS;
+    static const QString UPLOAD_FUNDS;
+    //etc.
+
+    // Statement that moves funds, with what the audit trail needs to know about it
+    struct BalanceChange
+    {
+        QString _query;
+        AuditLog::Statement _statement;
+        double _amount;
+        QString _card_number;
+        QVariantList _values;   // Bound to _query in order; empty: _query is run as it is
+    };
+    enum ApplyResult
+    {
+        APPLY_DONE      = 0,
+        APPLY_DUPLICATE = 1,    // ID has been applied before: nothing was run
+        APPLY_FAILED    = 2     // Nothing was committed
+    };
+    // Card's history entry for a movement, to commit with it (amount is negative for debits).
+    // 'hot': the card is a hot account (see HotAccounts.h).
+    static BalanceChange historyEntry(const QString& cardNumber, CardHistory::Entry entry, double amount, qint64 time,
+                                      const QString& counterparty, bool hot);
+    // Top-up for the gateway of terminal 'atmId' to send, to commit with its debit
+    static BalanceChange queuedTopUp(const TopUpGateway::Request& request, quint16 atmId);
+    // Credit of a transfer: into the terminal's slot 'atmId' if the account is hot, into its row otherwise
+    static BalanceChange transferCredit(const QString& cardNumber, double amount, quint16 atmId, bool hot);
+    // Record 'transactionId' in applied_transactions and run 'changes' in one DB transaction.
+    // Runs nothing if the ID is there already. Audit trail and ID index are up to the caller.
+    static ApplyResult commitOnce(QSqlDatabase& database, const QString& transactionId,
+                                  const BalanceChange* changes, int count);
+
+protected:
+    ATMBase();
+    ~ATMBase();
+
+    static const size_t MAX_PIN_ERRORS = 3;
+
+    // Expected reasons for not serving a card. These are ordinary outcomes
+    // (card-testing traffic is mostly made of them), so they are returned, not thrown.
+    enum CardStatus
+    {
+        CARD_OK             = 0,
+        CARD_UNREADABLE     = 1,    // Invalid or inexistant card number
+        CARD_INACTIVE       = 2,    // Card is blocked or not yet active
+        CARD_DB_UNAVAILABLE = 3,    // Failed to connect to bank DB
+        CARD_DB_FAILED      = 4     // Query to bank DB failed
+    };
+
+    // Ejection messages
+    static const QString EJECT_SUCCESS;
+    static const QString EJECT_ERR_CONN;    // No connection to bank DB
+    static const QString EJECT_ERR_READ;    // Invalid or inexistant card number
+    static const QString EJECT_ERR_FAIL;    // Other error
+
+    // Cassette set the ATM starts with
+    static const CashDispenser::Cassette DEFAULT_CASSETTES[];
+    static const int DEFAULT_CASSETTE_COUNT;
+    static QVector<CashDispenser::Cassette> defaultCassettes();
+
+    // Debit would exceed hourly, daily or monthly limit
+    static const QString LIMIT_EXCEEDED_MESSAGE;
+    // Fraud scoring refused the operation
+    static const QString DECLINED_MESSAGE;
+
+    // Prompts and messages that do not depend on card data
+    static const QString PROMPT_INSERT_CARD;
+    static const QString PROMPT_WAIT;
+    static const QString PROMPT_TOP_MENU;
+    static const QString PROMPT_BALANCE_OPTIONS;
+    static const QString PROMPT_AMOUNT;
+    static const QString PROMPT_RECEPIENT;
+    static const QString PROMPT_PHONE;
+    static const QString PROMPT_STEP_UP_PIN;
+    static const QString PIN_REQUEST_TEMPLATE;
+    static const QString MSG_TAKE_MONEY;
+    static const QString MSG_NOT_ENOUGH_FUNDS;
+    static const QString MSG_TRANSFER_COMPLETED;
+    static const QString MSG_TOPUP_QUEUED;
+    static const QString MSG_ALREADY_PROCESSED;
+    static const QString MSG_NO_RATE;
+    static const QString MSG_NO_POWER;
+    static const QString MSG_OUT_OF_SERVICE;
+    static const QString INVALID_PIN_MESSAGES[MAX_PIN_ERRORS];  // Indexed by attempts left
+
+    // Card states
+    static const QString CARD_STATE_INSERTED;
+    static const QString CARD_STATE_EJECTED;
+    static const QString CARD_STATE_SEIZED;
+    static const QString CARD_STATE_ABSENT;
+    static const QString CARD_STATE_NONE;
+
+    // Keypad input
+    static const QString DIGITS[10];
+    static const QString PIN_MASK;
+
+    // Seizure messages
+    static const QString SEIZE_INVALID_PIN; // You have stolen it, haven't you?
+    static const QString SEIZE_INACTIVE;    // The card is not yet or no longer active
+
+    // Perform common operations on card seizure/ejection
+    // (such as DB disconnection)
+    void finalizeCard();
+
+    // Query DB for currently inserted card's data
+    inline CardStatus updateCardData()
+    {
+        return updateCardData(_current_card->_card_number);
+    }
+    // CARD_OK if there is such a card, CARD_UNREADABLE if there is not
+    CardStatus cardExists(QString number);
+    // Query DB for card data by its number
+    CardStatus updateCardData(QString cardNumber);
+    // Same for the inserted card, from the read snapshot (see SnapshotReader.h).
+    // For balance and ledger reads only: funds movement reads through updateCardData().
+    CardStatus readCardData();
+    // Fill _current_card from the row 'query' has just selected on 'database'
+    CardStatus takeCardData(QSqlQuery& query, const QString& cardNumber, QSqlDatabase& database);
+    // Mark currently inserted card as inactive in DB. Returns false if DB failed to do so.
+    bool deactivateCard();
+    // Get everything ready for the first card at once, in parallel where possible.
+    // Leaves the connection to bank DB open until power off.
+    // Returns false if any phase failed; the first one is audited.
+    bool warmStart();
+    // Prepare statements run for every card
+    bool prepareStatements();
+    // Same for the read snapshot
+    bool prepareReads();
+    // Run SELECT_CARD_BY_NUMBER for the card; results are in _select_card
+    bool selectCard(const QString& cardNumber);
+    // Compare with the inserted card's PIN; failures are reported to fraud scoring.
+    // 'answered' is false if the answer comes later, with takePinCheck() (see setPinCheckWakeUp()).
+    // CARD_DB_FAILED if DB failed to tell which PIN the card has: 'matched' is not set then.
+    CardStatus beginPinCheck(const QString& pin, bool& answered, bool& matched);
+    // Answer to the check beginPinCheck() left running.
+    // CARD_DB_FAILED if the verifier stopped without one: 'matched' is not set then.
+    CardStatus takePinCheck(bool& matched);
+    // Status and 'matched' for a verifier's answer; a mismatch goes to fraud scoring
+    CardStatus pinAnswer(PinVerifier::Answer answer, bool& matched);
+    // Start checking a PIN that is complete but not yet entered (see PinVerifier.h)
+    void prefetchPinCheck(const QString& pin);
+    // Look up the inserted card's PIN hash, once per card. False if DB failed to tell.
+    bool loadPinHash();
+    // Currency of any card; empty for the base currency. False if DB failed to tell.
+    bool selectCurrency(const QString& cardNumber, QString& currency);
+    // Same for the inserted card, once per card
+    bool loadCardCurrency();
+    // Code to show next to the inserted card's amounts; empty if not known
+    QString currencyCode();
+    // Cassette counts of this terminal as the DB has them; empty if it has none
+    bool selectCassettes(QSqlDatabase& database, QVector<CashDispenser::Cassette>& cassettes, QString& refill);
+    // Replace them with what the cassettes hold now, as a new load
+    bool storeCassettes();
+
+    static const QString& invalidPinMessage(size_t attemptsLeft);
+
+    // TODO: Separate from this class entirely?
+    // Statement kind, amount and card number only go to the audit trail
+    // Returns false if the query failed
+    bool executeQuery(QString query,
+                      AuditLog::Statement statement = AuditLog::STMT_OTHER,
+                      double amount = 0,
+                      QString cardNumber = QString());
+
+    // Write to audit trail. Card number goes in masked and tokenized.
+    AuditRecord auditRecord(AuditLog::Event event, QString cardNumber = QString()) const;
+    void audit(AuditLog::Event event, quint8 result = 0, double amount = 0, QString cardNumber = QString());
+    void auditStatement(AuditLog::Statement statement, bool succeeded, double amount = 0, QString cardNumber = QString());
+    // Bring refunds of refused top-ups into the audit trail
+    void auditTopUpRefunds();
+    // Same for steps of idle-time DB maintenance
+    void auditMaintenance();
+    // Report velocity counters that did not reach the DB
+    void auditLimits();
+    // Take the card filter the last maintenance cycle rebuilt, if any
+    void refreshCardFilter();
+
+    // ATM errors
+    // Only true faults are thrown; expected outcomes are reported through CardStatus.
+    class InternalErrorException;               // Base class for all errors ATM may encounter
+    class NotImplementedException;              // Feature is not yet implemented
+
+    struct Card
+    {
+        QString _card_number;
+        bool _is_active;
+        QString _pin;
+        QString _owner_last_name;
+        bool _owner_gender_male;    // For politeness :)
+        double _balance;
+        QByteArray _pin_hash;       // Empty until the card is migrated to hashed PINs
+        bool _pin_hash_loaded;
+        QString _currency;          // Empty: the ATM's base currency
+        bool _currency_loaded;
+        //etc.
+    };
+
+    Card* _current_card;            // Lives in _session_arena
+    SessionArena _session_arena;    // Per-session storage, released at once in finalizeCard()
+
+    enum ATMState
+    {
+        POWER_OFF   = 0,
+        NO_CARD     = 1,
+        PENDING_PIN = 2,
+        TOP_MENU    = 3,
+        OUT_OF_SERVICE = 4  // Startup failed: no card is taken until the next power on
+    };
+    enum MenuState
+    {
+        TOP                 = 0,
+        SHOW_BALANCE_METHOD = 1,
+        DISPLAY_BALANCE     = 2,
+        PRINT_BALANCE       = 3,
+        WITHDRAWAL_AMOUNT   = 4,
+        TRANSFER_AMOUNT     = 5,
+        TRANSFER_RECEPIENT  = 6,
+        MOBILE_AMOUNT       = 7,
+        MOBILE_RECEPIENT    = 8,
+        REPORT_RESULT       = 9,
+        CONFIRM_PIN         = 10
+    };
+    enum TransactionResult
+    {
+        TRANS_SUCCESS           = 0,
+        TRANS_FAIL              = 1,
+        TRANS_NOT_ENOUGH_FUNDS  = 2,
+        TRANS_INVALID_RECEPIENT = 3,
+        TRANS_CANNOT_DISPENSE   = 4,
+        TRANS_LIMIT_EXCEEDED    = 5,
+        TRANS_DECLINED          = 6,
+        TRANS_STEP_UP_REQUIRED  = 7,
+        TRANS_CARD_INACTIVE     = 8,
+        TRANS_DUPLICATE         = 9,    // Transaction ID has been applied already
+        TRANS_NO_RATE           = 10    // Card's currency and the operation's have no exchange rate
+    };
+
+
+    ATMState _state;
+    MenuState _menu_state;
+    qint64 _state_changed_ns;   // SessionTracer::now() at the last state change; keys pressed before were typed ahead
+
+    QLockFile* _terminal_lock;  // Held on _atm_id for as long as the ATM lives
+    const quint16 _atm_id;  // Terminal id: numbers the audit trail, checkpoint and cassettes, names the DB connection
+    QSqlDatabase _database; // Connection to DB, open from power on to power off
+    QSqlQuery _select_card; // Prepared SELECT_CARD_BY_NUMBER
+    bool _select_card_prepared;
+    QSqlQuery _select_pin_hash;     // Prepared PinVerifier::SELECT_HASH, on first use
+    bool _select_pin_hash_prepared;
+    QSqlQuery _select_currency;     // Prepared ExchangeRates::SELECT_CARD_CURRENCY, on first use
+    bool _select_currency_prepared;
+
+    // Balance and ledger reads, kept off the connection that moves funds
+    SnapshotReader _reader;
+    QSqlQuery _read_card;   // SELECT_CARD_BY_NUMBER on _reader
+    bool _read_card_prepared;
+
+    std::vector<StartupPipeline::Timing> _startup_timings;
+    qint64 _startup_us;
+
+    // Rejects inexistent cards without a DB round trip; rebuilt by maintenance
+    CardFilter _card_filter;
+
+    // Cash cassettes and note-mix planner
+    CashDispenser _cash_dispenser;
+    QString _cassette_refill;       // Refill the counts in the DB come from (see ATMConfig.h)
+
+    // Per-card hourly, daily and monthly debit limits
+    VelocityLimits _velocity_limits;
+
+    // Scores debits before they are committed
+    FraudScorer _fraud_scorer;
+
+    // Trail of everything the ATM does, for regulators
+    AuditLog _audit_log;
+    // Card numbers leave the ATM as tokens
+    CardToken _card_token;
+
+    // Where the time of sampled sessions goes
+    SessionTracer _tracer;
+
+    // Delivers mobile top-ups in background
+    TopUpGateway _topup_gateway;
+
+    // Credits to beneficiaries many terminals pay at once, merged in background
+    HotAccounts _hot_accounts;
+
+    // Recently applied transaction IDs, so that retries are rejected without a DB read
+    IdempotencyIndex _applied_transactions;
+
+    // Upkeep of the bank DB while no card is in
+    MaintenanceScheduler _maintenance;
+
+    // Session as it stood at the last transition, for recovery after a crash
+    SessionCheckpoint _checkpoint;
+    // Session the last run died in with a card in. It carries on if the first card read is that one.
+    SessionRecord _interrupted_session;
+    bool _resume_pending;
+
+    // PIN hash checks, off this thread
+    PinVerifier _pin_verifier;
+    PinVerifier::Ticket _pin_ticket;    // Check started before Enter, for _pin_ticket_pin
+    QString _pin_ticket_pin;
+    PinVerifier::Ticket _pin_check;     // Check of the entered PIN, while its answer is awaited
+    bool _pin_check_wake_up;            // Answers are awaited without blocking
+
+    // Rates for cards in other currencies, read without locks
+    ExchangeRates _exchange_rates;
+
+    // Printed statements; its buffer is reused from one statement to the next
+    StatementExporter _statement_exporter;
+
+    size_t _pin_attempts_left;
+
+    double _pending_transfer_amount;    // Used to save input
+    double _pending_debit_amount;       // In the card's currency, if not the same as above; 0 otherwise
+    CashDispenser::Plan _pending_plan;  // Notes the withdrawal in flight takes; none otherwise
+    QString _pending_recepient;
+    QString _pending_transaction_id;    // Kept until the operation's result is reported or the card leaves
+    QString _pending_topup_key;         // Top-up that follows the debit in flight
+    FraudScorer::Operation _pending_operation;  // Operation in flight or waiting for PIN confirmation
+    SessionCheckpoint::DebitPhase _debit_phase;
+    bool _step_up_confirmed;            // PIN has just been re-entered for pending operation
+
+    // All state changes go through these, so that they get audited
+    void setState(ATMState state);
+    void setMenuState(MenuState menuState);
+    // Menu state while in TOP_MENU, ATM state otherwise
+    const char* stateName() const;
+    // Save session as it stands now. State changes do it themselves; anything
+    // else a crash must not lose (PIN attempts, debits) calls it.
+    void checkpointSession();
+    void setDebitPhase(SessionCheckpoint::DebitPhase phase, FraudScorer::Operation operation);
+    // Give the operation being entered an ID, unless it has one already
+    void assignTransactionId();
+    // Find out what became of the debit an interrupted session had in flight,
+    // and refund it if it committed before any cash was dispensed. Debits cut
+    // short while dispensing are left to reconciliation.
+    // Must run before the first state change, which overwrites the checkpoint.
+    AuditLog::Recovery settleInterruptedDebit(const SessionRecord& session);
+
+    static TransactionResult toTransactionResult(CardStatus status);
+    // Run 'changes' and record 'transactionId' in one DB transaction,
+    // unless a transaction with that ID has been applied already
+    ApplyResult applyOnce(const QString& transactionId, const BalanceChange* changes, int count);
+    // Operations below change balances at most once per transaction ID.
+    // Withdrawals are in the base currency and debit the card in its own, top-ups take
+    // base currency cards only; transfers are in the payer's currency and credit the
+    // recipient in theirs.
+    TransactionResult withdrawFunds(const QString& transactionId,
+                                    double amount,
+                                    FraudScorer::Operation operation = FraudScorer::OP_WITHDRAWAL,
+                                    QString beneficiary = QString(),
+                                    const QVector<BalanceChange>& followUps = QVector<BalanceChange>());
+    // Withdraw funds and hand out notes; cassette counts go down with the debit
+    TransactionResult withdrawCash(const QString& transactionId, double amount);
+    TransactionResult rechargeMobile(const QString& transactionId, double amount, QString phoneNumber);
+    // Ask fraud scorer whether the operation may be committed
+    TransactionResult screenTransaction(const FraudScorer::Transaction& transaction);
+    static FraudScorer::Transaction makeTransaction(FraudScorer::Operation operation, double amount, const QString& beneficiary);
+    TransactionResult transferFunds(const QString& transactionId, QString targetCardNumber, double amount);
+};
+
+// Interface for everything that can be connected to ATM: displays, printers, fingerprints scanners, etc.
+class ATMBase::IConnectableModule
+{
+public:
+    // Called when ATM establishes connection to its module
+    virtual void connect(const ATM& atm) = 0;
+    // Called when ATM disconnects (e.g. when it is destroyed)
+    virtual void disconnect() = 0;
+};
+
+// Internal errors
+
+// Base class for all internal errors of the ATM
+class ATMBase::InternalErrorException : public std::exception
+{
+public:
+    explicit InternalErrorException(QString message = "Unknown internal error."):
+        std::exception(message.toStdString().c_str())
+    {}
+};
+
+// Feature is not yet implemented
+class ATMBase::NotImplementedException : public ATMBase::InternalErrorException
+{
+public:
+    explicit NotImplementedException(QString message = "This feature is not yet implemented."):
+        InternalErrorException(message)
+    {}
+};
+
+#endif // ATMBASE_H
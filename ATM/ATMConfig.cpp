@@ -0,0 +1,158 @@
+#include "ATMConfig.h"
+
+#include <QFile>
+#include <QSettings>
+#include <QStringList>
+#include <climits>
+
+// Ini key prefixes, indexed by VelocityLimits::Window
+static const char* const WINDOW_KEYS[VelocityLimits::WINDOW_COUNT] = {"limits/hour", "limits/day", "limits/month"};
+
+ATMConfig::ATMConfig():
+    _trace_sample_every(-1),
+    _max_staleness_ms(-1),
+    _maintenance_interval_s(-1),
+    _maintenance_drop_backups(-1)
+{
+    for(int w = 0; w < VelocityLimits::WINDOW_COUNT; ++w)
+    {
+        _has_limit[w] = false;
+        _limits[w]._max_count = 0;
+        _limits[w]._max_amount = 0;
+    }
+}
+
+bool ATMConfig::load(const QString& path)
+{
+    if(!QFile::exists(path))
+    {
+        return true;
+    }
+    QSettings settings(path, QSettings::IniFormat);
+    bool wellFormed = (settings.status() == QSettings::NoError);
+
+    for(int w = 0; w < VelocityLimits::WINDOW_COUNT; ++w)
+    {
+        const QString count = QString("%1_count").arg(WINDOW_KEYS[w]);
+        const QString amount = QString("%1_amount").arg(WINDOW_KEYS[w]);
+        if(!settings.contains(count) && !settings.contains(amount))
+        {
+            continue;
+        }
+        // A window is set as a whole: count and amount go together
+        bool countOk = false;
+        bool amountOk = false;
+        const uint maxCount = settings.value(count).toUInt(&countOk);
+        const double maxAmount = settings.value(amount).toDouble(&amountOk);
+        if(countOk && amountOk && maxAmount >= 0)
+        {
+            _has_limit[w] = true;
+            _limits[w]._max_count = maxCount;
+            _limits[w]._max_amount = maxAmount;
+        }
+        else
+        {
+            wellFormed = false;
+        }
+    }
+
+    if(settings.contains("cassettes/notes"))
+    {
+        // QSettings splits comma-separated values into a list
+        const QStringList notes = settings.value("cassettes/notes").toStringList();
+        QVector<CashDispenser::Cassette> cassettes;
+        for(int i = 0; i < notes.size(); ++i)
+        {
+            const QStringList parts = notes[i].trimmed().split(':');
+            bool denominationOk = false;
+            bool countOk = false;
+            CashDispenser::Cassette cassette;
+            if(parts.size() == 2)
+            {
+                cassette._denomination = parts[0].toInt(&denominationOk);
+                cassette._count = parts[1].toInt(&countOk);
+            }
+            if(!denominationOk || !countOk || cassette._denomination <= 0 || cassette._count < 0)
+            {
+                wellFormed = false;
+                cassettes.clear();
+                break;
+            }
+            cassettes.append(cassette);
+        }
+        _cassettes = cassettes;
+    }
+    _cassette_refill = settings.value("cassettes/refill").toString().trimmed();
+
+    if(settings.contains("trace/sample_every"))
+    {
+        bool ok = false;
+        const int sampleEvery = settings.value("trace/sample_every").toInt(&ok);
+        if(ok && sampleEvery >= 0)
+        {
+            _trace_sample_every = sampleEvery;
+        }
+        else
+        {
+            wellFormed = false;
+        }
+    }
+
+    if(settings.contains("reads/max_staleness_ms"))
+    {
+        bool ok = false;
+        const qint64 maxStaleness = settings.value("reads/max_staleness_ms").toLongLong(&ok);
+        if(ok && maxStaleness >= 0)
+        {
+            _max_staleness_ms = maxStaleness;
+        }
+        else
+        {
+            wellFormed = false;
+        }
+    }
+
+    if(settings.contains("maintenance/interval_s"))
+    {
+        bool ok = false;
+        const int interval = settings.value("maintenance/interval_s").toInt(&ok);
+        if(ok && interval >= 0)
+        {
+            _maintenance_interval_s = interval;
+        }
+        else
+        {
+            wellFormed = false;
+        }
+    }
+    if(settings.contains("maintenance/drop_backups"))
+    {
+        const QString drop = settings.value("maintenance/drop_backups").toString().trimmed().toLower();
+        if(drop == "true" || drop == "false")
+        {
+            _maintenance_drop_backups = (drop == "true") ? 1 : 0;
+        }
+        else
+        {
+            wellFormed = false;
+        }
+    }
+    // Taken by the ATM when it is built (see terminalId()); only checked here
+    if(settings.contains("terminal/id") && terminalId(path) < 0)
+    {
+        wellFormed = false;
+    }
+    return wellFormed;
+}
+
+int ATMConfig::terminalId(const QString& path)
+{
+    if(!QFile::exists(path))
+    {
+        return -1;
+    }
+    QSettings settings(path, QSettings::IniFormat);
+    bool idOk = false;
+    const uint id = settings.value("terminal/id").toUInt(&idOk);
+    return (idOk && id > 0 && id <= USHRT_MAX) ? static_cast<int>(id) : -1;
+}
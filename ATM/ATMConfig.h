@@ -0,0 +1,53 @@
+#ifndef ATMCONFIG_H
+#define ATMCONFIG_H
+
+#include <QString>
+#include <QVector>
+
+#include "CashDispenser.h"
+#include "VelocityLimits.h"
+
+// Settings a branch tunes without a rebuild, read from an ini file:
+//
+//     [limits]
+//     hour_count=5
+//     hour_amount=5000
+//     ...day_* and month_* alike
+//     [cassettes]
+//     notes=500:100, 200:200, 100:200, 50:200
+//     refill=2026-10-19-a         (new value: notes are loaded once; see CashDispenser.h)
+//     [trace]
+//     sample_every=100            (0: off; see SessionTracer.h)
+//     [reads]
+//     max_staleness_ms=1000       (see SnapshotReader.h)
+//     [maintenance]
+//     interval_s=600              (0: off; see MaintenanceScheduler.h)
+//     drop_backups=false          (true: drop *_ALTER_BACKUP_* tables instead of reporting them)
+//     [terminal]
+//     id=17                       (1-65535; see terminalId())
+//
+// Whatever the file does not set keeps built-in defaults.
+struct ATMConfig
+{
+    bool _has_limit[VelocityLimits::WINDOW_COUNT];
+    VelocityLimits::Limit _limits[VelocityLimits::WINDOW_COUNT];
+    QVector<CashDispenser::Cassette> _cassettes;    // Empty: not set
+    QString _cassette_refill;                       // Empty: not set
+    int _trace_sample_every;                        // -1: not set
+    qint64 _max_staleness_ms;                       // -1: not set
+    int _maintenance_interval_s;                    // -1: not set
+    int _maintenance_drop_backups;                  // 0 or 1; -1: not set
+
+    ATMConfig();
+
+    // Missing file is not an error. Returns false if a value is malformed;
+    // everything else is taken anyway.
+    bool load(const QString& path);
+
+    // Numbers the terminal's audit trail, session checkpoint and cassettes, so it
+    // must stay the same from run to run. Read on its own: the ATM needs it before
+    // it starts. -1 if the file does not set it or it is malformed.
+    static int terminalId(const QString& path);
+};
+
+#endif // ATMCONFIG_H
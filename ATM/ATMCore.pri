@@ -0,0 +1,70 @@
+#-------------------------------------------------
+#
+# ATM core: everything but the GUI.
+# Shared by the application and the tools/benchmarks built around it.
+#
+#-------------------------------------------------
+
+QT       += core sql
+
+INCLUDEPATH += $$PWD
+
+# With Qt's SQLite driver built against the system library (-system-sqlite),
+# "qmake CONFIG+=system_sqlite" lets maintenance interrupt a long statement
+# as soon as a customer arrives (see MaintenanceScheduler.h).
+system_sqlite {
+    DEFINES += MAINTENANCE_PROGRESS_HANDLER
+    LIBS += -lsqlite3
+}
+
+SOURCES += $$PWD/ATMBase.cpp \
+    $$PWD/ATM.cpp \
+    $$PWD/CardFilter.cpp \
+    $$PWD/CardToken.cpp \
+    $$PWD/CardNumberValidator.cpp \
+    $$PWD/CashDispenser.cpp \
+    $$PWD/VelocityLimits.cpp \
+    $$PWD/FraudScorer.cpp \
+    $$PWD/AuditLog.cpp \
+    $$PWD/CardHistory.cpp \
+    $$PWD/TopUpGateway.cpp \
+    $$PWD/StartupPipeline.cpp \
+    $$PWD/ThreadConnection.cpp \
+    $$PWD/BankSchema.cpp \
+    $$PWD/ATMConfig.cpp \
+    $$PWD/SessionTracer.cpp \
+    $$PWD/SnapshotReader.cpp \
+    $$PWD/HotAccounts.cpp \
+    $$PWD/IdempotencyIndex.cpp \
+    $$PWD/MaintenanceScheduler.cpp \
+    $$PWD/SessionCheckpoint.cpp \
+    $$PWD/PinVerifier.cpp \
+    $$PWD/ExchangeRates.cpp
+
+HEADERS  += $$PWD/ATMBase.h \
+    $$PWD/ATM.h \
+    $$PWD/ATM.tpp \
+    $$PWD/HeadlessTerminal.h \
+    $$PWD/SessionArena.h \
+    $$PWD/KeypadQueue.h \
+    $$PWD/CardFilter.h \
+    $$PWD/CardToken.h \
+    $$PWD/CardNumberValidator.h \
+    $$PWD/CashDispenser.h \
+    $$PWD/VelocityLimits.h \
+    $$PWD/FraudScorer.h \
+    $$PWD/AuditLog.h \
+    $$PWD/CardHistory.h \
+    $$PWD/TopUpGateway.h \
+    $$PWD/StartupPipeline.h \
+    $$PWD/ThreadConnection.h \
+    $$PWD/BankSchema.h \
+    $$PWD/ATMConfig.h \
+    $$PWD/SessionTracer.h \
+    $$PWD/SnapshotReader.h \
+    $$PWD/HotAccounts.h \
+    $$PWD/IdempotencyIndex.h \
+    $$PWD/MaintenanceScheduler.h \
+    $$PWD/SessionCheckpoint.h \
+    $$PWD/PinVerifier.h \
+    $$PWD/ExchangeRates.h
@@ -0,0 +1,329 @@
+#include "AuditLog.h"
+
+#include <QDir>
+#include <chrono>
+#include <cstring>
+
+static_assert(sizeof(AuditRecord) == 64, "Audit record layout must stay 64 bytes");
+
+const char AuditLog::FILE_MAGIC[8] = {'A', 'T', 'M', 'A', 'U', 'D', 'I', 'T'};
+const quint32 AuditLog::FORMAT_VERSION = 2;
+const int AuditLog::HEADER_SIZE = 16;
+const qint64 AuditLog::MAX_FILE_SIZE = 16 * 1024 * 1024;
+const int AuditLog::KEPT_FILES = 8;
+const unsigned long AuditLog::FLUSH_INTERVAL_MS = 50;
+
+// Background thread that drains the ring
+//==========
+
+class AuditLog::Flusher : public QThread
+{
+public:
+    explicit Flusher(AuditLog& log):
+        _log(log)
+    {}
+
+protected:
+    void run()
+    {
+        // Polling keeps the producer free of any wake-up calls
+        while(!_log._stopping.load(std::memory_order_acquire))
+        {
+            _log.drain();
+            msleep(FLUSH_INTERVAL_MS);
+        }
+        _log.drain();
+    }
+
+private:
+    AuditLog& _log;
+};
+
+// Audit log
+//==========
+
+AuditLog::AuditLog(quint16 atmId, const QString& directory):
+    _atm_id(atmId),
+    _directory(directory),
+    _next_sequence(0),
+    _unreported_drops(0),
+    _head(0),
+    _tail(0),
+    _dropped(0),
+    _flusher(NULL),
+    _stopping(false)
+{}
+
+AuditLog::~AuditLog()
+{
+    stop();
+}
+
+void AuditLog::start()
+{
+    if(_flusher)
+    {
+        return;
+    }
+    QDir().mkpath(_directory);
+    openCurrentFile();
+    _stopping.store(false, std::memory_order_release);
+    _flusher = new Flusher(*this);
+    _flusher->start();
+}
+
+void AuditLog::stop()
+{
+    if(!_flusher)
+    {
+        return;
+    }
+    _stopping.store(true, std::memory_order_release);
+    _flusher->wait();
+    delete _flusher;
+    _flusher = NULL;
+    _file.close();
+}
+
+void AuditLog::append(AuditRecord& record)
+{
+    record._sequence = _next_sequence++;
+    record._atm_id = _atm_id;
+    record._timestamp_ns = static_cast<quint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                    std::chrono::system_clock::now().time_since_epoch()).count());
+
+    const quint64 head = _head.load(std::memory_order_relaxed);
+    if(head - _tail.load(std::memory_order_acquire) >= RING_SIZE)
+    {
+        // Flusher is behind; never make the customer wait for the disk
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        ++_unreported_drops;
+        return;
+    }
+    record._dropped_before = _unreported_drops;
+    _unreported_drops = 0;
+    _ring[head & (RING_SIZE - 1)] = record;
+    _head.store(head + 1, std::memory_order_release);
+}
+
+void AuditLog::drain()
+{
+    quint64 tail = _tail.load(std::memory_order_relaxed);
+    const quint64 head = _head.load(std::memory_order_acquire);
+    while(tail != head)
+    {
+        // Write contiguous part of the ring in one go
+        const quint64 index = tail & (RING_SIZE - 1);
+        const quint64 count = qMin(head - tail, static_cast<quint64>(RING_SIZE) - index);
+        if(_file.isOpen())
+        {
+            _file.write(reinterpret_cast<const char*>(&_ring[index]), count * sizeof(AuditRecord));
+        }
+        tail += count;
+        _tail.store(tail, std::memory_order_release);
+    }
+    if(_file.isOpen())
+    {
+        _file.flush();
+        if(_file.size() >= MAX_FILE_SIZE)
+        {
+            rotate();
+        }
+    }
+}
+
+void AuditLog::rotate()
+{
+    _file.close();
+    QFile::remove(filePath(KEPT_FILES - 1));
+    for(int i = KEPT_FILES - 2; i >= 0; --i)
+    {
+        QFile::rename(filePath(i), filePath(i + 1));
+    }
+    openCurrentFile();
+}
+
+QString AuditLog::filePath(int index) const
+{
+    return QDir(_directory).filePath(QString("audit-%1.%2.bin").arg(QString::number(_atm_id), QString::number(index)));
+}
+
+bool AuditLog::openCurrentFile()
+{
+    _file.setFileName(filePath(0));
+    if(!_file.open(QIODevice::WriteOnly | QIODevice::Append))
+    {
+        return false;
+    }
+    if(_file.size() == 0)
+    {
+        char header[HEADER_SIZE];
+        memset(header, 0, sizeof(header));
+        memcpy(header, FILE_MAGIC, sizeof(FILE_MAGIC));
+        const quint32 recordSize = sizeof(AuditRecord);
+        memcpy(header + 8, &FORMAT_VERSION, sizeof(FORMAT_VERSION));
+        memcpy(header + 12, &recordSize, sizeof(recordSize));
+        _file.write(header, sizeof(header));
+    }
+    return true;
+}
+
+const char* AuditLog::eventName(quint8 event)
+{
+    switch(event)
+    {
+    case EVENT_POWER_ON:
+        return "power-on";
+    case EVENT_POWER_OFF:
+        return "power-off";
+    case EVENT_STATE_CHANGE:
+        return "state";
+    case EVENT_DB_STATEMENT:
+        return "db";
+    case EVENT_CARD_INSERTED:
+        return "card-inserted";
+    case EVENT_CARD_EJECTED:
+        return "card-ejected";
+    case EVENT_CARD_SEIZED:
+        return "card-seized";
+    case EVENT_TRANSACTION:
+        return "transaction";
+    case EVENT_CASH_DISPENSED:
+        return "cash-dispensed";
+    case EVENT_STARTUP_PHASE:
+        return "startup-phase";
+    case EVENT_READY:
+        return "ready";
+    case EVENT_MAINTENANCE:
+        return "maintenance";
+    case EVENT_SESSION_RECOVERED:
+        return "session-recovered";
+    case EVENT_OUT_OF_SERVICE:
+        return "out-of-service";
+    }
+    return "unknown";
+}
+
+const char* AuditLog::statementName(quint32 statement)
+{
+    switch(statement)
+    {
+    case STMT_SELECT_CARD:
+        return "SELECT_CARD_BY_NUMBER";
+    case STMT_DEACTIVATE_CARD:
+        return "DEACTIVATE_CARD";
+    case STMT_WITHDRAW_FUNDS:
+        return "WITHDRAW_FUNDS";
+    case STMT_UPLOAD_FUNDS:
+        return "UPLOAD_FUNDS";
+    case STMT_LOAD_CARDS:
+        return "SELECT_ALL_CARDS";
+    case STMT_RECORD_HISTORY:
+        return "RECORD_ENTRY";
+    case STMT_SELECT_HISTORY:
+        return "SELECT_ENTRIES";
+    case STMT_QUEUE_TOPUP:
+        return "QUEUE_TOPUP";
+    case STMT_APPEND_CREDIT:
+        return "APPEND_CREDIT";
+    case STMT_RECORD_TRANSACTION:
+        return "RECORD_TRANSACTION";
+    case STMT_TAKE_NOTES:
+        return "TAKE_NOTES";
+    case STMT_STORE_CASSETTES:
+        return "STORE_CASSETTES";
+    case STMT_STORE_COUNTERS:
+        return "STORE_COUNTERS";
+    case STMT_RETURN_NOTES:
+        return "RETURN_NOTES";
+    }
+    return "OTHER";
+}
+
+const char* AuditLog::startupPhaseName(quint32 phase)
+{
+    switch(phase)
+    {
+    case PHASE_OPEN_CONNECTION:
+        return "open-connection";
+    case PHASE_PREPARE_STATEMENTS:
+        return "prepare-statements";
+    case PHASE_VERIFY_SCHEMA:
+        return "verify-schema";
+    case PHASE_MIGRATE_SCHEMA:
+        return "migrate-schema";
+    case PHASE_WARM_CACHE:
+        return "warm-cache";
+    case PHASE_LOAD_CARD_FILTER:
+        return "load-card-filter";
+    case PHASE_START_LIMITS:
+        return "start-limits";
+    case PHASE_START_TOPUPS:
+        return "start-topups";
+    case PHASE_LOAD_CONFIG:
+        return "load-config";
+    case PHASE_OPEN_READER:
+        return "open-reader";
+    case PHASE_START_MERGER:
+        return "start-merger";
+    case PHASE_LOAD_TRANSACTION_IDS:
+        return "load-transaction-ids";
+    case PHASE_START_MAINTENANCE:
+        return "start-maintenance";
+    case PHASE_START_PIN_VERIFIER:
+        return "start-pin-verifier";
+    case PHASE_START_RATES:
+        return "start-rates";
+    case PHASE_LOAD_CASSETTES:
+        return "load-cassettes";
+    case PHASE_LOAD_CARD_KEY:
+        return "load-card-key";
+    }
+    return "unknown";
+}
+
+const char* AuditLog::maintenanceTaskName(quint32 task)
+{
+    switch(task)
+    {
+    case TASK_DROP_BACKUP:
+        return "drop-backup";
+    case TASK_VACUUM:
+        return "incremental-vacuum";
+    case TASK_ENABLE_VACUUM:
+        return "enable-incremental-vacuum";
+    case TASK_ANALYZE:
+        return "analyze";
+    case TASK_CHECK_INDEX:
+        return "check-index";
+    case TASK_REINDEX:
+        return "reindex";
+    case TASK_CHECKPOINT:
+        return "wal-checkpoint";
+    case TASK_REFRESH_CARD_FILTER:
+        return "refresh-card-filter";
+    case TASK_REPORT_BACKUPS:
+        return "report-backups";
+    }
+    return "unknown";
+}
+
+const char* AuditLog::recoveryName(quint32 recovery)
+{
+    switch(recovery)
+    {
+    case RECOVERY_NO_DEBIT:
+        return "no-debit";
+    case RECOVERY_DEBIT_KEPT:
+        return "debit-kept";
+    case RECOVERY_NOT_COMMITTED:
+        return "not-committed";
+    case RECOVERY_REFUNDED:
+        return "refunded";
+    case RECOVERY_FAILED:
+        return "FAILED";
+    case RECOVERY_RECONCILE:
+        return "RECONCILE";
+    }
+    return "unknown";
+}
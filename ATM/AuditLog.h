@@ -0,0 +1,174 @@
+#ifndef AUDITLOG_H
+#define AUDITLOG_H
+
+#include <QString>
+#include <QFile>
+#include <QThread>
+#include <atomic>
+
+// Fixed-size binary audit record. Layout is part of the on-disk format:
+// change AuditLog::FORMAT_VERSION whenever it changes.
+struct AuditRecord
+{
+    quint64 _timestamp_ns;      // Nanoseconds since epoch
+    quint32 _sequence;          // Per-ATM record number, gaps mean dropped records
+    quint16 _atm_id;
+    quint8 _event;              // AuditLog::Event
+    quint8 _result;             // Statement success, transaction result, etc.
+    quint8 _old_state;          // ATM state and menu state before...
+    quint8 _new_state;          // ...and after the event
+    quint8 _old_menu_state;
+    quint8 _new_menu_state;
+    quint32 _statement;         // AuditLog::Statement for DB events
+    double _amount;
+    char _card_number[20];      // Masked (see CardToken.h), NUL-padded
+    quint32 _dropped_before;    // Records dropped since the previous one that was kept
+    quint64 _card_token;        // CardToken::token() of the card number; 0: no card
+};
+
+// Per-ATM audit trail.
+//
+// The ATM thread appends records to a lock-free single-producer ring and never blocks:
+// if the ring is full the record is dropped and counted, and the next record that
+// makes it into the ring carries the count. A background thread
+// drains the ring into rotating files: <directory>/audit-<atm>.0.bin is the
+// current one, older files get higher numbers.
+class AuditLog
+{
+public:
+    enum Event
+    {
+        EVENT_POWER_ON          = 1,
+        EVENT_POWER_OFF         = 2,
+        EVENT_STATE_CHANGE      = 3,
+        EVENT_DB_STATEMENT      = 4,
+        EVENT_CARD_INSERTED     = 5,
+        EVENT_CARD_EJECTED      = 6,
+        EVENT_CARD_SEIZED       = 7,
+        EVENT_TRANSACTION       = 8,
+        EVENT_CASH_DISPENSED    = 9,    // Notes handed out, amount is their sum
+        EVENT_STARTUP_PHASE     = 10,   // Statement field holds the phase, amount its duration in ms
+        EVENT_READY             = 11,   // Startup is over, amount is its duration in ms
+        EVENT_MAINTENANCE       = 12,   // Statement field holds the task, amount what it reclaimed or checked
+        EVENT_SESSION_RECOVERED = 13,   // Result is the AuditLog::Recovery, amount that of the debit in flight
+        EVENT_OUT_OF_SERVICE    = 14    // Startup failed, statement field holds the first phase that did
+    };
+    enum Statement
+    {
+        STMT_OTHER              = 0,
+        STMT_SELECT_CARD        = 1,
+        STMT_DEACTIVATE_CARD    = 2,
+        STMT_WITHDRAW_FUNDS     = 3,
+        STMT_UPLOAD_FUNDS       = 4,
+        STMT_LOAD_CARDS         = 5,
+        STMT_RECORD_HISTORY     = 6,
+        STMT_SELECT_HISTORY     = 7,
+        STMT_QUEUE_TOPUP        = 8,
+        STMT_APPEND_CREDIT      = 9,    // Credit to a hot account
+        STMT_RECORD_TRANSACTION = 10,   // Transaction ID, committed with its balance changes
+        STMT_TAKE_NOTES         = 11,   // Cassette count, committed with the debit; amount: value of the notes
+        STMT_STORE_CASSETTES    = 12,   // Cassettes (re)loaded
+        STMT_STORE_COUNTERS     = 13,   // Velocity counters the limits engine failed to store; amount: how many
+        STMT_RETURN_NOTES       = 14    // Cassette count of a refunded withdrawal; amount: value of the notes
+    };
+    enum StartupPhase
+    {
+        PHASE_OPEN_CONNECTION   = 0,
+        PHASE_PREPARE_STATEMENTS = 1,
+        PHASE_VERIFY_SCHEMA     = 2,
+        PHASE_MIGRATE_SCHEMA    = 3,
+        PHASE_WARM_CACHE        = 4,
+        PHASE_LOAD_CARD_FILTER  = 5,
+        PHASE_START_LIMITS      = 6,
+        PHASE_START_TOPUPS      = 7,
+        PHASE_LOAD_CONFIG       = 8,
+        PHASE_OPEN_READER       = 9,
+        PHASE_START_MERGER      = 10,
+        PHASE_LOAD_TRANSACTION_IDS = 11,
+        PHASE_START_MAINTENANCE = 12,
+        PHASE_START_PIN_VERIFIER = 13,
+        PHASE_START_RATES       = 14,
+        PHASE_LOAD_CASSETTES    = 15,
+        PHASE_LOAD_CARD_KEY     = 16
+    };
+    // Idle-time DB maintenance steps (see MaintenanceScheduler.h)
+    enum MaintenanceTask
+    {
+        TASK_DROP_BACKUP        = 1,    // Amount: pages freed
+        TASK_VACUUM             = 2,    // Incremental; amount: pages given back to the file system
+        TASK_ENABLE_VACUUM      = 3,    // One full VACUUM to turn incremental vacuum on; amount: pages given back
+        TASK_ANALYZE            = 4,    // Amount: statistics rows written
+        TASK_CHECK_INDEX        = 5,    // Indexes of one table against it; amount: problems found
+        TASK_REINDEX            = 6,    // Indexes of one table rebuilt; amount: problems left
+        TASK_CHECKPOINT         = 7,    // Amount: WAL frames copied into the DB
+        TASK_REFRESH_CARD_FILTER = 8,   // Card filter rebuilt for the ATM; amount: cards in it
+        TASK_REPORT_BACKUPS     = 9     // Backup tables left in place (see MaintenanceScheduler.h); amount: how many
+    };
+    // What became of the debit in flight when a session was cut short by a crash
+    // (see SessionCheckpoint.h)
+    enum Recovery
+    {
+        RECOVERY_NO_DEBIT       = 0,
+        RECOVERY_DEBIT_KEPT     = 1,    // Committed along with what follows it
+        RECOVERY_NOT_COMMITTED  = 2,    // Nothing to undo
+        RECOVERY_REFUNDED       = 3,    // Committed, but no cash or top-up followed
+        RECOVERY_FAILED         = 4,    // DB failed to tell or to refund: left to reconciliation
+        RECOVERY_RECONCILE      = 5     // Committed, died dispensing: cassette counts tell if cash was handed out
+    };
+
+    static const char FILE_MAGIC[8];        // "ATMAUDIT"
+    static const quint32 FORMAT_VERSION;
+    static const int HEADER_SIZE;           // Magic, version, record size
+
+    AuditLog(quint16 atmId, const QString& directory);
+    ~AuditLog();
+
+    // Start/stop background flushing. stop() writes out everything recorded so far.
+    void start();
+    void stop();
+
+    // Append a record; only to be called from the ATM's thread.
+    // Sequence number and timestamp are filled in here.
+    void append(AuditRecord& record);
+
+    inline quint64 dropped() const
+    {
+        return _dropped.load(std::memory_order_relaxed);
+    }
+
+    static const char* eventName(quint8 event);
+    static const char* statementName(quint32 statement);
+    static const char* startupPhaseName(quint32 phase);
+    static const char* maintenanceTaskName(quint32 task);
+    static const char* recoveryName(quint32 recovery);
+
+private:
+    enum { RING_SIZE = 4096 };              // Records, must be a power of two
+    static const qint64 MAX_FILE_SIZE;      // Rotate after this many bytes
+    static const int KEPT_FILES;            // Rotated files to keep
+    static const unsigned long FLUSH_INTERVAL_MS;
+
+    class Flusher;
+
+    // Move everything from the ring to the current file
+    void drain();
+    void rotate();
+    QString filePath(int index) const;
+    bool openCurrentFile();
+
+    const quint16 _atm_id;
+    const QString _directory;
+    quint32 _next_sequence;
+    quint32 _unreported_drops;      // Owned by producer
+
+    AuditRecord _ring[RING_SIZE];
+    std::atomic<quint64> _head;     // Next slot to write, owned by producer
+    std::atomic<quint64> _tail;     // Next slot to read, owned by flusher
+    std::atomic<quint64> _dropped;
+
+    QFile _file;
+    Flusher* _flusher;
+    std::atomic<bool> _stopping;
+};
+
+#endif // AUDITLOG_H
@@ -0,0 +1,178 @@
+#include "BankSchema.h"
+#include "CardHistory.h"
+#include "TopUpGateway.h"
+#include "HotAccounts.h"
+#include "IdempotencyIndex.h"
+#include "PinVerifier.h"
+#include "ExchangeRates.h"
+#include "CashDispenser.h"
+#include "SnapshotReader.h"
+#include "VelocityLimits.h"
+
+#include <QtSql>
+#include <QStringList>
+
+// Columns the ATM's queries rely on
+static const char* const CARDS_COLUMNS[] = {"id", "card_number", "client_id", "balance", "pin", "active"};
+static const char* const CLIENTS_COLUMNS[] = {"id", "last_name", "gender_male"};
+
+// Looked up on every card insertion
+static const char* const HOT_TABLES[] = {"cards", "clients"};
+
+template<size_t N>
+static bool hasColumns(QSqlDatabase& database, const char* table, const char* const (&columns)[N])
+{
+    QSqlQuery query(database);
+    if(!query.exec(QString("PRAGMA table_info(%1)").arg(table)))
+    {
+        return false;
+    }
+    QStringList present;
+    while(query.next())
+    {
+        present.append(query.value(1).toString());      // table_info.name
+    }
+    for(size_t i = 0; i < N; ++i)
+    {
+        if(!present.contains(columns[i]))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BankSchema::verify(QSqlDatabase database)
+{
+    return database.isOpen() &&
+           hasColumns(database, "cards", CARDS_COLUMNS) &&
+           hasColumns(database, "clients", CLIENTS_COLUMNS);
+}
+
+const char* BankSchema::migration(int version)
+{
+    switch(version)
+    {
+    case 0:
+        return CardHistory::CREATE_TABLE;
+    case 1:
+        return CardHistory::CREATE_INDEX;
+    case 2:
+        return TopUpGateway::CREATE_TABLE;
+    case 3:
+        return HotAccounts::CREATE_ACCOUNTS_TABLE;
+    case 4:
+        return HotAccounts::CREATE_CREDITS_TABLE;
+    case 5:
+        return HotAccounts::CREATE_CREDITS_INDEX;
+    case 6:
+        return IdempotencyIndex::CREATE_TABLE;
+    case 7:
+        return PinVerifier::CREATE_TABLE;
+    case 8:
+        return ExchangeRates::CREATE_CARD_CURRENCIES;
+    case 9:
+        return CashDispenser::CREATE_TABLE;
+    case 10:
+        return SnapshotReader::ENABLE_WAL;
+    case 11:
+        return VelocityLimits::CREATE_TABLE;
+    case 12:
+        return TopUpGateway::ADD_ATM_COLUMN;
+    }
+    return NULL;
+}
+
+bool BankSchema::isTransactional(int version)
+{
+    return migration(version) != SnapshotReader::ENABLE_WAL;
+}
+
+int BankSchema::migrationCount()
+{
+    int count = 0;
+    while(migration(count))
+    {
+        ++count;
+    }
+    return count;
+}
+
+bool BankSchema::migrate(QSqlDatabase database)
+{
+    QSqlQuery query(database);
+    if(!query.exec("PRAGMA user_version") || !query.next())
+    {
+        return false;
+    }
+    const int applied = query.value(0).toInt();
+    query.finish();
+    for(int version = applied; migration(version); ++version)
+    {
+        // Statements are idempotent, so a DB whose tables were made by older ATM builds migrates as well.
+        // Should the process die between a statement run on its own and the version, it runs again.
+        if(!isTransactional(version))
+        {
+            if(!query.exec(migration(version)) || !query.exec(QString("PRAGMA user_version = %1").arg(version + 1)))
+            {
+                return false;
+            }
+            continue;
+        }
+        if(!database.transaction())
+        {
+            return false;
+        }
+        if(!query.exec(migration(version)) || !query.exec(QString("PRAGMA user_version = %1").arg(version + 1)))
+        {
+            database.rollback();
+            return false;
+        }
+        if(!database.commit())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BankSchema::warm(QSqlDatabase database)
+{
+    if(!database.isOpen())
+    {
+        return false;
+    }
+    bool succeeded = true;
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    for(size_t t = 0; t < sizeof(HOT_TABLES) / sizeof(HOT_TABLES[0]); ++t)
+    {
+        const QString table = HOT_TABLES[t];
+        // Table itself...
+        succeeded = query.exec(QString("SELECT COUNT(*) FROM \"%1\" NOT INDEXED").arg(table)) && succeeded;
+
+        // ...and every index of it, scanned through its first column
+        QStringList indexes;
+        if(query.exec(QString("PRAGMA index_list(\"%1\")").arg(table)))
+        {
+            while(query.next())
+            {
+                indexes.append(query.value(1).toString());      // index_list.name
+            }
+        }
+        for(int i = 0; i < indexes.size(); ++i)
+        {
+            QString column;
+            if(query.exec(QString("PRAGMA index_info(\"%1\")").arg(indexes[i])) && query.next())
+            {
+                column = query.value(2).toString();             // index_info.name
+            }
+            if(!column.isEmpty())
+            {
+                succeeded = query.exec(QString("SELECT COUNT(\"%1\") FROM \"%2\" INDEXED BY \"%3\"")
+                                       .arg(column, table, indexes[i])) && succeeded;
+            }
+        }
+    }
+    return succeeded;
+}
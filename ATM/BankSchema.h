@@ -0,0 +1,30 @@
+#ifndef BANKSCHEMA_H
+#define BANKSCHEMA_H
+
+#include <QSqlDatabase>
+
+// Layout of the bank DB as far as the ATM is concerned.
+//
+// Tables the ATM adds to the bank's own are created by numbered migrations;
+// the number of migrations applied is kept in the DB's user_version.
+// Migrations run in a transaction each, but for the journal mode switch,
+// which SQLite does not allow in one.
+class BankSchema
+{
+public:
+    // Bank tables have every column the ATM reads
+    static bool verify(QSqlDatabase database);
+    // Apply migrations the DB has not seen yet
+    static bool migrate(QSqlDatabase database);
+    // Read hot tables and indexes once, so that first lookups find them in the page cache
+    static bool warm(QSqlDatabase database);
+
+    static int migrationCount();
+
+private:
+    // Statement taking the DB from version 'version' to 'version' + 1
+    static const char* migration(int version);
+    static bool isTransactional(int version);
+};
+
+#endif // BANKSCHEMA_H
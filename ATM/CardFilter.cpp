@@ -0,0 +1,153 @@
+#include "CardFilter.h"
+
+#include <QtSql>
+#include <QDateTime>
+#include <cassert>
+
+const char* const CardFilter::COUNT_CARDS = "SELECT COUNT(*) FROM cards";
+const char* const CardFilter::SELECT_ALL_CARDS = "SELECT card_number, active FROM cards";
+
+const size_t CardFilter::BITS_PER_CARD = 10;
+const size_t CardFilter::HASH_COUNT = 7;
+const size_t CardFilter::MIN_BITS = 1024;
+
+CardFilter::CardFilter():
+    _bit_count(0),
+    _card_count(0),
+    _built_ms(0),
+    _ready(false)
+{}
+
+bool CardFilter::load(QSqlDatabase database)
+{
+    clear();
+    if(!database.isOpen())
+    {
+        // Filter stays unusable and lets every card through to the DB
+        return false;
+    }
+    QSqlQuery count(COUNT_CARDS, database);
+    if(!count.isActive() || !count.first())
+    {
+        return false;
+    }
+    QSqlQuery cards(database);
+    cards.setForwardOnly(true);
+    const bool loaded = cards.exec(SELECT_ALL_CARDS);
+    if(loaded)
+    {
+        prepare(count.value(0).toLongLong());
+        while(cards.next())
+        {
+            addCard(cards.value(0).toString(),     // cards.card_number
+                    cards.value(1).toBool());      // cards.active
+        }
+    }
+    if(cards.lastError().isValid())
+    {
+        // Partially built filter would reject existing cards
+        clear();
+        return false;
+    }
+    return loaded;
+}
+
+void CardFilter::clear()
+{
+    _bits.clear();
+    _bit_count = 0;
+    _card_count = 0;
+    _built_ms = 0;
+    _inactive.clear();
+    _ready = false;
+}
+
+void CardFilter::prepare(size_t expectedCards)
+{
+    clear();
+    _bit_count = expectedCards * BITS_PER_CARD;
+    if(_bit_count < MIN_BITS)
+    {
+        _bit_count = MIN_BITS;
+    }
+    // Round up to whole 64-bit words
+    _bit_count = (_bit_count + 63) & ~static_cast<size_t>(63);
+    _bits.assign(_bit_count / 64, 0);
+    // Cards are listed right after: what the DB had then is what the filter knows
+    _built_ms = QDateTime::currentMSecsSinceEpoch();
+    _ready = true;
+}
+
+void CardFilter::addCard(const QString& cardNumber, bool isActive)
+{
+    assert(_ready && "FATAL: CardFilter::prepare() must be called before adding cards!!!");
+    // Double hashing: i-th probe is h1 + i*h2
+    const quint64 h = hash(cardNumber);
+    const quint64 h1 = h & 0xFFFFFFFFu;
+    const quint64 h2 = (h >> 32) | 1;
+    for(size_t i = 0; i < HASH_COUNT; ++i)
+    {
+        const size_t bit = static_cast<size_t>((h1 + i * h2) % _bit_count);
+        _bits[bit / 64] |= (static_cast<quint64>(1) << (bit % 64));
+    }
+    ++_card_count;
+    if(!isActive)
+    {
+        _inactive.insert(cardNumber);
+    }
+}
+
+void CardFilter::markInactive(const QString& cardNumber)
+{
+    // Bloom filter does not support removal, so blocked cards stay there
+    // and are caught by the exact set instead.
+    _inactive.insert(cardNumber);
+}
+
+bool CardFilter::mayExist(const QString& cardNumber) const
+{
+    if(!isCurrent())
+    {
+        return true;
+    }
+    const quint64 h = hash(cardNumber);
+    const quint64 h1 = h & 0xFFFFFFFFu;
+    const quint64 h2 = (h >> 32) | 1;
+    for(size_t i = 0; i < HASH_COUNT; ++i)
+    {
+        const size_t bit = static_cast<size_t>((h1 + i * h2) % _bit_count);
+        if(!(_bits[bit / 64] & (static_cast<quint64>(1) << (bit % 64))))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool CardFilter::isInactive(const QString& cardNumber) const
+{
+    // A card reactivated since the filter was built may be in the set still
+    return isCurrent() && _inactive.contains(cardNumber);
+}
+
+bool CardFilter::isCurrent() const
+{
+    return _ready && QDateTime::currentMSecsSinceEpoch() - _built_ms < MAX_AGE_MS;
+}
+
+// 64-bit FNV-1a over UTF-16 code units followed by a final mix,
+// so that both halves are usable as independent hashes.
+quint64 CardFilter::hash(const QString& cardNumber)
+{
+    quint64 h = 14695981039346656037ULL;
+    const QChar* data = cardNumber.constData();
+    for(int i = 0; i < cardNumber.size(); ++i)
+    {
+        h ^= data[i].unicode();
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
@@ -0,0 +1,81 @@
+#ifndef CARDFILTER_H
+#define CARDFILTER_H
+
+#include <QString>
+#include <QSet>
+#include <QSqlDatabase>
+#include <vector>
+
+// Negative-lookup filter for card numbers.
+//
+// Answers two questions without touching the bank DB:
+// - "Does such a card definitely not exist?" (Bloom filter over all known card numbers)
+// - "Is this card known to be blocked?" (exact set of inactive cards)
+// A Bloom filter never gives false negatives, so a card that is reported
+// as absent can be rejected right away. Positive answers still have to be
+// confirmed by the DB.
+//
+// Cards issued or reactivated after the filter was built are unknown to it
+// until it is rebuilt (see MaintenanceScheduler.h). The filter only answers
+// for MAX_AGE_MS after it was built: past that, every card may exist and none
+// is known to be blocked, so each one is looked up until the next rebuild.
+class CardFilter
+{
+public:
+    static const char* const COUNT_CARDS;
+    static const char* const SELECT_ALL_CARDS;
+
+    enum
+    {
+        MAX_AGE_MS  = 15 * 60 * 1000    // Longer than a maintenance cycle
+    };
+
+    CardFilter();
+
+    // Build from every card in the DB. Returns false, leaving the filter
+    // unusable, if DB failed to list them.
+    bool load(QSqlDatabase database);
+    // Drop all data. Filter stays unusable until prepare() is called again.
+    void clear();
+    // Size the filter for the expected number of cards and mark it as usable.
+    void prepare(size_t expectedCards);
+    // Register a card read from the DB
+    void addCard(const QString& cardNumber, bool isActive);
+    // Card has been deactivated (e.g. after too many PIN errors)
+    void markInactive(const QString& cardNumber);
+
+    // Filter has been built and may be consulted
+    inline bool isReady() const
+    {
+        return _ready;
+    }
+    inline size_t cardCount() const
+    {
+        return _card_count;
+    }
+
+    // false means there is definitely no such card in the DB.
+    // Until the filter is ready, and once it is too old, every card may exist.
+    bool mayExist(const QString& cardNumber) const;
+    // true means the card is blocked or inactive.
+    // Once the filter is too old, no card is known to be.
+    bool isInactive(const QString& cardNumber) const;
+
+private:
+    static const size_t BITS_PER_CARD;  // 10 bits per card give ~1% false positives...
+    static const size_t HASH_COUNT;     // ...with 7 hash functions
+    static const size_t MIN_BITS;       // Lower bound for tiny banks
+
+    static quint64 hash(const QString& cardNumber);
+    // Built less than MAX_AGE_MS ago
+    bool isCurrent() const;
+
+    std::vector<quint64> _bits;
+    size_t _bit_count;
+    size_t _card_count;
+    qint64 _built_ms;   // When prepared, in ms since epoch
+    QSet<QString> _inactive;
+    bool _ready;
+};
+
+#endif // CARDFILTER_H
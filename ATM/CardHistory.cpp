@@ -0,0 +1,261 @@
+#include "CardHistory.h"
+
+#include <QtSql>
+#include <cstdio>
+
+const char* const CardHistory::CREATE_TABLE =
+    "CREATE TABLE IF NOT EXISTS card_history (id INTEGER PRIMARY KEY AUTOINCREMENT, card_number CHAR(19) NOT NULL, "
+    "time INTEGER NOT NULL, entry INTEGER NOT NULL, amount REAL NOT NULL, balance REAL NOT NULL, "
+    "counterparty VARCHAR(19) NOT NULL DEFAULT '')";
+// Statements read one card's range in time order straight off the index
+const char* const CardHistory::CREATE_INDEX =
+    "CREATE INDEX IF NOT EXISTS card_history_by_card ON card_history (card_number, time)";
+const char* const CardHistory::SELECT_ENTRIES =
+    "SELECT time, entry, amount, balance, counterparty FROM card_history "
+    "WHERE card_number = ? AND time >= ? AND time < ? ORDER BY time, id";
+const char* const CardHistory::RECORD_ENTRY =
+    "INSERT INTO card_history (card_number, time, entry, amount, balance, counterparty) "
+    "SELECT card_number, ?, ?, ?, balance, ? FROM cards WHERE card_number = ?";
+
+const char* CardHistory::entryName(int entry)
+{
+    switch(entry)
+    {
+    case ENTRY_WITHDRAWAL:
+        return "withdrawal";
+    case ENTRY_MOBILE_RECHARGE:
+        return "mobile-recharge";
+    case ENTRY_TRANSFER_OUT:
+        return "transfer-out";
+    case ENTRY_TRANSFER_IN:
+        return "transfer-in";
+    case ENTRY_MOBILE_REFUND:
+        return "mobile-refund";
+    case ENTRY_WITHDRAWAL_REFUND:
+        return "withdrawal-refund";
+    }
+    return "other";
+}
+
+// Formatting helpers: write into caller's char buffer, never allocate
+//==========
+
+// Room for one formatted row, statement header or trailer
+static const int LINE_CAPACITY = 128;
+
+// Operation as printed on receipts: fits the OPERATION column
+static const char* printedEntryName(int entry)
+{
+    switch(entry)
+    {
+    case CardHistory::ENTRY_WITHDRAWAL:
+        return "CASH";
+    case CardHistory::ENTRY_MOBILE_RECHARGE:
+        return "MOBILE";
+    case CardHistory::ENTRY_TRANSFER_OUT:
+        return "XFER OUT";
+    case CardHistory::ENTRY_TRANSFER_IN:
+        return "XFER IN";
+    case CardHistory::ENTRY_MOBILE_REFUND:
+    case CardHistory::ENTRY_WITHDRAWAL_REFUND:
+        return "REFUND";
+    }
+    return "OTHER";
+}
+
+static void formatCents(char* out, size_t size, qint64 cents)
+{
+    const quint64 absolute = (cents < 0) ? static_cast<quint64>(-cents) : static_cast<quint64>(cents);
+    snprintf(out, size, "%s%llu.%02llu", (cents < 0) ? "-" : "",
+             static_cast<unsigned long long>(absolute / 100),
+             static_cast<unsigned long long>(absolute % 100));
+}
+
+// UTC calendar date and time of day; days-from-civil algorithm run backwards.
+// QDateTime would do, at the cost of a few allocations per row.
+static void formatTime(char* out, size_t size, qint64 seconds, bool withSeconds)
+{
+    qint64 days = seconds / 86400;
+    qint64 second = seconds % 86400;
+    if(second < 0)
+    {
+        second += 86400;
+        --days;
+    }
+    days += 719468;     // Days from 0000-03-01 to 1970-01-01
+    const qint64 era = ((days >= 0) ? days : days - 146096) / 146097;
+    const unsigned dayOfEra = static_cast<unsigned>(days - era * 146097);
+    const unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    const unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    const unsigned monthFromMarch = (5 * dayOfYear + 2) / 153;
+    const unsigned day = dayOfYear - (153 * monthFromMarch + 2) / 5 + 1;
+    const unsigned month = (monthFromMarch < 10) ? monthFromMarch + 3 : monthFromMarch - 9;
+    const long long year = static_cast<long long>(yearOfEra) + era * 400 + ((month <= 2) ? 1 : 0);
+    const int hour = static_cast<int>(second / 3600);
+    const int minute = static_cast<int>(second / 60 % 60);
+    if(withSeconds)
+    {
+        snprintf(out, size, "%04lld-%02u-%02u %02d:%02d:%02d", year, month, day, hour, minute, static_cast<int>(second % 60));
+    }
+    else
+    {
+        snprintf(out, size, "%04lld-%02u-%02u %02d:%02d", year, month, day, hour, minute);
+    }
+}
+
+static void formatDay(char* out, size_t size, qint64 seconds)
+{
+    char time[LINE_CAPACITY];
+    formatTime(time, sizeof(time), seconds, false);
+    snprintf(out, size, "%.10s", time);
+}
+
+// Statement export
+//==========
+
+StatementExporter::StatementExporter()
+{}
+
+qint64 StatementExporter::exportStatement(QSqlDatabase database,
+                                          const QString& cardNumber,
+                                          qint64 from,
+                                          qint64 to,
+                                          Format format,
+                                          ISink& sink)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.prepare(CardHistory::SELECT_ENTRIES))
+    {
+        return -1;
+    }
+    query.bindValue(0, cardNumber);
+    query.bindValue(1, from);
+    query.bindValue(2, to);
+    if(!query.exec())
+    {
+        return -1;
+    }
+
+    const int chunkRows = (format == FORMAT_PRINT) ? PRINT_PAGE_ROWS : CSV_CHUNK_ROWS;
+    // Header and trailer take a few rows' worth; the buffer is never grown past this
+    _buffer.reserve((chunkRows + 8) * LINE_CAPACITY);
+    _buffer.resize(0);
+    appendHeader(cardNumber, from, to, format, true);
+
+    qint64 entries = 0;
+    qint64 debits = 0;
+    qint64 credits = 0;
+    int rows = 0;
+    while(query.next())
+    {
+        const qint64 cents = qRound64(query.value(2).toDouble() * 100.0);
+        appendRow(query.value(0).toLongLong(),                  // card_history.time
+                  query.value(1).toInt(),                       // card_history.entry
+                  cents,                                        // card_history.amount
+                  qRound64(query.value(3).toDouble() * 100.0),  // card_history.balance
+                  query.value(4).toString(),                    // card_history.counterparty
+                  format);
+        ++entries;
+        if(cents < 0)
+        {
+            debits -= cents;
+        }
+        else
+        {
+            credits += cents;
+        }
+        if(++rows == chunkRows)
+        {
+            flush(sink);
+            rows = 0;
+            if(format == FORMAT_PRINT)
+            {
+                // Every page gets column titles
+                appendHeader(cardNumber, from, to, format, false);
+            }
+        }
+    }
+    if(query.lastError().isValid())
+    {
+        // Statement would look complete while it is not
+        return -1;
+    }
+    appendTrailer(entries, debits, credits, format);
+    flush(sink);
+    return entries;
+}
+
+void StatementExporter::appendHeader(const QString& cardNumber, qint64 from, qint64 to, Format format, bool firstPage)
+{
+    char line[LINE_CAPACITY];
+    if(format == FORMAT_CSV)
+    {
+        if(firstPage)
+        {
+            _buffer.append(QLatin1String("time,operation,amount,balance,counterparty\n"));
+        }
+        return;
+    }
+    if(firstPage)
+    {
+        char first[LINE_CAPACITY];
+        char last[LINE_CAPACITY];
+        formatDay(first, sizeof(first), from);
+        formatDay(last, sizeof(last), to - 1);
+        _buffer.append(QLatin1String("STATEMENT\nCard: "));
+        _buffer.append(cardNumber);
+        snprintf(line, sizeof(line), "\nPeriod: %s - %s (UTC)\n", (from > 0) ? first : "opening", last);
+        _buffer.append(QLatin1String(line));
+    }
+    snprintf(line, sizeof(line), "%-10s %-5s %-10s%10s%11s\n", "DATE", "TIME", "OPERATION", "AMOUNT", "BALANCE");
+    _buffer.append(QLatin1String(line));
+}
+
+void StatementExporter::appendRow(qint64 time, int entry, qint64 cents, qint64 balanceCents,
+                                  const QString& counterparty, Format format)
+{
+    char when[LINE_CAPACITY];
+    char amount[32];
+    char balance[32];
+    char line[LINE_CAPACITY];
+    formatTime(when, sizeof(when), time, format == FORMAT_CSV);
+    formatCents(amount, sizeof(amount), cents);
+    formatCents(balance, sizeof(balance), balanceCents);
+    if(format == FORMAT_CSV)
+    {
+        snprintf(line, sizeof(line), "%s,%s,%s,%s,", when, CardHistory::entryName(entry), amount, balance);
+        _buffer.append(QLatin1String(line));
+        _buffer.append(counterparty);
+        _buffer.append(QLatin1Char('\n'));
+    }
+    else
+    {
+        // "yyyy-MM-dd hh:mm" is exactly the DATE and TIME columns
+        snprintf(line, sizeof(line), "%-16s %-10s%10s%11s\n", when, printedEntryName(entry), amount, balance);
+        _buffer.append(QLatin1String(line));
+    }
+}
+
+void StatementExporter::appendTrailer(qint64 entries, qint64 debits, qint64 credits, Format format)
+{
+    if(format == FORMAT_CSV)
+    {
+        return;
+    }
+    char debitText[32];
+    char creditText[32];
+    char line[LINE_CAPACITY];
+    formatCents(debitText, sizeof(debitText), debits);
+    formatCents(creditText, sizeof(creditText), credits);
+    snprintf(line, sizeof(line), "Entries: %lld\nDebits: %s\nCredits: %s\n",
+             static_cast<long long>(entries), debitText, creditText);
+    _buffer.append(QLatin1String(line));
+}
+
+void StatementExporter::flush(ISink& sink)
+{
+    sink.write(_buffer);
+    // Keeps allocated capacity unless the sink held on to a copy
+    _buffer.resize(0);
+}
@@ -0,0 +1,86 @@
+#ifndef CARDHISTORY_H
+#define CARDHISTORY_H
+
+#include <QString>
+#include <QSqlDatabase>
+
+// Balance movements of every card, kept in the bank DB for statements.
+//
+// The ATM adds an entry for each committed debit and credit, together with
+// the balance the card was left with, so a statement never has to replay history.
+class CardHistory
+{
+public:
+    enum Entry
+    {
+        ENTRY_WITHDRAWAL        = 1,
+        ENTRY_MOBILE_RECHARGE   = 2,
+        ENTRY_TRANSFER_OUT      = 3,
+        ENTRY_TRANSFER_IN       = 4,
+        ENTRY_MOBILE_REFUND     = 5,    // Operator refused the top-up
+        ENTRY_WITHDRAWAL_REFUND = 6     // Withdrawal cut short by a crash before any cash left
+    };
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_TABLE;
+    static const char* const CREATE_INDEX;
+    // Entries of one card within [from, to), oldest first
+    static const char* const SELECT_ENTRIES;
+    // Prepared: time, entry, signed amount, counterparty, card number.
+    // Balance is taken from the card itself, so it must run after the card is updated,
+    // in the same DB transaction: it then sees that change and no one else's.
+    static const char* const RECORD_ENTRY;
+
+    static const char* entryName(int entry);
+};
+
+// Streams statements of one card out of the DB.
+//
+// Rows come from a forward-only cursor and are formatted into one reused buffer,
+// which is handed to the sink every CHUNK_ROWS rows. Exporting years of history
+// takes as much memory as exporting a day.
+class StatementExporter
+{
+public:
+    enum Format
+    {
+        FORMAT_CSV      = 0,    // Spreadsheet-friendly, one entry per line
+        FORMAT_PRINT    = 1     // Fixed-width receipt layout, one page per chunk
+    };
+
+    // Receives the statement chunk by chunk
+    class ISink
+    {
+    public:
+        virtual void write(const QString& chunk) = 0;
+    };
+
+    enum
+    {
+        CSV_CHUNK_ROWS      = 1024,
+        PRINT_PAGE_ROWS     = 40,
+        PRINT_WIDTH         = 48
+    };
+
+    StatementExporter();
+
+    // Write entries of a card made within [from, to) (seconds since epoch, UTC).
+    // Returns number of entries written, or -1 if history could not be read.
+    qint64 exportStatement(QSqlDatabase database,
+                           const QString& cardNumber,
+                           qint64 from,
+                           qint64 to,
+                           Format format,
+                           ISink& sink);
+
+private:
+    // Column titles on every page, statement title on the first one
+    void appendHeader(const QString& cardNumber, qint64 from, qint64 to, Format format, bool firstPage);
+    void appendRow(qint64 time, int entry, qint64 cents, qint64 balanceCents, const QString& counterparty, Format format);
+    void appendTrailer(qint64 entries, qint64 debits, qint64 credits, Format format);
+    void flush(ISink& sink);
+
+    QString _buffer;    // Keeps its capacity between chunks and statements
+};
+
+#endif // CARDHISTORY_H
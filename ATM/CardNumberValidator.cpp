@@ -0,0 +1,180 @@
+#include "CardNumberValidator.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CARD_VALIDATOR_SSE2
+#include <emmintrin.h>
+#endif
+
+const int CardNumberValidator::INTERNAL_LENGTH = 8;
+const int CardNumberValidator::PAN_MIN_LENGTH = 12;
+const int CardNumberValidator::PAN_MAX_LENGTH = 19;
+
+QString CardNumberValidator::normalize(const QString& cardNumber)
+{
+    QString result;
+    result.reserve(cardNumber.size());
+    for(int i = 0; i < cardNumber.size(); ++i)
+    {
+        const QChar c = cardNumber.at(i);
+        if(!c.isSpace() && c != QChar('-'))
+        {
+            result.append(c);
+        }
+    }
+    return result;
+}
+
+CardNumberValidator::Result CardNumberValidator::validate(const QString& cardNumber)
+{
+    Result result = {BAD_LENGTH, SCHEME_UNKNOWN};
+    if(cardNumber.size() > PAN_MAX_LENGTH)
+    {
+        return result;
+    }
+    // Card numbers are short: copy to a stack buffer instead of converting to QByteArray
+    char digits[32];
+    for(int i = 0; i < cardNumber.size(); ++i)
+    {
+        const ushort c = cardNumber.at(i).unicode();
+        digits[i] = (c < 0x80) ? static_cast<char>(c) : '?';
+    }
+    return validate(digits, cardNumber.size());
+}
+
+CardNumberValidator::Result CardNumberValidator::validate(const char* digits, size_t length)
+{
+    Result result = {VALID, SCHEME_UNKNOWN};
+    if(length == 0)
+    {
+        result.status = EMPTY;
+        return result;
+    }
+    for(size_t i = 0; i < length; ++i)
+    {
+        if(digits[i] < '0' || digits[i] > '9')
+        {
+            result.status = NOT_DIGITS;
+            return result;
+        }
+    }
+    if(length == static_cast<size_t>(INTERNAL_LENGTH))
+    {
+        // In-house numbers carry no checksum
+        result.scheme = SCHEME_INTERNAL;
+        return result;
+    }
+    if(length < static_cast<size_t>(PAN_MIN_LENGTH) || length > static_cast<size_t>(PAN_MAX_LENGTH))
+    {
+        result.status = BAD_LENGTH;
+        return result;
+    }
+    result.scheme = classify(digits, length);
+    if(!luhnValid(digits, length))
+    {
+        result.status = BAD_CHECKSUM;
+    }
+    return result;
+}
+
+void CardNumberValidator::validateBatch(const char* records, size_t recordSize, size_t count, Result* results)
+{
+    for(size_t r = 0; r < count; ++r)
+    {
+        const char* record = records + r * recordSize;
+#ifdef CARD_VALIDATOR_SSE2
+        // Fast path for the dominant case: record is exactly 16 digits
+        if(recordSize == 16)
+        {
+            const __m128i chars = _mm_loadu_si128(reinterpret_cast<const __m128i*>(record));
+            const __m128i values = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+            const __m128i nine = _mm_set1_epi8(9);
+            const __m128i bad = _mm_or_si128(_mm_cmplt_epi8(values, _mm_setzero_si128()),
+                                             _mm_cmpgt_epi8(values, nine));
+            if(_mm_movemask_epi8(bad) == 0)
+            {
+                // Luhn: every second digit counting from the rightmost one is doubled,
+                // which for 16 digits means even positions counting from the left.
+                const __m128i evenMask = _mm_set1_epi16(0x00FF);
+                __m128i doubled = _mm_add_epi8(values, values);
+                doubled = _mm_sub_epi8(doubled, _mm_and_si128(_mm_cmpgt_epi8(doubled, nine), nine));
+                const __m128i mixed = _mm_or_si128(_mm_and_si128(evenMask, doubled),
+                                                   _mm_andnot_si128(evenMask, values));
+                const __m128i sums = _mm_sad_epu8(mixed, _mm_setzero_si128());
+                const int sum = _mm_cvtsi128_si32(sums) + _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+                results[r].status = (sum % 10 == 0) ? VALID : BAD_CHECKSUM;
+                results[r].scheme = classify(record, 16);
+                continue;
+            }
+        }
+#endif
+        // Generic path: strip padding and validate as usual
+        size_t length = recordSize;
+        while(length > 0 && (record[length - 1] == ' ' || record[length - 1] == '\0'))
+        {
+            --length;
+        }
+        results[r] = validate(record, length);
+    }
+}
+
+CardNumberValidator::Scheme CardNumberValidator::classify(const char* digits, size_t length)
+{
+    if(length == static_cast<size_t>(INTERNAL_LENGTH))
+    {
+        return SCHEME_INTERNAL;
+    }
+    if(length < 4)
+    {
+        return SCHEME_UNKNOWN;
+    }
+    const int bin2 = (digits[0] - '0') * 10 + (digits[1] - '0');
+    const int bin3 = bin2 * 10 + (digits[2] - '0');
+    const int bin4 = bin3 * 10 + (digits[3] - '0');
+
+    if(digits[0] == '4' && (length == 13 || length == 16 || length == 19))
+    {
+        return SCHEME_VISA;
+    }
+    if(length == 16 && ((bin2 >= 51 && bin2 <= 55) || (bin4 >= 2221 && bin4 <= 2720)))
+    {
+        return SCHEME_MASTERCARD;
+    }
+    if(length == 15 && (bin2 == 34 || bin2 == 37))
+    {
+        return SCHEME_AMEX;
+    }
+    if(length >= 16 && (bin4 == 6011 || (bin3 >= 644 && bin3 <= 649) || bin2 == 65))
+    {
+        return SCHEME_DISCOVER;
+    }
+    if(length >= 16 && bin4 >= 3528 && bin4 <= 3589)
+    {
+        return SCHEME_JCB;
+    }
+    if(bin2 == 50 || (bin2 >= 56 && bin2 <= 58) || digits[0] == '6')
+    {
+        return SCHEME_MAESTRO;
+    }
+    return SCHEME_UNKNOWN;
+}
+
+bool CardNumberValidator::luhnValid(const char* digits, size_t length)
+{
+    int sum = 0;
+    bool doubleIt = false;
+    for(size_t i = length; i-- > 0; )
+    {
+        int d = digits[i] - '0';
+        if(doubleIt)
+        {
+            d += d;
+            if(d > 9)
+            {
+                d -= 9;
+            }
+        }
+        sum += d;
+        doubleIt = !doubleIt;
+    }
+    return (sum % 10) == 0;
+}
@@ -0,0 +1,68 @@
+#ifndef CARDNUMBERVALIDATOR_H
+#define CARDNUMBERVALIDATOR_H
+
+#include <QString>
+#include <cstddef>
+
+// Syntactic validation of card numbers read by the card reader or typed in by user.
+//
+// Two kinds of numbers are accepted:
+// - bank's own in-house numbers (8 digits, no checksum), e.g. "00010001"
+// - ISO/IEC 7812 PANs (12 to 19 digits) protected by the Luhn checksum
+//
+// Scalar validate() is used on the live path (one card at a time),
+// validateBatch() is meant for bulk files (settlement, card imports)
+// and uses SSE2 where available.
+class CardNumberValidator
+{
+public:
+    enum Status
+    {
+        VALID           = 0,
+        EMPTY           = 1,
+        NOT_DIGITS      = 2,
+        BAD_LENGTH      = 3,
+        BAD_CHECKSUM    = 4
+    };
+    enum Scheme
+    {
+        SCHEME_UNKNOWN      = 0,
+        SCHEME_INTERNAL     = 1,    // Our own in-house cards
+        SCHEME_VISA         = 2,
+        SCHEME_MASTERCARD   = 3,
+        SCHEME_AMEX         = 4,
+        SCHEME_DISCOVER     = 5,
+        SCHEME_JCB          = 6,
+        SCHEME_MAESTRO      = 7
+    };
+    struct Result
+    {
+        Status status;
+        Scheme scheme;
+    };
+
+    static const int INTERNAL_LENGTH;   // 8
+    static const int PAN_MIN_LENGTH;    // 12
+    static const int PAN_MAX_LENGTH;    // 19
+
+    // Remove separators (spaces and dashes) that may come with the number
+    static QString normalize(const QString& cardNumber);
+
+    // Validate single normalized card number
+    static Result validate(const QString& cardNumber);
+    // Same for an ASCII buffer
+    static Result validate(const char* digits, size_t length);
+
+    // Validate 'count' fixed-width ASCII records laid out one after another.
+    // Each record is 'recordSize' bytes long and holds a card number
+    // right-padded with spaces or NULs. results must have room for 'count' items.
+    static void validateBatch(const char* records, size_t recordSize, size_t count, Result* results);
+
+    // Payment scheme by BIN (leading digits) and length. Digits must be already checked.
+    static Scheme classify(const char* digits, size_t length);
+
+private:
+    static bool luhnValid(const char* digits, size_t length);
+};
+
+#endif // CARDNUMBERVALIDATOR_H
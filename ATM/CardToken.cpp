@@ -0,0 +1,77 @@
+#include "CardToken.h"
+
+#include <QFile>
+#include <QMessageAuthenticationCode>
+#include <QCryptographicHash>
+#include <QtEndian>
+#include <random>
+
+// Digits left in the clear on either end of a masked number
+static const int MASK_KEEP_FIRST = 6;
+static const int MASK_KEEP_LAST = 4;
+
+CardToken::CardToken():
+    _key(randomKey())
+{}
+
+bool CardToken::load(const QString& path)
+{
+    QFile file(path);
+    if(file.exists())
+    {
+        if(!file.open(QIODevice::ReadOnly))
+        {
+            return false;
+        }
+        const QByteArray key = file.readAll();
+        if(key.size() != KEY_SIZE)
+        {
+            return false;
+        }
+        _key = key;
+        return true;
+    }
+    // Only the owner may read it: with the key, tokens can be matched with guessed numbers
+    const QByteArray key = randomKey();
+    if(!file.open(QIODevice::WriteOnly) ||
+       !file.setPermissions(QFile::ReadOwner | QFile::WriteOwner) ||
+       file.write(key) != key.size())
+    {
+        file.close();
+        QFile::remove(path);
+        return false;
+    }
+    _key = key;
+    return true;
+}
+
+quint64 CardToken::token(const QString& cardNumber) const
+{
+    const QByteArray digest = QMessageAuthenticationCode::hash(cardNumber.toLatin1(), _key, QCryptographicHash::Sha256);
+    return qFromBigEndian<quint64>(reinterpret_cast<const uchar*>(digest.constData()));
+}
+
+// Raw reader input is masked as well: it may be a card number with a typo
+QString CardToken::mask(const QString& cardNumber)
+{
+    const int length = cardNumber.size();
+    const int first = (length > MASK_KEEP_FIRST + MASK_KEEP_LAST + 2) ? MASK_KEEP_FIRST : 0;
+    const int last = (length > MASK_KEEP_LAST) ? MASK_KEEP_LAST : 0;
+    QString masked(cardNumber);
+    for(int i = first; i < length - last; ++i)
+    {
+        masked[i] = QChar('*');
+    }
+    return masked;
+}
+
+QByteArray CardToken::randomKey()
+{
+    std::random_device device;
+    QByteArray key(KEY_SIZE, '\0');
+    for(int i = 0; i < KEY_SIZE; i += 4)
+    {
+        qToLittleEndian(static_cast<quint32>(device()), reinterpret_cast<uchar*>(key.data()) + i);
+    }
+    return key;
+}
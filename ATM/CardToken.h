@@ -0,0 +1,39 @@
+#ifndef CARDTOKEN_H
+#define CARDTOKEN_H
+
+#include <QString>
+#include <QByteArray>
+
+// Card numbers in files that leave the bank DB.
+//
+// Audit trail and session checkpoint files are copied off the terminal for
+// settlement and support, so they never hold a card number in the clear:
+// people get the masked number (first six and last four digits), programs
+// a token, the first 8 bytes of HMAC-SHA256 of the number under a secret key.
+// Settlement holds the same key and tokenizes the card numbers it has
+// balances for to match audit records with cards.
+//
+// The key is a file of KEY_SIZE random bytes, provisioned to terminals and to
+// the settlement job alike. A terminal that finds none makes one.
+class CardToken
+{
+public:
+    enum { KEY_SIZE = 32 };
+
+    // Key is random until load(): tokens match nothing anybody else has
+    CardToken();
+
+    // Read key from 'path', making a new one there if there is none.
+    // False if neither worked; the key in use stays as it was.
+    bool load(const QString& path);
+
+    quint64 token(const QString& cardNumber) const;
+    static QString mask(const QString& cardNumber);
+
+private:
+    static QByteArray randomKey();
+
+    QByteArray _key;
+};
+
+#endif // CARDTOKEN_H
@@ -0,0 +1,195 @@
+#include "CashDispenser.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+const int CashDispenser::MAX_NOTES_PER_DISPENSE = 40;
+const quint8 CashDispenser::NO_PLAN = 0xFF;
+
+const char* const CashDispenser::CREATE_TABLE =
+    "CREATE TABLE IF NOT EXISTS cassettes (atm_id INTEGER NOT NULL, slot INTEGER NOT NULL, "
+    "denomination INTEGER NOT NULL, loaded INTEGER NOT NULL, remaining INTEGER NOT NULL, "
+    "refill TEXT NOT NULL DEFAULT '', PRIMARY KEY (atm_id, slot))";
+const char* const CashDispenser::SELECT_CASSETTES =
+    "SELECT slot, denomination, remaining, refill FROM cassettes WHERE atm_id = ? ORDER BY slot";
+const char* const CashDispenser::CLEAR_CASSETTES = "DELETE FROM cassettes WHERE atm_id = ?";
+const char* const CashDispenser::STORE_CASSETTE =
+    "INSERT INTO cassettes (atm_id, slot, denomination, loaded, remaining, refill) VALUES (?, ?, ?, ?, ?, ?)";
+const char* const CashDispenser::TAKE_NOTES = "UPDATE cassettes SET remaining = remaining - ? WHERE atm_id = ? AND slot = ?";
+const char* const CashDispenser::RETURN_NOTES = "UPDATE cassettes SET remaining = remaining + ? WHERE atm_id = ? AND slot = ?";
+
+CashDispenser::CashDispenser():
+    _unit(1),
+    _plans(1),
+    _stale(false)
+{
+    memset(&_plans[0], 0, sizeof(Plan));
+}
+
+void CashDispenser::load(const QVector<Cassette>& cassettes)
+{
+    assert(cassettes.size() <= MAX_CASSETTES && "FATAL: Too many cassettes!!!");
+    _cassettes = cassettes;
+    rebuild();
+}
+
+bool CashDispenser::plan(double amount, Plan& plan)
+{
+    refresh();
+    if(amount <= 0 || amount > maxAmount() || amount != std::floor(amount))
+    {
+        return false;
+    }
+    const int value = static_cast<int>(amount);
+    if(value % _unit != 0)
+    {
+        return false;
+    }
+    const Plan& found = _plans[value / _unit];
+    if(found._total_notes == NO_PLAN)
+    {
+        return false;
+    }
+    plan = found;
+    return true;
+}
+
+void CashDispenser::dispense(const Plan& plan)
+{
+    for(int c = 0; c < _cassettes.size(); ++c)
+    {
+        assert(_cassettes[c]._count >= plan._notes[c] && "FATAL: Dispense plan exceeds cassette contents!!!");
+        _cassettes[c]._count -= plan._notes[c];
+    }
+    // Customer is waiting for the notes: the table can wait for them to go
+    _stale = true;
+}
+
+void CashDispenser::putBack(const Plan& plan)
+{
+    for(int c = 0; c < _cassettes.size(); ++c)
+    {
+        _cassettes[c]._count += plan._notes[c];
+    }
+    _stale = true;
+}
+
+void CashDispenser::refresh()
+{
+    if(_stale)
+    {
+        rebuild();
+    }
+}
+
+QString CashDispenser::availableNotes() const
+{
+    QString result;
+    for(int c = 0; c < _cassettes.size(); ++c)
+    {
+        if(_cassettes[c]._count > 0)
+        {
+            if(!result.isEmpty())
+            {
+                result.append(", ");
+            }
+            result.append(QString::number(_cassettes[c]._denomination));
+        }
+    }
+    return result;
+}
+
+static int gcd(int a, int b)
+{
+    while(b != 0)
+    {
+        const int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Bounded knapsack minimizing number of notes.
+// Runs in O(cassettes * amounts * notes) on every change of cassette contents,
+// which keeps each individual request O(1).
+void CashDispenser::rebuild()
+{
+    _stale = false;
+    _unit = 0;
+    int maxDenomination = 0;
+    int totalValue = 0;
+    for(int c = 0; c < _cassettes.size(); ++c)
+    {
+        if(_cassettes[c]._count > 0)
+        {
+            _unit = gcd(_unit, _cassettes[c]._denomination);
+            maxDenomination = qMax(maxDenomination, _cassettes[c]._denomination);
+            totalValue += _cassettes[c]._denomination * qMin(_cassettes[c]._count, MAX_NOTES_PER_DISPENSE);
+        }
+    }
+    if(_unit == 0)
+    {
+        // Empty ATM: nothing can be dispensed
+        _unit = 1;
+        _plans.assign(1, Plan());
+        memset(&_plans[0], 0, sizeof(Plan));
+        return;
+    }
+
+    const int amounts = qMin(totalValue, maxDenomination * MAX_NOTES_PER_DISPENSE) / _unit + 1;
+    const int cassettes = _cassettes.size();
+
+    // best[a]: fewest notes for a*_unit using cassettes processed so far
+    std::vector<quint8> best(amounts, NO_PLAN);
+    std::vector<quint8> next(amounts);
+    // taken[c * amounts + a]: notes taken from cassette c in the best mix for a
+    std::vector<quint8> taken(cassettes * amounts, 0);
+    best[0] = 0;
+
+    for(int c = 0; c < cassettes; ++c)
+    {
+        const int step = _cassettes[c]._denomination / _unit;
+        const int limit = qMin(_cassettes[c]._count, MAX_NOTES_PER_DISPENSE);
+        quint8* takenHere = &taken[c * amounts];
+        for(int a = 0; a < amounts; ++a)
+        {
+            quint8 bestNotes = best[a];
+            quint8 bestTaken = 0;
+            for(int k = 1; k <= limit && k * step <= a; ++k)
+            {
+                const quint8 before = best[a - k * step];
+                if(before != NO_PLAN && before + k < bestNotes && before + k <= MAX_NOTES_PER_DISPENSE)
+                {
+                    bestNotes = static_cast<quint8>(before + k);
+                    bestTaken = static_cast<quint8>(k);
+                }
+            }
+            next[a] = bestNotes;
+            takenHere[a] = bestTaken;
+        }
+        best.swap(next);
+    }
+
+    // Unroll the choices into a complete plan for every amount
+    _plans.assign(amounts, Plan());
+    for(int a = 0; a < amounts; ++a)
+    {
+        Plan& plan = _plans[a];
+        memset(&plan, 0, sizeof(Plan));
+        plan._total_notes = best[a];
+        if(best[a] == NO_PLAN)
+        {
+            continue;
+        }
+        int rest = a;
+        for(int c = cassettes - 1; c >= 0; --c)
+        {
+            const quint8 k = taken[c * amounts + rest];
+            plan._notes[c] = k;
+            rest -= k * (_cassettes[c]._denomination / _unit);
+        }
+        assert(rest == 0 && "FATAL: Broken dispense plan!!!");
+    }
+}
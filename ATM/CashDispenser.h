@@ -0,0 +1,95 @@
+#ifndef CASHDISPENSER_H
+#define CASHDISPENSER_H
+
+#include <QString>
+#include <QVector>
+#include <vector>
+
+// Cash cassettes of the ATM and the planner that decides which notes to dispense.
+//
+// For every amount the dispenser is able to pay out, the best note mix
+// (the one with the fewest notes) is precomputed, so a withdrawal request is
+// answered with a single table lookup. Taking notes out only marks the table
+// stale: the ATM rebuilds it with refresh() once the customer has gone. A plan
+// asked for before that (a second withdrawal in one session) rebuilds it first.
+//
+// Note counts survive restarts in the bank DB, one row per cassette of every
+// terminal: 'loaded' is what the last refill put in, 'remaining' goes down in
+// the transaction of each debit that pays notes out. Settlement compares the
+// two with the cash the audit trail says was handed out.
+class CashDispenser
+{
+public:
+    enum { MAX_CASSETTES = 8 };
+    static const int MAX_NOTES_PER_DISPENSE;    // Presenter capacity: 40 notes
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_TABLE;
+    // Prepared: atm id. Slot, denomination, remaining and refill, by slot.
+    static const char* const SELECT_CASSETTES;
+    // Prepared: atm id
+    static const char* const CLEAR_CASSETTES;
+    // Prepared: atm id, slot, denomination, loaded, remaining, refill
+    static const char* const STORE_CASSETTE;
+    // Prepared: notes taken, atm id, slot
+    static const char* const TAKE_NOTES;
+    // Prepared: notes put back, atm id, slot
+    static const char* const RETURN_NOTES;
+
+    struct Cassette
+    {
+        int _denomination;
+        int _count;
+    };
+
+    // Number of notes to take from each cassette
+    struct Plan
+    {
+        quint8 _notes[MAX_CASSETTES];
+        quint8 _total_notes;
+    };
+
+    CashDispenser();
+
+    // Replace cassette set (e.g. after ATM is refilled)
+    void load(const QVector<Cassette>& cassettes);
+
+    inline int cassetteCount() const
+    {
+        return _cassettes.size();
+    }
+    inline const Cassette& cassette(int index) const
+    {
+        return _cassettes[index];
+    }
+    // Largest amount that can be dispensed at once
+    inline int maxAmount() const
+    {
+        return static_cast<int>(_plans.size() - 1) * _unit;
+    }
+
+    // Find note mix for the amount. Returns false if it cannot be dispensed.
+    bool plan(double amount, Plan& plan);
+    // Take notes out of cassettes according to the plan
+    void dispense(const Plan& plan);
+    // Count the notes of a plan in again: they never left (see ATMBase::settleInterruptedDebit())
+    void putBack(const Plan& plan);
+    // Rebuild the plan table if notes have been taken since it was built
+    void refresh();
+
+    // Human readable list of denominations currently available, e.g. "50, 100, 200"
+    QString availableNotes() const;
+
+private:
+    static const quint8 NO_PLAN;
+
+    // Recompute the plan table from current cassette contents
+    void rebuild();
+
+    QVector<Cassette> _cassettes;
+    int _unit;                  // GCD of all denominations
+    std::vector<Plan> _plans;   // Indexed by amount / _unit
+    bool _stale;                // Counts changed since _plans was built
+};
+
+#endif // CASHDISPENSER_H
@@ -0,0 +1,239 @@
+#include "ExchangeRates.h"
+
+#include <QFile>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QSettings>
+#include <QStringList>
+#include <cmath>
+
+const char* const ExchangeRates::CREATE_CARD_CURRENCIES =
+    "CREATE TABLE IF NOT EXISTS card_currencies ("
+    "card_number TEXT PRIMARY KEY, "
+    "currency CHAR(3) NOT NULL)";
+const char* const ExchangeRates::SELECT_CARD_CURRENCY = "SELECT currency FROM card_currencies WHERE card_number = ?";
+
+// Rates file as last seen by the updater
+struct FileStamp
+{
+    qint64 _modified_ms;
+    qint64 _size;
+
+    bool operator!=(const FileStamp& other) const
+    {
+        return _modified_ms != other._modified_ms || _size != other._size;
+    }
+};
+
+static FileStamp stampOf(const QString& path)
+{
+    const QFileInfo info(path);
+    const FileStamp stamp = {info.exists() ? info.lastModified().toMSecsSinceEpoch() : -1, info.exists() ? info.size() : -1};
+    return stamp;
+}
+
+// Background updater
+//==========
+
+class ExchangeRates::Updater : public QThread
+{
+public:
+    explicit Updater(ExchangeRates& rates):
+        _rates(rates)
+    {}
+
+protected:
+    void run();
+
+private:
+    ExchangeRates& _rates;
+};
+
+void ExchangeRates::Updater::run()
+{
+    FileStamp seen = stampOf(_rates._path);
+    QMutexLocker locker(&_rates._lock);
+    while(!_rates._stopping)
+    {
+        _rates._wake.wait(&_rates._lock, POLL_MS);
+        if(_rates._stopping)
+        {
+            break;
+        }
+        locker.unlock();
+        const FileStamp stamp = stampOf(_rates._path);
+        if(stamp != seen)
+        {
+            seen = stamp;
+            // A file caught half-written, or removed, leaves the rates in use as they are
+            Table* table = load(_rates._path);
+            if(table)
+            {
+                _rates.publish(table);
+            }
+        }
+        // Readers may have let go of a table the last publish could not free
+        _rates.reclaim();
+        locker.relock();
+    }
+}
+
+// Exchange rates
+//==========
+
+ExchangeRates::ExchangeRates():
+    _current(NULL),
+    _hazard(NULL),
+    _stopping(false),
+    _updater(NULL)
+{}
+
+ExchangeRates::~ExchangeRates()
+{
+    stop();
+    delete _current.exchange(NULL);
+}
+
+void ExchangeRates::start(const QString& path)
+{
+    stop();
+    _path = path;
+    publish(load(path));
+    _stopping = false;
+    _updater = new Updater(*this);
+    _updater->start();
+}
+
+void ExchangeRates::stop()
+{
+    if(!_updater)
+    {
+        return;
+    }
+    _lock.lock();
+    _stopping = true;
+    _wake.wakeAll();
+    _lock.unlock();
+    _updater->wait();
+    delete _updater;
+    _updater = NULL;
+    reclaim();
+}
+
+ExchangeRates::Table* ExchangeRates::load(const QString& path)
+{
+    if(!QFile::exists(path))
+    {
+        return NULL;
+    }
+    QSettings settings(path, QSettings::IniFormat);
+    if(settings.status() != QSettings::NoError)
+    {
+        return NULL;
+    }
+    settings.beginGroup("rates");
+    Table* table = new Table;
+    table->_base = settings.value("base").toString().trimmed().toUpper();
+    const QStringList currencies = settings.childKeys();
+    bool wellFormed = !table->_base.isEmpty();
+    for(int i = 0; wellFormed && i < currencies.size(); ++i)
+    {
+        if(currencies[i] == "base")
+        {
+            continue;
+        }
+        bool ok = false;
+        const double rate = settings.value(currencies[i]).toDouble(&ok);
+        wellFormed = ok && rate > 0;
+        table->_rates.insert(currencies[i].toUpper(), rate);
+    }
+    table->_rates.insert(table->_base, 1.0);
+    if(!wellFormed)
+    {
+        delete table;
+        return NULL;
+    }
+    return table;
+}
+
+const ExchangeRates::Table* ExchangeRates::acquire() const
+{
+    const Table* table = _current.load(std::memory_order_acquire);
+    for(;;)
+    {
+        // Table is safe once marked, provided it was still current after marking:
+        // the updater frees a table only if it is not marked after it was replaced
+        _hazard.store(table, std::memory_order_seq_cst);
+        const Table* current = _current.load(std::memory_order_seq_cst);
+        if(current == table)
+        {
+            return table;
+        }
+        table = current;
+    }
+}
+
+void ExchangeRates::release() const
+{
+    _hazard.store(NULL, std::memory_order_release);
+}
+
+void ExchangeRates::publish(Table* table)
+{
+    const Table* replaced = _current.exchange(table, std::memory_order_seq_cst);
+    if(replaced)
+    {
+        _retired.push_back(replaced);
+    }
+    reclaim();
+}
+
+void ExchangeRates::reclaim()
+{
+    const Table* held = _hazard.load(std::memory_order_seq_cst);
+    for(size_t i = 0; i < _retired.size(); )
+    {
+        if(_retired[i] != held)
+        {
+            delete _retired[i];
+            _retired[i] = _retired.back();
+            _retired.pop_back();
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+bool ExchangeRates::convert(double amount, const QString& from, const QString& to, double& converted) const
+{
+    if(from == to)
+    {
+        converted = amount;
+        return true;
+    }
+    const Table* table = acquire();
+    bool known = (table != NULL);
+    if(known)
+    {
+        // No currency means the base one
+        const double fromRate = table->_rates.value(from.isEmpty() ? table->_base : from, 0);
+        const double toRate = table->_rates.value(to.isEmpty() ? table->_base : to, 0);
+        known = (fromRate > 0 && toRate > 0);
+        if(known)
+        {
+            converted = std::floor(amount * fromRate / toRate * 100 + 0.5) / 100;
+        }
+    }
+    release();
+    return known;
+}
+
+QString ExchangeRates::base() const
+{
+    const Table* table = acquire();
+    const QString base = table ? table->_base : QString();
+    release();
+    return base;
+}
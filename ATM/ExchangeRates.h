@@ -0,0 +1,88 @@
+#ifndef EXCHANGERATES_H
+#define EXCHANGERATES_H
+
+#include <QString>
+#include <QHash>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <atomic>
+#include <vector>
+
+// Exchange rates for cards held in another currency than the ATM's cash.
+//
+// Rates come from a local ini file:
+//
+//     [rates]
+//     base=UAH        currency of the ATM's cash, and of cards with no currency of their own
+//     USD=41.25       units of base per unit of USD
+//     EUR=44.80
+//
+// The table is immutable once published. A background updater re-reads the
+// file when it changes and swaps the new table in with one atomic store (RCU
+// style). Readers take the current table with an atomic load and mark it in a
+// hazard slot while they use it; they never lock, wait or touch the DB. The
+// updater frees a replaced table once the hazard slot no longer holds it.
+//
+// Conversions are made on the ATM's thread only (there is one hazard slot).
+// A card's currency is kept in card_currencies; cards not listed there, and
+// the empty currency code, are in the base currency.
+class ExchangeRates
+{
+public:
+    enum
+    {
+        POLL_MS     = 5000      // How often the file is looked at
+    };
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_CARD_CURRENCIES;
+    // Prepared: card number
+    static const char* const SELECT_CARD_CURRENCY;
+
+    ExchangeRates();
+    ~ExchangeRates();
+
+    // Loads the file once on the caller's thread, then follows it in background.
+    // A missing or malformed file leaves same-currency operations only.
+    void start(const QString& path);
+    void stop();
+
+    // 'amount' in 'from' as 'to', rounded to cents. False if either has no rate.
+    // Same currency on both sides converts without a table.
+    bool convert(double amount, const QString& from, const QString& to, double& converted) const;
+
+    // Base currency of the current table; empty if there is none
+    QString base() const;
+
+private:
+    class Updater;
+
+    struct Table
+    {
+        QString _base;
+        QHash<QString, double> _rates;      // Units of base per unit, base itself included
+    };
+
+    // Read the file. NULL if it is missing or malformed.
+    static Table* load(const QString& path);
+    // Current table, marked as in use until release()
+    const Table* acquire() const;
+    void release() const;
+    // Make 'table' current; replaced tables are freed once no reader holds them
+    void publish(Table* table);
+    void reclaim();
+
+    std::atomic<const Table*> _current;
+    mutable std::atomic<const Table*> _hazard;
+    std::vector<const Table*> _retired;     // Updater's only
+
+    // Shared with the updater
+    QMutex _lock;
+    QWaitCondition _wake;
+    bool _stopping;
+    Updater* _updater;
+    QString _path;
+};
+
+#endif // EXCHANGERATES_H
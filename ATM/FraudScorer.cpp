@@ -0,0 +1,185 @@
+#include "FraudScorer.h"
+
+#include <QElapsedTimer>
+#include <cmath>
+#include <cstring>
+
+const qint64 FraudScorer::DEFAULT_BUDGET_NS = 50000;
+const int FraudScorer::STEP_UP_POINTS = 40;
+const int FraudScorer::DENY_POINTS = 70;
+
+const qint64 FraudScorer::PIN_FAILURE_WINDOW = 10 * 60;
+const qint64 FraudScorer::BURST_WINDOW = 60;
+const double FraudScorer::FIRST_LARGE_AMOUNT = 2000;
+
+FraudScorer::FraudScorer():
+    _budget_ns(DEFAULT_BUDGET_NS)
+{}
+
+FraudScorer::CardProfile& FraudScorer::profile(const QString& cardNumber)
+{
+    QHash<QString, CardProfile>::iterator found = _profiles.find(cardNumber);
+    if(found == _profiles.end())
+    {
+        CardProfile fresh;
+        memset(&fresh, 0, sizeof(fresh));
+        found = _profiles.insert(cardNumber, fresh);
+    }
+    return found.value();
+}
+
+bool FraudScorer::isNight(int hour)
+{
+    return hour >= 0 && hour < 6;
+}
+
+FraudScorer::Score FraudScorer::score(const QString& cardNumber, const Transaction& transaction)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    Score result;
+    result._verdict = ALLOW;
+    result._points = 0;
+    result._rules = 0;
+    result._over_budget = false;
+
+    const CardProfile& card = profile(cardNumber);
+
+    // Rules are ordered by weight, so an exhausted budget loses the least
+    for(int rule = 0; rule < 6; ++rule)
+    {
+        if(timer.nsecsElapsed() > _budget_ns)
+        {
+            result._over_budget = true;
+            break;
+        }
+        switch(rule)
+        {
+        case 0:
+            // Amount vs. history
+            if(card._count >= 5)
+            {
+                const double deviation = std::sqrt(card._m2 / (card._count - 1));
+                if(transaction._amount > card._mean + 3 * deviation && transaction._amount > 2 * card._mean)
+                {
+                    result._points += 40;
+                    result._rules |= RULE_AMOUNT_OUTLIER;
+                }
+            }
+            else if(transaction._amount >= FIRST_LARGE_AMOUNT)
+            {
+                result._points += 20;
+                result._rules |= RULE_FIRST_LARGE;
+            }
+            break;
+        case 1:
+            // Recent PIN failures
+        {
+            int failures = 0;
+            for(int i = 0; i < PIN_FAILURES_KEPT; ++i)
+            {
+                if(card._pin_failures[i] != 0 && transaction._time - card._pin_failures[i] <= PIN_FAILURE_WINDOW)
+                {
+                    ++failures;
+                }
+            }
+            if(failures >= 2)
+            {
+                result._points += 30;
+                result._rules |= RULE_PIN_FAILURES;
+            }
+        }
+            break;
+        case 2:
+            // New beneficiary
+            if(transaction._operation == OP_TRANSFER)
+            {
+                const quint32 beneficiary = qHash(transaction._beneficiary);
+                bool known = false;
+                for(int i = 0; i < KNOWN_BENEFICIARIES; ++i)
+                {
+                    known = known || (card._beneficiaries[i] == beneficiary);
+                }
+                if(!known)
+                {
+                    result._points += (card._count > 0 && transaction._amount > card._mean) ? 40 : 25;
+                    result._rules |= RULE_NEW_BENEFICIARY;
+                }
+            }
+            break;
+        case 3:
+            // Time of day, weighted by how unusual it is for this card
+            if(isNight(transaction._hour))
+            {
+                result._points += (card._count > 0 && card._night_count * 10 >= card._count) ? 5 : 15;
+                result._rules |= RULE_NIGHT_TIME;
+            }
+            break;
+        case 4:
+            // Burst of debits
+            if(card._last_time != 0 && transaction._time - card._last_time < BURST_WINDOW)
+            {
+                result._points += 10;
+                result._rules |= RULE_BURST;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    if(result._over_budget)
+    {
+        // Could not finish in time: neither let it through blindly nor turn customer away
+        result._verdict = (result._points >= DENY_POINTS) ? DENY : STEP_UP;
+    }
+    else if(result._points >= DENY_POINTS)
+    {
+        result._verdict = DENY;
+    }
+    else if(result._points >= STEP_UP_POINTS)
+    {
+        result._verdict = STEP_UP;
+    }
+    result._elapsed_ns = timer.nsecsElapsed();
+    return result;
+}
+
+void FraudScorer::onCommitted(const QString& cardNumber, const Transaction& transaction)
+{
+    CardProfile& card = profile(cardNumber);
+    ++card._count;
+    const double delta = transaction._amount - card._mean;
+    card._mean += delta / card._count;
+    card._m2 += delta * (transaction._amount - card._mean);
+    if(isNight(transaction._hour))
+    {
+        ++card._night_count;
+    }
+    card._last_time = transaction._time;
+    if(transaction._operation == OP_TRANSFER)
+    {
+        card._beneficiaries[card._next_beneficiary++ % KNOWN_BENEFICIARIES] = qHash(transaction._beneficiary);
+    }
+}
+
+void FraudScorer::onPinFailure(const QString& cardNumber, qint64 time)
+{
+    CardProfile& card = profile(cardNumber);
+    card._pin_failures[card._next_pin_failure++ % PIN_FAILURES_KEPT] = time;
+}
+
+const char* FraudScorer::verdictName(Verdict verdict)
+{
+    switch(verdict)
+    {
+    case ALLOW:
+        return "allow";
+    case STEP_UP:
+        return "step-up";
+    case DENY:
+        return "deny";
+    }
+    return "unknown";
+}
@@ -0,0 +1,104 @@
+#ifndef FRAUDSCORER_H
+#define FRAUDSCORER_H
+
+#include <QString>
+#include <QHash>
+
+// Rule-based fraud scoring of debits before they are committed.
+//
+// Features are taken from per-card profiles that are updated incrementally
+// as events arrive, so scoring never queries the DB. Every rule is O(1)
+// and scoring stops as soon as the time budget is spent.
+class FraudScorer
+{
+public:
+    enum Operation
+    {
+        OP_WITHDRAWAL   = 0,
+        OP_TRANSFER     = 1,
+        OP_MOBILE       = 2
+    };
+    enum Verdict
+    {
+        ALLOW   = 0,
+        STEP_UP = 1,    // Ask customer to confirm identity (e.g. re-enter PIN)
+        DENY    = 2
+    };
+    // Rules that contributed to a score (bit mask)
+    enum Rule
+    {
+        RULE_AMOUNT_OUTLIER     = 1 << 0,   // Much more than card usually moves
+        RULE_FIRST_LARGE        = 1 << 1,   // Large amount on card without history
+        RULE_NEW_BENEFICIARY    = 1 << 2,   // Transfer to an account never paid before
+        RULE_PIN_FAILURES       = 1 << 3,   // Recent wrong PINs
+        RULE_NIGHT_TIME         = 1 << 4,   // Unusual time of day
+        RULE_BURST              = 1 << 5    // Previous debit just moments ago
+    };
+
+    struct Transaction
+    {
+        Operation _operation;
+        double _amount;
+        QString _beneficiary;   // Target account or phone number, if any
+        qint64 _time;           // Seconds since epoch
+        int _hour;              // Local hour of day, 0-23
+    };
+
+    struct Score
+    {
+        Verdict _verdict;
+        int _points;
+        quint32 _rules;         // Rule bits that fired
+        qint64 _elapsed_ns;
+        bool _over_budget;      // Budget ran out, verdict is the fallback one
+    };
+
+    static const qint64 DEFAULT_BUDGET_NS;  // 50 microseconds
+    static const int STEP_UP_POINTS;        // Score from which identity is re-checked
+    static const int DENY_POINTS;           // Score from which operation is refused
+
+    FraudScorer();
+
+    inline void setBudget(qint64 budgetNs)
+    {
+        _budget_ns = budgetNs;
+    }
+
+    // Score transaction that is about to be committed
+    Score score(const QString& cardNumber, const Transaction& transaction);
+
+    // Feed events that update card profiles
+    void onCommitted(const QString& cardNumber, const Transaction& transaction);
+    void onPinFailure(const QString& cardNumber, qint64 time);
+
+    static const char* verdictName(Verdict verdict);
+
+private:
+    enum { KNOWN_BENEFICIARIES = 8, PIN_FAILURES_KEPT = 4 };
+
+    static const qint64 PIN_FAILURE_WINDOW;     // Seconds PIN failures are remembered for
+    static const qint64 BURST_WINDOW;           // Seconds between debits considered a burst
+    static const double FIRST_LARGE_AMOUNT;
+
+    // Incrementally maintained aggregates for one card
+    struct CardProfile
+    {
+        quint32 _count;             // Committed debits
+        double _mean;               // Welford's running mean...
+        double _m2;                 // ...and sum of squared deviations of amounts
+        quint32 _night_count;       // Debits made between 0:00 and 6:00
+        qint64 _last_time;
+        quint32 _beneficiaries[KNOWN_BENEFICIARIES];    // Hashes of recently paid accounts
+        quint32 _next_beneficiary;
+        qint64 _pin_failures[PIN_FAILURES_KEPT];        // Times of recent PIN failures
+        quint32 _next_pin_failure;
+    };
+
+    CardProfile& profile(const QString& cardNumber);
+    static bool isNight(int hour);
+
+    QHash<QString, CardProfile> _profiles;
+    qint64 _budget_ns;
+};
+
+#endif // FRAUDSCORER_H
@@ -0,0 +1,28 @@
+#ifndef HEADLESSTERMINAL_H
+#define HEADLESSTERMINAL_H
+
+#include "ATM.h"
+
+// Terminal without any hardware: swallows all output.
+// Used by benchmarks and simulators that drive the ATM through processInput().
+class HeadlessTerminal : public ITerminal
+{
+public:
+    void connect(const ATM&) {}
+    void disconnect() {}
+
+    void showText(const QString&) {}
+    void showCardState(const QString&) {}
+    void appendText(const QString&) {}
+
+    void enableInput() {}
+    void disableInput() {}
+    void enableKeyboard() {}
+    void disableKeyboard() {}
+
+    void printText(const QString&) {}
+    void enablePrinter() {}
+    void disablePrinter() {}
+};
+
+#endif // HEADLESSTERMINAL_H
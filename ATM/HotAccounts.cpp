@@ -0,0 +1,190 @@
+#include "HotAccounts.h"
+#include "ThreadConnection.h"
+
+#include <QtSql>
+#include <QLockFile>
+#include <cassert>
+
+const char* const HotAccounts::CREATE_ACCOUNTS_TABLE =
+    "CREATE TABLE IF NOT EXISTS hot_accounts (card_number CHAR(19) PRIMARY KEY NOT NULL)";
+// Slot is the number of the terminal that made the credit
+const char* const HotAccounts::CREATE_CREDITS_TABLE =
+    "CREATE TABLE IF NOT EXISTS hot_account_credits (id INTEGER PRIMARY KEY, card_number CHAR(19) NOT NULL, "
+    "slot INTEGER NOT NULL, amount REAL NOT NULL)";
+const char* const HotAccounts::CREATE_CREDITS_INDEX =
+    "CREATE INDEX IF NOT EXISTS hot_account_credits_by_card ON hot_account_credits (card_number, slot)";
+const char* const HotAccounts::APPEND_CREDIT =
+    "INSERT INTO hot_account_credits (card_number, slot, amount) VALUES (?, ?, ?)";
+const char* const HotAccounts::LOCK_SUFFIX = ".merger.lock";
+const char* const HotAccounts::RECORD_ENTRY =
+    "INSERT INTO card_history (card_number, time, entry, amount, balance, counterparty) "
+    "SELECT card_number, ?, ?, ?, balance + COALESCE((SELECT SUM(amount) FROM hot_account_credits "
+    "WHERE hot_account_credits.card_number = cards.card_number), 0), ? FROM cards WHERE card_number = ?";
+const char* const HotAccounts::SELECT_BALANCE =
+    "SELECT balance + COALESCE((SELECT SUM(amount) FROM hot_account_credits "
+    "WHERE hot_account_credits.card_number = cards.card_number), 0) FROM cards WHERE card_number = ?";
+const char* const HotAccounts::SELECT_ACCOUNTS = "SELECT card_number FROM hot_accounts";
+const char* const HotAccounts::ANY_CREDIT = "SELECT 1 FROM hot_account_credits LIMIT 1";
+// Once the UPDATE runs, the transaction holds the write lock: nothing can be
+// appended between the two statements, so DELETE removes exactly what was merged
+const char* const HotAccounts::MERGE_CREDITS =
+    "UPDATE cards SET balance = balance + (SELECT SUM(amount) FROM hot_account_credits "
+    "WHERE hot_account_credits.card_number = cards.card_number) "
+    "WHERE card_number IN (SELECT card_number FROM hot_account_credits)";
+const char* const HotAccounts::DELETE_CREDITS = "DELETE FROM hot_account_credits";
+
+// Background merger
+//==========
+
+class HotAccounts::Merger : public QThread
+{
+public:
+    explicit Merger(HotAccounts& accounts):
+        _accounts(accounts)
+    {}
+
+protected:
+    void run();
+
+private:
+    HotAccounts& _accounts;
+};
+
+void HotAccounts::Merger::run()
+{
+    ThreadConnection connection("hot_merger", this, _accounts._database_driver, _accounts._database_name);
+    QSqlDatabase& database = connection.database();
+    database.open();
+    // Held by this process until it dies: no age makes it stale
+    QLockFile mergerLock(_accounts._database_name + LOCK_SUFFIX);
+    mergerLock.setStaleLockTime(0);
+
+    bool stopping = false;
+    while(!stopping)
+    {
+        {
+            QMutexLocker locker(&_accounts._merger_lock);
+            if(!_accounts._stopping)
+            {
+                _accounts._stop_requested.wait(&_accounts._merger_lock, MERGE_INTERVAL_MS);
+            }
+            stopping = _accounts._stopping;
+        }
+        if(!mergerLock.isLocked() && !mergerLock.tryLock(0))
+        {
+            continue;
+        }
+        // A failed merge leaves the credits where they are, for the next one
+        if(database.isOpen() || database.open())
+        {
+            merge(database);
+        }
+    }
+}
+
+// Hot accounts
+//==========
+
+HotAccounts::HotAccounts():
+    _stopping(false),
+    _merger(NULL)
+{}
+
+HotAccounts::~HotAccounts()
+{
+    stop();
+}
+
+void HotAccounts::start(const QString& databaseDriver, const QString& databaseName)
+{
+    stop();
+    _database_driver = databaseDriver;
+    _database_name = databaseName;
+    _accounts.clear();
+
+    {
+        ThreadConnection connection("hot_loader", this, _database_driver, _database_name);
+        QSqlDatabase& database = connection.database();
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            if(query.exec(SELECT_ACCOUNTS))
+            {
+                while(query.next())
+                {
+                    _accounts.insert(query.value(0).toString());
+                }
+            }
+        }
+    }
+
+    _stopping = false;
+    _merger = new Merger(*this);
+    _merger->start();
+}
+
+void HotAccounts::stop()
+{
+    if(!_merger)
+    {
+        return;
+    }
+    _merger_lock.lock();
+    _stopping = true;
+    _stop_requested.wakeAll();
+    _merger_lock.unlock();
+    _merger->wait();
+    delete _merger;
+    _merger = NULL;
+}
+
+bool HotAccounts::selectBalance(QSqlDatabase database, const QString& cardNumber, double& balance)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.prepare(SELECT_BALANCE))
+    {
+        return false;
+    }
+    query.addBindValue(cardNumber);
+    if(!query.exec() || !query.next())
+    {
+        return false;
+    }
+    balance = query.value(0).toDouble();
+    return true;
+}
+
+int HotAccounts::merge(QSqlDatabase database)
+{
+    assert(database.isOpen() && "FATAL: Merging hot account credits without DB connection!!!");
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    // Idle terminals cost no write transaction
+    if(!query.exec(ANY_CREDIT))
+    {
+        return -1;
+    }
+    if(!query.next())
+    {
+        return 0;
+    }
+    query.finish();
+    if(!database.transaction())
+    {
+        return -1;
+    }
+    if(!query.exec(MERGE_CREDITS) || !query.exec(DELETE_CREDITS))
+    {
+        database.rollback();
+        return -1;
+    }
+    const int merged = query.numRowsAffected();
+    if(!database.commit())
+    {
+        database.rollback();
+        return -1;
+    }
+    return merged;
+}
@@ -0,0 +1,89 @@
+#ifndef HOTACCOUNTS_H
+#define HOTACCOUNTS_H
+
+#include <QString>
+#include <QSet>
+#include <QSqlDatabase>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+
+// Credits to hot accounts: beneficiaries (utilities, merchants) that customers
+// of many terminals pay at the same time.
+//
+// An ordinary credit updates the beneficiary's row in cards, so every payment
+// to a popular beneficiary queues on that one row. A credit to a hot account is
+// appended to hot_account_credits instead, into the paying terminal's slot, and
+// leaves the row alone. A background merger folds appended credits into
+// cards.balance every MERGE_INTERVAL_MS and deletes them, in one transaction.
+//
+// Every terminal of the branch runs a merger on the shared DB, but only the one
+// holding <DB>.merger.lock merges; the others take the lock over should its
+// holder's process die. Merging takes every slot at once, so one is enough.
+//
+// Balance of a hot account is cards.balance plus its credits not merged yet.
+// Merging changes both in the same transaction, so any read that takes the sum
+// in one statement (see SELECT_BALANCE) sees the right balance.
+//
+// The bank designates hot accounts in hot_accounts; the list is read at start().
+class HotAccounts
+{
+public:
+    enum
+    {
+        MERGE_INTERVAL_MS   = 1000
+    };
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_ACCOUNTS_TABLE;
+    static const char* const CREATE_CREDITS_TABLE;
+    static const char* const CREATE_CREDITS_INDEX;
+    // Prepared: card number, slot, amount
+    static const char* const APPEND_CREDIT;
+    static const char* const LOCK_SUFFIX;   // Appended to the DB's file name
+    // Same as CardHistory::RECORD_ENTRY, with credits not merged yet in the balance.
+    // In the credit's DB transaction, those are the credits committed before it and its own.
+    static const char* const RECORD_ENTRY;
+    // Balance of one card, credits not merged yet included
+    static const char* const SELECT_BALANCE;
+
+    HotAccounts();
+    ~HotAccounts();
+
+    // Read the list of hot accounts and start merging in background
+    void start(const QString& databaseDriver, const QString& databaseName);
+    // Stop merging. Whatever is appended by then is merged first by the merger
+    // holding the lock; otherwise it is left to the one that does.
+    void stop();
+
+    // Only to be called between start() and stop(), or while stopped
+    inline bool isHot(const QString& cardNumber) const
+    {
+        return !_accounts.isEmpty() && _accounts.contains(cardNumber);
+    }
+
+    // Balance of 'cardNumber' as SELECT_BALANCE reads it. False if DB failed to.
+    static bool selectBalance(QSqlDatabase database, const QString& cardNumber, double& balance);
+    // Fold every appended credit into its card. Returns number of credits merged, -1 if DB failed to.
+    static int merge(QSqlDatabase database);
+
+private:
+    class Merger;
+
+    static const char* const SELECT_ACCOUNTS;
+    static const char* const ANY_CREDIT;
+    static const char* const MERGE_CREDITS;
+    static const char* const DELETE_CREDITS;
+
+    QSet<QString> _accounts;    // Written by start() only
+
+    // Shared with background merger
+    QMutex _merger_lock;
+    QWaitCondition _stop_requested;
+    bool _stopping;
+    Merger* _merger;
+    QString _database_driver;
+    QString _database_name;
+};
+
+#endif // HOTACCOUNTS_H
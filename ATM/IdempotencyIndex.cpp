@@ -0,0 +1,100 @@
+#include "IdempotencyIndex.h"
+
+#include <QtSql>
+#include <QUuid>
+
+const char* const IdempotencyIndex::CREATE_TABLE =
+    "CREATE TABLE IF NOT EXISTS applied_transactions (transaction_id CHAR(46) PRIMARY KEY NOT NULL, "
+    "card_number CHAR(19) NOT NULL, amount REAL NOT NULL, time INTEGER NOT NULL)";
+const char* const IdempotencyIndex::RECORD_ID =
+    "INSERT OR IGNORE INTO applied_transactions (transaction_id, card_number, amount, time) VALUES (?, ?, ?, ?)";
+// Newest first: rowids grow with every insert
+const char* const IdempotencyIndex::SELECT_RECENT =
+    "SELECT transaction_id FROM applied_transactions ORDER BY rowid DESC LIMIT ?";
+const char* const IdempotencyIndex::SELECT_ID = "SELECT card_number FROM applied_transactions WHERE transaction_id = ?";
+
+IdempotencyIndex::IdempotencyIndex():
+    _oldest(0)
+{
+    _ids.reserve(CAPACITY);
+    _order.reserve(CAPACITY);
+}
+
+QString IdempotencyIndex::newId()
+{
+    return QUuid::createUuid().toString();
+}
+
+bool IdempotencyIndex::load(QSqlDatabase database)
+{
+    _ids.clear();
+    _order.clear();
+    _oldest = 0;
+    if(!database.isOpen())
+    {
+        return false;
+    }
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.prepare(SELECT_RECENT))
+    {
+        return false;
+    }
+    query.addBindValue(static_cast<int>(CAPACITY));
+    if(!query.exec())
+    {
+        return false;
+    }
+    std::vector<QString> newestFirst;
+    while(query.next())
+    {
+        newestFirst.push_back(query.value(0).toString());
+    }
+    // Oldest go in first, so that they are the first to make room
+    for(size_t i = newestFirst.size(); i > 0; --i)
+    {
+        insert(newestFirst[i - 1]);
+    }
+    return !query.lastError().isValid();
+}
+
+bool IdempotencyIndex::isRecorded(QSqlDatabase database, const QString& transactionId, bool& recorded,
+                                  QString* cardNumber)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.prepare(SELECT_ID))
+    {
+        return false;
+    }
+    query.addBindValue(transactionId);
+    if(!query.exec())
+    {
+        return false;
+    }
+    recorded = query.next();
+    if(recorded && cardNumber)
+    {
+        *cardNumber = query.value(0).toString();
+    }
+    return !query.lastError().isValid();
+}
+
+void IdempotencyIndex::insert(const QString& transactionId)
+{
+    if(_ids.contains(transactionId))
+    {
+        return;
+    }
+    if(_order.size() < CAPACITY)
+    {
+        _order.push_back(transactionId);
+    }
+    else
+    {
+        _ids.remove(_order[_oldest]);
+        _order[_oldest] = transactionId;
+        _oldest = (_oldest + 1) % CAPACITY;
+    }
+    _ids.insert(transactionId);
+}
@@ -0,0 +1,63 @@
+#ifndef IDEMPOTENCYINDEX_H
+#define IDEMPOTENCYINDEX_H
+
+#include <QString>
+#include <QSet>
+#include <QSqlDatabase>
+#include <vector>
+
+// Transaction IDs already applied to the bank DB, so that a retried debit or
+// credit is applied once.
+//
+// Every withdrawal and transfer gets an ID when the customer commits to it,
+// and a retry of it carries the same ID. The ID goes into applied_transactions
+// in the same DB transaction as the balance change: either both are in the DB
+// or neither is.
+//
+// The last CAPACITY IDs are kept here as well, loaded from the DB at power on
+// and added to as transactions commit. A duplicate among them is rejected with
+// one hash lookup, without going to the DB; an older one is still caught by
+// the table's key when its ID is recorded.
+class IdempotencyIndex
+{
+public:
+    enum
+    {
+        CAPACITY    = 4096
+    };
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_TABLE;
+    // Prepared: transaction ID, card number, amount, time.
+    // Inserts nothing for an ID that is already there.
+    static const char* const RECORD_ID;
+
+    IdempotencyIndex();
+
+    // Fresh transaction ID
+    static QString newId();
+
+    // Replace contents with the most recent IDs in the DB. False if DB failed to list them.
+    bool load(QSqlDatabase database);
+    // Whether 'transactionId' has committed, however old, and the card it was recorded with.
+    // False if DB failed to tell.
+    static bool isRecorded(QSqlDatabase database, const QString& transactionId, bool& recorded,
+                           QString* cardNumber = NULL);
+
+    inline bool contains(const QString& transactionId) const
+    {
+        return _ids.contains(transactionId);
+    }
+    // Transaction has committed; the oldest ID makes room for it
+    void insert(const QString& transactionId);
+
+private:
+    static const char* const SELECT_RECENT;
+    static const char* const SELECT_ID;
+
+    QSet<QString> _ids;
+    std::vector<QString> _order;    // Ring of the IDs in _ids, oldest at _oldest
+    size_t _oldest;
+};
+
+#endif // IDEMPOTENCYINDEX_H
@@ -0,0 +1,112 @@
+#ifndef KEYPADQUEUE_H
+#define KEYPADQUEUE_H
+
+#include <QChar>
+#include <QtGlobal>
+
+// Keypad presses waiting for the ATM's state machine, oldest first.
+//
+// Every key is stamped with the time it was pressed, taken from its input
+// event where there is one. A key pressed before the last state change was
+// typed ahead of the screen it lands on; what happens to it then is up to
+// the state that takes it (see ATM::InputContainer).
+//
+// Capacity is fixed and nothing is allocated: a key pressed while the queue
+// is full is dropped and counted. Called from the ATM's thread only.
+class KeypadQueue
+{
+public:
+    enum { CAPACITY = 16 };
+
+    struct Key
+    {
+        QChar _key;
+        qint64 _pressed_ns;     // SessionTracer::now() clock
+    };
+
+    // What happened to the keys so far. Dwell is the time from press until
+    // the state machine took the key, for keys it did take.
+    struct Stats
+    {
+        quint64 _handled;
+        quint64 _discarded;     // Typed ahead into a state that does not keep type-ahead
+        quint64 _dropped;       // Queue was full
+        qint64 _dwell_total_ns;
+        qint64 _dwell_max_ns;
+    };
+
+    KeypadQueue():
+        _head(0),
+        _count(0)
+    {
+        _stats._handled = 0;
+        _stats._discarded = 0;
+        _stats._dropped = 0;
+        _stats._dwell_total_ns = 0;
+        _stats._dwell_max_ns = 0;
+    }
+
+    // False if the queue is full and the key was dropped
+    bool push(QChar key, qint64 pressedNs)
+    {
+        if(_count == CAPACITY)
+        {
+            ++_stats._dropped;
+            return false;
+        }
+        Key& slot = _keys[(_head + _count) % CAPACITY];
+        slot._key = key;
+        slot._pressed_ns = pressedNs;
+        ++_count;
+        return true;
+    }
+
+    // False if there is nothing to take
+    bool pop(Key& key)
+    {
+        if(_count == 0)
+        {
+            return false;
+        }
+        key = _keys[_head];
+        _head = (_head + 1) % CAPACITY;
+        --_count;
+        return true;
+    }
+
+    void clear()
+    {
+        _head = 0;
+        _count = 0;
+    }
+
+    bool isEmpty() const
+    {
+        return _count == 0;
+    }
+
+    void recordHandled(qint64 dwellNs)
+    {
+        ++_stats._handled;
+        _stats._dwell_total_ns += dwellNs;
+        _stats._dwell_max_ns = qMax(_stats._dwell_max_ns, dwellNs);
+    }
+
+    void recordDiscarded()
+    {
+        ++_stats._discarded;
+    }
+
+    const Stats& stats() const
+    {
+        return _stats;
+    }
+
+private:
+    Key _keys[CAPACITY];
+    int _head;
+    int _count;
+    Stats _stats;
+};
+
+#endif // KEYPADQUEUE_H
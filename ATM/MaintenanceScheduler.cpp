@@ -0,0 +1,464 @@
+#include "MaintenanceScheduler.h"
+#include "ThreadConnection.h"
+
+#include <QtSql>
+#include <QSqlDriver>
+#include <QDateTime>
+#include <QElapsedTimer>
+#include <QLockFile>
+#include <climits>
+
+#ifdef MAINTENANCE_PROGRESS_HANDLER
+#include <sqlite3.h>
+#endif
+
+const char* const MaintenanceScheduler::LOCK_SUFFIX = ".maintenance.lock";
+
+// Tables a schema change copies aside and drops once done; interrupted, it leaves them behind
+static const char* const SELECT_BACKUP_TABLES =
+    "SELECT name FROM sqlite_master WHERE type = 'table' AND name GLOB '*_ALTER_BACKUP_*'";
+static const char* const SELECT_TABLES =
+    "SELECT name FROM sqlite_master WHERE type = 'table' AND name NOT LIKE 'sqlite_%' "
+    "AND name NOT GLOB '*_ALTER_BACKUP_*'";
+static const char* const COUNT_STATISTICS = "SELECT COUNT(*) FROM sqlite_stat1 WHERE tbl = ?";
+static const char* const COUNT_BACKUP_TABLES =
+    "SELECT COUNT(*) FROM sqlite_master WHERE type = 'table' AND name GLOB '*_ALTER_BACKUP_*'";
+
+// PRAGMA auto_vacuum
+enum AutoVacuum
+{
+    AUTO_VACUUM_NONE        = 0,
+    AUTO_VACUUM_FULL        = 1,
+    AUTO_VACUUM_INCREMENTAL = 2
+};
+
+#ifdef MAINTENANCE_PROGRESS_HANDLER
+// Non-zero interrupts the running statement, which then fails
+static int interruptUnlessIdle(void* idle)
+{
+    return static_cast<const std::atomic<bool>*>(idle)->load(std::memory_order_acquire) ? 0 : 1;
+}
+#endif
+
+// Statements on 'database' stop as soon as the ATM is no longer idle.
+// Without the driver's sqlite3 handle, they are only cut between steps.
+static void interruptWhenBusy(QSqlDatabase& database, const std::atomic<bool>& idle)
+{
+#ifdef MAINTENANCE_PROGRESS_HANDLER
+    const QVariant handle = database.driver()->handle();
+    if(handle.isValid() && qstrcmp(handle.typeName(), "sqlite3*") == 0)
+    {
+        sqlite3* connection = *static_cast<sqlite3* const*>(handle.data());
+        if(connection)
+        {
+            sqlite3_progress_handler(connection, MaintenanceScheduler::PROGRESS_OPS, interruptUnlessIdle,
+                                     const_cast<std::atomic<bool>*>(&idle));
+        }
+    }
+#else
+    Q_UNUSED(database);
+    Q_UNUSED(idle);
+#endif
+}
+
+// Value of a PRAGMA returning a single number, -1 if DB failed to
+static qint64 pragmaValue(QSqlDatabase& database, const char* pragma)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.exec(QString("PRAGMA %1").arg(pragma)) || !query.next())
+    {
+        return -1;
+    }
+    return query.value(0).toLongLong();
+}
+
+// Problems PRAGMA integrity_check finds in 'table' and its indexes, -1 if DB failed to check
+static int countProblems(QSqlDatabase& database, const QString& table)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.exec(QString("PRAGMA integrity_check(\"%1\")").arg(table)))
+    {
+        return -1;
+    }
+    int problems = 0;
+    while(query.next())
+    {
+        problems += (query.value(0).toString() == "ok") ? 0 : 1;
+    }
+    return query.lastError().isValid() ? -1 : problems;
+}
+
+// Give free pages back to the file system, a chunk at a time while still idle
+static void vacuum(QSqlDatabase& database, const std::atomic<bool>& idle, MaintenanceScheduler::Report& report)
+{
+    const qint64 autoVacuum = pragmaValue(database, "auto_vacuum");
+    const qint64 pagesBefore = pragmaValue(database, "page_count");
+    const qint64 freePages = pragmaValue(database, "freelist_count");
+    QSqlQuery query(database);
+    if(autoVacuum == AUTO_VACUUM_INCREMENTAL)
+    {
+        report._succeeded = true;
+        while(report._succeeded && idle.load(std::memory_order_acquire) && pragmaValue(database, "freelist_count") > 0)
+        {
+            // Driver steps a statement without result columns once, and every step frees one page
+            report._succeeded = database.transaction();
+            for(int i = 0; report._succeeded && i < MaintenanceScheduler::VACUUM_CHUNK_PAGES; ++i)
+            {
+                report._succeeded = query.exec("PRAGMA incremental_vacuum(1)");
+            }
+            report._succeeded = report._succeeded && database.commit();
+            if(!report._succeeded)
+            {
+                database.rollback();
+            }
+        }
+    }
+    else if(autoVacuum == AUTO_VACUUM_NONE && freePages > 0 && pagesBefore <= MaintenanceScheduler::MAX_FULL_VACUUM_PAGES)
+    {
+        // Free pages can only be given back by a full VACUUM; the one that switches
+        // incremental vacuum on is the last one needed
+        report._task = AuditLog::TASK_ENABLE_VACUUM;
+        report._succeeded = query.exec("PRAGMA auto_vacuum = INCREMENTAL") && query.exec("VACUUM");
+    }
+    else
+    {
+        report._succeeded = (autoVacuum >= 0);
+    }
+    const qint64 pagesAfter = pragmaValue(database, "page_count");
+    report._amount = (pagesBefore >= 0 && pagesAfter >= 0) ? static_cast<double>(pagesBefore - pagesAfter) : 0;
+}
+
+// Background worker
+//==========
+
+class MaintenanceScheduler::Worker : public QThread
+{
+public:
+    explicit Worker(MaintenanceScheduler& scheduler):
+        _scheduler(scheduler)
+    {}
+
+protected:
+    void run();
+
+private:
+    MaintenanceScheduler& _scheduler;
+};
+
+void MaintenanceScheduler::Worker::run()
+{
+    ThreadConnection connection("maintenance", this, _scheduler._database_driver, _scheduler._database_name);
+    QSqlDatabase& database = connection.database();
+    database.setConnectOptions(QString("QSQLITE_BUSY_TIMEOUT=%1").arg(BUSY_TIMEOUT_MS));
+    // Held by this process until it dies: no age makes it stale
+    QLockFile upkeepLock(_scheduler._database_name + LOCK_SUFFIX);
+    upkeepLock.setStaleLockTime(0);
+
+    QVector<Step> steps;
+    int next = 0;
+    qint64 cycleStartedMs = -1;
+    while(_scheduler.waitForTurn(cycleStartedMs, next < steps.size()))
+    {
+        if(next >= steps.size())
+        {
+            cycleStartedMs = QDateTime::currentMSecsSinceEpoch();
+            if(!database.isOpen() && database.open())
+            {
+                // Bounds the time ANALYZE takes on a large table; ignored by older SQLite
+                QSqlQuery(database).exec(QString("PRAGMA analysis_limit = %1").arg(ANALYSIS_LIMIT));
+                interruptWhenBusy(database, _scheduler._idle);
+            }
+            const bool upkeep = upkeepLock.isLocked() || upkeepLock.tryLock(0);
+            bool dropBackups = false;
+            {
+                QMutexLocker locker(&_scheduler._lock);
+                dropBackups = _scheduler._drop_backups;
+            }
+            steps = database.isOpen() ? plan(database, upkeep, dropBackups) : QVector<Step>();
+            next = 0;
+            continue;
+        }
+
+        QVector<Step> followUps;
+        CardFilter cardFilter;
+        const Report report = runStep(database, steps[next++], _scheduler._idle, followUps, cardFilter);
+        if(!report._succeeded && !_scheduler._idle.load(std::memory_order_acquire))
+        {
+            // Most likely interrupted for a customer: run it again once the ATM is idle
+            --next;
+            continue;
+        }
+        for(int i = 0; i < followUps.size(); ++i)
+        {
+            steps.insert(next + i, followUps[i]);
+        }
+        if(report._task == AuditLog::TASK_REFRESH_CARD_FILTER && report._succeeded)
+        {
+            _scheduler.publishCardFilter(cardFilter);
+        }
+        _scheduler.addReport(report);
+
+        QMutexLocker locker(&_scheduler._lock);
+        if(!_scheduler._stopping)
+        {
+            _scheduler._changed.wait(&_scheduler._lock, STEP_GAP_MS);
+        }
+    }
+}
+
+// Maintenance scheduler
+//==========
+
+MaintenanceScheduler::MaintenanceScheduler():
+    _idle(false),
+    _report_count(0),
+    _has_card_filter(false),
+    _idle_since_ms(-1),
+    _interval_s(DEFAULT_INTERVAL_S),
+    _drop_backups(false),
+    _stopping(false),
+    _worker(NULL)
+{}
+
+MaintenanceScheduler::~MaintenanceScheduler()
+{
+    stop();
+}
+
+void MaintenanceScheduler::start(const QString& databaseDriver, const QString& databaseName)
+{
+    stop();
+    _database_driver = databaseDriver;
+    _database_name = databaseName;
+    _stopping = false;
+    _worker = new Worker(*this);
+    _worker->start();
+}
+
+void MaintenanceScheduler::stop()
+{
+    if(!_worker)
+    {
+        return;
+    }
+    _lock.lock();
+    _stopping = true;
+    _changed.wakeAll();
+    _lock.unlock();
+    _worker->wait();
+    delete _worker;
+    _worker = NULL;
+}
+
+void MaintenanceScheduler::setIdle(bool idle)
+{
+    // Seen by a running vacuum without the lock
+    _idle.store(idle, std::memory_order_release);
+    QMutexLocker locker(&_lock);
+    if(!idle)
+    {
+        _idle_since_ms = -1;
+    }
+    else if(_idle_since_ms < 0)
+    {
+        _idle_since_ms = QDateTime::currentMSecsSinceEpoch();
+        _changed.wakeAll();
+    }
+}
+
+void MaintenanceScheduler::setInterval(int seconds)
+{
+    QMutexLocker locker(&_lock);
+    _interval_s = qMax(0, seconds);
+    _changed.wakeAll();
+}
+
+void MaintenanceScheduler::setDropBackups(bool drop)
+{
+    QMutexLocker locker(&_lock);
+    _drop_backups = drop;
+}
+
+void MaintenanceScheduler::takeReports(QVector<Report>& reports)
+{
+    QMutexLocker locker(&_lock);
+    reports += _reports;
+    _reports.clear();
+    _report_count.store(0, std::memory_order_release);
+}
+
+void MaintenanceScheduler::takeCardFilter(CardFilter& filter)
+{
+    QMutexLocker locker(&_lock);
+    filter = _card_filter;
+    _card_filter.clear();
+    _has_card_filter.store(false, std::memory_order_release);
+}
+
+void MaintenanceScheduler::publishCardFilter(const CardFilter& filter)
+{
+    QMutexLocker locker(&_lock);
+    _card_filter = filter;
+    _has_card_filter.store(true, std::memory_order_release);
+}
+
+void MaintenanceScheduler::addReport(const Report& report)
+{
+    QMutexLocker locker(&_lock);
+    _reports.append(report);
+    _report_count.store(_reports.size(), std::memory_order_release);
+}
+
+bool MaintenanceScheduler::waitForTurn(qint64 cycleStartedMs, bool resuming)
+{
+    QMutexLocker locker(&_lock);
+    for(;;)
+    {
+        if(_stopping)
+        {
+            return false;
+        }
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        const qint64 nextCycleMs = (cycleStartedMs < 0) ? now : cycleStartedMs + _interval_s * Q_INT64_C(1000);
+        qint64 wait = -1;
+        if(resuming || (_interval_s > 0 && now >= nextCycleMs))
+        {
+            if(_idle_since_ms >= 0)
+            {
+                if(now >= _idle_since_ms + SETTLE_MS)
+                {
+                    return true;
+                }
+                wait = _idle_since_ms + SETTLE_MS - now;
+            }
+        }
+        else if(_interval_s > 0)
+        {
+            wait = nextCycleMs - now;
+        }
+        _changed.wait(&_lock, (wait < 0) ? ULONG_MAX : static_cast<unsigned long>(wait));
+    }
+}
+
+QVector<MaintenanceScheduler::Step> MaintenanceScheduler::plan(QSqlDatabase& database, bool upkeep, bool dropBackups)
+{
+    QVector<Step> steps;
+    // First, as it is the only step the ATM itself waits for
+    Step refresh = {AuditLog::TASK_REFRESH_CARD_FILTER, QString()};
+    steps.append(refresh);
+    if(!upkeep)
+    {
+        return steps;
+    }
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!dropBackups)
+    {
+        Step report = {AuditLog::TASK_REPORT_BACKUPS, QString()};
+        steps.append(report);
+    }
+    else if(query.exec(SELECT_BACKUP_TABLES))
+    {
+        while(query.next())
+        {
+            Step step = {AuditLog::TASK_DROP_BACKUP, query.value(0).toString()};
+            steps.append(step);
+        }
+    }
+    // After the drops, so that it gives their pages back too
+    Step vacuumStep = {AuditLog::TASK_VACUUM, QString()};
+    steps.append(vacuumStep);
+    if(query.exec(SELECT_TABLES))
+    {
+        while(query.next())
+        {
+            Step analyze = {AuditLog::TASK_ANALYZE, query.value(0).toString()};
+            Step check = {AuditLog::TASK_CHECK_INDEX, query.value(0).toString()};
+            steps.append(analyze);
+            steps.append(check);
+        }
+    }
+    if(query.exec("PRAGMA journal_mode") && query.next() && query.value(0).toString().compare("wal", Qt::CaseInsensitive) == 0)
+    {
+        Step checkpoint = {AuditLog::TASK_CHECKPOINT, QString()};
+        steps.append(checkpoint);
+    }
+    return steps;
+}
+
+MaintenanceScheduler::Report MaintenanceScheduler::runStep(QSqlDatabase& database, const Step& step,
+                                                           const std::atomic<bool>& idle, QVector<Step>& followUps,
+                                                           CardFilter& cardFilter)
+{
+    Report report = {step._task, step._object, 0, false, 0};
+    QElapsedTimer timer;
+    timer.start();
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    switch(step._task)
+    {
+    case AuditLog::TASK_DROP_BACKUP:
+    {
+        const qint64 freeBefore = pragmaValue(database, "freelist_count");
+        report._succeeded = query.exec(QString("DROP TABLE IF EXISTS \"%1\"").arg(step._object));
+        report._amount = static_cast<double>(qMax(Q_INT64_C(0), pragmaValue(database, "freelist_count") - freeBefore));
+        break;
+    }
+    case AuditLog::TASK_REPORT_BACKUPS:
+        // Left to the bank: a failed report only means there is nothing to tell
+        report._succeeded = query.exec(COUNT_BACKUP_TABLES) && query.next();
+        report._amount = report._succeeded ? query.value(0).toDouble() : 0;
+        break;
+    case AuditLog::TASK_VACUUM:
+    case AuditLog::TASK_ENABLE_VACUUM:
+        vacuum(database, idle, report);
+        break;
+    case AuditLog::TASK_ANALYZE:
+        report._succeeded = query.exec(QString("ANALYZE \"%1\"").arg(step._object));
+        if(report._succeeded && query.prepare(COUNT_STATISTICS))
+        {
+            query.addBindValue(step._object);
+            if(query.exec() && query.next())
+            {
+                report._amount = query.value(0).toDouble();
+            }
+        }
+        break;
+    case AuditLog::TASK_CHECK_INDEX:
+    {
+        const int problems = countProblems(database, step._object);
+        report._succeeded = (problems == 0);
+        report._amount = qMax(0, problems);
+        if(problems > 0)
+        {
+            Step reindex = {AuditLog::TASK_REINDEX, step._object};
+            followUps.append(reindex);
+        }
+        break;
+    }
+    case AuditLog::TASK_REINDEX:
+    {
+        // Mends indexes only; problems in the table itself are left for the bank
+        const int problems = query.exec(QString("REINDEX \"%1\"").arg(step._object)) ? countProblems(database, step._object) : -1;
+        report._succeeded = (problems == 0);
+        report._amount = qMax(0, problems);
+        break;
+    }
+    case AuditLog::TASK_REFRESH_CARD_FILTER:
+        report._succeeded = cardFilter.load(database);
+        report._amount = static_cast<double>(cardFilter.cardCount());
+        break;
+    case AuditLog::TASK_CHECKPOINT:
+        // PASSIVE never waits for readers; frames they still need stay for the next cycle
+        report._succeeded = query.exec("PRAGMA wal_checkpoint(PASSIVE)") && query.next() && query.value(0).toInt() == 0;
+        if(report._succeeded)
+        {
+            report._amount = qMax(0, query.value(2).toInt());   // Frames checkpointed
+        }
+        break;
+    }
+    report._elapsed_us = timer.nsecsElapsed() / 1000;
+    return report;
+}
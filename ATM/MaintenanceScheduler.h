@@ -0,0 +1,136 @@
+#ifndef MAINTENANCESCHEDULER_H
+#define MAINTENANCESCHEDULER_H
+
+#include <QString>
+#include <QVector>
+#include <QSqlDatabase>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <atomic>
+
+#include "AuditLog.h"
+#include "CardFilter.h"
+
+// Upkeep of the bank DB, done while nobody is at the ATM.
+//
+// A background worker on its own connection keeps the DB from slowly degrading:
+// it reports tables left behind by interrupted schema changes (*_ALTER_BACKUP_*),
+// gives free pages back to the file system, refreshes planner statistics,
+// checks every index against its table and checkpoints the WAL. Backup tables
+// are only dropped if the branch asks for it (see setDropBackups()): they may
+// be all that is left of the data a schema change was moving.
+//
+// The bank DB is shared by every ATM of the branch, and this upkeep locks it:
+// only the scheduler holding <DB>.maintenance.lock does it. The others take the
+// lock over should its holder's process die. Every scheduler, holder or not,
+// rebuilds its ATM's card filter each cycle, so that cards issued or reactivated
+// meanwhile are let through; the ATM's thread picks it up with takeCardFilter().
+// A filter left without rebuilds, e.g. with maintenance turned off, stops
+// answering after a while (see CardFilter.h).
+//
+// Work runs only while the ATM is idle (NO_CARD) and has been for SETTLE_MS.
+// It is cut into steps of one statement each; setIdle(false) is seen before the
+// next step and between chunks of a vacuum, and the rest of the cycle resumes
+// once the ATM is idle again. Where Qt's SQLite driver uses the system library
+// (see ATMCore.pri), a progress handler interrupts the statement itself as soon
+// as the ATM is busy, and the step is run again from the start later. The
+// worker's connection gives up on a locked DB after BUSY_TIMEOUT_MS, so it
+// never queues behind a customer.
+//
+// Every step reports what it reclaimed or checked. Reports are picked up with
+// takeReports() by the ATM's thread, which owns the audit trail.
+class MaintenanceScheduler
+{
+public:
+    struct Report
+    {
+        AuditLog::MaintenanceTask _task;
+        QString _object;        // Table or index, if any
+        double _amount;         // See AuditLog::MaintenanceTask
+        bool _succeeded;
+        qint64 _elapsed_us;
+    };
+
+    enum
+    {
+        DEFAULT_INTERVAL_S      = 10 * 60,  // Between the starts of two cycles
+        SETTLE_MS               = 2000,     // Idle for this long before any step
+        STEP_GAP_MS             = 50,       // Between steps, to leave the disk to others
+        BUSY_TIMEOUT_MS         = 100,
+        VACUUM_CHUNK_PAGES      = 64,
+        MAX_FULL_VACUUM_PAGES   = 4096,     // Larger files are never rewritten in one go
+        ANALYSIS_LIMIT          = 1000,     // Rows ANALYZE samples per index
+        PROGRESS_OPS            = 1000      // SQLite instructions between two looks at setIdle()
+    };
+
+    static const char* const LOCK_SUFFIX;   // Appended to the DB's file name
+
+    MaintenanceScheduler();
+    ~MaintenanceScheduler();
+
+    void start(const QString& databaseDriver, const QString& databaseName);
+    // Waits for the current step, if any
+    void stop();
+
+    // Steps run only while idle. Never blocks.
+    void setIdle(bool idle);
+    // 0 turns maintenance off
+    void setInterval(int seconds);
+    // Drop backup tables instead of reporting them. Off by default.
+    void setDropBackups(bool drop);
+
+    inline bool hasReports() const
+    {
+        return _report_count.load(std::memory_order_acquire) != 0;
+    }
+    // Move reports of steps done since the last call to 'reports'
+    void takeReports(QVector<Report>& reports);
+
+    inline bool hasCardFilter() const
+    {
+        return _has_card_filter.load(std::memory_order_acquire);
+    }
+    // Move the card filter rebuilt by the last cycle to 'filter'
+    void takeCardFilter(CardFilter& filter);
+
+private:
+    class Worker;
+
+    struct Step
+    {
+        AuditLog::MaintenanceTask _task;
+        QString _object;
+    };
+
+    // Steps of one cycle, in the order they are run. Only the card filter if not 'upkeep'.
+    static QVector<Step> plan(QSqlDatabase& database, bool upkeep, bool dropBackups);
+    // Steps that turn out to be needed, e.g. a reindex, go to 'followUps'.
+    // A rebuilt card filter goes to 'cardFilter'.
+    static Report runStep(QSqlDatabase& database, const Step& step, const std::atomic<bool>& idle,
+                          QVector<Step>& followUps, CardFilter& cardFilter);
+
+    // Waits until a step may run: a cycle is due or being resumed, and the ATM has settled. False when stopping.
+    bool waitForTurn(qint64 cycleStartedMs, bool resuming);
+    void addReport(const Report& report);
+    void publishCardFilter(const CardFilter& filter);
+
+    std::atomic<bool> _idle;
+    std::atomic<int> _report_count;
+    std::atomic<bool> _has_card_filter;
+
+    // Shared with background worker
+    QMutex _lock;
+    QWaitCondition _changed;
+    qint64 _idle_since_ms;      // -1 while busy
+    int _interval_s;
+    bool _drop_backups;
+    QVector<Report> _reports;
+    CardFilter _card_filter;
+    bool _stopping;
+    Worker* _worker;
+    QString _database_driver;
+    QString _database_name;
+};
+
+#endif // MAINTENANCESCHEDULER_H
@@ -0,0 +1,509 @@
+#include "PinVerifier.h"
+
+#include <QMessageAuthenticationCode>
+#include <QCryptographicHash>
+#include <QList>
+#include <QtSql>
+#include <QUuid>
+#include <QtEndian>
+#include <cassert>
+#include <chrono>
+#include <cstring>
+#include <vector>
+
+const PinVerifier::Cost PinVerifier::DEFAULT_COST = {14, 8, 1};
+
+const char* const PinVerifier::CREATE_TABLE =
+    "CREATE TABLE IF NOT EXISTS pin_hashes ("
+    "card_number TEXT PRIMARY KEY, "
+    "hash TEXT NOT NULL)";
+const char* const PinVerifier::SELECT_HASH = "SELECT hash FROM pin_hashes WHERE card_number = ?";
+const char* const PinVerifier::STORE_HASH = "INSERT OR REPLACE INTO pin_hashes (card_number, hash) VALUES (?, ?)";
+
+static const char* const HASH_SCHEME = "scrypt";
+
+// scrypt (RFC 7914)
+//==========
+
+static inline quint32 rotate(quint32 value, int bits)
+{
+    return (value << bits) | (value >> (32 - bits));
+}
+
+static void salsa20_8(quint32 b[16])
+{
+    quint32 x[16];
+    memcpy(x, b, sizeof(x));
+    for(int i = 0; i < 8; i += 2)
+    {
+        // Columns
+        x[ 4] ^= rotate(x[ 0] + x[12],  7);  x[ 8] ^= rotate(x[ 4] + x[ 0],  9);
+        x[12] ^= rotate(x[ 8] + x[ 4], 13);  x[ 0] ^= rotate(x[12] + x[ 8], 18);
+        x[ 9] ^= rotate(x[ 5] + x[ 1],  7);  x[13] ^= rotate(x[ 9] + x[ 5],  9);
+        x[ 1] ^= rotate(x[13] + x[ 9], 13);  x[ 5] ^= rotate(x[ 1] + x[13], 18);
+        x[14] ^= rotate(x[10] + x[ 6],  7);  x[ 2] ^= rotate(x[14] + x[10],  9);
+        x[ 6] ^= rotate(x[ 2] + x[14], 13);  x[10] ^= rotate(x[ 6] + x[ 2], 18);
+        x[ 3] ^= rotate(x[15] + x[11],  7);  x[ 7] ^= rotate(x[ 3] + x[15],  9);
+        x[11] ^= rotate(x[ 7] + x[ 3], 13);  x[15] ^= rotate(x[11] + x[ 7], 18);
+        // Rows
+        x[ 1] ^= rotate(x[ 0] + x[ 3],  7);  x[ 2] ^= rotate(x[ 1] + x[ 0],  9);
+        x[ 3] ^= rotate(x[ 2] + x[ 1], 13);  x[ 0] ^= rotate(x[ 3] + x[ 2], 18);
+        x[ 6] ^= rotate(x[ 5] + x[ 4],  7);  x[ 7] ^= rotate(x[ 6] + x[ 5],  9);
+        x[ 4] ^= rotate(x[ 7] + x[ 6], 13);  x[ 5] ^= rotate(x[ 4] + x[ 7], 18);
+        x[11] ^= rotate(x[10] + x[ 9],  7);  x[ 8] ^= rotate(x[11] + x[10],  9);
+        x[ 9] ^= rotate(x[ 8] + x[11], 13);  x[10] ^= rotate(x[ 9] + x[ 8], 18);
+        x[12] ^= rotate(x[15] + x[14],  7);  x[13] ^= rotate(x[12] + x[15],  9);
+        x[14] ^= rotate(x[13] + x[12], 13);  x[15] ^= rotate(x[14] + x[13], 18);
+    }
+    for(int i = 0; i < 16; ++i)
+    {
+        b[i] += x[i];
+    }
+}
+
+// 'in' and 'out' are 2r blocks of 16 words
+static void blockMix(const quint32* in, quint32* out, int r)
+{
+    quint32 x[16];
+    memcpy(x, in + (2 * r - 1) * 16, sizeof(x));
+    for(int i = 0; i < 2 * r; ++i)
+    {
+        for(int k = 0; k < 16; ++k)
+        {
+            x[k] ^= in[i * 16 + k];
+        }
+        salsa20_8(x);
+        // Even blocks go to the first half, odd ones to the second
+        memcpy(out + ((i % 2) * r + i / 2) * 16, x, sizeof(x));
+    }
+}
+
+// 'block' is 32r words; 'scratch' is (N + 1) * 32r words
+static void roMix(quint32* block, int r, quint32 n, quint32* scratch)
+{
+    const size_t words = 32 * static_cast<size_t>(r);
+    quint32* v = scratch;
+    quint32* x = scratch + static_cast<size_t>(n) * words;
+    memcpy(x, block, words * sizeof(quint32));
+    for(quint32 i = 0; i < n; ++i)
+    {
+        memcpy(v + i * words, x, words * sizeof(quint32));
+        blockMix(v + i * words, x, r);
+    }
+    for(quint32 i = 0; i < n; ++i)
+    {
+        // Integerify: first word of the last block; N is a power of two
+        const quint32 j = x[words - 16] & (n - 1);
+        for(size_t k = 0; k < words; ++k)
+        {
+            block[k] = x[k] ^ v[j * words + k];
+        }
+        blockMix(block, x, r);
+    }
+    memcpy(block, x, words * sizeof(quint32));
+}
+
+// PBKDF2-HMAC-SHA256 with one iteration, which is all scrypt asks of it
+static QByteArray pbkdf2(const QByteArray& password, const QByteArray& salt, int length)
+{
+    QByteArray key;
+    for(quint32 i = 1; key.size() < length; ++i)
+    {
+        QByteArray counter(4, '\0');
+        qToBigEndian(i, reinterpret_cast<uchar*>(counter.data()));
+        key += QMessageAuthenticationCode::hash(salt + counter, password, QCryptographicHash::Sha256);
+    }
+    return key.left(length);
+}
+
+static QByteArray scrypt(const QByteArray& password, const QByteArray& salt, const PinVerifier::Cost& cost, int length)
+{
+    const size_t words = 32 * static_cast<size_t>(cost._r);
+    const quint32 n = 1u << cost._log2_n;
+    QByteArray bytes = pbkdf2(password, salt, cost._p * static_cast<int>(words) * 4);
+    std::vector<quint32> block(words);
+    std::vector<quint32> scratch((static_cast<size_t>(n) + 1) * words);
+    for(int p = 0; p < cost._p; ++p)
+    {
+        uchar* chunk = reinterpret_cast<uchar*>(bytes.data()) + p * words * 4;
+        for(size_t k = 0; k < words; ++k)
+        {
+            block[k] = qFromLittleEndian<quint32>(chunk + k * 4);
+        }
+        roMix(&block[0], cost._r, n, &scratch[0]);
+        for(size_t k = 0; k < words; ++k)
+        {
+            qToLittleEndian(block[k], chunk + k * 4);
+        }
+    }
+    return pbkdf2(password, bytes, length);
+}
+
+// Stored hashes
+//==========
+
+static bool isSupported(const PinVerifier::Cost& cost)
+{
+    return cost._log2_n >= 1 && cost._log2_n <= PinVerifier::MAX_LOG2_N &&
+           cost._r >= 1 && cost._r <= PinVerifier::MAX_R &&
+           cost._p >= 1 && cost._p <= PinVerifier::MAX_P;
+}
+
+// Splits 'stored' into its cost, salt and hash. False if it is malformed.
+static bool parse(const QByteArray& stored, PinVerifier::Cost& cost, QByteArray& salt, QByteArray& hash)
+{
+    const QList<QByteArray> fields = stored.split('$');
+    if(fields.size() != 6 || fields[0] != HASH_SCHEME)
+    {
+        return false;
+    }
+    bool log2nOk = false;
+    bool rOk = false;
+    bool pOk = false;
+    cost._log2_n = fields[1].toInt(&log2nOk);
+    cost._r = fields[2].toInt(&rOk);
+    cost._p = fields[3].toInt(&pOk);
+    salt = QByteArray::fromBase64(fields[4]);
+    hash = QByteArray::fromBase64(fields[5]);
+    return log2nOk && rOk && pOk && isSupported(cost) && !salt.isEmpty() && !hash.isEmpty();
+}
+
+QByteArray PinVerifier::hash(const QString& pin, const Cost& cost)
+{
+    if(!isSupported(cost))
+    {
+        return QByteArray();
+    }
+    const QByteArray salt = QUuid::createUuid().toRfc4122().left(SALT_BYTES);
+    const QByteArray hash = scrypt(pin.toUtf8(), salt, cost, HASH_BYTES);
+    return QString("%1$%2$%3$%4$%5$%6").arg(HASH_SCHEME)
+                                       .arg(cost._log2_n).arg(cost._r).arg(cost._p)
+                                       .arg(QString::fromLatin1(salt.toBase64()), QString::fromLatin1(hash.toBase64()))
+                                       .toLatin1();
+}
+
+bool PinVerifier::matches(const QString& pin, const QByteArray& stored)
+{
+    Cost cost;
+    QByteArray salt;
+    QByteArray expected;
+    if(!parse(stored, cost, salt, expected))
+    {
+        return false;
+    }
+    const QByteArray actual = scrypt(pin.toUtf8(), salt, cost, expected.size());
+    // Every byte is compared, so that timing does not tell how much of it matched
+    char difference = 0;
+    for(int i = 0; i < expected.size(); ++i)
+    {
+        difference |= actual[i] ^ expected[i];
+    }
+    return difference == 0;
+}
+
+bool PinVerifier::costOf(const QByteArray& stored, Cost& cost)
+{
+    QByteArray salt;
+    QByteArray hash;
+    return parse(stored, cost, salt, hash);
+}
+
+bool PinVerifier::selectHash(QSqlDatabase database, const QString& cardNumber, QByteArray& stored)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.prepare(SELECT_HASH))
+    {
+        return false;
+    }
+    query.addBindValue(cardNumber);
+    if(!query.exec())
+    {
+        return false;
+    }
+    stored = query.next() ? query.value(0).toByteArray() : QByteArray();
+    return !query.lastError().isValid();
+}
+
+// Worker pool
+//==========
+
+class PinVerifier::Worker : public QThread
+{
+public:
+    explicit Worker(PinVerifier& verifier):
+        _verifier(verifier)
+    {}
+
+protected:
+    void run();
+
+private:
+    PinVerifier& _verifier;
+};
+
+void PinVerifier::Worker::run()
+{
+    Job job;
+    bool isCheck = false;
+    while(_verifier.takeJob(job, isCheck))
+    {
+        const qint64 startedNs = now();
+        Result result;
+        result._matched = isCheck && matches(job._pin, job._stored);
+        if(!isCheck)
+        {
+            result._hash = hash(job._pin, job._cost);
+        }
+        _verifier.finishJob(job, isCheck, result, startedNs, now());
+    }
+}
+
+PinVerifier::PinVerifier():
+    _last_ticket(0),
+    _stopping(false)
+{
+    memset(&_metrics, 0, sizeof(_metrics));
+}
+
+PinVerifier::~PinVerifier()
+{
+    stop();
+}
+
+qint64 PinVerifier::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void PinVerifier::start(int workers)
+{
+    QMutexLocker locker(&_lock);
+    if(!_workers.isEmpty())
+    {
+        return;
+    }
+    _stopping = false;
+    for(int i = 0; i < qMax(1, workers); ++i)
+    {
+        _workers.append(new Worker(*this));
+        _workers.last()->start();
+    }
+}
+
+void PinVerifier::stop()
+{
+    QVector<Worker*> workers;
+    bool checksFailed = false;
+    {
+        QMutexLocker locker(&_lock);
+        _stopping = true;
+        workers = _workers;
+        _workers.clear();
+        // Whatever is still queued fails
+        checksFailed = !_checks.isEmpty();
+        while(!_checks.isEmpty())
+        {
+            _pending.remove(_checks.dequeue()._ticket);
+        }
+        while(!_hashes.isEmpty())
+        {
+            _pending.remove(_hashes.dequeue()._ticket);
+        }
+        _queued.wakeAll();
+        _finished.wakeAll();
+        _room.wakeAll();
+    }
+    for(int i = 0; i < workers.size(); ++i)
+    {
+        workers[i]->wait();
+        delete workers[i];
+    }
+    // Whoever waits for a failed check is told all the same
+    if(checksFailed && _completion)
+    {
+        _completion();
+    }
+}
+
+void PinVerifier::setCompletion(const Completion& completion)
+{
+    assert(_workers.isEmpty() && "FATAL: PinVerifier::setCompletion() called while running!!!");
+    _completion = completion;
+}
+
+PinVerifier::Ticket PinVerifier::submit(const QString& pin, const QByteArray& stored)
+{
+    QMutexLocker locker(&_lock);
+    if(_workers.isEmpty() || _checks.size() >= CHECK_QUEUE_SIZE)
+    {
+        return 0;
+    }
+    Job job;
+    job._ticket = ++_last_ticket;
+    job._pin = pin;
+    job._stored = stored;
+    job._cost = DEFAULT_COST;
+    job._queued_ns = now();
+    _checks.enqueue(job);
+    _pending.insert(job._ticket);
+    _queued.wakeOne();
+    return job._ticket;
+}
+
+bool PinVerifier::isDone(Ticket ticket) const
+{
+    QMutexLocker locker(&_lock);
+    return _results.contains(ticket) || !_pending.contains(ticket);
+}
+
+PinVerifier::Answer PinVerifier::wait(Ticket ticket)
+{
+    QMutexLocker locker(&_lock);
+    while(!_results.contains(ticket) && _pending.contains(ticket))
+    {
+        _finished.wait(&_lock);
+    }
+    // Not there if stopped before the check was done
+    if(!_results.contains(ticket))
+    {
+        return ANSWER_NONE;
+    }
+    return _results.take(ticket)._matched ? ANSWER_MATCH : ANSWER_MISMATCH;
+}
+
+void PinVerifier::cancel(Ticket ticket)
+{
+    QMutexLocker locker(&_lock);
+    for(int i = 0; i < _checks.size(); ++i)
+    {
+        if(_checks[i]._ticket == ticket)
+        {
+            _checks.removeAt(i);
+            break;
+        }
+    }
+    _pending.remove(ticket);
+    _results.remove(ticket);
+}
+
+PinVerifier::Answer PinVerifier::check(const QString& pin, const QByteArray& stored)
+{
+    const Ticket ticket = submit(pin, stored);
+    if(ticket != 0)
+    {
+        return wait(ticket);
+    }
+    const qint64 startedNs = now();
+    const bool matched = matches(pin, stored);
+    recordInline(now() - startedNs);
+    return matched ? ANSWER_MATCH : ANSWER_MISMATCH;
+}
+
+QVector<QByteArray> PinVerifier::hashBatch(const QVector<QString>& pins, const Cost& cost)
+{
+    QVector<QByteArray> hashes(pins.size());
+    QVector<Ticket> tickets(pins.size(), 0);
+    QMutexLocker locker(&_lock);
+    for(int i = 0; i < pins.size() && !_workers.isEmpty(); ++i)
+    {
+        while(_hashes.size() >= HASH_QUEUE_SIZE && !_workers.isEmpty())
+        {
+            _room.wait(&_lock);
+        }
+        if(_workers.isEmpty())
+        {
+            break;
+        }
+        Job job;
+        job._ticket = ++_last_ticket;
+        job._pin = pins[i];
+        job._cost = cost;
+        job._queued_ns = now();
+        _hashes.enqueue(job);
+        _pending.insert(job._ticket);
+        tickets[i] = job._ticket;
+        _queued.wakeOne();
+    }
+    for(int i = 0; i < tickets.size(); ++i)
+    {
+        while(tickets[i] != 0 && !_results.contains(tickets[i]) && _pending.contains(tickets[i]))
+        {
+            _finished.wait(&_lock);
+        }
+        hashes[i] = _results.take(tickets[i])._hash;
+    }
+    return hashes;
+}
+
+PinVerifier::Metrics PinVerifier::metrics() const
+{
+    QMutexLocker locker(&_lock);
+    return _metrics;
+}
+
+bool PinVerifier::takeJob(Job& job, bool& isCheck)
+{
+    QMutexLocker locker(&_lock);
+    while(!_stopping && _checks.isEmpty() && _hashes.isEmpty())
+    {
+        _queued.wait(&_lock);
+    }
+    if(_stopping)
+    {
+        return false;
+    }
+    isCheck = !_checks.isEmpty();
+    job = isCheck ? _checks.dequeue() : _hashes.dequeue();
+    if(!isCheck)
+    {
+        _room.wakeAll();
+    }
+    return true;
+}
+
+void PinVerifier::finishJob(const Job& job, bool isCheck, const Result& result, qint64 startedNs, qint64 finishedNs)
+{
+    bool answered = false;
+    {
+        QMutexLocker locker(&_lock);
+        const qint64 waitNs = startedNs - job._queued_ns;
+        const qint64 kdfNs = finishedNs - startedNs;
+        if(isCheck)
+        {
+            ++_metrics._checks;
+            _metrics._check_wait_total_ns += waitNs;
+            _metrics._check_wait_max_ns = qMax(_metrics._check_wait_max_ns, waitNs);
+            _metrics._check_kdf_total_ns += kdfNs;
+            _metrics._check_kdf_max_ns = qMax(_metrics._check_kdf_max_ns, kdfNs);
+        }
+        else
+        {
+            ++_metrics._hashes;
+            _metrics._hash_wait_total_ns += waitNs;
+            _metrics._hash_kdf_total_ns += kdfNs;
+        }
+        // Cancelled meanwhile: nobody is waiting for it
+        if(_pending.remove(job._ticket))
+        {
+            _results.insert(job._ticket, result);
+            answered = isCheck;
+        }
+        _finished.wakeAll();
+    }
+    // Outside the lock: whoever is told may take the answer right away
+    if(answered && _completion)
+    {
+        _completion();
+    }
+}
+
+void PinVerifier::recordInline(qint64 kdfNs)
+{
+    QMutexLocker locker(&_lock);
+    ++_metrics._checks;
+    ++_metrics._inline_checks;
+    _metrics._check_kdf_total_ns += kdfNs;
+    _metrics._check_kdf_max_ns = qMax(_metrics._check_kdf_max_ns, kdfNs);
+}
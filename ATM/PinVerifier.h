@@ -0,0 +1,165 @@
+#ifndef PINVERIFIER_H
+#define PINVERIFIER_H
+
+#include <QString>
+#include <QByteArray>
+#include <QVector>
+#include <QQueue>
+#include <QHash>
+#include <QSet>
+#include <QSqlDatabase>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <functional>
+
+// PIN checks against salted, memory-hard hashes, on a pool of worker threads.
+//
+// Hashes are scrypt, kept in pin_hashes next to the bank's cards table as
+//     scrypt$<log2 N>$<r>$<p>$<salt, base64>$<hash, base64>
+// so that every hash carries the cost it was made with: a stronger cost only
+// affects hashes made from then on, and old ones still verify. Cards without
+// a hash are checked against cards.pin until they are migrated (see hashBatch()).
+//
+// A check is deliberately expensive (tens of ms, N * r * 128 bytes of memory).
+// The ATM submits it as soon as the fourth PIN digit is in and only takes its
+// answer when Enter comes, so most of the cost is gone by then. A caller that
+// must not block is told when a check is done (see setCompletion()). Checks go
+// ahead of batch hashing, which only takes workers the checks leave free.
+//
+// Queue wait and KDF time are counted separately for checks and hashes (see
+// metrics()), so that the cost can be raised up to what time-to-menu allows.
+class PinVerifier
+{
+public:
+    // N = 2^log2_n
+    struct Cost
+    {
+        int _log2_n;
+        int _r;
+        int _p;
+    };
+    static const Cost DEFAULT_COST;     // N = 2^14, r = 8, p = 1: 16 MiB a check
+
+    // Nanoseconds
+    struct Metrics
+    {
+        quint64 _checks;
+        quint64 _inline_checks;         // Pool was full or stopped: run on the caller's thread
+        qint64 _check_wait_total_ns;    // Queued, until a worker took it
+        qint64 _check_wait_max_ns;
+        qint64 _check_kdf_total_ns;
+        qint64 _check_kdf_max_ns;
+        quint64 _hashes;
+        qint64 _hash_wait_total_ns;
+        qint64 _hash_kdf_total_ns;
+    };
+
+    typedef quint64 Ticket;             // 0: none
+
+    enum Answer
+    {
+        ANSWER_MISMATCH     = 0,
+        ANSWER_MATCH        = 1,
+        ANSWER_NONE         = 2         // Pool was stopped before the check was done
+    };
+
+    // Called on a worker thread once a submitted check is done or has failed,
+    // unless it was cancelled. Must not call back into the verifier.
+    typedef std::function<void()> Completion;
+
+    enum
+    {
+        DEFAULT_WORKERS     = 2,
+        CHECK_QUEUE_SIZE    = 16,       // Checks beyond it run on the caller's thread
+        HASH_QUEUE_SIZE     = 64,       // hashBatch() waits for room beyond it
+        SALT_BYTES          = 16,
+        HASH_BYTES          = 32,
+        MAX_LOG2_N          = 24,       // Anything stronger is taken for a corrupt hash
+        MAX_R               = 32,
+        MAX_P               = 16
+    };
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_TABLE;
+    // Prepared: card number
+    static const char* const SELECT_HASH;
+    // Prepared: card number, hash. Replaces the card's hash if any.
+    static const char* const STORE_HASH;
+
+    PinVerifier();
+    ~PinVerifier();
+
+    void start(int workers = DEFAULT_WORKERS);
+    // Waits for KDFs in progress; checks still queued fail
+    void stop();
+    // Only to be changed while stopped. Empty: nobody is told.
+    void setCompletion(const Completion& completion);
+
+    // New hash of 'pin' with a fresh salt
+    static QByteArray hash(const QString& pin, const Cost& cost);
+    // False for a malformed hash as well
+    static bool matches(const QString& pin, const QByteArray& stored);
+    // Cost 'stored' was made with. False if it is malformed.
+    static bool costOf(const QByteArray& stored, Cost& cost);
+    // Hash of 'cardNumber' in pin_hashes; empty if the card has none yet. False if DB failed to tell.
+    static bool selectHash(QSqlDatabase database, const QString& cardNumber, QByteArray& stored);
+
+    // Start checking 'pin' on the pool. Returns 0 if the pool is full or stopped.
+    Ticket submit(const QString& pin, const QByteArray& stored);
+    // Submitted check is done, or has failed: wait() would not block
+    bool isDone(Ticket ticket) const;
+    // Answer to a submitted check, once it is done
+    Answer wait(Ticket ticket);
+    // Check is no longer wanted (e.g. the PIN was edited); its result is dropped
+    void cancel(Ticket ticket);
+    // submit() and wait(), or on the caller's thread if the pool cannot take it
+    Answer check(const QString& pin, const QByteArray& stored);
+
+    // Hash every PIN on the pool, for migrating cards to hashes or to a new cost.
+    // Waits until all are done. Entries are empty if the pool was stopped.
+    QVector<QByteArray> hashBatch(const QVector<QString>& pins, const Cost& cost);
+
+    Metrics metrics() const;
+
+private:
+    class Worker;
+
+    struct Job
+    {
+        Ticket _ticket;
+        QString _pin;
+        QByteArray _stored;     // Checks: hash to check against
+        Cost _cost;             // Hashes: cost to hash with
+        qint64 _queued_ns;
+    };
+    struct Result
+    {
+        bool _matched;
+        QByteArray _hash;
+
+        Result(): _matched(false) {}
+    };
+
+    static qint64 now();
+    // Job the workers should take next, checks first. False when stopping.
+    bool takeJob(Job& job, bool& isCheck);
+    void finishJob(const Job& job, bool isCheck, const Result& result, qint64 startedNs, qint64 finishedNs);
+    void recordInline(qint64 kdfNs);
+
+    mutable QMutex _lock;
+    QWaitCondition _queued;         // Workers wait for jobs...
+    QWaitCondition _finished;       // ...and callers for results
+    QWaitCondition _room;           // hashBatch() waits for the hash queue to drain
+    QQueue<Job> _checks;
+    QQueue<Job> _hashes;
+    QHash<Ticket, Result> _results;
+    QSet<Ticket> _pending;          // Queued or being worked on, not cancelled
+    Ticket _last_ticket;
+    bool _stopping;
+    QVector<Worker*> _workers;
+    Metrics _metrics;
+    Completion _completion;
+};
+
+#endif // PINVERIFIER_H
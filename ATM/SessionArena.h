@@ -0,0 +1,87 @@
+#ifndef SESSIONARENA_H
+#define SESSIONARENA_H
+
+#include <cassert>
+#include <cstddef>
+#include <new>
+
+// Storage for objects that live exactly as long as a customer session.
+//
+// Memory is reserved once, together with the ATM; objects are placed into it
+// one after another and destroyed all together by reset() when the card leaves
+// the ATM. Nothing is taken from the heap while a session is in progress.
+class SessionArena
+{
+public:
+    enum { CAPACITY = 1024, MAX_OBJECTS = 8 };
+
+    SessionArena():
+        _used(0),
+        _object_count(0)
+    {}
+
+    ~SessionArena()
+    {
+        reset();
+    }
+
+    // Construct a default-initialized T inside the arena
+    template <class T>
+    T* create()
+    {
+        const size_t offset = align(_used, alignof(T));
+        assert(offset + sizeof(T) <= CAPACITY && "FATAL: Session arena exhausted!!!");
+        assert(_object_count < MAX_OBJECTS && "FATAL: Too many objects in session arena!!!");
+
+        T* object = new (_buffer + offset) T();
+        _objects[_object_count]._object = object;
+        _objects[_object_count]._destroy = &destroy<T>;
+        ++_object_count;
+        _used = offset + sizeof(T);
+        return object;
+    }
+
+    // Destroy everything created since the last reset (newest first)
+    void reset()
+    {
+        while(_object_count > 0)
+        {
+            --_object_count;
+            _objects[_object_count]._destroy(_objects[_object_count]._object);
+        }
+        _used = 0;
+    }
+
+    size_t used() const
+    {
+        return _used;
+    }
+
+private:
+    SessionArena(const SessionArena&);
+    SessionArena& operator=(const SessionArena&);
+
+    struct Entry
+    {
+        void* _object;
+        void (*_destroy)(void*);
+    };
+
+    template <class T>
+    static void destroy(void* object)
+    {
+        static_cast<T*>(object)->~T();
+    }
+
+    static size_t align(size_t offset, size_t alignment)
+    {
+        return (offset + alignment - 1) & ~(alignment - 1);
+    }
+
+    alignas(std::max_align_t) unsigned char _buffer[CAPACITY];
+    size_t _used;
+    Entry _objects[MAX_OBJECTS];
+    size_t _object_count;
+};
+
+#endif // SESSIONARENA_H
@@ -0,0 +1,117 @@
+#include "SessionCheckpoint.h"
+
+#include <QDir>
+#include <QDateTime>
+#include <cstring>
+
+static_assert(sizeof(SessionRecord) == 184, "Session record layout must stay 184 bytes");
+
+const quint32 SessionCheckpoint::RECORD_MAGIC = 0x53534e34;    // "SSN4"
+const qint64 SessionCheckpoint::RESUME_WINDOW_MS = 2 * 60 * 1000;
+
+SessionCheckpoint::SessionCheckpoint(quint16 atmId, const QString& directory):
+    _atm_id(atmId),
+    _directory(directory),
+    _slots(NULL),
+    _next_sequence(1)
+{}
+
+SessionCheckpoint::~SessionCheckpoint()
+{
+    close();
+}
+
+bool SessionCheckpoint::open()
+{
+    if(_slots)
+    {
+        return true;
+    }
+    QDir().mkpath(_directory);
+    _file.setFileName(filePath());
+    const qint64 size = SLOT_COUNT * sizeof(SessionRecord);
+    if(!_file.open(QIODevice::ReadWrite) || (_file.size() != size && !_file.resize(size)))
+    {
+        _file.close();
+        return false;
+    }
+    _slots = reinterpret_cast<SessionRecord*>(_file.map(0, size));
+    if(!_slots)
+    {
+        _file.close();
+        return false;
+    }
+    // Carry on from the latest record, so that the older slot is always the one overwritten
+    SessionRecord latest;
+    _next_sequence = load(latest) ? latest._sequence + 1 : 1;
+    return true;
+}
+
+void SessionCheckpoint::close()
+{
+    if(!_slots)
+    {
+        return;
+    }
+    _file.unmap(reinterpret_cast<uchar*>(_slots));
+    _slots = NULL;
+    _file.close();
+}
+
+bool SessionCheckpoint::load(SessionRecord& record) const
+{
+    if(!_slots)
+    {
+        return false;
+    }
+    const SessionRecord* latest = NULL;
+    for(int i = 0; i < SLOT_COUNT; ++i)
+    {
+        if(isIntact(_slots[i]) && (!latest || _slots[i]._sequence > latest->_sequence))
+        {
+            latest = &_slots[i];
+        }
+    }
+    if(!latest)
+    {
+        return false;
+    }
+    record = *latest;
+    return true;
+}
+
+void SessionCheckpoint::save(SessionRecord& record)
+{
+    if(!_slots)
+    {
+        return;
+    }
+    record._magic = RECORD_MAGIC;
+    record._sequence = _next_sequence++;
+    record._saved_ms = QDateTime::currentMSecsSinceEpoch();
+    record._checksum = checksum(record);
+    memcpy(&_slots[record._sequence % SLOT_COUNT], &record, sizeof(record));
+}
+
+bool SessionCheckpoint::isResumable(const SessionRecord& record, qint64 nowMs)
+{
+    // A clock set back makes the record's age unknown: too old, then
+    return nowMs >= record._saved_ms && nowMs - record._saved_ms <= RESUME_WINDOW_MS;
+}
+
+QString SessionCheckpoint::filePath() const
+{
+    return QDir(_directory).filePath(QString("session-%1.bin").arg(QString::number(_atm_id)));
+}
+
+quint16 SessionCheckpoint::checksum(const SessionRecord& record)
+{
+    SessionRecord copy = record;
+    copy._checksum = 0;
+    return qChecksum(reinterpret_cast<const char*>(&copy), sizeof(copy));
+}
+
+bool SessionCheckpoint::isIntact(const SessionRecord& record)
+{
+    return record._magic == RECORD_MAGIC && record._checksum == checksum(record);
+}
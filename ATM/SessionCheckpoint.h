@@ -0,0 +1,116 @@
+#ifndef SESSIONCHECKPOINT_H
+#define SESSIONCHECKPOINT_H
+
+#include <QString>
+#include <QFile>
+
+#include "CashDispenser.h"
+
+// Fixed-size session record. Layout is part of the on-disk format:
+// change SessionCheckpoint::RECORD_MAGIC whenever it changes.
+struct SessionRecord
+{
+    quint32 _magic;
+    quint32 _sequence;          // Grows with every record; the higher of the two slots wins
+    quint16 _checksum;          // qChecksum() of the record with this field zeroed
+    quint8 _state;              // ATMBase::ATMState
+    quint8 _menu_state;         // ATMBase::MenuState
+    quint8 _pin_attempts_left;
+    quint8 _operation;          // FraudScorer::Operation in flight or waiting for PIN
+    quint8 _debit_phase;        // SessionCheckpoint::DebitPhase
+    quint8 _reserved0;
+    double _amount;
+    char _card_mask[20];        // CardToken::mask() of the card number, NUL-padded, as are the ones below
+    char _recepient[20];        // Card or phone number, masked as well
+    char _transaction_id[48];
+    char _topup_key[40];
+    double _debit_amount;       // Taken from the card, in its currency; 0: same as _amount
+    quint64 _card_token;        // CardToken::token() of the card number; 0: no card
+    qint64 _saved_ms;           // When the record was saved, ms since epoch
+    quint8 _notes[CashDispenser::MAX_CASSETTES];    // Taken from each cassette by the withdrawal in flight
+};
+
+// Per-ATM session checkpoint, so that a session survives the process dying.
+//
+// The ATM saves a record on every state transition and whenever PIN attempts
+// or a debit in flight change. Records go to the two slots of a small
+// memory-mapped file in turn: a record torn by a crash fails its checksum, and
+// the other slot still holds the one before. Pages written to the mapping
+// belong to the OS from then on and outlive the process; they are not synced
+// on every save, so a power cut may take the last records with it.
+//
+// The file is <directory>/session-<atm>.bin, <atm> being the terminal id: the
+// same from run to run, and held by one ATM at a time (see ATMConfig.h), so a
+// restarted terminal finds its own sessions. A missing or unusable file only
+// means sessions cannot be recovered: the ATM works without it. Card numbers
+// are not kept in it: the card is known again when the reader reads it, and
+// the card a debit in flight was taken from is in applied_transactions.
+class SessionCheckpoint
+{
+public:
+    // What is known of the debit in flight
+    enum DebitPhase
+    {
+        DEBIT_NONE      = 0,
+        DEBIT_ISSUED    = 1,    // May or may not have committed: applied_transactions knows
+        DEBIT_SETTLED   = 2,    // Committed, and cash or top-up has followed
+        DEBIT_DISPENSING = 3    // Committed, cash may or may not have left the dispenser
+    };
+
+    static const quint32 RECORD_MAGIC;
+    enum { SLOT_COUNT = 2 };
+    // A card read again later than this after the record is a new session:
+    // the customer has walked away, and whoever holds the card now is not them
+    static const qint64 RESUME_WINDOW_MS;   // 2 minutes
+
+    SessionCheckpoint(quint16 atmId, const QString& directory);
+    ~SessionCheckpoint();
+
+    bool open();
+    void close();
+    inline bool isOpen() const
+    {
+        return _slots != NULL;
+    }
+
+    // Latest intact record. False if there is none.
+    bool load(SessionRecord& record) const;
+    // Stamp and store 'record'. Does nothing while closed.
+    void save(SessionRecord& record);
+    // Saved within the resume window before 'nowMs'
+    static bool isResumable(const SessionRecord& record, qint64 nowMs);
+
+    // NUL-padded text fields of SessionRecord
+    template <int N>
+    static void setText(char (&field)[N], const QString& text)
+    {
+        const int length = qMin(text.size(), N - 1);
+        for(int i = 0; i < length; ++i)
+        {
+            field[i] = text.at(i).toLatin1();
+        }
+    }
+    template <int N>
+    static QString text(const char (&field)[N])
+    {
+        int length = 0;
+        while(length < N && field[length])
+        {
+            ++length;
+        }
+        return QString::fromLatin1(field, length);
+    }
+
+private:
+    QString filePath() const;
+    static quint16 checksum(const SessionRecord& record);
+    static bool isIntact(const SessionRecord& record);
+
+    const quint16 _atm_id;
+    const QString _directory;
+    QFile _file;
+    SessionRecord* _slots;      // SLOT_COUNT of them, mapped
+    quint32 _next_sequence;
+};
+
+#endif // SESSIONCHECKPOINT_H
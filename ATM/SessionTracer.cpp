@@ -0,0 +1,226 @@
+#include "SessionTracer.h"
+
+#include <QDir>
+#include <QDateTime>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+SessionTracer::SessionTracer(quint16 atmId, const QString& directory):
+    _atm_id(atmId),
+    _directory(directory),
+    _sample_every(0),
+    _applied_sample_every(0),
+    _sessions(0),
+    _traced(0),
+    _recording(false),
+    _ending(false),
+    _open_spans(0),
+    _session_start_ns(0),
+    _session_end_ns(0),
+    _dropped(0),
+    _first_event(true)
+{
+    _card_tail[0] = '\0';
+}
+
+SessionTracer::~SessionTracer()
+{
+    stop();
+}
+
+void SessionTracer::setSampling(int sampleEvery)
+{
+    _sample_every.store(sampleEvery > 0 ? sampleEvery : 0, std::memory_order_relaxed);
+}
+
+// Monotonic: spans must not stretch or shrink when the wall clock is set
+qint64 SessionTracer::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SessionTracer::beginSession(const QString& cardNumber)
+{
+    if(_recording)
+    {
+        // Previous session never reached finalizeCard()
+        endSession();
+    }
+    const int sampleEvery = _sample_every.load(std::memory_order_relaxed);
+    if(sampleEvery != _applied_sample_every)
+    {
+        closeFile();
+        _applied_sample_every = sampleEvery;
+        _sessions = 0;
+    }
+    if(sampleEvery == 0 || (_sessions++ % sampleEvery) != 0)
+    {
+        return;
+    }
+    if(!_file.isOpen() && !openFile())
+    {
+        return;
+    }
+
+    // Card number is not validated yet: keep up to four trailing digits
+    int length = 0;
+    for(int i = qMax(0, cardNumber.size() - 4); i < cardNumber.size(); ++i)
+    {
+        const QChar c = cardNumber.at(i);
+        if(c.isDigit())
+        {
+            _card_tail[length++] = c.toLatin1();
+        }
+    }
+    _card_tail[length] = '\0';
+
+    _spans.clear();
+    _spans.reserve(SPAN_CAPACITY);
+    _dropped = 0;
+    _open_spans = 0;
+    _ending = false;
+    ++_traced;
+    _session_start_ns = now();
+    _recording = true;
+}
+
+void SessionTracer::endSession()
+{
+    if(!_recording)
+    {
+        return;
+    }
+    _session_end_ns = now();
+    if(_open_spans > 0)
+    {
+        // Called from within a span (e.g. ejection inside processInput)
+        _ending = true;
+        return;
+    }
+    flushSession();
+}
+
+void SessionTracer::closeSpan(const char* name, const char* category, const char* detail, qint64 startNs)
+{
+    const qint64 endNs = now();
+    --_open_spans;
+    if(_spans.size() < SPAN_CAPACITY)
+    {
+        Span span = {name, category, detail, startNs, endNs};
+        _spans.push_back(span);
+    }
+    else
+    {
+        ++_dropped;
+    }
+    if(_ending && _open_spans == 0)
+    {
+        _session_end_ns = qMax(_session_end_ns, endNs);
+        flushSession();
+    }
+}
+
+void SessionTracer::recordSpan(const char* name, const char* category, const char* detail, qint64 startNs)
+{
+    if(!_recording)
+    {
+        return;
+    }
+    ++_open_spans;
+    closeSpan(name, category, detail, startNs);
+}
+
+void SessionTracer::stop()
+{
+    if(_recording)
+    {
+        _open_spans = 0;
+        endSession();
+    }
+    closeFile();
+    _applied_sample_every = 0;
+}
+
+bool SessionTracer::openFile()
+{
+    QDir().mkpath(_directory);
+    _file.setFileName(QDir(_directory).filePath(QString("atm-%1-%2.json").arg(QString::number(_atm_id),
+                                                                             QString::number(QDateTime::currentMSecsSinceEpoch()))));
+    if(!_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        return false;
+    }
+    // JSON array format: the closing bracket is optional, so a file cut short still loads
+    _file.write("[\n");
+    _first_event = true;
+    _traced = 0;
+    char line[128];
+    const int length = snprintf(line, sizeof(line),
+                                "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%u,\"args\":{\"name\":\"ATM %u\"}}",
+                                static_cast<unsigned>(_atm_id), static_cast<unsigned>(_atm_id));
+    _json.resize(0);
+    appendEvent(line, length);
+    _file.write(_json);
+    return true;
+}
+
+void SessionTracer::closeFile()
+{
+    if(_file.isOpen())
+    {
+        _file.write("\n]\n");
+        _file.close();
+    }
+}
+
+void SessionTracer::appendEvent(const char* json, int length)
+{
+    if(length <= 0)
+    {
+        return;
+    }
+    if(!_first_event)
+    {
+        _json.append(",\n");
+    }
+    _json.append(json, length);
+    _first_event = false;
+}
+
+// Complete ("X") events nest by time on a track, so spans need no parent links
+void SessionTracer::flushSession()
+{
+    _recording = false;
+    _ending = false;
+    _json.resize(0);
+
+    char line[512];
+    const unsigned pid = _atm_id;
+    const unsigned tid = _traced;
+    int length = snprintf(line, sizeof(line),
+                          "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"session %u card *%s\"}}",
+                          pid, tid, tid, _card_tail);
+    appendEvent(line, length);
+    length = snprintf(line, sizeof(line),
+                      "{\"name\":\"session\",\"cat\":\"session\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u,"
+                      "\"args\":{\"card\":\"*%s\",\"spans\":%u,\"dropped\":%u}}",
+                      _session_start_ns / 1000.0, (_session_end_ns - _session_start_ns) / 1000.0, pid, tid,
+                      _card_tail, static_cast<unsigned>(_spans.size()), _dropped);
+    appendEvent(line, length);
+    for(size_t i = 0; i < _spans.size(); ++i)
+    {
+        const Span& span = _spans[i];
+        length = snprintf(line, sizeof(line),
+                          "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%u,\"tid\":%u%s%s%s}",
+                          span._name, span._category, span._start_ns / 1000.0, (span._end_ns - span._start_ns) / 1000.0,
+                          pid, tid,
+                          span._detail ? ",\"args\":{\"detail\":\"" : "",
+                          span._detail ? span._detail : "",
+                          span._detail ? "\"}" : "");
+        appendEvent(line, length);
+    }
+    _file.write(_json);
+    _file.flush();
+}
@@ -0,0 +1,134 @@
+#ifndef SESSIONTRACER_H
+#define SESSIONTRACER_H
+
+#include <QString>
+#include <QFile>
+#include <QByteArray>
+#include <atomic>
+#include <vector>
+
+// Per-ATM span trace of customer sessions, in Chrome trace-event JSON
+// (opens in chrome://tracing and Perfetto).
+//
+// A traced session is a root span from card insertion to finalizeCard();
+// spans opened while it is recorded (inputs, DB statements, module calls,
+// PIN checks) become its children. Every session gets a track of its own.
+//
+// Sampling can be changed from any thread and takes effect from the next
+// session. Everything else is called from the ATM's thread only. Spans are
+// kept in memory and written out when their session ends, so a session
+// that is not sampled costs one branch per span.
+//
+// Files are <directory>/atm-<atm>-<ms since epoch>.json, one per stretch
+// of tracing; a file cut short by a crash still loads.
+class SessionTracer
+{
+public:
+    class Scope;
+
+    enum { SPAN_CAPACITY = 512 };   // Per session; later spans are dropped and counted
+
+    SessionTracer(quint16 atmId, const QString& directory);
+    ~SessionTracer();
+
+    // 0 turns tracing off, N traces one session in N
+    void setSampling(int sampleEvery);
+    inline int sampling() const
+    {
+        return _sample_every.load(std::memory_order_relaxed);
+    }
+
+    void beginSession(const QString& cardNumber);
+    // Root span closes once the spans still open inside it do
+    void endSession();
+    // Write out whatever is recorded and close the file (power off)
+    void stop();
+
+    inline bool recording() const
+    {
+        return _recording;
+    }
+
+    // Span that started before it could be opened (e.g. a key waiting to be
+    // taken), closing now. Strings must be static.
+    void recordSpan(const char* name, const char* category, const char* detail, qint64 startNs);
+
+    // Clock spans are timed with, in ns
+    static qint64 now();
+
+private:
+    struct Span
+    {
+        const char* _name;
+        const char* _category;
+        const char* _detail;    // Optional
+        qint64 _start_ns;
+        qint64 _end_ns;
+    };
+
+    inline qint64 openSpan()
+    {
+        ++_open_spans;
+        return now();
+    }
+    void closeSpan(const char* name, const char* category, const char* detail, qint64 startNs);
+
+    bool openFile();
+    void closeFile();
+    void flushSession();
+    void appendEvent(const char* json, int length);
+
+    const quint16 _atm_id;
+    const QString _directory;
+    std::atomic<int> _sample_every;
+    int _applied_sample_every;      // Sampling the current file was opened for
+    quint64 _sessions;              // Seen since tracing was turned on
+    quint32 _traced;                // Track number of the current session
+
+    bool _recording;
+    bool _ending;                   // endSession() came while spans were open
+    int _open_spans;
+    qint64 _session_start_ns;
+    qint64 _session_end_ns;
+    char _card_tail[5];             // Last digits only: traces are not for card numbers
+    std::vector<Span> _spans;
+    quint32 _dropped;
+
+    QFile _file;
+    bool _first_event;
+    QByteArray _json;               // Reused from one session to the next
+};
+
+// Span covering the scope it lives in. Does nothing unless a session
+// was being recorded when it was opened. Strings must be static.
+class SessionTracer::Scope
+{
+public:
+    Scope(SessionTracer& tracer, const char* name, const char* category, const char* detail = NULL):
+        _tracer(tracer.recording() ? &tracer : NULL),
+        _name(name),
+        _category(category),
+        _detail(detail),
+        _start_ns(_tracer ? _tracer->openSpan() : 0)
+    {}
+
+    ~Scope()
+    {
+        if(_tracer)
+        {
+            _tracer->closeSpan(_name, _category, _detail, _start_ns);
+        }
+    }
+
+private:
+    Scope(const Scope&);
+    Scope& operator=(const Scope&);
+
+    SessionTracer* const _tracer;
+    const char* const _name;
+    const char* const _category;
+    const char* const _detail;
+    const qint64 _start_ns;
+};
+
+#endif // SESSIONTRACER_H
@@ -0,0 +1,106 @@
+#include "SnapshotReader.h"
+
+#include <QtSql>
+
+const qint64 SnapshotReader::DEFAULT_MAX_STALENESS_MS = 1000;
+// Persistent: every later connection opens in WAL mode
+const char* const SnapshotReader::ENABLE_WAL = "PRAGMA journal_mode=WAL";
+
+SnapshotReader::SnapshotReader(const QString& connectionName):
+    _connection_name(connectionName),
+    _keeps_snapshots(false),
+    _in_snapshot(false),
+    _invalidated(false),
+    _max_staleness_ms(DEFAULT_MAX_STALENESS_MS)
+{
+}
+
+SnapshotReader::~SnapshotReader()
+{
+    close();
+}
+
+bool SnapshotReader::open(const QString& databaseDriver, const QString& databaseName)
+{
+    if(_database.isOpen())
+    {
+        return true;
+    }
+    if(!_database.isValid())
+    {
+        _database = QSqlDatabase::addDatabase(databaseDriver, _connection_name);
+    }
+    _database.setDatabaseName(databaseName);
+    _database.setConnectOptions("QSQLITE_OPEN_READONLY");
+    if(!_database.open())
+    {
+        return false;
+    }
+    _in_snapshot = false;
+    _invalidated = false;
+    detectJournalMode();
+    return true;
+}
+
+void SnapshotReader::detectJournalMode()
+{
+    if(!_database.isOpen() || _in_snapshot)
+    {
+        return;
+    }
+    QSqlQuery query(_database);
+    _keeps_snapshots = query.exec("PRAGMA journal_mode") && query.next() &&
+                       query.value(0).toString().compare("wal", Qt::CaseInsensitive) == 0;
+}
+
+void SnapshotReader::close()
+{
+    if(!_database.isValid())
+    {
+        return;
+    }
+    release();
+    _database.close();
+    _database = QSqlDatabase();
+    QSqlDatabase::removeDatabase(_connection_name);
+}
+
+void SnapshotReader::setMaxStaleness(qint64 ms)
+{
+    _max_staleness_ms = qMax(Q_INT64_C(0), ms);
+}
+
+bool SnapshotReader::acquire()
+{
+    if(!_database.isOpen())
+    {
+        return false;
+    }
+    if(!_keeps_snapshots)
+    {
+        return true;
+    }
+    // A snapshot out of bounds is never read from, even if it could not be let go
+    if(_in_snapshot && (_invalidated || _snapshot_age.elapsed() > _max_staleness_ms) && !release())
+    {
+        return false;
+    }
+    if(!_in_snapshot)
+    {
+        // Snapshot itself is taken by the first read of the transaction
+        _in_snapshot = _database.transaction();
+        _invalidated = false;
+        _snapshot_age.start();
+    }
+    return _in_snapshot;
+}
+
+bool SnapshotReader::release()
+{
+    if(_in_snapshot)
+    {
+        // Nothing was written: commit only ends the read transaction, and so does a rollback
+        _in_snapshot = !_database.commit() && !_database.rollback();
+    }
+    return !_in_snapshot;
+}
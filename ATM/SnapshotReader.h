@@ -0,0 +1,76 @@
+#ifndef SNAPSHOTREADER_H
+#define SNAPSHOTREADER_H
+
+#include <QString>
+#include <QSqlDatabase>
+#include <QElapsedTimer>
+
+// Read-only connection for balance and ledger reads, kept apart from the
+// connection that moves funds.
+//
+// With the bank DB in WAL mode, reads are served from a snapshot: a read
+// transaction that never waits for writers and never makes them wait.
+// Staleness is bounded:
+// - a snapshot is never older than the maximum staleness;
+// - a snapshot never predates the ATM's own last committed write (see invalidate());
+// - a snapshot does not outlive the card session (see release()), so
+//   checkpoints are never held back by an idle ATM.
+// With a rollback journal there are no snapshots to keep: every read sees
+// the latest committed data. A BankSchema migration puts the DB in WAL mode.
+//
+// Connections are bound to the thread that opened them: every ATM reads
+// through a reader of its own.
+class SnapshotReader
+{
+public:
+    static const qint64 DEFAULT_MAX_STALENESS_MS;   // 1000
+
+    // Applied by BankSchema migrations, outside of a transaction
+    static const char* const ENABLE_WAL;
+
+    explicit SnapshotReader(const QString& connectionName);
+    ~SnapshotReader();
+
+    bool open(const QString& databaseDriver, const QString& databaseName);
+    void close();
+    // Journal mode is read at open(); read it again once migrations are done
+    void detectJournalMode();
+    inline bool isOpen() const
+    {
+        return _database.isOpen();
+    }
+
+    void setMaxStaleness(qint64 ms);
+
+    // Make sure reads see a snapshot that meets the bounds above
+    bool acquire();
+    // Own write was committed: the next acquire() takes a new snapshot
+    inline void invalidate()
+    {
+        _invalidated = true;
+    }
+    // End of session: let the snapshot go. False if it could not be:
+    // acquire() fails until it is.
+    bool release();
+
+    inline QSqlDatabase& database()
+    {
+        return _database;
+    }
+    // False with a rollback journal
+    inline bool keepsSnapshots() const
+    {
+        return _keeps_snapshots;
+    }
+
+private:
+    const QString _connection_name;
+    QSqlDatabase _database;
+    bool _keeps_snapshots;
+    bool _in_snapshot;
+    bool _invalidated;
+    qint64 _max_staleness_ms;
+    QElapsedTimer _snapshot_age;
+};
+
+#endif // SNAPSHOTREADER_H
@@ -0,0 +1,145 @@
+#include "StartupPipeline.h"
+#include "ThreadConnection.h"
+
+#include <QElapsedTimer>
+#include <QThread>
+#include <QtSql>
+#include <cassert>
+
+// Lane running on a thread of its own
+class StartupPipeline::Worker : public QThread
+{
+public:
+    Worker(StartupPipeline& pipeline, int lane, const QElapsedTimer& clock):
+        _pipeline(pipeline),
+        _lane(lane),
+        _clock(clock)
+    {}
+
+protected:
+    void run()
+    {
+        _pipeline.waitForLane(_pipeline._lanes[_lane]._after);
+        if(_pipeline._lanes[_lane]._with_database)
+        {
+            ThreadConnection connection(QString("startup_%1").arg(_lane), this,
+                                        _pipeline._database_driver, _pipeline._database_name);
+            // Failure shows up in the phases' own results
+            connection.database().open();
+            _pipeline.runLane(_lane, connection.database(), _clock.nsecsElapsed());
+        }
+        else
+        {
+            QSqlDatabase database;
+            _pipeline.runLane(_lane, database, _clock.nsecsElapsed());
+        }
+        _pipeline.laneDone(_lane);
+    }
+
+private:
+    StartupPipeline& _pipeline;
+    const int _lane;
+    const QElapsedTimer& _clock;
+};
+
+StartupPipeline::StartupPipeline(const QString& databaseDriver, const QString& databaseName):
+    _database_driver(databaseDriver),
+    _database_name(databaseName),
+    _lanes(1),
+    _elapsed_us(0)
+{
+    _lanes[CALLER_LANE]._with_database = true;
+    _lanes[CALLER_LANE]._after = -1;
+    _lanes[CALLER_LANE]._done = false;
+}
+
+int StartupPipeline::addLane(bool withDatabase, int after)
+{
+    assert(after < static_cast<int>(_lanes.size()) && "FATAL: No such startup lane!!!");
+    Lane lane;
+    lane._with_database = withDatabase;
+    lane._after = after;
+    lane._done = false;
+    _lanes.push_back(lane);
+    return static_cast<int>(_lanes.size() - 1);
+}
+
+void StartupPipeline::addPhase(int lane, int phase, const Phase& run)
+{
+    assert(lane >= 0 && lane < static_cast<int>(_lanes.size()) && "FATAL: No such startup lane!!!");
+    Timing timing;
+    timing._phase = phase;
+    timing._lane = lane;
+    timing._started_us = 0;
+    timing._elapsed_us = 0;
+    timing._succeeded = false;
+    _lanes[lane]._phases.push_back(_phases.size());
+    _phases.push_back(run);
+    _timings.push_back(timing);
+}
+
+void StartupPipeline::runLane(int lane, QSqlDatabase& database, qint64 startedNs)
+{
+    QElapsedTimer timer;
+    timer.start();
+    const std::vector<size_t>& phases = _lanes[lane]._phases;
+    for(size_t i = 0; i < phases.size(); ++i)
+    {
+        Timing& timing = _timings[phases[i]];
+        timing._started_us = (startedNs + timer.nsecsElapsed()) / 1000;
+        const qint64 before = timer.nsecsElapsed();
+        timing._succeeded = _phases[phases[i]](database);
+        timing._elapsed_us = (timer.nsecsElapsed() - before) / 1000;
+    }
+}
+
+void StartupPipeline::waitForLane(int lane)
+{
+    if(lane < 0)
+    {
+        return;
+    }
+    QMutexLocker locker(&_lanes_lock);
+    while(!_lanes[lane]._done)
+    {
+        _lane_done.wait(&_lanes_lock);
+    }
+}
+
+void StartupPipeline::laneDone(int lane)
+{
+    QMutexLocker locker(&_lanes_lock);
+    _lanes[lane]._done = true;
+    _lane_done.wakeAll();
+}
+
+bool StartupPipeline::run(QSqlDatabase& callerDatabase)
+{
+    QElapsedTimer clock;
+    clock.start();
+    for(size_t lane = 0; lane < _lanes.size(); ++lane)
+    {
+        _lanes[lane]._done = false;
+    }
+    std::vector<Worker*> workers;
+    for(size_t lane = CALLER_LANE + 1; lane < _lanes.size(); ++lane)
+    {
+        workers.push_back(new Worker(*this, static_cast<int>(lane), clock));
+        workers.back()->start();
+    }
+    runLane(CALLER_LANE, callerDatabase, clock.nsecsElapsed());
+    laneDone(CALLER_LANE);
+    for(size_t i = 0; i < workers.size(); ++i)
+    {
+        workers[i]->wait();
+        delete workers[i];
+    }
+    _elapsed_us = clock.nsecsElapsed() / 1000;
+
+    bool succeeded = true;
+    for(size_t i = 0; i < _timings.size(); ++i)
+    {
+        succeeded = succeeded && _timings[i]._succeeded;
+    }
+    return succeeded;
+}
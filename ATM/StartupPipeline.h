@@ -0,0 +1,79 @@
+#ifndef STARTUPPIPELINE_H
+#define STARTUPPIPELINE_H
+
+#include <QString>
+#include <QSqlDatabase>
+#include <QMutex>
+#include <QWaitCondition>
+#include <functional>
+#include <vector>
+
+// Runs startup phases on parallel lanes and times every phase.
+//
+// Phases of one lane run one after another in the order they were added,
+// lanes run side by side unless a lane was told to wait for another. Lane 0 runs on the calling thread and uses the
+// caller's DB connection; other lanes get threads of their own and, if asked
+// for, a connection opened on that thread (connections must not change threads).
+class StartupPipeline
+{
+public:
+    // Connection of the lane, or an invalid one for lanes without DB
+    typedef std::function<bool(QSqlDatabase& database)> Phase;
+
+    enum { CALLER_LANE = 0 };
+
+    struct Timing
+    {
+        int _phase;             // Caller's phase id
+        int _lane;
+        qint64 _started_us;     // Since the pipeline started
+        qint64 _elapsed_us;
+        bool _succeeded;
+    };
+
+    StartupPipeline(const QString& databaseDriver, const QString& databaseName);
+
+    // New worker lane; returns its number. With 'after', its phases start
+    // once every phase of that lane is done.
+    int addLane(bool withDatabase, int after = -1);
+    void addPhase(int lane, int phase, const Phase& run);
+
+    // Returns when every lane is done; false if any phase failed
+    bool run(QSqlDatabase& callerDatabase);
+
+    // In the order phases were added
+    inline const std::vector<Timing>& timings() const
+    {
+        return _timings;
+    }
+    inline qint64 elapsedUs() const
+    {
+        return _elapsed_us;
+    }
+
+private:
+    class Worker;
+
+    struct Lane
+    {
+        bool _with_database;
+        int _after;                     // Lane to wait for, or -1
+        bool _done;                     // Guarded by _lanes_lock
+        std::vector<size_t> _phases;    // Indexes into _phases and _timings
+    };
+
+    void runLane(int lane, QSqlDatabase& database, qint64 startedNs);
+    void waitForLane(int lane);
+    void laneDone(int lane);
+
+    const QString _database_driver;
+    const QString _database_name;
+    std::vector<Lane> _lanes;
+    std::vector<Phase> _phases;
+    std::vector<Timing> _timings;       // Each written by its own lane only
+    QMutex _lanes_lock;
+    QWaitCondition _lane_done;
+    qint64 _elapsed_us;
+};
+
+#endif // STARTUPPIPELINE_H
@@ -0,0 +1,17 @@
+#include "ThreadConnection.h"
+
+ThreadConnection::ThreadConnection(const QString& purpose, const void* owner,
+                                   const QString& databaseDriver, const QString& databaseName):
+    _connection_name(QString("%1_%2").arg(purpose, QString::number(reinterpret_cast<quintptr>(owner)))),
+    _database(QSqlDatabase::addDatabase(databaseDriver, _connection_name))
+{
+    _database.setDatabaseName(databaseName);
+}
+
+ThreadConnection::~ThreadConnection()
+{
+    _database.close();
+    // removeDatabase() warns about, and breaks, handles still in use
+    _database = QSqlDatabase();
+    QSqlDatabase::removeDatabase(_connection_name);
+}
@@ -0,0 +1,34 @@
+#ifndef THREADCONNECTION_H
+#define THREADCONNECTION_H
+
+#include <QString>
+#include <QSqlDatabase>
+
+// Bank DB connection of one thread, for as long as the object lives.
+//
+// Connections may only be used from the thread that created them, and two
+// connections may not share a name: background threads make one of their
+// own, named after what it is for and who owns it. It is added on
+// construction but not opened, so connect options can still be set; it is
+// closed and removed on destruction, after every query on it is gone.
+class ThreadConnection
+{
+public:
+    ThreadConnection(const QString& purpose, const void* owner,
+                     const QString& databaseDriver, const QString& databaseName);
+    ~ThreadConnection();
+
+    inline QSqlDatabase& database()
+    {
+        return _database;
+    }
+
+private:
+    ThreadConnection(const ThreadConnection&);
+    ThreadConnection& operator=(const ThreadConnection&);
+
+    const QString _connection_name;
+    QSqlDatabase _database;
+};
+
+#endif // THREADCONNECTION_H
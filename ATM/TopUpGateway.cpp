@@ -0,0 +1,395 @@
+#include "TopUpGateway.h"
+#include "CardHistory.h"
+#include "ThreadConnection.h"
+
+#include <QtSql>
+#include <QDateTime>
+#include <QUuid>
+#include <cassert>
+#include <climits>
+
+const char* const TopUpGateway::CREATE_TABLE =
+    "CREATE TABLE IF NOT EXISTS mobile_topups (idempotency_key CHAR(38) PRIMARY KEY NOT NULL, "
+    "card_number CHAR(19) NOT NULL, phone_number VARCHAR(19) NOT NULL, amount REAL NOT NULL, "
+    "deadline INTEGER NOT NULL, status INTEGER NOT NULL DEFAULT 0)";
+const char* const TopUpGateway::QUEUE_TOPUP =
+    "INSERT INTO mobile_topups (idempotency_key, card_number, phone_number, amount, deadline, atm_id) "
+    "VALUES (?, ?, ?, ?, ?, ?)";
+const char* const TopUpGateway::ADD_ATM_COLUMN =
+    "ALTER TABLE mobile_topups ADD COLUMN atm_id INTEGER NOT NULL DEFAULT 0";
+// Top-ups queued before terminals were recorded (atm id 0) are resumed by every terminal:
+// only one of them gets to change the status, and only that one credits a refund
+const char* const TopUpGateway::SELECT_PENDING =
+    "SELECT idempotency_key, card_number, phone_number, amount, deadline FROM mobile_topups "
+    "WHERE status = 0 AND atm_id IN (?, 0)";
+const char* const TopUpGateway::MARK_TOPUP =
+    "UPDATE mobile_topups SET status = ? WHERE idempotency_key = ? AND status = 0";
+const char* const TopUpGateway::REFUND_CARD = "UPDATE cards SET balance = balance + ? WHERE card_number = ?";
+
+// Background sender: owns the operator round trips and the refunds
+//==========
+
+class TopUpGateway::Sender : public QThread
+{
+public:
+    explicit Sender(TopUpGateway& gateway):
+        _gateway(gateway)
+    {}
+
+protected:
+    void run();
+
+private:
+    // Take due top-ups out of the queue; waits until there are some. False when stopping.
+    bool takeBatch(QVector<Pending>& batch);
+    // Commit refund of a refused top-up. False if DB failed to.
+    // 'credited' is false if the top-up was settled already, by another sender.
+    bool refund(QSqlDatabase& database, const Request& request, bool& credited);
+    void markAccepted(QSqlDatabase& database, const Request& request);
+
+    TopUpGateway& _gateway;
+};
+
+bool TopUpGateway::Sender::takeBatch(QVector<Pending>& batch)
+{
+    QMutexLocker locker(&_gateway._pending_lock);
+    for(;;)
+    {
+        if(_gateway._stopping)
+        {
+            return false;
+        }
+        const qint64 now = QDateTime::currentMSecsSinceEpoch();
+        qint64 nextDue = LLONG_MAX;
+        int due = 0;
+        for(int i = 0; i < _gateway._pending.size(); ++i)
+        {
+            nextDue = qMin(nextDue, _gateway._pending[i]._next_attempt_ms);
+            due += (_gateway._pending[i]._next_attempt_ms <= now) ? 1 : 0;
+        }
+        if(due == 0)
+        {
+            const unsigned long wait = (nextDue == LLONG_MAX) ? ULONG_MAX : static_cast<unsigned long>(nextDue - now);
+            _gateway._pending_changed.wait(&_gateway._pending_lock, wait);
+            continue;
+        }
+        if(due < BATCH_SIZE)
+        {
+            // Give customers at neighbouring moments a chance to share the round trip
+            _gateway._pending_changed.wait(&_gateway._pending_lock, LINGER_MS);
+        }
+        break;
+    }
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QVector<Pending> rest;
+    for(int i = 0; i < _gateway._pending.size(); ++i)
+    {
+        const Pending& pending = _gateway._pending[i];
+        if(pending._next_attempt_ms <= now && batch.size() < BATCH_SIZE)
+        {
+            batch.append(pending);
+        }
+        else
+        {
+            rest.append(pending);
+        }
+    }
+    _gateway._pending.swap(rest);
+    return true;
+}
+
+bool TopUpGateway::Sender::refund(QSqlDatabase& database, const Request& request, bool& credited)
+{
+    credited = false;
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+    // Status change, credit and history entry go together or not at all
+    if(!database.transaction())
+    {
+        return false;
+    }
+    QSqlQuery mark(database);
+    mark.prepare(MARK_TOPUP);
+    mark.bindValue(0, static_cast<int>(STATUS_REFUNDED));
+    mark.bindValue(1, request._key);
+    if(!mark.exec())
+    {
+        database.rollback();
+        return false;
+    }
+    // The status changes once: whoever changed it first has settled the top-up
+    if(mark.numRowsAffected() != 1)
+    {
+        database.rollback();
+        return true;
+    }
+    QSqlQuery credit(database);
+    credit.prepare(REFUND_CARD);
+    credit.bindValue(0, request._amount);
+    credit.bindValue(1, request._card_number);
+    QSqlQuery history(database);
+    history.prepare(CardHistory::RECORD_ENTRY);
+    history.bindValue(0, now);
+    history.bindValue(1, static_cast<int>(CardHistory::ENTRY_MOBILE_REFUND));
+    history.bindValue(2, request._amount);
+    history.bindValue(3, request._phone_number);
+    history.bindValue(4, request._card_number);
+    const bool done = credit.exec() && credit.numRowsAffected() == 1 &&
+                      history.exec() && database.commit();
+    if(!done)
+    {
+        database.rollback();
+    }
+    credited = done;
+    return done;
+}
+
+void TopUpGateway::Sender::markAccepted(QSqlDatabase& database, const Request& request)
+{
+    QSqlQuery mark(database);
+    mark.prepare(MARK_TOPUP);
+    mark.bindValue(0, static_cast<int>(STATUS_ACCEPTED));
+    mark.bindValue(1, request._key);
+    // If this fails, the top-up is sent again after restart; its key gets it accepted again.
+    // A top-up already refunded stays refunded: the status only leaves pending once.
+    mark.exec();
+}
+
+void TopUpGateway::Sender::run()
+{
+    ThreadConnection connection("topup_sender", this, _gateway._database_driver, _gateway._database_name);
+    QSqlDatabase& database = connection.database();
+    database.open();
+
+    QVector<Pending> batch;
+    QVector<Request> requests;
+    QVector<Outcome> outcomes;
+    while(takeBatch(batch))
+    {
+        requests.clear();
+        for(int i = 0; i < batch.size(); ++i)
+        {
+            if(!batch[i]._refund_due)
+            {
+                requests.append(batch[i]._request);
+            }
+        }
+        outcomes.fill(OUTCOME_NO_ANSWER, requests.size());
+        if(!requests.isEmpty())
+        {
+            _gateway.transport()->send(requests, outcomes, TIMEOUT_MS);
+        }
+
+        QVector<Pending> retry;
+        QVector<Refund> refunds;
+        for(int i = 0, sent = 0; i < batch.size(); ++i)
+        {
+            Pending& pending = batch[i];
+            if(!pending._refund_due)
+            {
+                const Outcome outcome = outcomes[sent++];
+                if(outcome == OUTCOME_ACCEPTED)
+                {
+                    markAccepted(database, pending._request);
+                    continue;
+                }
+                pending._refund_due = (outcome == OUTCOME_REJECTED);
+            }
+            bool credited = false;
+            if(pending._refund_due && refund(database, pending._request, credited))
+            {
+                if(credited)
+                {
+                    Refund done = {pending._request._card_number, pending._request._amount};
+                    refunds.append(done);
+                }
+                continue;
+            }
+            pending._next_attempt_ms = QDateTime::currentMSecsSinceEpoch() + retryDelay(++pending._attempts);
+            retry.append(pending);
+        }
+        batch.clear();
+
+        QMutexLocker locker(&_gateway._pending_lock);
+        _gateway._pending += retry;
+        if(!refunds.isEmpty())
+        {
+            _gateway._refunds += refunds;
+            _gateway._refund_count.store(_gateway._refunds.size(), std::memory_order_release);
+        }
+    }
+}
+
+// Operator stub
+//==========
+
+const double TopUpGateway::StubTransport::MAX_AMOUNT = 5000;
+
+TopUpGateway::StubTransport::StubTransport():
+    _latency_ms(0)
+{}
+
+void TopUpGateway::StubTransport::setLatency(unsigned long latencyMs)
+{
+    _latency_ms = latencyMs;
+}
+
+void TopUpGateway::StubTransport::send(const QVector<Request>& batch, QVector<Outcome>& outcomes, int timeoutMs)
+{
+    if(_latency_ms > static_cast<unsigned long>(timeoutMs))
+    {
+        // Nothing comes back in time; the operator still applies what it got
+        QThread::msleep(timeoutMs);
+    }
+    else
+    {
+        QThread::msleep(_latency_ms);
+    }
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+    for(int i = 0; i < batch.size(); ++i)
+    {
+        const Request& request = batch[i];
+        QHash<QString, Outcome>::const_iterator known = _answers.constFind(request._key);
+        Outcome answer;
+        if(known != _answers.constEnd())
+        {
+            // Same key, same answer: nothing is applied twice
+            answer = known.value();
+        }
+        else
+        {
+            const QString& phone = request._phone_number;
+            bool digits = (phone.size() >= 10 && phone.size() <= 12);
+            for(int c = 0; digits && c < phone.size(); ++c)
+            {
+                digits = phone.at(c).isDigit();
+            }
+            const bool valid = digits && request._amount > 0 && request._amount <= MAX_AMOUNT;
+            answer = (valid && now <= request._deadline) ? OUTCOME_ACCEPTED : OUTCOME_REJECTED;
+            _answers.insert(request._key, answer);
+        }
+        if(_latency_ms <= static_cast<unsigned long>(timeoutMs))
+        {
+            outcomes[i] = answer;
+        }
+    }
+}
+
+// Gateway
+//==========
+
+TopUpGateway::TopUpGateway():
+    _transport(NULL),
+    _stub(new StubTransport()),
+    _refund_count(0),
+    _stopping(false),
+    _sender(NULL)
+{}
+
+TopUpGateway::~TopUpGateway()
+{
+    stop();
+    delete _stub;
+}
+
+void TopUpGateway::setTransport(ITransport* transport)
+{
+    assert(!_sender && "FATAL: Top-up transport changed while sending!!!");
+    _transport = transport;
+}
+
+TopUpGateway::ITransport* TopUpGateway::transport()
+{
+    return _transport ? _transport : _stub;
+}
+
+qint64 TopUpGateway::retryDelay(int attempts)
+{
+    return qMin<qint64>(static_cast<qint64>(RETRY_BASE_MS) << qMin(attempts - 1, 16), RETRY_CAP_MS);
+}
+
+void TopUpGateway::start(const QString& databaseDriver, const QString& databaseName, quint16 atmId)
+{
+    stop();
+    _database_driver = databaseDriver;
+    _database_name = databaseName;
+    _pending.clear();
+
+    {
+        ThreadConnection connection("topup_loader", this, _database_driver, _database_name);
+        QSqlDatabase& database = connection.database();
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            query.prepare(SELECT_PENDING);
+            query.bindValue(0, atmId);
+            if(query.exec())
+            {
+                while(query.next())
+                {
+                    Pending pending;
+                    pending._request._key = query.value(0).toString();
+                    pending._request._card_number = query.value(1).toString();
+                    pending._request._phone_number = query.value(2).toString();
+                    pending._request._amount = query.value(3).toDouble();
+                    pending._request._deadline = query.value(4).toLongLong();
+                    pending._attempts = 0;
+                    pending._next_attempt_ms = 0;
+                    pending._refund_due = false;
+                    _pending.append(pending);
+                }
+            }
+        }
+    }
+
+    _stopping = false;
+    _sender = new Sender(*this);
+    _sender->start();
+}
+
+void TopUpGateway::stop()
+{
+    if(!_sender)
+    {
+        return;
+    }
+    _pending_lock.lock();
+    _stopping = true;
+    _pending_changed.wakeAll();
+    _pending_lock.unlock();
+    _sender->wait();
+    delete _sender;
+    _sender = NULL;
+}
+
+TopUpGateway::Request TopUpGateway::makeRequest(const QString& cardNumber, const QString& phoneNumber, double amount, qint64 now)
+{
+    Request request;
+    request._key = QUuid::createUuid().toString();
+    request._card_number = cardNumber;
+    request._phone_number = phoneNumber;
+    request._amount = amount;
+    request._deadline = now + KEY_VALIDITY_S;
+    return request;
+}
+
+void TopUpGateway::submit(const Request& request)
+{
+    Pending pending;
+    pending._request = request;
+    pending._attempts = 0;
+    pending._next_attempt_ms = 0;
+    pending._refund_due = false;
+    QMutexLocker locker(&_pending_lock);
+    _pending.append(pending);
+    _pending_changed.wakeAll();
+}
+
+void TopUpGateway::takeRefunds(QVector<Refund>& refunds)
+{
+    QMutexLocker locker(&_pending_lock);
+    refunds += _refunds;
+    _refunds.clear();
+    _refund_count.store(0, std::memory_order_release);
+}
@@ -0,0 +1,162 @@
+#ifndef TOPUPGATEWAY_H
+#define TOPUPGATEWAY_H
+
+#include <QString>
+#include <QVector>
+#include <QHash>
+#include <QSqlDatabase>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <atomic>
+
+// Mobile top-ups, sent to the operator off the customer's critical path.
+//
+// The ATM debits the card, stores the top-up in the bank DB and queues it here;
+// a background sender delivers queued top-ups in batches and retries those
+// left without answer. Every top-up carries an idempotency key, so resending it
+// never tops up twice. The operator honours a key until its deadline only:
+// a top-up it has not applied by then is refused for good, so every top-up
+// eventually gets a definite answer. Refused top-ups are refunded to the card.
+//
+// Each terminal sends the top-ups it queued. A stored top-up leaves pending once,
+// to accepted or refunded, so a refund is credited once even if two senders race.
+//
+// Refunds are committed by the sender on its own DB connection. The audit trail
+// belongs to the ATM's thread, so the ATM picks refunds up with takeRefunds().
+class TopUpGateway
+{
+public:
+    struct Request
+    {
+        QString _key;           // Idempotency key
+        QString _card_number;
+        QString _phone_number;
+        double _amount;
+        qint64 _deadline;       // Seconds since epoch; operator refuses unknown keys after it
+    };
+
+    enum Outcome
+    {
+        OUTCOME_NO_ANSWER   = 0,    // Timed out or lost, to be sent again
+        OUTCOME_ACCEPTED    = 1,
+        OUTCOME_REJECTED    = 2
+    };
+
+    // Way to reach the operator
+    class ITransport
+    {
+    public:
+        virtual ~ITransport() {}
+
+        // One round trip. 'outcomes' gets an entry per request, left OUTCOME_NO_ANSWER
+        // for requests not answered within the timeout.
+        virtual void send(const QVector<Request>& batch, QVector<Outcome>& outcomes, int timeoutMs) = 0;
+    };
+
+    // Operator simulator: applies each key once and remembers the answer.
+    // Refuses malformed phone numbers, amounts over its limit and expired keys.
+    class StubTransport;
+
+    struct Refund
+    {
+        QString _card_number;
+        double _amount;
+    };
+
+    enum
+    {
+        BATCH_SIZE          = 32,
+        LINGER_MS           = 20,       // Wait for a batch to fill up
+        TIMEOUT_MS          = 5000,     // Per round trip
+        RETRY_BASE_MS       = 500,      // Doubled on every attempt...
+        RETRY_CAP_MS        = 60000,    // ...up to this
+        KEY_VALIDITY_S      = 15 * 60
+    };
+
+    // Status of a stored top-up
+    enum Status
+    {
+        STATUS_PENDING      = 0,
+        STATUS_ACCEPTED     = 1,
+        STATUS_REFUNDED     = 2
+    };
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_TABLE;
+    static const char* const ADD_ATM_COLUMN;
+    // Prepared: key, card number, phone number, amount, deadline, atm id
+    static const char* const QUEUE_TOPUP;
+
+    TopUpGateway();
+    ~TopUpGateway();
+
+    // NULL means the built-in stub. Not owned; only to be changed while stopped.
+    void setTransport(ITransport* transport);
+
+    // Resume top-ups the terminal 'atmId' left pending and start sending in background
+    void start(const QString& databaseDriver, const QString& databaseName, quint16 atmId);
+    // Stop sending; pending top-ups stay in the DB for the next start
+    void stop();
+
+    // New top-up with a fresh key. Store it with QUEUE_TOPUP in the debit's transaction, then submit().
+    static Request makeRequest(const QString& cardNumber, const QString& phoneNumber, double amount, qint64 now);
+    void submit(const Request& request);
+
+    inline bool hasRefunds() const
+    {
+        return _refund_count.load(std::memory_order_acquire) != 0;
+    }
+    // Move refunds committed since the last call to 'refunds'
+    void takeRefunds(QVector<Refund>& refunds);
+
+private:
+    class Sender;
+
+    struct Pending
+    {
+        Request _request;
+        int _attempts;
+        qint64 _next_attempt_ms;    // Not before this (ms since epoch)
+        bool _refund_due;           // Refused, but the refund has not been committed yet
+    };
+
+    static const char* const SELECT_PENDING;
+    static const char* const MARK_TOPUP;
+    static const char* const REFUND_CARD;
+
+    ITransport* transport();
+    static qint64 retryDelay(int attempts);
+
+    ITransport* _transport;
+    StubTransport* _stub;
+
+    // Shared with background sender
+    QMutex _pending_lock;
+    QWaitCondition _pending_changed;
+    QVector<Pending> _pending;
+    QVector<Refund> _refunds;
+    std::atomic<int> _refund_count;
+    bool _stopping;
+    Sender* _sender;
+    QString _database_driver;
+    QString _database_name;
+};
+
+class TopUpGateway::StubTransport : public TopUpGateway::ITransport
+{
+public:
+    StubTransport();
+
+    // Round trip time to simulate
+    void setLatency(unsigned long latencyMs);
+    void send(const QVector<Request>& batch, QVector<Outcome>& outcomes, int timeoutMs);
+
+private:
+    static const double MAX_AMOUNT;
+
+    QHash<QString, Outcome> _answers;   // By idempotency key
+    unsigned long _latency_ms;
+};
+
+#endif // TOPUPGATEWAY_H
@@ -0,0 +1,406 @@
+#include "VelocityLimits.h"
+#include "ThreadConnection.h"
+
+#include <QtSql>
+#include <QtEndian>
+#include <cassert>
+#include <cstring>
+
+const char* const VelocityLimits::CREATE_TABLE =
+    "CREATE TABLE IF NOT EXISTS card_velocity (card_number CHAR(19) PRIMARY KEY NOT NULL, counters BLOB NOT NULL)";
+const char* const VelocityLimits::SELECT_COUNTERS = "SELECT card_number, counters FROM card_velocity";
+const char* const VelocityLimits::SELECT_CARD_COUNTERS = "SELECT counters FROM card_velocity WHERE card_number = ?";
+const char* const VelocityLimits::STORE_COUNTERS = "INSERT OR REPLACE INTO card_velocity (card_number, counters) VALUES (?, ?)";
+const quint8 VelocityLimits::COUNTERS_VERSION = 1;
+
+// Background writer: persists changed counters without blocking the ATM
+//==========
+
+class VelocityLimits::Writer : public QThread
+{
+public:
+    static const unsigned long FLUSH_INTERVAL_MS = 1000;
+
+    explicit Writer(VelocityLimits& limits):
+        _limits(limits)
+    {}
+
+protected:
+    void run();
+
+private:
+    VelocityLimits& _limits;
+};
+
+void VelocityLimits::Writer::run()
+{
+    ThreadConnection connection("velocity_writer", this, _limits._database_driver, _limits._database_name);
+    QSqlDatabase& database = connection.database();
+    const bool connected = database.open();
+    for(;;)
+    {
+        Debits batch;
+        bool stopping;
+        _limits._pending_lock.lock();
+        if(!_limits._stopping && _limits._pending.isEmpty())
+        {
+            _limits._pending_changed.wait(&_limits._pending_lock, FLUSH_INTERVAL_MS);
+        }
+        batch.swap(_limits._pending);
+        _limits._in_flight = batch;
+        stopping = _limits._stopping;
+        _limits._pending_lock.unlock();
+
+        // Rows are read and written back in one transaction: the write lock is taken first,
+        // so that no other terminal's debits land in between
+        bool stored = true;
+        if(!batch.isEmpty())
+        {
+            QSqlQuery transaction(database);
+            QSqlQuery select(database);
+            QSqlQuery store(database);
+            select.setForwardOnly(true);
+            stored = connected && transaction.exec("BEGIN IMMEDIATE") &&
+                     select.prepare(SELECT_CARD_COUNTERS) && store.prepare(STORE_COUNTERS);
+            for(Debits::const_iterator i = batch.constBegin(); stored && i != batch.constEnd(); ++i)
+            {
+                CardCounters card;
+                stored = load(select, i.key(), card);
+                for(int d = 0; stored && d < i.value().size(); ++d)
+                {
+                    add(card, i.value()[d]);
+                }
+                store.bindValue(0, i.key());
+                store.bindValue(1, serialize(card));
+                stored = stored && store.exec();
+            }
+            select.finish();
+            store.finish();
+            if(!stored || !transaction.exec("COMMIT"))
+            {
+                transaction.exec("ROLLBACK");
+                stored = false;
+            }
+        }
+
+        _limits._pending_lock.lock();
+        _limits._in_flight.clear();
+        if(!stored)
+        {
+            // Counters are still enforced from memory; debits are added on the next round,
+            // ahead of those made since
+            for(Debits::iterator i = batch.begin(); i != batch.end(); ++i)
+            {
+                i.value() += _limits._pending.value(i.key());
+            }
+            for(Debits::const_iterator i = _limits._pending.constBegin(); i != _limits._pending.constEnd(); ++i)
+            {
+                if(!batch.contains(i.key()))
+                {
+                    batch.insert(i.key(), i.value());
+                }
+            }
+            _limits._pending.swap(batch);
+        }
+        _limits._pending_lock.unlock();
+        if(!stored)
+        {
+            _limits._failed_writes.fetch_add(batch.size(), std::memory_order_relaxed);
+        }
+        if(stopping)
+        {
+            break;
+        }
+    }
+}
+
+// Bucket rings
+//==========
+
+template<int BUCKETS, int SPAN>
+void VelocityLimits::BucketRing<BUCKETS, SPAN>::clear()
+{
+    memset(this, 0, sizeof(*this));
+}
+
+template<int BUCKETS, int SPAN>
+void VelocityLimits::BucketRing<BUCKETS, SPAN>::advance(qint64 now)
+{
+    const qint64 slot = now / SPAN;
+    if(slot <= _head)
+    {
+        return;
+    }
+    if(slot - _head >= BUCKETS)
+    {
+        // Whole window has expired
+        clear();
+    }
+    else
+    {
+        for(qint64 s = _head + 1; s <= slot; ++s)
+        {
+            const int index = static_cast<int>(s % BUCKETS);
+            _total_count -= _count[index];
+            _total_amount -= _amount[index];
+            _count[index] = 0;
+            _amount[index] = 0;
+        }
+    }
+    _head = slot;
+}
+
+template<int BUCKETS, int SPAN>
+void VelocityLimits::BucketRing<BUCKETS, SPAN>::store(uchar* data) const
+{
+    qToLittleEndian(_head, data);
+    data += 8;
+    for(int i = 0; i < BUCKETS; ++i)
+    {
+        quint64 amount;
+        memcpy(&amount, &_amount[i], sizeof(amount));
+        qToLittleEndian(_count[i], data);
+        qToLittleEndian(amount, data + 4);
+        data += 4 + 8;
+    }
+}
+
+template<int BUCKETS, int SPAN>
+void VelocityLimits::BucketRing<BUCKETS, SPAN>::restore(const uchar* data)
+{
+    clear();
+    _head = qFromLittleEndian<qint64>(data);
+    data += 8;
+    for(int i = 0; i < BUCKETS; ++i)
+    {
+        const quint64 amount = qFromLittleEndian<quint64>(data + 4);
+        _count[i] = qFromLittleEndian<quint32>(data);
+        memcpy(&_amount[i], &amount, sizeof(amount));
+        _total_count += _count[i];
+        _total_amount += _amount[i];
+        data += 4 + 8;
+    }
+}
+
+template<int BUCKETS, int SPAN>
+void VelocityLimits::BucketRing<BUCKETS, SPAN>::add(double amount)
+{
+    const int index = static_cast<int>(_head % BUCKETS);
+    ++_count[index];
+    _amount[index] += amount;
+    ++_total_count;
+    _total_amount += amount;
+}
+
+// Stored counters
+//==========
+
+QByteArray VelocityLimits::serialize(const CardCounters& card)
+{
+    QByteArray blob(1 + card._hour.STORED_SIZE + card._day.STORED_SIZE + card._month.STORED_SIZE, '\0');
+    uchar* data = reinterpret_cast<uchar*>(blob.data());
+    *data++ = COUNTERS_VERSION;
+    card._hour.store(data);
+    data += card._hour.STORED_SIZE;
+    card._day.store(data);
+    data += card._day.STORED_SIZE;
+    card._month.store(data);
+    return blob;
+}
+
+// Counters of another version or size are not trusted: the card starts from zero
+bool VelocityLimits::deserialize(const QByteArray& blob, CardCounters& card)
+{
+    if(blob.size() != 1 + card._hour.STORED_SIZE + card._day.STORED_SIZE + card._month.STORED_SIZE ||
+       static_cast<quint8>(blob[0]) != COUNTERS_VERSION)
+    {
+        return false;
+    }
+    const uchar* data = reinterpret_cast<const uchar*>(blob.constData()) + 1;
+    card._hour.restore(data);
+    data += card._hour.STORED_SIZE;
+    card._day.restore(data);
+    data += card._day.STORED_SIZE;
+    card._month.restore(data);
+    return true;
+}
+
+void VelocityLimits::clear(CardCounters& card)
+{
+    card._hour.clear();
+    card._day.clear();
+    card._month.clear();
+}
+
+void VelocityLimits::add(CardCounters& card, const Debit& debit)
+{
+    card._hour.advance(debit._time);
+    card._day.advance(debit._time);
+    card._month.advance(debit._time);
+    card._hour.add(debit._amount);
+    card._day.add(debit._amount);
+    card._month.add(debit._amount);
+}
+
+// A card without a row, or with one that cannot be trusted, starts from zero
+bool VelocityLimits::load(QSqlQuery& select, const QString& cardNumber, CardCounters& card)
+{
+    select.bindValue(0, cardNumber);
+    if(!select.exec())
+    {
+        return false;
+    }
+    if(!select.next() || !deserialize(select.value(0).toByteArray(), card))
+    {
+        clear(card);
+    }
+    select.finish();
+    return true;
+}
+
+// Limits engine
+//==========
+
+VelocityLimits::VelocityLimits():
+    _stopping(false),
+    _failed_writes(0),
+    _writer(NULL)
+{
+    // Defaults that any bank would want to tune
+    const Limit hour = {5, 5000};
+    const Limit day = {20, 20000};
+    const Limit month = {200, 200000};
+    _limits[WINDOW_HOUR] = hour;
+    _limits[WINDOW_DAY] = day;
+    _limits[WINDOW_MONTH] = month;
+}
+
+VelocityLimits::~VelocityLimits()
+{
+    stop();
+}
+
+void VelocityLimits::setLimit(Window window, const Limit& limit)
+{
+    assert(window < WINDOW_COUNT && "FATAL: Invalid velocity limit window!!!");
+    _limits[window] = limit;
+}
+
+bool VelocityLimits::start(const QString& databaseDriver, const QString& databaseName)
+{
+    stop();
+    _database_driver = databaseDriver;
+    _database_name = databaseName;
+    _cards.clear();
+
+    bool loaded = false;
+    {
+        ThreadConnection connection("velocity_loader", this, _database_driver, _database_name);
+        QSqlDatabase& database = connection.database();
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            loaded = query.exec(SELECT_COUNTERS);
+            while(loaded && query.next())
+            {
+                CardCounters card;
+                if(deserialize(query.value(1).toByteArray(), card))
+                {
+                    _cards.insert(query.value(0).toString(), card);
+                }
+            }
+        }
+    }
+
+    _stopping = false;
+    _writer = new Writer(*this);
+    _writer->start();
+    return loaded;
+}
+
+void VelocityLimits::stop()
+{
+    if(!_writer)
+    {
+        return;
+    }
+    _pending_lock.lock();
+    _stopping = true;
+    _pending_changed.wakeAll();
+    _pending_lock.unlock();
+    _writer->wait();
+    delete _writer;
+    _writer = NULL;
+}
+
+VelocityLimits::CardCounters& VelocityLimits::counters(const QString& cardNumber)
+{
+    QHash<QString, CardCounters>::iterator found = _cards.find(cardNumber);
+    if(found == _cards.end())
+    {
+        CardCounters fresh;
+        clear(fresh);
+        found = _cards.insert(cardNumber, fresh);
+    }
+    return found.value();
+}
+
+bool VelocityLimits::fits(quint32 count, double amount, double newAmount, const Limit& limit)
+{
+    return (count + 1 <= limit._max_count) && (amount + newAmount <= limit._max_amount);
+}
+
+bool VelocityLimits::refresh(QSqlDatabase& database, const QString& cardNumber)
+{
+    // Writer only lets go of its debits under the lock, once they are committed:
+    // whatever the row does not have yet is found in memory, at worst twice
+    QMutexLocker locker(&_pending_lock);
+    QSqlQuery select(database);
+    select.setForwardOnly(true);
+    CardCounters card;
+    if(!select.prepare(SELECT_CARD_COUNTERS) || !load(select, cardNumber, card))
+    {
+        return false;
+    }
+    const QVector<Debit> inFlight = _in_flight.value(cardNumber);
+    const QVector<Debit> pending = _pending.value(cardNumber);
+    for(int d = 0; d < inFlight.size(); ++d)
+    {
+        add(card, inFlight[d]);
+    }
+    for(int d = 0; d < pending.size(); ++d)
+    {
+        add(card, pending[d]);
+    }
+    _cards.insert(cardNumber, card);
+    return true;
+}
+
+bool VelocityLimits::allows(const QString& cardNumber, double amount, qint64 now)
+{
+    CardCounters& card = counters(cardNumber);
+    card._hour.advance(now);
+    card._day.advance(now);
+    card._month.advance(now);
+    return fits(card._hour._total_count, card._hour._total_amount, amount, _limits[WINDOW_HOUR]) &&
+           fits(card._day._total_count, card._day._total_amount, amount, _limits[WINDOW_DAY]) &&
+           fits(card._month._total_count, card._month._total_amount, amount, _limits[WINDOW_MONTH]);
+}
+
+void VelocityLimits::record(const QString& cardNumber, double amount, qint64 now)
+{
+    const Debit debit = {now, amount};
+    add(counters(cardNumber), debit);
+
+    // Writer adds the debit to the card's row, whatever other terminals put there
+    _pending_lock.lock();
+    _pending[cardNumber].append(debit);
+    _pending_changed.wakeOne();
+    _pending_lock.unlock();
+}
+
+int VelocityLimits::takeFailedWrites()
+{
+    return _failed_writes.exchange(0);
+}
@@ -0,0 +1,151 @@
+#ifndef VELOCITYLIMITS_H
+#define VELOCITYLIMITS_H
+
+#include <QString>
+#include <QHash>
+#include <QByteArray>
+#include <QVector>
+#include <QSqlDatabase>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <atomic>
+
+class QSqlQuery;
+
+// Per-card velocity limits: number and sum of debits per hour, day and month.
+//
+// Counters live in memory as fixed-size rings of time buckets, so a check
+// costs the same whatever the card's history is. Every terminal keeps its own
+// copy: the card's row in the DB is what all of them have debited. Debits are
+// added to that row by a background thread, which reads and rewrites it in one
+// transaction; the card's counters are read back from it (see refresh()) before
+// they are checked, so that debits made at other terminals count too. Writes
+// that fail are counted and tried again; the ATM's thread reports them to the
+// audit trail.
+//
+// Stored counters are a version byte followed by every ring, little endian:
+// the newest bucket's slot, then count and amount of each bucket. Totals are
+// summed again when counters are read back.
+class VelocityLimits
+{
+public:
+    enum Window
+    {
+        WINDOW_HOUR     = 0,
+        WINDOW_DAY      = 1,
+        WINDOW_MONTH    = 2,
+        WINDOW_COUNT    = 3
+    };
+
+    struct Limit
+    {
+        quint32 _max_count;     // Debits allowed within the window
+        double _max_amount;     // Total amount allowed within the window
+    };
+
+    VelocityLimits();
+    ~VelocityLimits();
+
+    void setLimit(Window window, const Limit& limit);
+
+    // Read persisted counters and start writing changes back in background.
+    // One DB read at power on is all the limits engine ever costs the ATM.
+    // Returns false if counters could not be read: limits then start from zero.
+    bool start(const QString& databaseDriver, const QString& databaseName);
+    // Flush pending changes and stop background writer
+    void stop();
+
+    // Take the card's counters from the DB, along with this terminal's debits not
+    // stored yet. False if DB failed to tell: counters in memory are kept.
+    bool refresh(QSqlDatabase& database, const QString& cardNumber);
+    // Would a debit of 'amount' at 'now' (seconds since epoch) stay within every limit?
+    bool allows(const QString& cardNumber, double amount, qint64 now);
+    // Account a completed debit
+    void record(const QString& cardNumber, double amount, qint64 now);
+
+    // Counters the writer failed to store since the last call
+    inline bool hasFailedWrites() const
+    {
+        return _failed_writes.load(std::memory_order_relaxed) != 0;
+    }
+    int takeFailedWrites();
+
+    // Applied by BankSchema migrations
+    static const char* const CREATE_TABLE;
+
+private:
+    // Sliding window made of BUCKETS buckets, each SPAN seconds long
+    template<int BUCKETS, int SPAN>
+    struct BucketRing
+    {
+        qint64 _head;               // Index of the newest bucket (time / SPAN)
+        quint32 _count[BUCKETS];
+        double _amount[BUCKETS];
+        quint32 _total_count;       // Sums over all buckets
+        double _total_amount;
+
+        static const int STORED_SIZE = 8 + BUCKETS * (4 + 8);
+
+        void clear();
+        // Stored form, STORED_SIZE bytes
+        void store(uchar* data) const;
+        void restore(const uchar* data);
+        // Move window forward, expiring at most BUCKETS buckets
+        void advance(qint64 now);
+        void add(double amount);
+    };
+
+    // Compact record kept for every card that has been debited
+    struct CardCounters
+    {
+        BucketRing<12, 5 * 60>      _hour;  // 5-minute buckets
+        BucketRing<24, 60 * 60>     _day;   // 1-hour buckets
+        BucketRing<30, 24 * 60 * 60> _month; // 1-day buckets
+    };
+
+    // Debit made at this terminal, waiting to be added to the card's row
+    struct Debit
+    {
+        qint64 _time;
+        double _amount;
+    };
+    typedef QHash<QString, QVector<Debit> > Debits;
+
+    class Writer;
+
+    static const quint8 COUNTERS_VERSION;
+
+    static QByteArray serialize(const CardCounters& card);
+    static bool deserialize(const QByteArray& blob, CardCounters& card);
+    static void clear(CardCounters& card);
+    // A debit older than a ring's newest bucket goes to that bucket: it expires late, never early
+    static void add(CardCounters& card, const Debit& debit);
+    // False if the row could not be read
+    static bool load(QSqlQuery& select, const QString& cardNumber, CardCounters& card);
+
+    static const char* const SELECT_COUNTERS;
+    // Prepared: card number
+    static const char* const SELECT_CARD_COUNTERS;
+    // Prepared: card number, counters
+    static const char* const STORE_COUNTERS;
+
+    CardCounters& counters(const QString& cardNumber);
+    static bool fits(quint32 count, double amount, double newAmount, const Limit& limit);
+
+    Limit _limits[WINDOW_COUNT];
+    QHash<QString, CardCounters> _cards;
+
+    // Shared with background writer
+    QMutex _pending_lock;
+    QWaitCondition _pending_changed;
+    Debits _pending;                        // Not handed to the writer yet
+    Debits _in_flight;                      // Being added by the writer
+    bool _stopping;
+    std::atomic<int> _failed_writes;
+    Writer* _writer;
+    QString _database_driver;
+    QString _database_name;
+};
+
+#endif // VELOCITYLIMITS_H
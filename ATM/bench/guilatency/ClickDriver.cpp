@@ -0,0 +1,167 @@
+#include "ClickDriver.h"
+#include "mainwindow.h"
+
+#include <QAbstractButton>
+#include <QApplication>
+#include <QLineEdit>
+#include <QMouseEvent>
+#include <QTextBrowser>
+
+const char* const ClickDriver::STEP_NAMES[STEP_COUNT] = {"card", "pin-digit", "pin-enter", "menu", "eject"};
+
+ClickDriver::ClickDriver(MainWindow& window, const QString& cardNumber, const QString& pin):
+    _window(window),
+    _text(window.findChild<QTextBrowser*>("textBrowser")),
+    _input(window.findChild<QLineEdit*>("inputField")),
+    _ready(true),
+    _next(0),
+    _warmup_left(0),
+    _sessions_left(0),
+    _min_gap_ns(0),
+    _click_ns(0),
+    _first_click_ns(-1),
+    _text_pending(false),
+    _frame_pending(false)
+{
+    _samples._stalls = 0;
+    _samples._elapsed_ns = 0;
+
+    // Card, PIN, balance on screen, back to the menu, card out
+    Action card = {button("enterBtn"), STEP_CARD, cardNumber};
+    _script.append(card);
+    for(int i = 0; i < pin.size(); ++i)
+    {
+        Action digit = {button(QString("pushButton_%1").arg(pin.at(i)).toLatin1().constData()), STEP_PIN_DIGIT, QString()};
+        _script.append(digit);
+    }
+    Action enter = {button("enterBtn"), STEP_PIN_ENTER, QString()};
+    Action balance = {button("pushButton_1"), STEP_MENU, QString()};
+    Action display = {button("pushButton_1"), STEP_MENU, QString()};
+    Action back = {button("pushButton_0"), STEP_MENU, QString()};
+    Action eject = {button("pushButton_0"), STEP_EJECT, QString()};
+    _script << enter << balance << display << back << eject;
+
+    _ready = _ready && _text && _input;
+    if(!_ready)
+    {
+        return;
+    }
+    QObject::connect(_text, SIGNAL(textChanged()), this, SLOT(onTextChanged()));
+    _text->viewport()->installEventFilter(this);
+    _watchdog.setSingleShot(true);
+    QObject::connect(&_watchdog, SIGNAL(timeout()), this, SLOT(onStalled()));
+}
+
+QAbstractButton* ClickDriver::button(const char* name)
+{
+    QAbstractButton* found = _window.findChild<QAbstractButton*>(name);
+    _ready = _ready && found;
+    return found;
+}
+
+void ClickDriver::start(int warmup, int sessions, int rate)
+{
+    _warmup_left = warmup;
+    _sessions_left = sessions;
+    _min_gap_ns = (rate > 0) ? Q_INT64_C(1000000000) / rate : 0;
+    _next = 0;
+    _clock.start();
+    QTimer::singleShot(0, this, SLOT(click()));
+}
+
+void ClickDriver::click()
+{
+    if(_next == _script.size())
+    {
+        _next = 0;
+        if(_warmup_left > 0)
+        {
+            --_warmup_left;
+        }
+        else if(--_sessions_left == 0)
+        {
+            QApplication::quit();
+            return;
+        }
+    }
+    const Action& action = _script[_next];
+    if(!action._typed.isEmpty())
+    {
+        // Operator's typing is not what is measured
+        _input->setText(action._typed);
+    }
+    _text_pending = true;
+    _frame_pending = true;
+    _click_ns = _clock.nsecsElapsed();
+    if(measuring() && _first_click_ns < 0)
+    {
+        _first_click_ns = _click_ns;
+    }
+    // Press and release go through the event queue, like those of a real click
+    const QPoint center = action._button->rect().center();
+    QApplication::postEvent(action._button, new QMouseEvent(QEvent::MouseButtonPress, center,
+                                                           Qt::LeftButton, Qt::LeftButton, Qt::NoModifier));
+    QApplication::postEvent(action._button, new QMouseEvent(QEvent::MouseButtonRelease, center,
+                                                           Qt::LeftButton, Qt::NoButton, Qt::NoModifier));
+    _watchdog.start(STALL_MS);
+}
+
+void ClickDriver::onTextChanged()
+{
+    if(!_text_pending)
+    {
+        return;
+    }
+    _text_pending = false;
+    if(measuring())
+    {
+        _samples._to_text[_script[_next]._step].push_back(_clock.nsecsElapsed() - _click_ns);
+    }
+}
+
+bool ClickDriver::eventFilter(QObject* watched, QEvent* event)
+{
+    if(event->type() != QEvent::Paint)
+    {
+        return QObject::eventFilter(watched, event);
+    }
+    // Paint here rather than after the filter, so that the paint itself is timed
+    const qint64 start = _clock.nsecsElapsed();
+    watched->event(event);
+    const qint64 end = _clock.nsecsElapsed();
+    if(measuring())
+    {
+        _samples._paint.push_back(end - start);
+    }
+    if(_frame_pending && !_text_pending)
+    {
+        _frame_pending = false;
+        if(measuring())
+        {
+            _samples._to_frame[_script[_next]._step].push_back(end - _click_ns);
+            _samples._elapsed_ns = end - _first_click_ns;
+        }
+        advance();
+    }
+    return true;
+}
+
+void ClickDriver::onStalled()
+{
+    if(measuring())
+    {
+        ++_samples._stalls;
+    }
+    _text_pending = false;
+    _frame_pending = false;
+    advance();
+}
+
+void ClickDriver::advance()
+{
+    _watchdog.stop();
+    ++_next;
+    // Even unpaced, the next click goes through the event loop, after what is queued now
+    const qint64 due = _click_ns + _min_gap_ns - _clock.nsecsElapsed();
+    QTimer::singleShot(static_cast<int>(qMax(Q_INT64_C(0), due) / 1000000), this, SLOT(click()));
+}
@@ -0,0 +1,109 @@
+#ifndef CLICKDRIVER_H
+#define CLICKDRIVER_H
+
+#include <QObject>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <vector>
+
+class QAbstractButton;
+class QLineEdit;
+class QTextBrowser;
+class MainWindow;
+
+// Clicks through scripted customer sessions in MainWindow, one click at a time,
+// and times each of them until its result is on screen.
+class ClickDriver : public QObject
+{
+    Q_OBJECT
+
+public:
+    // What a click is counted as
+    enum Step
+    {
+        STEP_CARD       = 0,    // Enter with the card number typed in
+        STEP_PIN_DIGIT  = 1,
+        STEP_PIN_ENTER  = 2,
+        STEP_MENU       = 3,
+        STEP_EJECT      = 4,
+        STEP_COUNT      = 5
+    };
+    static const char* const STEP_NAMES[STEP_COUNT];
+
+    enum
+    {
+        STALL_MS    = 1000      // Click that has not shown anything by then is given up on
+    };
+
+    // Nanoseconds, one entry per click (or per repaint)
+    struct Samples
+    {
+        std::vector<qint64> _to_text[STEP_COUNT];   // Click to textBrowser changed
+        std::vector<qint64> _to_frame[STEP_COUNT];  // Click to textBrowser repainted with it
+        std::vector<qint64> _paint;                 // textBrowser repaints
+        int _stalls;                                // Clicks given up on
+        qint64 _elapsed_ns;                         // Measured sessions, first click to last frame
+    };
+
+    // Window is expected powered on and waiting for a card
+    ClickDriver(MainWindow& window, const QString& cardNumber, const QString& pin);
+
+    // False if the window lacks any control the script needs
+    inline bool isReady() const
+    {
+        return _ready;
+    }
+    // Run 'warmup' sessions, then 'sessions' measured ones, at most 'rate' clicks per second
+    // (0: as fast as frames come). Quits the event loop when done.
+    void start(int warmup, int sessions, int rate);
+
+    inline const Samples& samples() const
+    {
+        return _samples;
+    }
+
+protected:
+    bool eventFilter(QObject* watched, QEvent* event);
+
+private slots:
+    void click();
+    void onTextChanged();
+    void onStalled();
+
+private:
+    struct Action
+    {
+        QAbstractButton* _button;
+        Step _step;
+        QString _typed;     // Put into the input field first, if any
+    };
+
+    QAbstractButton* button(const char* name);
+    // Previous click is on screen or given up on
+    void advance();
+    inline bool measuring() const
+    {
+        return _warmup_left == 0;
+    }
+
+    MainWindow& _window;
+    QTextBrowser* _text;
+    QLineEdit* _input;
+    QVector<Action> _script;    // One session
+    bool _ready;
+
+    int _next;
+    int _warmup_left;
+    int _sessions_left;
+    qint64 _min_gap_ns;
+    QElapsedTimer _clock;
+    qint64 _click_ns;
+    qint64 _first_click_ns;
+    bool _text_pending;
+    bool _frame_pending;
+    QTimer _watchdog;
+    Samples _samples;
+};
+
+#endif // CLICKDRIVER_H
@@ -0,0 +1,37 @@
+#-------------------------------------------------
+#
+# Click-to-frame latency of MainWindow through the Qt event loop
+#
+#-------------------------------------------------
+
+QT       += core gui sql
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = guilatency
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+include(../../ATMCore.pri)
+
+SOURCES += main.cpp \
+        ClickDriver.cpp \
+        ../../mainwindow.cpp
+
+HEADERS += ClickDriver.h \
+        ../../mainwindow.h
+
+FORMS   += ../../mainwindow.ui
+
+QMAKE_CXXFLAGS += -std=c++11
+
+# Copy database file to target directory after linking
+win32 {
+    DB_SRC_LOCATION = $$replace(PWD,/,\\)
+    DB_DST_LOCATION = $$replace(OUT_PWD,/,\\)
+    QMAKE_POST_LINK += copy $$DB_SRC_LOCATION\\..\\..\\bank.db $$DB_DST_LOCATION\\
+}
+unix {
+    QMAKE_POST_LINK += cp $$PWD/../../bank.db $$OUT_PWD/
+}
@@ -0,0 +1,286 @@
+// Input latency of the operator's window, through the Qt event loop.
+//
+// Runs MainWindow with a real ATM behind it and clicks through scripted customer
+// sessions (card, PIN, balance, back, eject) by posting mouse press and release
+// events to its buttons, the way clicks reach them. Every click is timed until
+// textBrowser holds its result (click to text) and until textBrowser has been
+// repainted with it (click to frame); repaints of textBrowser are timed too.
+//
+// A click follows as soon as the previous one is on screen, or at --rate clicks
+// per second if that is slower. Runs on the offscreen platform unless
+// QT_QPA_PLATFORM or -platform says otherwise, so no display is needed.
+//
+// Every run gets a fresh copy of bank.db (next to the executable) in the work
+// directory; sessions use its richest active card.
+//
+// Usage:
+//     guilatency [options]
+//         --sessions N            sessions to measure (default 200)
+//         --warmup N              sessions run first and not measured (default 10)
+//         --rate N                clicks per second at most (default 0: unpaced)
+//         --max-p99-us N          fail if click-to-frame p99 is above N us (default 0: no gate)
+//         --dir path              work directory (default guilatency-run)
+//
+// Exit code: 0 on success, 1 if over the --max-p99-us gate, 2 on errors
+// (including clicks that never showed anything).
+
+#include <QApplication>
+#include <QAbstractButton>
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+#include <QtSql>
+#include <algorithm>
+#include <vector>
+
+#include "ATM.h"
+#include "mainwindow.h"
+#include "ClickDriver.h"
+
+namespace
+{
+
+struct Options
+{
+    int _sessions;
+    int _warmup;
+    int _rate;
+    qint64 _max_p99_us;
+    QString _directory;
+
+    Options():
+        _sessions(200),
+        _warmup(10),
+        _rate(0),
+        _max_p99_us(0),
+        _directory("guilatency-run")
+    {}
+};
+
+bool parseOptions(const QStringList& args, Options& options, QTextStream& err)
+{
+    for(int i = 1; i < args.size(); ++i)
+    {
+        const QString& arg = args[i];
+        if(i + 1 >= args.size())
+        {
+            err << arg << ": value missing\n";
+            return false;
+        }
+        const QString value = args[++i];
+        bool ok = true;
+        if(arg == "--sessions")
+        {
+            options._sessions = value.toInt(&ok);
+            ok = ok && options._sessions > 0;
+        }
+        else if(arg == "--warmup")
+        {
+            options._warmup = value.toInt(&ok);
+            ok = ok && options._warmup >= 0;
+        }
+        else if(arg == "--rate")
+        {
+            options._rate = value.toInt(&ok);
+            ok = ok && options._rate >= 0;
+        }
+        else if(arg == "--max-p99-us")
+        {
+            options._max_p99_us = value.toLongLong(&ok);
+            ok = ok && options._max_p99_us >= 0;
+        }
+        else if(arg == "--dir")
+        {
+            options._directory = value;
+        }
+        else
+        {
+            ok = false;
+        }
+        if(!ok)
+        {
+            err << arg << " " << value << ": unknown option or bad value\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fresh copy of the shipped bank in the work directory
+bool copyBank(const Options& options, QTextStream& err)
+{
+    const QString bankTemplate = QDir(QCoreApplication::applicationDirPath()).filePath(BANK_DATABASE_NAME);
+    const QString bank = QDir(options._directory).filePath(BANK_DATABASE_NAME);
+    QFile::remove(bank);
+    if(!QFile::copy(bankTemplate, bank))
+    {
+        err << bankTemplate << ": failed to copy to " << bank << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Card the sessions use: richest active one with a keypad PIN, so that balances never run out
+bool pickCard(QString& cardNumber, QString& pin, QTextStream& err)
+{
+    bool found = false;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(BANK_DATABASE_DRIVER, "guilatency");
+        database.setDatabaseName(BANK_DATABASE_NAME);
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            if(query.exec("SELECT card_number, pin FROM cards WHERE active = 1 ORDER BY balance DESC"))
+            {
+                while(!found && query.next())
+                {
+                    cardNumber = query.value(0).toString();
+                    pin = query.value(1).toString();
+                    bool numeric = false;
+                    pin.toULongLong(&numeric);
+                    found = numeric && pin.size() <= 4;
+                }
+            }
+            database.close();
+        }
+    }
+    QSqlDatabase::removeDatabase("guilatency");
+    if(!found)
+    {
+        err << BANK_DATABASE_NAME << ": no active card with a numeric PIN\n";
+    }
+    return found;
+}
+
+double percentileUs(std::vector<qint64> values, double q)
+{
+    if(values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    const size_t rank = qMin(values.size() - 1, static_cast<size_t>(q * values.size()));
+    return values[rank] / 1000.0;
+}
+
+void printRow(QTextStream& out, const QString& name, const std::vector<qint64>& values)
+{
+    qint64 sum = 0;
+    for(size_t i = 0; i < values.size(); ++i)
+    {
+        sum += values[i];
+    }
+    out << QString("%1 %2 %3 %4 %5 %6\n")
+           .arg(name, -20)
+           .arg(static_cast<qulonglong>(values.size()), 8)
+           .arg(QString::number(values.empty() ? 0 : sum / 1000.0 / values.size(), 'f', 1), 10)
+           .arg(QString::number(percentileUs(values, 0.50), 'f', 1), 10)
+           .arg(QString::number(percentileUs(values, 0.99), 'f', 1), 10)
+           .arg(QString::number(percentileUs(values, 1.0), 'f', 1), 10);
+}
+
+void printHeader(QTextStream& out, const char* what)
+{
+    out << QString("%1 %2 %3 %4 %5 %6\n")
+           .arg(QString(what), -20).arg("count", 8).arg("mean us", 10).arg("p50 us", 10).arg("p99 us", 10).arg("max us", 10);
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+#if QT_VERSION >= 0x050000
+    // No display needed unless asked for one
+    if(qgetenv("QT_QPA_PLATFORM").isEmpty())
+    {
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+    }
+#endif
+    QApplication app(argc, argv);
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    Options options;
+    if(!parseOptions(QCoreApplication::arguments(), options, err))
+    {
+        err << "Usage: guilatency [--sessions N] [--warmup N] [--rate clicks/s] [--max-p99-us N] [--dir path]\n";
+        return 2;
+    }
+    if(!QDir().mkpath(options._directory) || !copyBank(options, err))
+    {
+        return 2;
+    }
+    // ATM finds bank DB, configuration and audit directory in the current directory
+    if(!QDir::setCurrent(options._directory))
+    {
+        err << options._directory << ": cannot change to it\n";
+        return 2;
+    }
+    QString cardNumber;
+    QString pin;
+    if(!pickCard(cardNumber, pin, err))
+    {
+        return 2;
+    }
+
+    MainWindow window;
+    window.show();
+    ATM atm(&window);
+    QAbstractButton* power = window.findChild<QAbstractButton*>("powerBtn");
+    ClickDriver driver(window, cardNumber, pin);
+    if(!power || !driver.isReady())
+    {
+        err << "MainWindow lacks a control the script clicks\n";
+        return 2;
+    }
+    // Power on is not an operator's click: it is out of the measurement
+    power->click();
+
+    driver.start(options._warmup, options._sessions, options._rate);
+    app.exec();
+
+    const ClickDriver::Samples& samples = driver.samples();
+    std::vector<qint64> allFrames;
+    for(int step = 0; step < ClickDriver::STEP_COUNT; ++step)
+    {
+        allFrames.insert(allFrames.end(), samples._to_frame[step].begin(), samples._to_frame[step].end());
+    }
+    const double seconds = samples._elapsed_ns / 1e9;
+    out << QString("%1 sessions, %2 clicks in %3 s: %4 clicks/s (%5)\n\n")
+           .arg(options._sessions)
+           .arg(static_cast<qulonglong>(allFrames.size()))
+           .arg(QString::number(seconds, 'f', 2))
+           .arg(QString::number(seconds > 0 ? allFrames.size() / seconds : 0, 'f', 1))
+           .arg(options._rate > 0 ? QString("at most %1/s").arg(options._rate) : QString("unpaced"));
+    printHeader(out, "click to text");
+    for(int step = 0; step < ClickDriver::STEP_COUNT; ++step)
+    {
+        printRow(out, ClickDriver::STEP_NAMES[step], samples._to_text[step]);
+    }
+    out << "\n";
+    printHeader(out, "click to frame");
+    for(int step = 0; step < ClickDriver::STEP_COUNT; ++step)
+    {
+        printRow(out, ClickDriver::STEP_NAMES[step], samples._to_frame[step]);
+    }
+    printRow(out, "all", allFrames);
+    out << "\n";
+    printHeader(out, "frame");
+    printRow(out, "textBrowser paint", samples._paint);
+
+    if(samples._stalls > 0)
+    {
+        err << samples._stalls << " clicks showed nothing within " << ClickDriver::STALL_MS
+            << " ms: script is out of step with the ATM\n";
+        return 2;
+    }
+    const double p99 = percentileUs(allFrames, 0.99);
+    if(options._max_p99_us > 0 && p99 > options._max_p99_us)
+    {
+        err << "click-to-frame p99 " << QString::number(p99, 'f', 1) << " us is over " << options._max_p99_us << " us\n";
+        return 1;
+    }
+    return 0;
+}
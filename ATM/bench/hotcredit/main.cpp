@@ -0,0 +1,469 @@
+// Many terminals paying one beneficiary.
+//
+// Every terminal, a thread with a DB connection of its own, pays the same
+// beneficiary over and over with the statements ATMBase::transferFunds() runs:
+// transaction ID, debit of the payer's card, credit of the beneficiary and a
+// history entry each, in one DB transaction.
+//
+// 1. "direct": the beneficiary is an ordinary account, every credit updates its row.
+// 2. "escrow": the beneficiary is a hot account (see HotAccounts.h): credits are
+//    appended into the terminals' slots and merged in background.
+//
+// Every run gets a fresh copy of bank.db (next to the executable) in the work
+// directory, with its cards replaced by the beneficiary and one payer per terminal.
+// After the run the beneficiary's balance is checked against the credits made.
+//
+// Usage:
+//     hotcredit [options]
+//         --terminals N           concurrent terminals (default 32)
+//         --duration S            per mode (default 5)
+//         --mode M                direct, escrow or both (default both)
+//         --journal J             wal or delete (default wal)
+//         --dir path              work directory (default hotcredit-run)
+//
+// Exit code: 0 on success, 1 if a balance does not add up, 2 on errors.
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QSemaphore>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QtSql>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "ATMBase.h"
+#include "BankSchema.h"
+#include "CardHistory.h"
+#include "HotAccounts.h"
+#include "IdempotencyIndex.h"
+
+namespace
+{
+
+enum Mode
+{
+    MODE_DIRECT = 0,
+    MODE_ESCROW = 1,
+    MODE_COUNT  = 2
+};
+const char* const MODE_NAMES[MODE_COUNT] = {"direct", "escrow"};
+
+// Beneficiary is FIRST_CARD, payers follow it
+const quint32 FIRST_CARD = 10000000;
+const int MAX_TERMINALS = 4096;
+const double AMOUNT = 1;
+const double OPENING_BALANCE = 1000000000;
+const int BUSY_TIMEOUT_MS = 60000;
+
+struct Options
+{
+    int _terminals;
+    int _duration_s;
+    bool _modes[MODE_COUNT];
+    bool _wal;
+    QString _directory;
+};
+
+// Latencies of one terminal, in ns
+struct Stats
+{
+    std::vector<qint64> _payments;
+    std::vector<qint64> _statements;    // Up to the commit
+    quint64 _credited;      // Transactions committed
+    quint64 _failures;      // Payments with a failed statement
+    qint64 _elapsed_ns;
+
+    Stats(): _credited(0), _failures(0), _elapsed_ns(0) {}
+};
+
+QString cardNumber(int index)
+{
+    return QString::number(FIRST_CARD + index);
+}
+
+bool parseOptions(const QStringList& args, Options& options, QTextStream& err)
+{
+    options._terminals = 32;
+    options._duration_s = 5;
+    options._modes[MODE_DIRECT] = options._modes[MODE_ESCROW] = true;
+    options._wal = true;
+    options._directory = "hotcredit-run";
+    for(int i = 1; i < args.size(); ++i)
+    {
+        const QString& arg = args[i];
+        if(i + 1 >= args.size())
+        {
+            err << arg << ": value expected\n";
+            return false;
+        }
+        const QString& value = args[++i];
+        if(arg == "--terminals")
+        {
+            options._terminals = qBound(1, value.toInt(), MAX_TERMINALS);
+        }
+        else if(arg == "--duration")
+        {
+            options._duration_s = qMax(1, value.toInt());
+        }
+        else if(arg == "--mode")
+        {
+            if(value != "direct" && value != "escrow" && value != "both")
+            {
+                err << value << ": direct, escrow or both expected\n";
+                return false;
+            }
+            options._modes[MODE_DIRECT] = (value != "escrow");
+            options._modes[MODE_ESCROW] = (value != "direct");
+        }
+        else if(arg == "--journal")
+        {
+            if(value != "wal" && value != "delete")
+            {
+                err << value << ": wal or delete expected\n";
+                return false;
+            }
+            options._wal = (value == "wal");
+        }
+        else if(arg == "--dir")
+        {
+            options._directory = value;
+        }
+        else
+        {
+            err << arg << ": unknown option\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fresh bank in the work directory: the shipped schema, the beneficiary and a payer per terminal
+bool generateBank(const Options& options, Mode mode, const QString& bank, QTextStream& err)
+{
+    const QString bankTemplate = QDir(QCoreApplication::applicationDirPath()).filePath(BANK_DATABASE_NAME);
+    QFile::remove(bank);
+    QFile::remove(bank + "-wal");
+    QFile::remove(bank + "-shm");
+    if(!QFile::copy(bankTemplate, bank))
+    {
+        err << bankTemplate << ": failed to copy to " << bank << "\n";
+        return false;
+    }
+    bool ok = false;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(BANK_DATABASE_DRIVER, "hotcredit");
+        database.setDatabaseName(bank);
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            QSqlQuery client(database);
+            QSqlQuery card(database);
+            ok = BankSchema::migrate(database) &&
+                 database.transaction() &&
+                 query.exec("DELETE FROM cards") &&
+                 query.exec("DELETE FROM clients") &&
+                 client.prepare("INSERT INTO clients (id, first_name, last_name, gender_male, tax_code) VALUES (?, ?, ?, ?, ?)") &&
+                 card.prepare("INSERT INTO cards (card_number, client_id, balance, pin, active) VALUES (?, ?, ?, ?, 1)");
+            for(int i = 0; ok && i <= options._terminals; ++i)
+            {
+                client.addBindValue(i + 1);
+                client.addBindValue(i ? "Payer" : "Beneficiary");
+                client.addBindValue(QString("Customer%1").arg(i));
+                client.addBindValue(i % 2);
+                client.addBindValue(cardNumber(i));
+                card.addBindValue(cardNumber(i));
+                card.addBindValue(i + 1);
+                card.addBindValue(OPENING_BALANCE);
+                card.addBindValue("0000");
+                ok = client.exec() && card.exec();
+            }
+            if(ok && mode == MODE_ESCROW)
+            {
+                ok = query.exec(QString("INSERT INTO hot_accounts (card_number) VALUES (\"%1\")").arg(cardNumber(0)));
+            }
+            ok = ok && database.commit();
+            // Migrations leave the DB in WAL mode
+            ok = ok && (options._wal || query.exec("PRAGMA journal_mode=DELETE"));
+            if(!ok)
+            {
+                err << bank << ": " << database.lastError().text() << "\n";
+            }
+            database.close();
+        }
+        else
+        {
+            err << bank << ": " << database.lastError().text() << "\n";
+        }
+    }
+    QSqlDatabase::removeDatabase("hotcredit");
+    return ok;
+}
+
+class Payer : public QThread
+{
+public:
+    Payer(int terminal, Mode mode, const Options& options, const QString& bank, QSemaphore& ready, QSemaphore& go):
+        _terminal(terminal),
+        _mode(mode),
+        _options(options),
+        _bank(bank),
+        _ready(ready),
+        _go(go)
+    {}
+
+    inline const Stats& stats() const
+    {
+        return _stats;
+    }
+
+protected:
+    void run()
+    {
+        const QString connection = QString("hotcredit_%1").arg(_terminal);
+        {
+            QSqlDatabase database = QSqlDatabase::addDatabase(BANK_DATABASE_DRIVER, connection);
+            database.setDatabaseName(_bank);
+            database.setConnectOptions(QString("QSQLITE_BUSY_TIMEOUT=%1").arg(BUSY_TIMEOUT_MS));
+            database.open();
+            pay(database);
+            database.close();
+        }
+        QSqlDatabase::removeDatabase(connection);
+    }
+
+private:
+    void pay(QSqlDatabase& database)
+    {
+        const QString payer = cardNumber(_terminal);
+        const QString beneficiary = cardNumber(0);
+        const QString amount = QString::number(AMOUNT);
+        const QString upload = ATMBase::UPLOAD_FUNDS.arg(beneficiary, amount);
+        QSqlQuery query(database);
+        QSqlQuery credit(database);
+        if(_mode == MODE_ESCROW)
+        {
+            credit.prepare(HotAccounts::APPEND_CREDIT);
+            credit.bindValue(0, beneficiary);
+            credit.bindValue(1, _terminal);
+            credit.bindValue(2, AMOUNT);
+        }
+        QSqlQuery record(database);
+        record.prepare(IdempotencyIndex::RECORD_ID);
+        QSqlQuery payerEntry(database);
+        payerEntry.prepare(CardHistory::RECORD_ENTRY);
+        QSqlQuery beneficiaryEntry(database);
+        beneficiaryEntry.prepare((_mode == MODE_ESCROW) ? HotAccounts::RECORD_ENTRY : CardHistory::RECORD_ENTRY);
+
+        _ready.release();
+        _go.acquire();
+        if(!database.isOpen())
+        {
+            ++_stats._failures;
+            return;
+        }
+        QElapsedTimer clock;
+        clock.start();
+        const qint64 durationNs = static_cast<qint64>(_options._duration_s) * 1000000000;
+        qint64 started = 0;
+        while((started = clock.nsecsElapsed()) < durationNs)
+        {
+            const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+            record.addBindValue(IdempotencyIndex::newId());
+            record.addBindValue(payer);
+            record.addBindValue(AMOUNT);
+            record.addBindValue(now);
+            payerEntry.addBindValue(now);
+            payerEntry.addBindValue(static_cast<int>(CardHistory::ENTRY_TRANSFER_OUT));
+            payerEntry.addBindValue(-AMOUNT);
+            payerEntry.addBindValue(beneficiary);
+            payerEntry.addBindValue(payer);
+            beneficiaryEntry.addBindValue(now);
+            beneficiaryEntry.addBindValue(static_cast<int>(CardHistory::ENTRY_TRANSFER_IN));
+            beneficiaryEntry.addBindValue(AMOUNT);
+            beneficiaryEntry.addBindValue(payer);
+            beneficiaryEntry.addBindValue(beneficiary);
+            const bool executed = database.transaction() &&
+                                  record.exec() &&
+                                  query.exec(ATMBase::WITHDRAW_FUNDS.arg(payer, amount)) &&
+                                  ((_mode == MODE_ESCROW) ? credit.exec() : query.exec(upload)) &&
+                                  payerEntry.exec() &&
+                                  beneficiaryEntry.exec();
+            const qint64 statementsEnded = clock.nsecsElapsed();
+            if(!executed || !database.commit())
+            {
+                database.rollback();
+                ++_stats._failures;
+                continue;
+            }
+            ++_stats._credited;
+            _stats._statements.push_back(statementsEnded - started);
+            _stats._payments.push_back(clock.nsecsElapsed() - started);
+        }
+        _stats._elapsed_ns = clock.nsecsElapsed();
+    }
+
+    const int _terminal;
+    const Mode _mode;
+    const Options& _options;
+    const QString _bank;
+    QSemaphore& _ready;
+    QSemaphore& _go;
+    Stats _stats;
+};
+
+// In us, from sorted ns
+double percentileUs(const std::vector<qint64>& sorted, double q)
+{
+    if(sorted.empty())
+    {
+        return 0;
+    }
+    const size_t rank = static_cast<size_t>(std::ceil(q * sorted.size()));
+    return sorted[qBound<size_t>(1, rank, sorted.size()) - 1] / 1000.0;
+}
+
+bool readBeneficiary(const QString& bank, double& balance, qint64& unmerged, QTextStream& err)
+{
+    bool ok = false;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(BANK_DATABASE_DRIVER, "hotcredit_check");
+        database.setDatabaseName(bank);
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            ok = query.exec(QString("SELECT balance FROM cards WHERE card_number=\"%1\"").arg(cardNumber(0))) && query.next();
+            if(ok)
+            {
+                balance = query.value(0).toDouble();
+                ok = query.exec("SELECT COUNT(*) FROM hot_account_credits") && query.next();
+                unmerged = ok ? query.value(0).toLongLong() : 0;
+            }
+            if(!ok)
+            {
+                err << bank << ": " << database.lastError().text() << "\n";
+            }
+            database.close();
+        }
+    }
+    QSqlDatabase::removeDatabase("hotcredit_check");
+    return ok;
+}
+
+// Returns 0 if the beneficiary's balance adds up, 1 if it does not, 2 on errors
+int runMode(const Options& options, Mode mode, QTextStream& out, QTextStream& err)
+{
+    const QString bank = QDir(options._directory).filePath(BANK_DATABASE_NAME);
+    if(!generateBank(options, mode, bank, err))
+    {
+        return 2;
+    }
+
+    HotAccounts accounts;
+    if(mode == MODE_ESCROW)
+    {
+        accounts.start(BANK_DATABASE_DRIVER, bank);
+    }
+    QSemaphore ready;
+    QSemaphore go;
+    std::vector<Payer*> payers;
+    for(int t = 1; t <= options._terminals; ++t)
+    {
+        payers.push_back(new Payer(t, mode, options, bank, ready, go));
+        payers.back()->start();
+    }
+    ready.acquire(options._terminals);
+    go.release(options._terminals);
+
+    std::vector<qint64> payments;
+    std::vector<qint64> statements;
+    quint64 credited = 0;
+    quint64 failures = 0;
+    qint64 elapsedNs = 0;
+    for(size_t t = 0; t < payers.size(); ++t)
+    {
+        payers[t]->wait();
+        const Stats& stats = payers[t]->stats();
+        payments.insert(payments.end(), stats._payments.begin(), stats._payments.end());
+        statements.insert(statements.end(), stats._statements.begin(), stats._statements.end());
+        credited += stats._credited;
+        failures += stats._failures;
+        elapsedNs = qMax(elapsedNs, stats._elapsed_ns);
+        delete payers[t];
+    }
+    // Merges whatever is left
+    accounts.stop();
+
+    double balance = 0;
+    qint64 unmerged = 0;
+    if(!readBeneficiary(bank, balance, unmerged, err))
+    {
+        return 2;
+    }
+    const double expected = OPENING_BALANCE + credited * AMOUNT;
+    const bool addsUp = (std::fabs(balance - expected) < 0.005 && unmerged == 0);
+
+    std::sort(payments.begin(), payments.end());
+    std::sort(statements.begin(), statements.end());
+    const double seconds = elapsedNs / 1e9;
+    out << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9\n")
+           .arg(QString(MODE_NAMES[mode]), -8)
+           .arg(static_cast<qulonglong>(payments.size()), 10)
+           .arg(QString::number(seconds > 0 ? payments.size() / seconds : 0, 'f', 1), 10)
+           .arg(failures, 8)
+           .arg(QString::number(percentileUs(payments, 0.50), 'f', 1), 12)
+           .arg(QString::number(percentileUs(payments, 0.99), 'f', 1), 12)
+           .arg(QString::number(percentileUs(statements, 0.50), 'f', 1), 12)
+           .arg(QString::number(percentileUs(statements, 0.99), 'f', 1), 12)
+           .arg(addsUp ? "yes" : "NO", 8);
+    if(!addsUp)
+    {
+        err << MODE_NAMES[mode] << ": beneficiary has " << QString::number(balance, 'f', 2)
+            << ", expected " << QString::number(expected, 'f', 2) << " (" << unmerged << " credits not merged)\n";
+    }
+    return addsUp ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    Options options;
+    if(!parseOptions(QCoreApplication::arguments(), options, err))
+    {
+        err << "Usage: hotcredit [--terminals N] [--duration s] [--mode direct|escrow|both]\n"
+               "                 [--journal wal|delete] [--dir path]\n";
+        return 2;
+    }
+    if(!QDir().mkpath(options._directory))
+    {
+        err << options._directory << ": cannot create it\n";
+        return 2;
+    }
+
+    out << QString("%1 terminals paying one beneficiary for %2 s, %3 journal\n\n")
+           .arg(options._terminals).arg(options._duration_s).arg(options._wal ? "WAL" : "rollback");
+    out << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9\n")
+           .arg("mode", -8).arg("payments", 10).arg("per s", 10).arg("failed", 8)
+           .arg("pay p50 us", 12).arg("pay p99 us", 12).arg("stmt p50 us", 12).arg("stmt p99 us", 12).arg("adds up", 8);
+    out.flush();
+    int result = 0;
+    for(int mode = 0; mode < MODE_COUNT; ++mode)
+    {
+        if(options._modes[mode])
+        {
+            result = qMax(result, runMode(options, static_cast<Mode>(mode), out, err));
+            out.flush();
+        }
+    }
+    return result;
+}
@@ -0,0 +1,846 @@
+// Closed-loop load generator.
+//
+// Drives many headless ATMs at once, one thread each, against a generated bank:
+// every terminal runs a customer session, waits for the next customer (think
+// time) and starts over, so offered load follows the system's own speed.
+//
+// Sessions pick an operation from a weighted mix and a card from a Zipf or
+// uniform distribution over the bank's cards. With Zipf most sessions hit
+// a few hot cards: their rows, their velocity counters and their fraud history
+// are shared by all terminals, which is where contention shows up.
+//
+// Reported: throughput, latency of whole sessions per operation and latency
+// of single inputs per state the ATM was in when it got them (p50/p99/p999).
+// Think time is not part of any latency.
+//
+// Every run gets a fresh copy of bank.db (next to the executable) in the work
+// directory, with its cards replaced by generated ones (PIN 0000); ATMs run
+// there, so their audit trails and atm.ini are the work directory's too.
+//
+// Usage:
+//     loadgen [options]
+//         --atms N                concurrent terminals (default 8)
+//         --cards N               cards in the generated bank (default 10000)
+//         --distribution D        zipf or uniform (default zipf)
+//         --zipf S                Zipf exponent (default 1.0)
+//         --mix op=W,...          operation weights, ops: balance, withdraw, transfer,
+//                                 mobile, bad-card, bad-pin
+//                                 (default balance=40,withdraw=25,transfer=15,mobile=10,bad-card=5,bad-pin=5)
+//         --think MS              mean think time, exponentially distributed (default 0)
+//         --duration S            measure for S seconds (default 10)
+//         --sessions N            or stop after N sessions in total
+//         --dir path              work directory (default loadgen-run)
+//         --config atm.ini        branch settings for every ATM (limits, cassettes)
+//         --wal                   put the bank DB in WAL mode
+//         --seed N
+//
+// Cassettes are refilled with the default set every REFILL_EVERY withdrawals,
+// so long runs keep measuring withdrawals rather than empty cassettes.
+//
+// Exit code: 0 on success, 2 on errors.
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QSemaphore>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QtSql>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <functional>
+#include <random>
+#include <vector>
+
+#include "ATM.h"
+#include "BankSchema.h"
+
+namespace
+{
+
+enum Operation
+{
+    OP_BALANCE  = 0,
+    OP_WITHDRAW = 1,
+    OP_TRANSFER = 2,
+    OP_MOBILE   = 3,
+    OP_BAD_CARD = 4,
+    OP_BAD_PIN  = 5,
+    OP_COUNT    = 6
+};
+const char* const OPERATION_NAMES[OP_COUNT] = {"balance", "withdraw", "transfer", "mobile", "bad-card", "bad-pin"};
+
+// Inputs are timed by the state the ATM was in when it got them:
+// ATMState for the first two, then ATMBase::MenuState in TOP_MENU, then cancellation
+enum { STEP_NO_CARD = 0, STEP_PENDING_PIN = 1, STEP_MENU = 2, STEP_CANCEL = 13, STEP_COUNT = 14 };
+const char* const STEP_NAMES[STEP_COUNT] = {
+    "NO_CARD", "PENDING_PIN",
+    "TOP", "SHOW_BALANCE_METHOD", "DISPLAY_BALANCE", "PRINT_BALANCE", "WITHDRAWAL_AMOUNT",
+    "TRANSFER_AMOUNT", "TRANSFER_RECEPIENT", "MOBILE_AMOUNT", "MOBILE_RECEPIENT", "REPORT_RESULT", "CONFIRM_PIN",
+    "cancel"
+};
+
+const QString PIN = "0000";
+const QString WRONG_PIN = "9999";
+const QString WITHDRAWAL_AMOUNT = "100";
+const QString TRANSFER_AMOUNT = "10";
+const QString MOBILE_AMOUNT = "10";
+const QString PHONE_NUMBER = "380501234567";
+const QString OPENING_BALANCE = "1000000000";
+
+// Generated cards are FIRST_CARD + i; well-formed numbers below it are unknown to the bank
+const quint32 FIRST_CARD = 10000000;
+const quint32 MAX_CARDS = 89999999;
+
+const int REFILL_EVERY = 500;
+
+//==========
+// Latency histogram: exact below 64 ns, then 32 buckets per power of two (about 3% wide)
+
+class Histogram
+{
+public:
+    enum { SUB_BITS = 5, SUB_BUCKETS = 1 << SUB_BITS, BUCKETS = 64 * SUB_BUCKETS };
+
+    Histogram(): _buckets(BUCKETS, 0), _count(0), _sum_ns(0), _max_ns(0) {}
+
+    void record(qint64 ns)
+    {
+        const quint64 value = static_cast<quint64>(qMax(ns, Q_INT64_C(0)));
+        ++_buckets[bucketOf(value)];
+        ++_count;
+        _sum_ns += value;
+        _max_ns = qMax(_max_ns, value);
+    }
+
+    void merge(const Histogram& other)
+    {
+        for(int i = 0; i < BUCKETS; ++i)
+        {
+            _buckets[i] += other._buckets[i];
+        }
+        _count += other._count;
+        _sum_ns += other._sum_ns;
+        _max_ns = qMax(_max_ns, other._max_ns);
+    }
+
+    inline quint64 count() const
+    {
+        return _count;
+    }
+    inline double meanUs() const
+    {
+        return _count ? _sum_ns / 1000.0 / _count : 0;
+    }
+    inline double maxUs() const
+    {
+        return _max_ns / 1000.0;
+    }
+
+    // Upper bound of the bucket holding the q-th quantile
+    double percentileUs(double q) const
+    {
+        if(!_count)
+        {
+            return 0;
+        }
+        const quint64 rank = qMax(static_cast<quint64>(q * _count + 0.999999), Q_UINT64_C(1));
+        quint64 seen = 0;
+        for(int i = 0; i < BUCKETS; ++i)
+        {
+            seen += _buckets[i];
+            if(seen >= rank)
+            {
+                return qMin(upperBound(i), _max_ns) / 1000.0;
+            }
+        }
+        return maxUs();
+    }
+
+private:
+    static int bucketOf(quint64 value)
+    {
+        if(value < 2 * SUB_BUCKETS)
+        {
+            return static_cast<int>(value);
+        }
+        int exponent = 0;
+        while(value >> (exponent + 1))
+        {
+            ++exponent;
+        }
+        return (exponent - SUB_BITS) * SUB_BUCKETS + static_cast<int>(value >> (exponent - SUB_BITS));
+    }
+
+    static quint64 upperBound(int bucket)
+    {
+        if(bucket < 2 * SUB_BUCKETS)
+        {
+            return static_cast<quint64>(bucket);
+        }
+        const int exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+        const quint64 mantissa = static_cast<quint64>(bucket - (exponent - SUB_BITS) * SUB_BUCKETS);
+        return ((mantissa + 1) << (exponent - SUB_BITS)) - 1;
+    }
+
+    std::vector<quint64> _buckets;
+    quint64 _count;
+    quint64 _sum_ns;
+    quint64 _max_ns;
+};
+
+// Everything one terminal measured
+struct Stats
+{
+    Histogram _sessions[OP_COUNT];
+    quint64 _completed[OP_COUNT];
+    quint64 _rejected[OP_COUNT];    // Card given back or kept before the customer was done
+    quint64 _step_ups[OP_COUNT];    // PIN asked again by fraud scoring
+    Histogram _steps[STEP_COUNT];
+    qint64 _elapsed_ns;             // From start signal to the last session's end
+
+    Stats(): _elapsed_ns(0)
+    {
+        std::fill(_completed, _completed + OP_COUNT, 0);
+        std::fill(_rejected, _rejected + OP_COUNT, 0);
+        std::fill(_step_ups, _step_ups + OP_COUNT, 0);
+    }
+
+    void merge(const Stats& other)
+    {
+        for(int op = 0; op < OP_COUNT; ++op)
+        {
+            _sessions[op].merge(other._sessions[op]);
+            _completed[op] += other._completed[op];
+            _rejected[op] += other._rejected[op];
+            _step_ups[op] += other._step_ups[op];
+        }
+        for(int step = 0; step < STEP_COUNT; ++step)
+        {
+            _steps[step].merge(other._steps[step]);
+        }
+        _elapsed_ns = qMax(_elapsed_ns, other._elapsed_ns);
+    }
+};
+
+//==========
+// Card and operation choice
+
+class CardPicker
+{
+public:
+    // exponent <= 0 means uniform
+    CardPicker(quint32 cards, double exponent):
+        _cards(cards)
+    {
+        if(exponent <= 0)
+        {
+            return;
+        }
+        // Card i is the i-th most popular one
+        _cdf.resize(cards);
+        double sum = 0;
+        for(quint32 i = 0; i < cards; ++i)
+        {
+            sum += 1.0 / std::pow(i + 1.0, exponent);
+            _cdf[i] = sum;
+        }
+        for(quint32 i = 0; i < cards; ++i)
+        {
+            _cdf[i] /= sum;
+        }
+    }
+
+    template <class Random>
+    quint32 pick(Random& random) const
+    {
+        if(_cdf.empty())
+        {
+            return std::uniform_int_distribution<quint32>(0, _cards - 1)(random);
+        }
+        const double u = std::uniform_real_distribution<double>(0, 1)(random);
+        const std::vector<double>::const_iterator found = std::upper_bound(_cdf.begin(), _cdf.end(), u);
+        return static_cast<quint32>(qMin<size_t>(found - _cdf.begin(), _cards - 1));
+    }
+
+    // Expected share of sessions going to the 'top' most popular cards
+    double share(quint32 top) const
+    {
+        if(_cdf.empty())
+        {
+            return static_cast<double>(qMin(top, _cards)) / _cards;
+        }
+        return _cdf[qMin(top, _cards) - 1];
+    }
+
+private:
+    const quint32 _cards;
+    std::vector<double> _cdf;   // Empty for uniform choice
+};
+
+inline QString cardNumber(quint32 card)
+{
+    return QString::number(FIRST_CARD + card);
+}
+
+//==========
+// Terminal
+
+// Headless ATM whose state the driver can look at
+class ProbedATM : public HeadlessATM
+{
+public:
+    inline bool hasCard() const
+    {
+        return _current_card != NULL;
+    }
+    inline bool atTopMenu() const
+    {
+        return _state == TOP_MENU && _menu_state == TOP;
+    }
+    inline bool confirmingPin() const
+    {
+        return _state == TOP_MENU && _menu_state == CONFIRM_PIN;
+    }
+    int step() const
+    {
+        switch(_state)
+        {
+        case NO_CARD:
+            return STEP_NO_CARD;
+        case PENDING_PIN:
+            return STEP_PENDING_PIN;
+        default:
+            return STEP_MENU + _menu_state;
+        }
+    }
+
+    // Cash-in-transit visit
+    void refill()
+    {
+        loadCassettes(defaultCassettes());
+    }
+};
+
+// Plays customers on one terminal
+class Customer
+{
+public:
+    Customer(ProbedATM& atm, Stats& stats):
+        _atm(atm),
+        _stats(stats),
+        _session_ns(0)
+    {}
+
+    void serve(Operation operation, const QString& card, const QString& recepient)
+    {
+        _session_ns = 0;
+        const bool completed = run(operation, card, recepient);
+        _stats._sessions[operation].record(_session_ns);
+        if(completed)
+        {
+            ++_stats._completed[operation];
+        }
+        else
+        {
+            ++_stats._rejected[operation];
+        }
+    }
+
+private:
+    // Timed input; true while the card is in
+    bool input(const QString& text)
+    {
+        const int step = _atm.step();
+        QElapsedTimer timer;
+        timer.start();
+        _atm.processInput(text);
+        const qint64 ns = timer.nsecsElapsed();
+        _stats._steps[step].record(ns);
+        _session_ns += ns;
+        return _atm.hasCard();
+    }
+
+    void cancel()
+    {
+        QElapsedTimer timer;
+        timer.start();
+        _atm.cancelOperation();
+        const qint64 ns = timer.nsecsElapsed();
+        _stats._steps[STEP_CANCEL].record(ns);
+        _session_ns += ns;
+    }
+
+    // False if the ATM let go of the card before the customer was done
+    bool run(Operation operation, const QString& card, const QString& recepient)
+    {
+        if(!input(card))
+        {
+            return false;
+        }
+        if(operation == OP_BAD_PIN)
+        {
+            // One typo, then the customer gives up
+            if(!input(WRONG_PIN))
+            {
+                return false;
+            }
+            cancel();
+            return true;
+        }
+        if(!input(PIN))
+        {
+            return false;
+        }
+        bool in = true;
+        switch(operation)
+        {
+        case OP_BALANCE:
+            in = input("1") && input("1");
+            break;
+        case OP_WITHDRAW:
+            in = input("2") && input(WITHDRAWAL_AMOUNT);
+            break;
+        case OP_TRANSFER:
+            in = input("3") && input(TRANSFER_AMOUNT) && input(recepient);
+            break;
+        case OP_MOBILE:
+            in = input("4") && input(MOBILE_AMOUNT) && input(PHONE_NUMBER);
+            break;
+        default:
+            break;
+        }
+        // Fraud scoring may want the PIN again; a correct one lets the operation through
+        while(in && _atm.confirmingPin())
+        {
+            ++_stats._step_ups[operation];
+            in = input(PIN);
+        }
+        if(in && !_atm.atTopMenu())
+        {
+            // Result or balance screen
+            in = input("0");
+        }
+        if(!in)
+        {
+            return false;
+        }
+        // Take the card
+        if(input("0"))
+        {
+            cancel();
+        }
+        return true;
+    }
+
+    ProbedATM& _atm;
+    Stats& _stats;
+    qint64 _session_ns;
+};
+
+//==========
+
+struct Options
+{
+    int _atms;
+    quint32 _cards;
+    double _zipf;                   // 0 for uniform
+    double _mix[OP_COUNT];
+    double _think_ms;
+    int _duration_s;
+    qint64 _sessions;               // 0: run for _duration_s
+    QString _directory;
+    QString _config;
+    bool _wal;
+    quint64 _seed;
+};
+
+bool parseMix(const QString& text, double (&mix)[OP_COUNT], QTextStream& err)
+{
+    std::fill(mix, mix + OP_COUNT, 0.0);
+    double total = 0;
+    const QStringList parts = text.split(',', QString::SkipEmptyParts);
+    for(int i = 0; i < parts.size(); ++i)
+    {
+        const QStringList pair = parts[i].split('=');
+        int op = 0;
+        while(op < OP_COUNT && pair[0].trimmed() != OPERATION_NAMES[op])
+        {
+            ++op;
+        }
+        bool ok = (pair.size() == 2 && op < OP_COUNT);
+        const double weight = ok ? pair[1].toDouble(&ok) : 0;
+        if(!ok || weight < 0)
+        {
+            err << parts[i] << ": operation=weight expected\n";
+            return false;
+        }
+        mix[op] = weight;
+        total += weight;
+    }
+    if(total <= 0)
+    {
+        err << text << ": no operation has a weight\n";
+        return false;
+    }
+    return true;
+}
+
+bool parseOptions(const QStringList& args, Options& options, QTextStream& err)
+{
+    options._atms = 8;
+    options._cards = 10000;
+    options._zipf = 1.0;
+    options._think_ms = 0;
+    options._duration_s = 10;
+    options._sessions = 0;
+    options._directory = "loadgen-run";
+    options._wal = false;
+    options._seed = 20161019;
+    if(!parseMix("balance=40,withdraw=25,transfer=15,mobile=10,bad-card=5,bad-pin=5", options._mix, err))
+    {
+        return false;
+    }
+    bool uniform = false;
+    for(int i = 1; i < args.size(); ++i)
+    {
+        const QString& arg = args[i];
+        if(arg == "--wal")
+        {
+            options._wal = true;
+            continue;
+        }
+        if(i + 1 >= args.size())
+        {
+            err << arg << ": value expected\n";
+            return false;
+        }
+        const QString& value = args[++i];
+        if(arg == "--atms")
+        {
+            options._atms = qMax(1, value.toInt());
+        }
+        else if(arg == "--cards")
+        {
+            options._cards = qBound<quint32>(2, value.toUInt(), MAX_CARDS);
+        }
+        else if(arg == "--distribution" && (value == "zipf" || value == "uniform"))
+        {
+            uniform = (value == "uniform");
+        }
+        else if(arg == "--zipf" && value.toDouble() > 0)
+        {
+            options._zipf = value.toDouble();
+        }
+        else if(arg == "--mix")
+        {
+            if(!parseMix(value, options._mix, err))
+            {
+                return false;
+            }
+        }
+        else if(arg == "--think")
+        {
+            options._think_ms = qMax(0.0, value.toDouble());
+        }
+        else if(arg == "--duration")
+        {
+            options._duration_s = qMax(1, value.toInt());
+        }
+        else if(arg == "--sessions")
+        {
+            options._sessions = qMax(Q_INT64_C(1), value.toLongLong());
+        }
+        else if(arg == "--dir")
+        {
+            options._directory = value;
+        }
+        else if(arg == "--config")
+        {
+            options._config = value;
+        }
+        else if(arg == "--seed")
+        {
+            options._seed = value.toULongLong();
+        }
+        else
+        {
+            err << arg << " " << value << ": unknown option or bad value\n";
+            return false;
+        }
+    }
+    if(uniform)
+    {
+        options._zipf = 0;
+    }
+    return true;
+}
+
+// Fresh bank in the work directory: the shipped schema with generated cards
+bool generateBank(const Options& options, QTextStream& err)
+{
+    const QString bankTemplate = QDir(QCoreApplication::applicationDirPath()).filePath(BANK_DATABASE_NAME);
+    const QDir directory(options._directory);
+    const QString bank = directory.filePath(BANK_DATABASE_NAME);
+    QFile::remove(bank);
+    if(!QFile::copy(bankTemplate, bank))
+    {
+        err << bankTemplate << ": failed to copy to " << bank << "\n";
+        return false;
+    }
+    if(!options._config.isEmpty())
+    {
+        const QString config = directory.filePath(ATM_CONFIG_FILE);
+        QFile::remove(config);
+        if(!QFile::copy(options._config, config))
+        {
+            err << options._config << ": failed to copy to " << config << "\n";
+            return false;
+        }
+    }
+
+    bool ok = false;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(BANK_DATABASE_DRIVER, "loadgen");
+        database.setDatabaseName(bank);
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            ok = database.transaction() &&
+                 query.exec("DELETE FROM cards") &&
+                 query.exec("DELETE FROM clients");
+            QSqlQuery client(database);
+            QSqlQuery card(database);
+            ok = ok &&
+                 client.prepare("INSERT INTO clients (id, first_name, last_name, gender_male, tax_code) VALUES (?, ?, ?, ?, ?)") &&
+                 card.prepare("INSERT INTO cards (card_number, client_id, balance, pin, active) VALUES (?, ?, ?, ?, 1)");
+            for(quint32 i = 0; ok && i < options._cards; ++i)
+            {
+                const QString number = cardNumber(i);
+                client.addBindValue(i + 1);
+                client.addBindValue("Load");
+                client.addBindValue(QString("Customer%1").arg(i));
+                client.addBindValue(i % 2);
+                client.addBindValue(number);
+                card.addBindValue(number);
+                card.addBindValue(i + 1);
+                card.addBindValue(OPENING_BALANCE);
+                card.addBindValue(PIN);
+                ok = client.exec() && card.exec();
+            }
+            ok = ok && database.commit();
+            // ATMs would race each other to migrate the schema
+            ok = ok && BankSchema::migrate(database);
+            // Migrations leave the DB in WAL mode
+            if(ok && !options._wal)
+            {
+                ok = query.exec("PRAGMA journal_mode=DELETE");
+            }
+            if(!ok)
+            {
+                err << bank << ": " << database.lastError().text() << "\n";
+            }
+            database.close();
+        }
+        else
+        {
+            err << bank << ": " << database.lastError().text() << "\n";
+        }
+    }
+    QSqlDatabase::removeDatabase("loadgen");
+    return ok;
+}
+
+class Worker : public QThread
+{
+public:
+    explicit Worker(const std::function<void()>& job): _job(job) {}
+
+protected:
+    void run()
+    {
+        _job();
+    }
+
+private:
+    std::function<void()> _job;
+};
+
+void printHistogramHeader(QTextStream& out, const char* what)
+{
+    out << QString("%1 %2 %3 %4 %5 %6 %7\n")
+           .arg(QString(what), -20)
+           .arg("count", 10)
+           .arg("mean us", 10)
+           .arg("p50 us", 10)
+           .arg("p99 us", 10)
+           .arg("p999 us", 10)
+           .arg("max us", 10);
+}
+
+void printHistogram(QTextStream& out, const char* name, const Histogram& histogram)
+{
+    out << QString("%1 %2 %3 %4 %5 %6 %7\n")
+           .arg(QString(name), -20)
+           .arg(histogram.count(), 10)
+           .arg(QString::number(histogram.meanUs(), 'f', 1), 10)
+           .arg(QString::number(histogram.percentileUs(0.50), 'f', 1), 10)
+           .arg(QString::number(histogram.percentileUs(0.99), 'f', 1), 10)
+           .arg(QString::number(histogram.percentileUs(0.999), 'f', 1), 10)
+           .arg(QString::number(histogram.maxUs(), 'f', 1), 10);
+}
+
+void report(QTextStream& out, const Options& options, const CardPicker& cards, const Stats& total)
+{
+    const double seconds = total._elapsed_ns / 1e9;
+    quint64 sessions = 0;
+    for(int op = 0; op < OP_COUNT; ++op)
+    {
+        sessions += total._sessions[op].count();
+    }
+    out << QString("%1 ATMs, %2 cards, %3, think %4 ms\n")
+           .arg(options._atms)
+           .arg(options._cards)
+           .arg(options._zipf > 0 ? QString("zipf %1").arg(options._zipf) : QString("uniform"))
+           .arg(options._think_ms);
+    out << QString("Hottest card gets %1% of sessions, hottest 1% of cards get %2%\n")
+           .arg(QString::number(100 * cards.share(1), 'f', 2))
+           .arg(QString::number(100 * cards.share(qMax<quint32>(1, options._cards / 100)), 'f', 2));
+    out << QString("%1 sessions in %2 s: %3 sessions/s\n\n")
+           .arg(sessions)
+           .arg(QString::number(seconds, 'f', 2))
+           .arg(QString::number(seconds > 0 ? sessions / seconds : 0, 'f', 1));
+
+    printHistogramHeader(out, "session");
+    for(int op = 0; op < OP_COUNT; ++op)
+    {
+        printHistogram(out, OPERATION_NAMES[op], total._sessions[op]);
+    }
+    out << "\n" << QString("%1 %2 %3 %4 %5\n")
+                   .arg("outcome", -20).arg("per s", 10).arg("completed", 10).arg("rejected", 10).arg("step-ups", 10);
+    for(int op = 0; op < OP_COUNT; ++op)
+    {
+        out << QString("%1 %2 %3 %4 %5\n")
+               .arg(QString(OPERATION_NAMES[op]), -20)
+               .arg(QString::number(seconds > 0 ? total._sessions[op].count() / seconds : 0, 'f', 1), 10)
+               .arg(total._completed[op], 10)
+               .arg(total._rejected[op], 10)
+               .arg(total._step_ups[op], 10);
+    }
+    out << "\n";
+    printHistogramHeader(out, "input in state");
+    for(int step = 0; step < STEP_COUNT; ++step)
+    {
+        if(total._steps[step].count())
+        {
+            printHistogram(out, STEP_NAMES[step], total._steps[step]);
+        }
+    }
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    Options options;
+    if(!parseOptions(QCoreApplication::arguments(), options, err))
+    {
+        err << "Usage: loadgen [--atms N] [--cards N] [--distribution zipf|uniform] [--zipf S]\n"
+               "               [--mix balance=W,withdraw=W,transfer=W,mobile=W,bad-card=W,bad-pin=W]\n"
+               "               [--think ms] [--duration s | --sessions N] [--dir path] [--config atm.ini]\n"
+               "               [--wal] [--seed N]\n";
+        return 2;
+    }
+    if(!QDir().mkpath(options._directory) || !generateBank(options, err))
+    {
+        return 2;
+    }
+    // ATMs find bank DB, configuration and audit directory in the current directory
+    if(!QDir::setCurrent(options._directory))
+    {
+        err << options._directory << ": cannot change to it\n";
+        return 2;
+    }
+
+    const CardPicker cards(options._cards, options._zipf);
+    std::discrete_distribution<int> mixTemplate(options._mix, options._mix + OP_COUNT);
+
+    std::vector<Stats> stats(options._atms);
+    QSemaphore ready;
+    QSemaphore go;
+    std::atomic<qint64> remaining(options._sessions);
+    std::vector<Worker*> workers;
+    for(int t = 0; t < options._atms; ++t)
+    {
+        workers.push_back(new Worker([&, t]() {
+            Stats& own = stats[t];
+            std::mt19937_64 random(options._seed + t);
+            std::discrete_distribution<int> mix(mixTemplate);
+            std::exponential_distribution<double> think(options._think_ms > 0 ? 1.0 / options._think_ms : 1.0);
+            std::uniform_int_distribution<quint32> unknown(0, FIRST_CARD - 1);
+
+            // ATM and its connection belong to this thread
+            ProbedATM atm;
+            atm.powerOn();
+            Customer customer(atm, own);
+            ready.release();
+            go.acquire();
+
+            QElapsedTimer clock;
+            clock.start();
+            const qint64 durationNs = static_cast<qint64>(options._duration_s) * 1000000000;
+            int withdrawals = 0;
+            for(;;)
+            {
+                if(options._sessions ? remaining.fetch_sub(1) <= 0 : clock.nsecsElapsed() >= durationNs)
+                {
+                    break;
+                }
+                const Operation operation = static_cast<Operation>(mix(random));
+                const quint32 card = cards.pick(random);
+                quint32 recepient = cards.pick(random);
+                if(recepient == card)
+                {
+                    recepient = (card + 1) % options._cards;
+                }
+                if(operation == OP_WITHDRAW && ++withdrawals % REFILL_EVERY == 0)
+                {
+                    atm.refill();
+                }
+                customer.serve(operation,
+                               (operation == OP_BAD_CARD) ? QString("%1").arg(unknown(random), 8, 10, QChar('0'))
+                                                          : cardNumber(card),
+                               cardNumber(recepient));
+                own._elapsed_ns = clock.nsecsElapsed();
+                if(options._think_ms > 0)
+                {
+                    QThread::usleep(static_cast<unsigned long>(think(random) * 1000));
+                }
+            }
+            atm.powerOff();
+        }));
+        workers.back()->start();
+    }
+    ready.acquire(options._atms);
+    out << "All " << options._atms << " ATMs powered on in " << options._directory << ", measuring...\n";
+    out.flush();
+    go.release(options._atms);
+
+    Stats total;
+    for(int t = 0; t < options._atms; ++t)
+    {
+        workers[t]->wait();
+        delete workers[t];
+        total.merge(stats[t]);
+    }
+    report(out, options, cards, total);
+    return 0;
+}
@@ -0,0 +1,191 @@
+// Throughput of the card reject path.
+//
+// 1. "exceptions": the way rejects used to be reported: an exception carrying
+//    a QString message converted to std::string, caught by a five-way ladder.
+// 2. "status": the way they are reported now: a CardStatus value and a switch.
+// 3. "ATM": the whole current reject path of an ATM with a headless terminal
+//    (validation, card filter, eject), fed with unknown and malformed card numbers.
+// 4. "HeadlessATM": the same path with no modules at all, resolved at compile time.
+//
+// Usage: rejectpath [iterations]
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QTextStream>
+#include <stdexcept>
+#include <string>
+
+#include "ATM.h"
+#include "HeadlessTerminal.h"
+
+namespace
+{
+
+// Replica of the former exception hierarchy
+class InternalError : public std::runtime_error
+{
+public:
+    explicit InternalError(QString message): std::runtime_error(message.toStdString()) {}
+};
+class ConnectionFailed : public InternalError
+{
+public:
+    ConnectionFailed(): InternalError("Failed to connect to bank database.") {}
+};
+class QueryFailed : public InternalError
+{
+public:
+    QueryFailed(): InternalError("Query execution failed.") {}
+};
+class FailedToRead : public InternalError
+{
+public:
+    FailedToRead(): InternalError("Failed to read card.") {}
+};
+class Inactive : public InternalError
+{
+public:
+    Inactive(): InternalError("Inserted card is inactive.") {}
+};
+
+enum Status { OK, UNREADABLE, INACTIVE, DB_UNAVAILABLE, DB_FAILED };
+
+volatile int sink = 0;
+
+// Keep the compiler from seeing through the calls
+#if defined(__GNUC__)
+#define NOINLINE __attribute__((noinline))
+#elif defined(_MSC_VER)
+#define NOINLINE __declspec(noinline)
+#else
+#define NOINLINE
+#endif
+
+NOINLINE void lookupThrowing(int i)
+{
+    if(i % 2)
+    {
+        throw FailedToRead();
+    }
+    throw Inactive();
+}
+
+NOINLINE Status lookupReturning(int i)
+{
+    return (i % 2) ? UNREADABLE : INACTIVE;
+}
+
+void handleThrowing(int i)
+{
+    try
+    {
+        lookupThrowing(i);
+    }
+    catch(const ConnectionFailed&)
+    {
+        sink = sink + 1;
+    }
+    catch(const QueryFailed&)
+    {
+        sink = sink + 2;
+    }
+    catch(const FailedToRead&)
+    {
+        sink = sink + 3;
+    }
+    catch(const Inactive&)
+    {
+        sink = sink + 4;
+    }
+    catch(const InternalError&)
+    {
+        sink = sink + 5;
+    }
+}
+
+void handleReturning(int i)
+{
+    switch(lookupReturning(i))
+    {
+    case DB_UNAVAILABLE:
+        sink = sink + 1;
+        break;
+    case DB_FAILED:
+        sink = sink + 2;
+        break;
+    case UNREADABLE:
+        sink = sink + 3;
+        break;
+    case INACTIVE:
+        sink = sink + 4;
+        break;
+    default:
+        sink = sink + 5;
+        break;
+    }
+}
+
+void report(QTextStream& out, const char* name, int iterations, qint64 ns)
+{
+    out << QString("%1 %2 rejects/s  %3 ns/reject\n")
+           .arg(QString(name), -12)
+           .arg(QString::number(iterations * 1e9 / ns, 'f', 0), 12)
+           .arg(QString::number(static_cast<double>(ns) / iterations, 'f', 1), 8);
+}
+
+// Feed unknown and malformed card numbers to a powered ATM
+template <class Machine>
+void rejectCards(QTextStream& out, const char* name, Machine& atm, int iterations)
+{
+    const QString unknownCard = "99999999";     // Well-formed, but no such card
+    const QString malformedCard = "12ab";
+    atm.powerOn();
+    QElapsedTimer timer;
+    timer.start();
+    for(int i = 0; i < iterations; ++i)
+    {
+        atm.processInput((i % 2) ? unknownCard : malformedCard);
+    }
+    report(out, name, iterations, timer.nsecsElapsed());
+    atm.powerOff();
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = QCoreApplication::arguments();
+    const int iterations = (args.size() > 1) ? args[1].toInt() : 1000000;
+    QTextStream out(stdout);
+    QElapsedTimer timer;
+
+    timer.start();
+    for(int i = 0; i < iterations; ++i)
+    {
+        handleThrowing(i);
+    }
+    report(out, "exceptions", iterations, timer.nsecsElapsed());
+
+    timer.start();
+    for(int i = 0; i < iterations; ++i)
+    {
+        handleReturning(i);
+    }
+    report(out, "status", iterations, timer.nsecsElapsed());
+
+    // End-to-end reject path of a real ATM.
+    // One ATM at a time: each of them takes the default DB connection.
+    const int atmIterations = iterations / 10;
+    {
+        HeadlessTerminal terminal;
+        ATM atm(&terminal);
+        rejectCards(out, "ATM", atm, atmIterations);
+    }
+    {
+        HeadlessATM atm;
+        rejectCards(out, "HeadlessATM", atm, atmIterations);
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+// Heap allocations made by a customer session.
+//
+// Global operator new is replaced with a counting one; only allocations made
+// by the thread driving the ATM are counted (the audit flusher and the limits
+// writer have threads of their own).
+//
+// Phases:
+// 1. power on;
+// 2. card insertion (DB query, card data);
+// 3. PIN entry (PIN hash lookup);
+// 4. balance display, a fresh DB read every time;
+// 5. steady state: menu navigation back and forth, which must not allocate;
+// 6. withdrawals (debit, history, cassette counts);
+// 7. card ejection.
+//
+// Phases that go to the DB allocate inside QtSql: they are reported, per step,
+// so that a change in them shows, but only the steady state is held to zero.
+// Exits with 1 if the steady state allocated anything.
+//
+// Usage: sessionalloc [iterations]
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QTextStream>
+#include <cstdlib>
+#include <new>
+
+#include "ATM.h"
+#include "HeadlessTerminal.h"
+
+namespace
+{
+
+thread_local unsigned long long allocations = 0;
+
+} // namespace
+
+void* operator new(size_t size)
+{
+    ++allocations;
+    void* memory = malloc(size ? size : 1);
+    if(!memory)
+    {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+    free(memory);
+}
+
+namespace
+{
+
+void report(QTextStream& out, const char* phase, unsigned long long count, int iterations = 1)
+{
+    out << QString("%1 %2 allocations").arg(QString(phase), -12).arg(count, 8);
+    if(iterations > 1)
+    {
+        out << QString("  (%1 per step)").arg(static_cast<double>(count) / iterations, 0, 'f', 2);
+    }
+    out << "\n";
+    out.flush();
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = QCoreApplication::arguments();
+    const int iterations = (args.size() > 1) ? args[1].toInt() : 100000;
+    QTextStream out(stdout);
+
+    HeadlessTerminal terminal;
+    ATM atm(&terminal);
+
+    // Inputs are prepared up front, just like key strings of a keyboard
+    const QString card = "00010001";
+    const QString pin = "0000";
+    const QString balanceOptions = "1";
+    const QString displayBalance = "1";
+    const QString withdrawal = "2";
+    const QString amount = "50";
+    const QString back = "0";
+    // Few enough to stay within the hourly velocity limit
+    const int withdrawals = 3;
+    const int balances = qMax(1, qMin(iterations, 1000));
+
+    unsigned long long start = allocations;
+    atm.powerOn();
+    report(out, "power on", allocations - start);
+
+    start = allocations;
+    atm.processInput(card);
+    report(out, "card", allocations - start);
+
+    start = allocations;
+    atm.processInput(pin);
+    report(out, "PIN", allocations - start);
+
+    start = allocations;
+    for(int i = 0; i < balances; ++i)
+    {
+        atm.processInput(balanceOptions);
+        atm.processInput(displayBalance);
+        atm.processInput(back);
+    }
+    report(out, "balance", allocations - start, balances);
+
+    // Warm up: first pass may touch lazily initialized state
+    atm.processInput(balanceOptions);
+    atm.processInput(back);
+
+    start = allocations;
+    for(int i = 0; i < iterations; ++i)
+    {
+        atm.processInput(balanceOptions);
+        atm.processInput(back);
+    }
+    const unsigned long long steady = allocations - start;
+    report(out, "menu", steady, iterations * 2);
+
+    start = allocations;
+    for(int i = 0; i < withdrawals; ++i)
+    {
+        atm.processInput(withdrawal);
+        atm.processInput(amount);
+        atm.processInput(back);
+    }
+    report(out, "withdrawal", allocations - start, withdrawals);
+
+    start = allocations;
+    atm.processInput(back);     // Complete work: card is ejected
+    report(out, "eject", allocations - start);
+
+    atm.powerOff();
+    return (steady == 0) ? 0 : 1;
+}
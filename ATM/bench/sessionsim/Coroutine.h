@@ -0,0 +1,78 @@
+#ifndef COROUTINE_H
+#define COROUTINE_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+// Coroutine running one terminal's dialog.
+//
+// Starts suspended: the worker owning the terminal resumes it first, and every
+// later resumption happens on that worker too. Whoever holds the Task destroys
+// the frame, which is fine while it is suspended at any co_await.
+class Task
+{
+public:
+    struct promise_type
+    {
+        Task get_return_object()
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept
+        {
+            return std::suspend_always();
+        }
+        std::suspend_always final_suspend() noexcept
+        {
+            return std::suspend_always();
+        }
+        void return_void() {}
+        void unhandled_exception()
+        {
+            std::terminate();
+        }
+    };
+
+    Task(): _handle() {}
+    Task(Task&& other) noexcept: _handle(std::exchange(other._handle, std::coroutine_handle<promise_type>())) {}
+    Task& operator=(Task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            _handle = std::exchange(other._handle, std::coroutine_handle<promise_type>());
+        }
+        return *this;
+    }
+    ~Task()
+    {
+        reset();
+    }
+
+    void resume()
+    {
+        _handle.resume();
+    }
+    bool done() const
+    {
+        return !_handle || _handle.done();
+    }
+    void reset()
+    {
+        if(_handle)
+        {
+            _handle.destroy();
+            _handle = std::coroutine_handle<promise_type>();
+        }
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle): _handle(handle) {}
+    Task(const Task&);
+    Task& operator=(const Task&);
+
+    std::coroutine_handle<promise_type> _handle;
+};
+
+#endif // COROUTINE_H
@@ -0,0 +1,224 @@
+// Customer dialog of a simulated terminal, written top to bottom as one coroutine.
+//
+// Where BasicATM keeps the dialog's place in _state and _menu_state and carries
+// amounts over in _pending_transfer_amount between calls to processInput(),
+// here the place is the co_await the dialog is suspended at, and everything
+// entered so far lives in local variables.
+//
+// Bank side is the ATM's own: cards are read with ATMBase::SELECT_CARD_BY_NUMBER,
+// PINs are checked against pin_hashes, and every debit is committed by
+// ATMBase::commitOnce() with the changes ATMBase commits with it: transaction ID,
+// credit (into the terminal's slot for a hot account), history entries and the
+// queued top-up. Generated cards are all in the base currency, so no exchange
+// rate is involved.
+
+#include "SessionEngine.h"
+#include "ATMBase.h"
+#include "CardHistory.h"
+#include "CardNumberValidator.h"
+#include "HotAccounts.h"
+#include "IdempotencyIndex.h"
+#include "PinVerifier.h"
+#include "TopUpGateway.h"
+
+#include <QDateTime>
+#include <QtSql>
+
+// As the ATM's
+static const int MAX_PIN_ERRORS = 3;
+
+struct CardData
+{
+    bool _found;
+    bool _active;
+    QString _pin;       // Only used until the card has a hash
+    double _balance;
+};
+
+static bool selectCard(QSqlDatabase& database, const QString& cardNumber, CardData& card)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.prepare(ATMBase::SELECT_CARD_BY_NUMBER))
+    {
+        return false;
+    }
+    query.addBindValue(cardNumber);
+    if(!query.exec())
+    {
+        return false;
+    }
+    card._found = query.next();
+    if(card._found)
+    {
+        card._active = query.value(0).toBool();
+        card._pin = query.value(1).toString();
+        card._balance = query.value(2).toDouble();
+    }
+    return !query.lastError().isValid();
+}
+
+// Same rule as ATMBase::beginPinCheck(): the card's hash, or cards.pin if it has none yet.
+// The KDF runs on the DB lane, which waits for it as a headless ATM's thread does.
+static bool checkPin(QSqlDatabase& database, const QString& cardNumber, const CardData& card, const QString& pin,
+                     bool& matched)
+{
+    QByteArray stored;
+    if(!PinVerifier::selectHash(database, cardNumber, stored))
+    {
+        return false;
+    }
+    matched = stored.isEmpty() ? (pin == card._pin) : PinVerifier::matches(pin, stored);
+    return true;
+}
+
+static bool deactivateCard(QSqlDatabase& database, const QString& cardNumber)
+{
+    QSqlQuery query(database);
+    return query.exec(ATMBase::DEACTIVATE_CARD.arg(cardNumber));
+}
+
+// Debit 'amount' as ATMBase does for 'operation', with what commits with the debit.
+// 'moved' is false if the card cannot pay or the beneficiary is unknown.
+static bool debit(QSqlDatabase& database, const Bank& bank, int slot, const QString& cardNumber, Operation operation,
+                  double amount, const QString& counterparty, bool& moved)
+{
+    moved = false;
+    // Card data is refreshed before the debit
+    CardData card = {false, false, QString(), 0};
+    if(!selectCard(database, cardNumber, card))
+    {
+        return false;
+    }
+    if(!card._found || !card._active || amount > card._balance)
+    {
+        return true;
+    }
+    const qint64 now = QDateTime::currentMSecsSinceEpoch() / 1000;
+    const bool hot = bank._hot_accounts->isHot(cardNumber);
+    QVector<ATMBase::BalanceChange> changes;
+    const ATMBase::BalanceChange withdrawal = {ATMBase::WITHDRAW_FUNDS.arg(cardNumber, QString::number(amount)),
+                                               AuditLog::STMT_WITHDRAW_FUNDS, amount, cardNumber, QVariantList()};
+    changes.append(withdrawal);
+    switch(operation)
+    {
+    case OP_TRANSFER:
+    {
+        CardData target = {false, false, QString(), 0};
+        if(!selectCard(database, counterparty, target))
+        {
+            return false;
+        }
+        if(CardNumberValidator::validate(counterparty).status != CardNumberValidator::VALID || !target._found)
+        {
+            return true;
+        }
+        const bool targetHot = bank._hot_accounts->isHot(counterparty);
+        changes.append(ATMBase::transferCredit(counterparty, amount, slot, targetHot));
+        changes.append(ATMBase::historyEntry(cardNumber, CardHistory::ENTRY_TRANSFER_OUT, -amount, now, counterparty, hot));
+        changes.append(ATMBase::historyEntry(counterparty, CardHistory::ENTRY_TRANSFER_IN, amount, now, cardNumber, targetHot));
+        break;
+    }
+    case OP_MOBILE:
+        changes.append(ATMBase::historyEntry(cardNumber, CardHistory::ENTRY_MOBILE_RECHARGE, -amount, now, counterparty, hot));
+        changes.append(ATMBase::queuedTopUp(TopUpGateway::makeRequest(cardNumber, counterparty, amount, now), slot));
+        break;
+    default:
+        changes.append(ATMBase::historyEntry(cardNumber, CardHistory::ENTRY_WITHDRAWAL, -amount, now, QString(), hot));
+        break;
+    }
+    const ATMBase::ApplyResult result = ATMBase::commitOnce(database, IdempotencyIndex::newId(),
+                                                            changes.constData(), changes.size());
+    moved = (result == ATMBase::APPLY_DONE);
+    return result != ATMBase::APPLY_FAILED;
+}
+
+Task Terminal::serve()
+{
+    for(;;)
+    {
+        const QString cardNumber = CardNumberValidator::normalize(co_await input(PROMPT_CARD));
+        if(CardNumberValidator::validate(cardNumber).status != CardNumberValidator::VALID)
+        {
+            ++stats()._rejected_cards;
+            continue;
+        }
+        CardData card = {false, false, QString(), 0};
+        if(!co_await db([&](QSqlDatabase& database) { return selectCard(database, cardNumber, card); }))
+        {
+            ++stats()._db_failures;
+            continue;
+        }
+        if(!card._found || !card._active)
+        {
+            ++stats()._rejected_cards;
+            continue;
+        }
+
+        bool authorized = false;
+        bool checked = true;
+        for(int attempts = 0; checked && attempts < MAX_PIN_ERRORS && !authorized; ++attempts)
+        {
+            const QString pin = co_await input(PROMPT_PIN);
+            checked = co_await db([&](QSqlDatabase& database) { return checkPin(database, cardNumber, card, pin, authorized); });
+        }
+        if(!checked)
+        {
+            // Card is returned, attempts untouched
+            ++stats()._db_failures;
+            continue;
+        }
+        if(!authorized)
+        {
+            // Card is seized
+            co_await db([&](QSqlDatabase& database) { return deactivateCard(database, cardNumber); });
+            ++stats()._rejected_cards;
+            continue;
+        }
+
+        for(;;)
+        {
+            const int choice = (co_await input(PROMPT_MENU)).toInt();
+            if(choice < 1 || choice > OP_COUNT)
+            {
+                // 0 or anything else: eject
+                break;
+            }
+            const Operation operation = static_cast<Operation>(choice - 1);
+            ++stats()._operations[operation];
+            bool moved = true;
+            bool succeeded = false;
+            if(operation == OP_BALANCE)
+            {
+                succeeded = co_await db([&](QSqlDatabase& database) { return selectCard(database, cardNumber, card); });
+            }
+            else
+            {
+                const double amount = (co_await input(PROMPT_AMOUNT)).toDouble();
+                QString counterparty;
+                if(operation == OP_TRANSFER)
+                {
+                    counterparty = CardNumberValidator::normalize(co_await input(PROMPT_RECEPIENT));
+                }
+                else if(operation == OP_MOBILE)
+                {
+                    counterparty = co_await input(PROMPT_PHONE);
+                }
+                succeeded = co_await db([&](QSqlDatabase& database) {
+                    return debit(database, _bank, _number, cardNumber, operation, amount, counterparty, moved);
+                });
+            }
+            if(!succeeded)
+            {
+                ++stats()._db_failures;
+                break;
+            }
+            if(!moved)
+            {
+                ++stats()._refused[operation];
+            }
+            co_await input(PROMPT_RESULT);
+        }
+        ++stats()._sessions;
+    }
+}
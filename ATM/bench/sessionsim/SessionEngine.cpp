@@ -0,0 +1,453 @@
+#include "SessionEngine.h"
+
+#include <QtSql>
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+
+//==========
+// Histogram
+
+Histogram::Histogram():
+    _buckets(BUCKETS, 0),
+    _count(0),
+    _sum_ns(0),
+    _max_ns(0)
+{}
+
+void Histogram::record(qint64 ns)
+{
+    const quint64 value = static_cast<quint64>(qMax(ns, Q_INT64_C(0)));
+    ++_buckets[bucketOf(value)];
+    ++_count;
+    _sum_ns += value;
+    _max_ns = qMax(_max_ns, value);
+}
+
+void Histogram::merge(const Histogram& other)
+{
+    for(int i = 0; i < BUCKETS; ++i)
+    {
+        _buckets[i] += other._buckets[i];
+    }
+    _count += other._count;
+    _sum_ns += other._sum_ns;
+    _max_ns = qMax(_max_ns, other._max_ns);
+}
+
+double Histogram::meanUs() const
+{
+    return _count ? _sum_ns / 1000.0 / _count : 0;
+}
+
+// Upper bound of the bucket holding the q-th quantile
+double Histogram::percentileUs(double q) const
+{
+    if(!_count)
+    {
+        return 0;
+    }
+    const quint64 rank = qMax(static_cast<quint64>(q * _count + 0.999999), Q_UINT64_C(1));
+    quint64 seen = 0;
+    for(int i = 0; i < BUCKETS; ++i)
+    {
+        seen += _buckets[i];
+        if(seen >= rank)
+        {
+            return qMin(upperBound(i), _max_ns) / 1000.0;
+        }
+    }
+    return maxUs();
+}
+
+int Histogram::bucketOf(quint64 value)
+{
+    if(value < 2 * SUB_BUCKETS)
+    {
+        return static_cast<int>(value);
+    }
+    int exponent = 0;
+    while(value >> (exponent + 1))
+    {
+        ++exponent;
+    }
+    return (exponent - SUB_BITS) * SUB_BUCKETS + static_cast<int>(value >> (exponent - SUB_BITS));
+}
+
+quint64 Histogram::upperBound(int bucket)
+{
+    if(bucket < 2 * SUB_BUCKETS)
+    {
+        return static_cast<quint64>(bucket);
+    }
+    const int exponent = bucket / SUB_BUCKETS + SUB_BITS - 1;
+    const quint64 mantissa = static_cast<quint64>(bucket - (exponent - SUB_BITS) * SUB_BUCKETS);
+    return ((mantissa + 1) << (exponent - SUB_BITS)) - 1;
+}
+
+Stats::Stats():
+    _sessions(0),
+    _db_failures(0),
+    _rejected_cards(0)
+{
+    std::fill(_operations, _operations + OP_COUNT, 0);
+    std::fill(_refused, _refused + OP_COUNT, 0);
+}
+
+void Stats::merge(const Stats& other)
+{
+    for(int p = 0; p < PROMPT_COUNT; ++p)
+    {
+        _responses[p].merge(other._responses[p]);
+    }
+    for(int op = 0; op < OP_COUNT; ++op)
+    {
+        _operations[op] += other._operations[op];
+        _refused[op] += other._refused[op];
+    }
+    _sessions += other._sessions;
+    _db_failures += other._db_failures;
+    _rejected_cards += other._rejected_cards;
+}
+
+//==========
+// Customer
+
+static const QString PIN = "0000";
+static const QString BACK = "0";
+static const QString WITHDRAWAL_AMOUNT = "100";
+static const QString OTHER_AMOUNT = "10";
+static const QString PHONE_NUMBER = "380501234567";
+
+Customer::Customer(const Population& population, quint64 seed):
+    _population(population),
+    _random(seed),
+    _mix(population._mix, population._mix + OP_COUNT),
+    _think(population._think_ms > 0 ? 1.0 / population._think_ms : 1.0),
+    _operation(OP_BALANCE),
+    _card(0),
+    _asked(false)
+{}
+
+QString Customer::card(quint32 index) const
+{
+    return QString::number(_population._first_card + index);
+}
+
+QString Customer::answer(Prompt prompt)
+{
+    switch(prompt)
+    {
+    case PROMPT_CARD:
+        // Next customer
+        _operation = static_cast<Operation>(_mix(_random));
+        _card = std::uniform_int_distribution<quint32>(0, _population._cards - 1)(_random);
+        _asked = false;
+        return card(_card);
+    case PROMPT_PIN:
+        return PIN;
+    case PROMPT_MENU:
+        if(_asked)
+        {
+            return BACK;
+        }
+        _asked = true;
+        return QString::number(_operation + 1);
+    case PROMPT_AMOUNT:
+        return (_operation == OP_WITHDRAW) ? WITHDRAWAL_AMOUNT : OTHER_AMOUNT;
+    case PROMPT_RECEPIENT:
+        return card((_card + 1 + std::uniform_int_distribution<quint32>(0, _population._cards - 2)(_random)) % _population._cards);
+    case PROMPT_PHONE:
+        return PHONE_NUMBER;
+    default:
+        return BACK;
+    }
+}
+
+qint64 Customer::thinkNs()
+{
+    return (_population._think_ms > 0) ? static_cast<qint64>(_think(_random) * 1000000) : 0;
+}
+
+//==========
+// Awaitables
+
+void InputCall::await_suspend(std::coroutine_handle<> handle)
+{
+    const qint64 now = SessionEngine::now();
+    Stats& stats = _terminal.stats();
+    if(_terminal._delivered_ns)
+    {
+        stats._responses[_terminal._answered].record(now - _terminal._delivered_ns);
+        _terminal._delivered_ns = 0;
+    }
+    // Customer makes up their mind now; the input arrives once they are done thinking
+    _terminal._input = _terminal._customer.answer(_prompt);
+    _terminal._answered = _prompt;
+    _terminal._waiting = handle;
+    _terminal._worker->schedule(&_terminal, now + _terminal._customer.thinkNs());
+}
+
+QString InputCall::await_resume()
+{
+    return _terminal._input;
+}
+
+DbCall::DbCall(Terminal& terminal, Job job):
+    _terminal(terminal),
+    _job(std::move(job)),
+    _succeeded(false)
+{}
+
+void DbCall::await_suspend(std::coroutine_handle<> handle)
+{
+    _handle = handle;
+    _terminal._engine.submit(this);
+}
+
+//==========
+// Terminal
+
+Terminal::Terminal(SessionEngine& engine, const Population& population, const Bank& bank, int number, quint64 seed):
+    _engine(engine),
+    _worker(NULL),
+    _bank(bank),
+    _number(number),
+    _customer(population, seed),
+    _answered(PROMPT_CARD),
+    _delivered_ns(0)
+{}
+
+Stats& Terminal::stats()
+{
+    return _worker->stats();
+}
+
+//==========
+// Worker
+
+Worker::Worker():
+    _stopping(false),
+    _timer_sequence(0)
+{}
+
+void Worker::post(std::coroutine_handle<> handle)
+{
+    QMutexLocker locker(&_lock);
+    _posted.push_back(handle);
+    _wake.wakeOne();
+}
+
+void Worker::stop()
+{
+    QMutexLocker locker(&_lock);
+    _stopping = true;
+    _wake.wakeOne();
+}
+
+void Worker::schedule(Terminal* terminal, qint64 dueNs)
+{
+    Timer timer = {dueNs, _timer_sequence++, terminal};
+    _timers.push(timer);
+}
+
+void Worker::run()
+{
+    // Every dialog runs up to its first prompt
+    for(size_t i = 0; i < _terminals.size(); ++i)
+    {
+        _terminals[i]->_task = _terminals[i]->serve();
+        _terminals[i]->_task.resume();
+    }
+
+    std::vector<std::coroutine_handle<> > ready;
+    for(;;)
+    {
+        {
+            QMutexLocker locker(&_lock);
+            if(_posted.empty() && !_stopping)
+            {
+                if(_timers.empty())
+                {
+                    _wake.wait(&_lock);
+                }
+                else
+                {
+                    const qint64 waitNs = _timers.top()._due_ns - SessionEngine::now();
+                    if(waitNs > 0)
+                    {
+                        _wake.wait(&_lock, static_cast<unsigned long>((waitNs + 999999) / 1000000));
+                    }
+                }
+            }
+            if(_stopping)
+            {
+                break;
+            }
+            ready.swap(_posted);
+        }
+
+        // DB results first: those dialogs have been waiting longest
+        for(size_t i = 0; i < ready.size(); ++i)
+        {
+            ready[i].resume();
+        }
+        ready.clear();
+
+        const qint64 now = SessionEngine::now();
+        while(!_timers.empty() && _timers.top()._due_ns <= now)
+        {
+            Terminal* terminal = _timers.top()._terminal;
+            _timers.pop();
+            std::coroutine_handle<> waiting = terminal->_waiting;
+            terminal->_waiting = std::coroutine_handle<>();
+            terminal->_delivered_ns = SessionEngine::now();
+            waiting.resume();
+        }
+    }
+}
+
+//==========
+// DB lanes
+
+class SessionEngine::DbLane : public QThread
+{
+public:
+    DbLane(SessionEngine& engine, int number):
+        _engine(engine),
+        _connection(QString("sessionsim_db_%1").arg(number))
+    {}
+
+protected:
+    void run()
+    {
+        {
+            QSqlDatabase database = QSqlDatabase::addDatabase(_engine._database_driver, _connection);
+            database.setDatabaseName(_engine._database_name);
+            // Failure shows up in the jobs' own results
+            database.open();
+            while(DbCall* call = _engine.nextCall())
+            {
+                call->_succeeded = database.isOpen() && call->_job(database);
+                call->_terminal._worker->post(call->_handle);
+            }
+            database.close();
+        }
+        QSqlDatabase::removeDatabase(_connection);
+    }
+
+private:
+    SessionEngine& _engine;
+    const QString _connection;
+};
+
+//==========
+// Engine
+
+SessionEngine::SessionEngine(int workers, int dbLanes, const QString& databaseDriver, const QString& databaseName):
+    _next_worker(0),
+    _database_driver(databaseDriver),
+    _database_name(databaseName),
+    _stopping(false)
+{
+    for(int i = 0; i < qMax(1, workers); ++i)
+    {
+        _workers.push_back(new Worker());
+    }
+    for(int i = 0; i < qMax(1, dbLanes); ++i)
+    {
+        _db_lanes.push_back(new DbLane(*this, i));
+    }
+}
+
+SessionEngine::~SessionEngine()
+{
+    stop();
+    for(size_t i = 0; i < _workers.size(); ++i)
+    {
+        delete _workers[i];
+    }
+    for(size_t i = 0; i < _db_lanes.size(); ++i)
+    {
+        delete _db_lanes[i];
+    }
+}
+
+qint64 SessionEngine::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void SessionEngine::add(Terminal* terminal)
+{
+    assert(!_workers.front()->isRunning() && "FATAL: Terminal added to a running engine!!!");
+    Worker* worker = _workers[_next_worker++ % _workers.size()];
+    terminal->_worker = worker;
+    worker->_terminals.push_back(terminal);
+}
+
+void SessionEngine::start()
+{
+    for(size_t i = 0; i < _db_lanes.size(); ++i)
+    {
+        _db_lanes[i]->start();
+    }
+    for(size_t i = 0; i < _workers.size(); ++i)
+    {
+        _workers[i]->start();
+    }
+}
+
+void SessionEngine::stop()
+{
+    // Workers first: DB calls still queued complete into frames nobody resumes
+    for(size_t i = 0; i < _workers.size(); ++i)
+    {
+        _workers[i]->stop();
+        _workers[i]->wait();
+    }
+    {
+        QMutexLocker locker(&_calls_lock);
+        _stopping = true;
+        _calls_ready.wakeAll();
+    }
+    for(size_t i = 0; i < _db_lanes.size(); ++i)
+    {
+        _db_lanes[i]->wait();
+    }
+}
+
+Stats SessionEngine::stats() const
+{
+    Stats total;
+    for(size_t i = 0; i < _workers.size(); ++i)
+    {
+        total.merge(_workers[i]->stats());
+    }
+    return total;
+}
+
+void SessionEngine::submit(DbCall* call)
+{
+    QMutexLocker locker(&_calls_lock);
+    _calls.push_back(call);
+    _calls_ready.wakeOne();
+}
+
+// NULL once stopping and drained
+DbCall* SessionEngine::nextCall()
+{
+    QMutexLocker locker(&_calls_lock);
+    while(_calls.empty() && !_stopping)
+    {
+        _calls_ready.wait(&_calls_lock);
+    }
+    if(_calls.empty())
+    {
+        return NULL;
+    }
+    DbCall* call = _calls.front();
+    _calls.pop_front();
+    return call;
+}
@@ -0,0 +1,315 @@
+#ifndef SESSIONENGINE_H
+#define SESSIONENGINE_H
+
+#include <QString>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QThread>
+#include <QSqlDatabase>
+#include <coroutine>
+#include <deque>
+#include <functional>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "Coroutine.h"
+
+class HotAccounts;
+
+// Coroutine session runtime: many simulated terminals on a few threads.
+//
+// Every terminal's dialog (card, PIN, menu, operation, eject) is one coroutine
+// that awaits customer input and DB results. Terminals are spread over a small
+// pool of workers; a worker resumes the dialogs it owns as their input arrives
+// or their DB calls complete, and never blocks on either. DB calls run on
+// a separate pool of DB lanes, each with a connection of its own, sized
+// to what the DB can take rather than to the number of terminals.
+
+class SessionEngine;
+class Terminal;
+class Worker;
+
+// What a dialog waits for the customer to enter
+enum Prompt
+{
+    PROMPT_CARD         = 0,
+    PROMPT_PIN          = 1,
+    PROMPT_MENU         = 2,
+    PROMPT_AMOUNT       = 3,
+    PROMPT_RECEPIENT    = 4,
+    PROMPT_PHONE        = 5,
+    PROMPT_RESULT       = 6,    // Result screen, any key goes back
+    PROMPT_COUNT        = 7
+};
+
+enum Operation
+{
+    OP_BALANCE  = 0,
+    OP_WITHDRAW = 1,
+    OP_TRANSFER = 2,
+    OP_MOBILE   = 3,
+    OP_COUNT    = 4
+};
+
+// Latency histogram: exact below 64 ns, then 32 buckets per power of two
+class Histogram
+{
+public:
+    Histogram();
+
+    void record(qint64 ns);
+    void merge(const Histogram& other);
+
+    inline quint64 count() const
+    {
+        return _count;
+    }
+    double meanUs() const;
+    double percentileUs(double q) const;
+    inline double maxUs() const
+    {
+        return _max_ns / 1000.0;
+    }
+
+private:
+    enum { SUB_BITS = 5, SUB_BUCKETS = 1 << SUB_BITS, BUCKETS = 64 * SUB_BUCKETS };
+
+    static int bucketOf(quint64 value);
+    static quint64 upperBound(int bucket);
+
+    std::vector<quint64> _buckets;
+    quint64 _count;
+    quint64 _sum_ns;
+    quint64 _max_ns;
+};
+
+// Per worker; only touched by the worker's thread
+struct Stats
+{
+    Histogram _responses[PROMPT_COUNT];     // From input to the next prompt, by prompt answered
+    quint64 _sessions;
+    quint64 _operations[OP_COUNT];
+    quint64 _refused[OP_COUNT];             // Not enough funds, unknown beneficiary, etc.
+    quint64 _db_failures;
+    quint64 _rejected_cards;
+
+    Stats();
+    void merge(const Stats& other);
+};
+
+// Settings shared by all simulated customers
+struct Population
+{
+    quint32 _cards;
+    quint32 _first_card;        // Card numbers are _first_card + i
+    double _think_ms;           // Mean time a customer takes to answer a prompt
+    double _mix[OP_COUNT];      // Operation weights
+};
+
+// Bank-side engines the dialogs share, as every ATM has its own. Not owned.
+struct Bank
+{
+    const HotAccounts* _hot_accounts;
+};
+
+// Customer standing at a terminal: answers prompts with one operation per visit
+class Customer
+{
+public:
+    Customer(const Population& population, quint64 seed);
+
+    QString answer(Prompt prompt);
+    // Time to answer, exponentially distributed
+    qint64 thinkNs();
+
+private:
+    QString card(quint32 index) const;
+
+    const Population& _population;
+    std::mt19937_64 _random;
+    std::discrete_distribution<int> _mix;
+    std::exponential_distribution<double> _think;
+    Operation _operation;
+    quint32 _card;
+    bool _asked;                // Operation has been chosen from the menu
+};
+
+// Awaitable: customer's next input
+class InputCall
+{
+public:
+    InputCall(Terminal& terminal, Prompt prompt): _terminal(terminal), _prompt(prompt) {}
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle);
+    QString await_resume();
+
+private:
+    Terminal& _terminal;
+    const Prompt _prompt;
+};
+
+// Awaitable: job run on a DB lane's connection; resumes with its result
+class DbCall
+{
+public:
+    typedef std::function<bool(QSqlDatabase& database)> Job;
+
+    DbCall(Terminal& terminal, Job job);
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+    void await_suspend(std::coroutine_handle<> handle);
+    bool await_resume() const
+    {
+        return _succeeded;
+    }
+
+private:
+    friend class SessionEngine;
+
+    Terminal& _terminal;
+    Job _job;
+    bool _succeeded;
+    std::coroutine_handle<> _handle;
+};
+
+// Simulated terminal: the dialog coroutine and the customer in front of it
+class Terminal
+{
+public:
+    // 'number' is the slot the terminal credits hot accounts into
+    Terminal(SessionEngine& engine, const Population& population, const Bank& bank, int number, quint64 seed);
+
+    // The dialog, from one card to the next, forever
+    Task serve();
+
+private:
+    friend class InputCall;
+    friend class DbCall;
+    friend class Worker;
+    friend class SessionEngine;
+
+    InputCall input(Prompt prompt)
+    {
+        return InputCall(*this, prompt);
+    }
+    DbCall db(DbCall::Job job)
+    {
+        return DbCall(*this, std::move(job));
+    }
+    Stats& stats();
+
+    SessionEngine& _engine;
+    Worker* _worker;
+    const Bank& _bank;
+    const int _number;
+    Customer _customer;
+    Task _task;
+    std::coroutine_handle<> _waiting;   // Dialog waiting for input
+    QString _input;                     // Delivered when its time comes
+    Prompt _answered;
+    qint64 _delivered_ns;               // 0: no input being handled
+};
+
+// Thread resuming the dialogs of the terminals it owns
+class Worker : public QThread
+{
+public:
+    Worker();
+
+    // Any thread: resume 'handle' on this worker
+    void post(std::coroutine_handle<> handle);
+    void stop();
+
+    // Worker's own thread: deliver terminal's input at 'dueNs'
+    void schedule(Terminal* terminal, qint64 dueNs);
+
+    inline Stats& stats()
+    {
+        return _stats;
+    }
+
+protected:
+    void run();
+
+private:
+    friend class SessionEngine;
+
+    struct Timer
+    {
+        qint64 _due_ns;
+        quint64 _sequence;      // Keeps order among timers due at the same time
+        Terminal* _terminal;
+
+        bool operator>(const Timer& other) const
+        {
+            return _due_ns != other._due_ns ? _due_ns > other._due_ns : _sequence > other._sequence;
+        }
+    };
+
+    std::vector<Terminal*> _terminals;
+    Stats _stats;
+
+    // Shared with DB lanes
+    QMutex _lock;
+    QWaitCondition _wake;
+    std::vector<std::coroutine_handle<> > _posted;
+    bool _stopping;
+
+    // Worker's own
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer> > _timers;
+    quint64 _timer_sequence;
+};
+
+class SessionEngine
+{
+public:
+    SessionEngine(int workers, int dbLanes, const QString& databaseDriver, const QString& databaseName);
+    ~SessionEngine();
+
+    // Before start(); terminals go to workers round-robin. Not owned.
+    void add(Terminal* terminal);
+    void start();
+    // Dialogs stay suspended where they are; their frames go with their terminals
+    void stop();
+
+    Stats stats() const;
+    inline int workerCount() const
+    {
+        return static_cast<int>(_workers.size());
+    }
+    inline int dbLaneCount() const
+    {
+        return static_cast<int>(_db_lanes.size());
+    }
+
+    static qint64 now();
+
+private:
+    friend class DbCall;
+    class DbLane;
+
+    void submit(DbCall* call);
+    DbCall* nextCall();
+
+    std::vector<Worker*> _workers;
+    std::vector<DbLane*> _db_lanes;
+    size_t _next_worker;
+    const QString _database_driver;
+    const QString _database_name;
+
+    // Shared between workers and DB lanes
+    QMutex _calls_lock;
+    QWaitCondition _calls_ready;
+    std::deque<DbCall*> _calls;
+    bool _stopping;
+};
+
+#endif // SESSIONENGINE_H
@@ -0,0 +1,339 @@
+// Many simulated terminals on a few threads, with coroutine dialogs.
+//
+// Every terminal's customer dialog is a coroutine (see Dialog.cpp) suspended
+// while its customer thinks or its DB call runs; a small worker pool resumes
+// them. Where bench/loadgen needs a thread and a whole ATM per terminal, this
+// runs tens of thousands of terminals in one process.
+//
+// Dialogs run the bank-side statements of the ATM (card lookup, PIN hash check,
+// debits through ATMBase::commitOnce() with their transaction IDs, credits, hot
+// accounts, history and queued top-ups) on the DB lanes; ATM-side engines
+// (limits, fraud scoring, audit trail, cash) are not simulated. Queued top-ups
+// are left pending: no gateway sends them.
+//
+// Every run gets a fresh copy of bank.db (next to the executable) in the work
+// directory, in WAL mode, with its cards replaced by generated ones. All of them
+// have PIN 0000, hashed as migrated cards are (one hash shared by all, so that
+// generating them takes one KDF).
+//
+// Usage:
+//     sessionsim [options]
+//         --terminals N           simulated terminals (default 10000)
+//         --workers N             threads resuming dialogs (default: number of cores)
+//         --db-lanes N            DB connections, one thread each (default 4)
+//         --cards N               cards in the generated bank (default 10000)
+//         --hot N                 first N cards are hot accounts (default 0)
+//         --pin-log2n N           cost of the PIN hash; the KDF runs on the DB lanes
+//                                 (default 14, as PinVerifier::DEFAULT_COST)
+//         --think MS              mean time a customer takes per prompt (default 1000)
+//         --mix op=W,...          ops: balance, withdraw, transfer, mobile
+//                                 (default balance=50,withdraw=25,transfer=15,mobile=10)
+//         --duration S            default 10
+//         --dir path              work directory (default sessionsim-run)
+//         --seed N
+//
+// Exit code: 0 on success, 2 on errors.
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QtSql>
+#include <algorithm>
+#include <memory>
+
+#include "SessionEngine.h"
+#include "ATMBase.h"
+#include "BankSchema.h"
+#include "HotAccounts.h"
+#include "PinVerifier.h"
+
+static const char* const OPERATION_NAMES[OP_COUNT] = {"balance", "withdraw", "transfer", "mobile"};
+static const char* const PROMPT_NAMES[PROMPT_COUNT] = {"card", "pin", "menu", "amount", "recepient", "phone", "result"};
+
+static const quint32 FIRST_CARD = 10000000;
+static const quint32 MAX_CARDS = 89999999;
+
+struct Options
+{
+    int _terminals;
+    int _workers;
+    int _db_lanes;
+    int _duration_s;
+    QString _directory;
+    quint64 _seed;
+    quint32 _hot_cards;
+    PinVerifier::Cost _pin_cost;
+    Population _population;
+};
+
+static bool parseMix(const QString& text, double (&mix)[OP_COUNT], QTextStream& err)
+{
+    std::fill(mix, mix + OP_COUNT, 0.0);
+    double total = 0;
+    const QStringList parts = text.split(',', QString::SkipEmptyParts);
+    for(int i = 0; i < parts.size(); ++i)
+    {
+        const QStringList pair = parts[i].split('=');
+        int op = 0;
+        while(op < OP_COUNT && pair[0].trimmed() != OPERATION_NAMES[op])
+        {
+            ++op;
+        }
+        bool ok = (pair.size() == 2 && op < OP_COUNT);
+        const double weight = ok ? pair[1].toDouble(&ok) : 0;
+        if(!ok || weight < 0)
+        {
+            err << parts[i] << ": operation=weight expected\n";
+            return false;
+        }
+        mix[op] = weight;
+        total += weight;
+    }
+    if(total <= 0)
+    {
+        err << text << ": no operation has a weight\n";
+        return false;
+    }
+    return true;
+}
+
+static bool parseOptions(const QStringList& args, Options& options, QTextStream& err)
+{
+    options._terminals = 10000;
+    options._workers = qMax(1, QThread::idealThreadCount());
+    options._db_lanes = 4;
+    options._duration_s = 10;
+    options._directory = "sessionsim-run";
+    options._seed = 20161019;
+    options._hot_cards = 0;
+    options._pin_cost = PinVerifier::DEFAULT_COST;
+    options._population._cards = 10000;
+    options._population._first_card = FIRST_CARD;
+    options._population._think_ms = 1000;
+    if(!parseMix("balance=50,withdraw=25,transfer=15,mobile=10", options._population._mix, err))
+    {
+        return false;
+    }
+    for(int i = 1; i < args.size(); ++i)
+    {
+        const QString& arg = args[i];
+        if(i + 1 >= args.size())
+        {
+            err << arg << ": value expected\n";
+            return false;
+        }
+        const QString& value = args[++i];
+        if(arg == "--terminals")
+        {
+            options._terminals = qMax(1, value.toInt());
+        }
+        else if(arg == "--workers")
+        {
+            options._workers = qMax(1, value.toInt());
+        }
+        else if(arg == "--db-lanes")
+        {
+            options._db_lanes = qMax(1, value.toInt());
+        }
+        else if(arg == "--cards")
+        {
+            options._population._cards = qBound<quint32>(2, value.toUInt(), MAX_CARDS);
+        }
+        else if(arg == "--hot")
+        {
+            options._hot_cards = value.toUInt();
+        }
+        else if(arg == "--pin-log2n")
+        {
+            options._pin_cost._log2_n = qBound<int>(1, value.toInt(), PinVerifier::MAX_LOG2_N);
+        }
+        else if(arg == "--think")
+        {
+            options._population._think_ms = qMax(0.0, value.toDouble());
+        }
+        else if(arg == "--mix")
+        {
+            if(!parseMix(value, options._population._mix, err))
+            {
+                return false;
+            }
+        }
+        else if(arg == "--duration")
+        {
+            options._duration_s = qMax(1, value.toInt());
+        }
+        else if(arg == "--dir")
+        {
+            options._directory = value;
+        }
+        else if(arg == "--seed")
+        {
+            options._seed = value.toULongLong();
+        }
+        else
+        {
+            err << arg << ": unknown option\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+// Fresh bank in the work directory: the shipped schema with generated cards
+static bool generateBank(const Options& options, const QString& bank, QTextStream& err)
+{
+    const QString bankTemplate = QDir(QCoreApplication::applicationDirPath()).filePath(BANK_DATABASE_NAME);
+    QFile::remove(bank);
+    if(!QFile::copy(bankTemplate, bank))
+    {
+        err << bankTemplate << ": failed to copy to " << bank << "\n";
+        return false;
+    }
+    bool ok = false;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase(BANK_DATABASE_DRIVER, "sessionsim");
+        database.setDatabaseName(bank);
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            QSqlQuery client(database);
+            QSqlQuery card(database);
+            QSqlQuery pinHash(database);
+            QSqlQuery hot(database);
+            const QByteArray hash = PinVerifier::hash("0000", options._pin_cost);
+            // Tables the migrations add come first, so that the cards can go with them
+            ok = BankSchema::migrate(database) &&
+                 database.transaction() &&
+                 query.exec("DELETE FROM cards") &&
+                 query.exec("DELETE FROM clients") &&
+                 query.exec("DELETE FROM pin_hashes") &&
+                 query.exec("DELETE FROM hot_accounts") &&
+                 client.prepare("INSERT INTO clients (id, first_name, last_name, gender_male, tax_code) VALUES (?, ?, ?, ?, ?)") &&
+                 card.prepare("INSERT INTO cards (card_number, client_id, balance, pin, active) VALUES (?, ?, ?, ?, 1)") &&
+                 pinHash.prepare(PinVerifier::STORE_HASH) &&
+                 hot.prepare("INSERT INTO hot_accounts (card_number) VALUES (?)");
+            for(quint32 i = 0; ok && i < options._population._cards; ++i)
+            {
+                const QString number = QString::number(FIRST_CARD + i);
+                client.addBindValue(i + 1);
+                client.addBindValue("Simulated");
+                client.addBindValue(QString("Customer%1").arg(i));
+                client.addBindValue(i % 2);
+                client.addBindValue(number);
+                card.addBindValue(number);
+                card.addBindValue(i + 1);
+                card.addBindValue(1000000000.0);
+                card.addBindValue("0000");
+                pinHash.addBindValue(number);
+                pinHash.addBindValue(hash);
+                ok = client.exec() && card.exec() && pinHash.exec();
+                if(ok && i < options._hot_cards)
+                {
+                    hot.addBindValue(number);
+                    ok = hot.exec();
+                }
+            }
+            ok = ok && database.commit();
+            if(!ok)
+            {
+                err << bank << ": " << database.lastError().text() << "\n";
+            }
+            database.close();
+        }
+        else
+        {
+            err << bank << ": " << database.lastError().text() << "\n";
+        }
+    }
+    QSqlDatabase::removeDatabase("sessionsim");
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    Options options;
+    if(!parseOptions(QCoreApplication::arguments(), options, err))
+    {
+        err << "Usage: sessionsim [--terminals N] [--workers N] [--db-lanes N] [--cards N] [--hot N]\n"
+               "                  [--pin-log2n N] [--think ms]\n"
+               "                  [--mix balance=W,withdraw=W,transfer=W,mobile=W] [--duration s]\n"
+               "                  [--dir path] [--seed N]\n";
+        return 2;
+    }
+    const QString bank = QDir(options._directory).filePath(BANK_DATABASE_NAME);
+    if(!QDir().mkpath(options._directory) || !generateBank(options, bank, err))
+    {
+        return 2;
+    }
+
+    // Credits to hot accounts are merged in background, as with the ATM
+    HotAccounts hotAccounts;
+    hotAccounts.start(BANK_DATABASE_DRIVER, bank);
+    const Bank shared = {&hotAccounts};
+
+    SessionEngine engine(options._workers, options._db_lanes, BANK_DATABASE_DRIVER, bank);
+    std::vector<std::unique_ptr<Terminal> > terminals;
+    terminals.reserve(options._terminals);
+    for(int i = 0; i < options._terminals; ++i)
+    {
+        terminals.push_back(std::unique_ptr<Terminal>(new Terminal(engine, options._population, shared, i + 1,
+                                                                   options._seed + i)));
+        engine.add(terminals.back().get());
+    }
+
+    const qint64 started = SessionEngine::now();
+    engine.start();
+    QThread::sleep(static_cast<unsigned long>(options._duration_s));
+    engine.stop();
+    const double seconds = (SessionEngine::now() - started) / 1e9;
+    // Suspended dialogs go with their terminals, now that nothing resumes them
+    terminals.clear();
+    hotAccounts.stop();
+
+    const Stats stats = engine.stats();
+    quint64 inputs = 0;
+    for(int p = 0; p < PROMPT_COUNT; ++p)
+    {
+        inputs += stats._responses[p].count();
+    }
+    out << QString("%1 terminals on %2 workers and %3 DB lanes, think %4 ms\n")
+           .arg(options._terminals).arg(engine.workerCount()).arg(engine.dbLaneCount()).arg(options._population._think_ms);
+    out << QString("%1 sessions, %2 inputs in %3 s: %4 sessions/s, %5 inputs/s\n")
+           .arg(stats._sessions).arg(inputs).arg(QString::number(seconds, 'f', 2))
+           .arg(QString::number(stats._sessions / seconds, 'f', 1))
+           .arg(QString::number(inputs / seconds, 'f', 1));
+    out << QString("%1 cards rejected, %2 DB failures\n\n").arg(stats._rejected_cards).arg(stats._db_failures);
+
+    out << QString("%1 %2 %3\n").arg("operation", -12).arg("count", 10).arg("refused", 10);
+    for(int op = 0; op < OP_COUNT; ++op)
+    {
+        out << QString("%1 %2 %3\n").arg(QString(OPERATION_NAMES[op]), -12).arg(stats._operations[op], 10).arg(stats._refused[op], 10);
+    }
+    out << "\n" << QString("%1 %2 %3 %4 %5 %6 %7\n")
+                   .arg("response to", -12).arg("count", 10).arg("mean us", 10).arg("p50 us", 10)
+                   .arg("p99 us", 10).arg("p999 us", 10).arg("max us", 10);
+    for(int p = 0; p < PROMPT_COUNT; ++p)
+    {
+        const Histogram& histogram = stats._responses[p];
+        if(!histogram.count())
+        {
+            continue;
+        }
+        out << QString("%1 %2 %3 %4 %5 %6 %7\n")
+               .arg(QString(PROMPT_NAMES[p]), -12)
+               .arg(histogram.count(), 10)
+               .arg(QString::number(histogram.meanUs(), 'f', 1), 10)
+               .arg(QString::number(histogram.percentileUs(0.50), 'f', 1), 10)
+               .arg(QString::number(histogram.percentileUs(0.99), 'f', 1), 10)
+               .arg(QString::number(histogram.percentileUs(0.999), 'f', 1), 10)
+               .arg(QString::number(histogram.maxUs(), 'f', 1), 10);
+    }
+    return 0;
+}
@@ -0,0 +1,38 @@
+#-------------------------------------------------
+#
+# Tens of thousands of simulated terminals with coroutine dialogs
+#
+#-------------------------------------------------
+
+QT       += core sql
+QT       -= gui
+
+TARGET = sessionsim
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+# Dialogs commit through ATMBase and share its statements
+include(../../ATMCore.pri)
+
+SOURCES += main.cpp \
+    SessionEngine.cpp \
+    Dialog.cpp
+
+HEADERS  += Coroutine.h \
+    SessionEngine.h
+
+# Coroutines need C++20. Core sources built into this target get it too;
+# the ATM itself still builds as C++11.
+QMAKE_CXXFLAGS += -std=c++2a
+*-g++*: QMAKE_CXXFLAGS += -fcoroutines
+
+# Copy database file to target directory after linking
+win32 {
+    DB_SRC_LOCATION = $$replace(PWD,/,\\)
+    DB_DST_LOCATION = $$replace(OUT_PWD,/,\\)
+    QMAKE_POST_LINK += copy $$DB_SRC_LOCATION\\..\\..\\bank.db $$DB_DST_LOCATION\\
+}
+unix {
+    QMAKE_POST_LINK += cp $$PWD/../../bank.db $$OUT_PWD/
+}
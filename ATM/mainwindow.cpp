@@ -3,13 +3,26 @@
 
 #include <cassert>
 
+// A press cannot have waited longer than this for the ATM: the event clock jumped instead
+static const qint64 MAX_EVENT_WAIT_NS = Q_INT64_C(60000000000);
+
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
     ui(new Ui::MainWindow),
     _connected_atm(NULL),
-    keyboard(NULL)
+    keyboard(NULL),
+    _keyboard_enabled(false),   // As in the form
+    _key_pressed_ns(0),
+    _event_clock_offset_ns(0),
+    _event_clock_known(false)
 {
     ui->setupUi(this);
+    QPushButton* const digits[] = {ui->pushButton_0, ui->pushButton_1, ui->pushButton_2, ui->pushButton_3, ui->pushButton_4,
+                                   ui->pushButton_5, ui->pushButton_6, ui->pushButton_7, ui->pushButton_8, ui->pushButton_9};
+    for(size_t i = 0; i < sizeof(digits) / sizeof(digits[0]); ++i)
+    {
+        digits[i]->installEventFilter(this);
+    }
 }
 
 MainWindow::~MainWindow()
@@ -17,20 +30,62 @@ MainWindow::~MainWindow()
     delete ui;
 }
 
-void MainWindow::showText(QString text)
+bool MainWindow::eventFilter(QObject* watched, QEvent* event)
+{
+    // Click only comes with the release, and both wait in the event queue while the ATM is busy
+    if(event->type() == QEvent::MouseButtonPress || event->type() == QEvent::KeyPress)
+    {
+        _key_pressed_ns = pressTime(static_cast<const QInputEvent*>(event));
+    }
+    return QMainWindow::eventFilter(watched, event);
+}
+
+// Input events carry the time the window system took them, in milliseconds of a
+// clock of its own. The smallest difference to SessionTracer::now() seen so far is
+// that of an event which did not wait: it converts the others.
+qint64 MainWindow::pressTime(const QInputEvent* event)
+{
+    const qint64 nowNs = SessionTracer::now();
+    if(event->timestamp() == 0)
+    {
+        // Made up by the application: taken as it comes
+        return nowNs;
+    }
+    const qint64 eventNs = static_cast<qint64>(event->timestamp()) * 1000000;
+    const qint64 offsetNs = nowNs - eventNs;
+    if(!_event_clock_known || offsetNs < _event_clock_offset_ns ||
+       offsetNs - _event_clock_offset_ns > MAX_EVENT_WAIT_NS)
+    {
+        _event_clock_offset_ns = offsetNs;
+        _event_clock_known = true;
+    }
+    return eventNs + _event_clock_offset_ns;
+}
+
+// A click with no press before it, e.g. made with QAbstractButton::click(), is stamped now
+qint64 MainWindow::takePressTime()
+{
+    const qint64 pressedNs = (_key_pressed_ns != 0) ? _key_pressed_ns : SessionTracer::now();
+    _key_pressed_ns = 0;
+    return pressedNs;
+}
+
+void MainWindow::showText(const QString& text)
 {
     ui->textBrowser->setText(text);
 }
 
-void MainWindow::appendText(QString text){
+void MainWindow::appendText(const QString& text){
     ui->textBrowser->moveCursor (QTextCursor::End);
     ui->textBrowser->insertPlainText (text);
     ui->textBrowser->moveCursor (QTextCursor::End);
 }
 
-void MainWindow::printText(QString text)
+void MainWindow::printText(const QString& text)
 {
-    ui->textBrowser_2->insertPlainText(text.append("\n-----\n"));
+    static const QString SEPARATOR = "\n-----\n";
+    ui->textBrowser_2->insertPlainText(text);
+    ui->textBrowser_2->insertPlainText(SEPARATOR);
     ui->textBrowser_2->moveCursor (QTextCursor::End);
 }
 
@@ -66,6 +121,7 @@ void MainWindow::enableKeyboard()
 
 void MainWindow::setKeyboardButtonsEnabled(bool enabled)
 {
+    _keyboard_enabled = enabled;
     this->ui->pushButton_1->setEnabled(enabled);
     this->ui->pushButton_2->setEnabled(enabled);
     this->ui->pushButton_3->setEnabled(enabled);
@@ -89,28 +145,29 @@ void MainWindow::disableEnterBtn(){
 }
 
 bool MainWindow::isEnabledKeyboard(){
-    return ((this->ui->pushButton_1->isEnabled()) && (this->ui->pushButton_2->isEnabled()) &&
-            (this->ui->pushButton_3->isEnabled()) && (this->ui->pushButton_4->isEnabled()) &&
-            (this->ui->pushButton_5->isEnabled()) && (this->ui->pushButton_6->isEnabled()) &&
-            (this->ui->pushButton_7->isEnabled()) && (this->ui->pushButton_8->isEnabled()) &&
-            (this->ui->pushButton_9->isEnabled()) && (this->ui->pushButton_0->isEnabled()) &&
-            (this->ui->pushButton_backspace->isEnabled()));
+    // Kept alongside the buttons: asking 11 widgets on every press is not free
+    return _keyboard_enabled;
 }
 
-void MainWindow::showCardState(QString cardState)
+void MainWindow::showCardState(const QString& cardState)
 {
     ui->cardState->setText(cardState);
 }
 
 void MainWindow::on_enterBtn_clicked()
 {
+    if(_connected_atm->isCheckingPin())
+    {
+        // Keypad is off for the check, not for the input field
+        return;
+    }
     if (!isEnabledKeyboard()){
         _connected_atm->processInput(ui->inputField->text());
         ui->inputField->clear();
         enableKeyboard();
         disableInput();
     }
-    else if (isEnabledKeyboard())
+    else
     {
         _connected_atm->processInput(keyboard->getPin());
         keyboard->clearPin();
@@ -119,52 +176,52 @@ void MainWindow::on_enterBtn_clicked()
 
 void MainWindow::on_pushButton_1_clicked()
 {
-    keyboard->acceptInput('1');
+    keyboard->acceptInput('1', takePressTime());
 }
 
 void MainWindow::on_pushButton_2_clicked()
 {
-    keyboard->acceptInput('2');
+    keyboard->acceptInput('2', takePressTime());
 }
 
 void MainWindow::on_pushButton_3_clicked()
 {
-    keyboard->acceptInput('3');
+    keyboard->acceptInput('3', takePressTime());
 }
 
 void MainWindow::on_pushButton_4_clicked()
 {
-    keyboard->acceptInput('4');
+    keyboard->acceptInput('4', takePressTime());
 }
 
 void MainWindow::on_pushButton_5_clicked()
 {
-    keyboard->acceptInput('5');
+    keyboard->acceptInput('5', takePressTime());
 }
 
 void MainWindow::on_pushButton_6_clicked()
 {
-    keyboard->acceptInput('6');
+    keyboard->acceptInput('6', takePressTime());
 }
 
 void MainWindow::on_pushButton_7_clicked()
 {
-    keyboard->acceptInput('7');
+    keyboard->acceptInput('7', takePressTime());
 }
 
 void MainWindow::on_pushButton_8_clicked()
 {
-    keyboard->acceptInput('8');
+    keyboard->acceptInput('8', takePressTime());
 }
 
 void MainWindow::on_pushButton_9_clicked()
 {
-    keyboard->acceptInput('9');
+    keyboard->acceptInput('9', takePressTime());
 }
 
 void MainWindow::on_pushButton_0_clicked()
 {
-    keyboard->acceptInput('0');
+    keyboard->acceptInput('0', takePressTime());
 }
 
 void MainWindow::on_pushButton_backspace_clicked()
@@ -194,8 +251,12 @@ void MainWindow::on_powerBtn_clicked()
     {
         _connected_atm->powerOn();
         ui->powerBtn->setText("Turn OFF");
-        enableEnterBtn();
-        enableInput();
+        // Out of service, the ATM has nothing to read until it is powered on again
+        if(!_connected_atm->isOutOfService())
+        {
+            enableEnterBtn();
+            enableInput();
+        }
         disableKeyboard();
         disablePrinter();
     }
@@ -205,3 +266,8 @@ void MainWindow::on_cancelButton_clicked()
 {
     _connected_atm->cancelOperation();
 }
+
+void MainWindow::finishPinCheck()
+{
+    _connected_atm->completePinCheck();
+}
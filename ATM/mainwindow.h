@@ -2,6 +2,7 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QInputEvent>
 #include "ATM.h"
 
 
@@ -22,12 +23,23 @@ private:
     Ui::MainWindow *ui;
     ATM * _connected_atm;
     ATM::InputContainer * keyboard;
+    // Whether keypad buttons are enabled; they only change together (see setKeyboardButtonsEnabled)
+    bool _keyboard_enabled;
+    // Press of the digit button whose click comes next, SessionTracer::now() clock; 0 if none
+    qint64 _key_pressed_ns;
+    // From input event timestamps to SessionTracer::now(), once an event is seen
+    qint64 _event_clock_offset_ns;
+    bool _event_clock_known;
 
 public:
     inline void connect(const ATM& atm)
     {
         _connected_atm = const_cast<ATM*>(&atm);
         keyboard = new ATM::InputContainer(const_cast<ATM&>(atm));
+        // PIN checks end on a verifier thread; the rest is done on this one
+        _connected_atm->setPinCheckWakeUp([this]() {
+            QMetaObject::invokeMethod(this, "finishPinCheck", Qt::QueuedConnection);
+        });
     }
     inline void disconnect()
     {
@@ -36,11 +48,11 @@ public:
         keyboard = NULL;
     }
 
-    void showText(QString text);
+    void showText(const QString& text);
 
-    void appendText(QString text);
+    void appendText(const QString& text);
 
-    void printText(QString text);
+    void printText(const QString& text);
 
     void enableInput();
 
@@ -58,10 +70,17 @@ public:
 
     void disableEnterBtn();
 
-    void showCardState(QString cardState);
+    void showCardState(const QString& cardState);
+
+protected:
+    // Stamps presses of the digit buttons (see pressTime())
+    bool eventFilter(QObject* watched, QEvent* event);
 
 private:
     void setKeyboardButtonsEnabled(bool enabled);
+    qint64 pressTime(const QInputEvent* event);
+    // Stamp for the click being handled; every press stamps one click only
+    qint64 takePressTime();
 
 private slots:
     void on_enterBtn_clicked();
@@ -79,6 +98,7 @@ private slots:
     bool isEnabledKeyboard();
     void on_powerBtn_clicked();
     void on_cancelButton_clicked();
+    void finishPinCheck();
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Decoder for ATM audit trail files
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = auditdump
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += $$PWD/../..
+
+SOURCES += main.cpp \
+    ../../AuditLog.cpp
+
+HEADERS  += ../../AuditLog.h
+
+QMAKE_CXXFLAGS += -std=c++11
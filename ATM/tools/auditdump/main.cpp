@@ -0,0 +1,138 @@
+// Prints ATM audit trail files as text, one record per line.
+//
+// Usage: auditdump file.bin [file.bin ...]
+// Rotated files should be given oldest first (audit-1.2.bin audit-1.1.bin audit-1.0.bin).
+// Gaps in sequence numbers mean records were dropped because the flusher fell behind;
+// the record after a gap says how many ("dropped=N").
+// Card numbers are masked, tokens are printed as hex (see CardToken.h).
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QFile>
+#include <QTextStream>
+#include <QStringList>
+#include <cstring>
+
+#include "AuditLog.h"
+
+// Must follow ATM::ATMState and ATM::MenuState
+static const char* const STATE_NAMES[] = {"POWER_OFF", "NO_CARD", "PENDING_PIN", "TOP_MENU", "OUT_OF_SERVICE"};
+static const char* const MENU_STATE_NAMES[] = {
+    "TOP", "SHOW_BALANCE_METHOD", "DISPLAY_BALANCE", "PRINT_BALANCE", "WITHDRAWAL_AMOUNT",
+    "TRANSFER_AMOUNT", "TRANSFER_RECEPIENT", "MOBILE_AMOUNT", "MOBILE_RECEPIENT", "REPORT_RESULT",
+    "CONFIRM_PIN"
+};
+
+template<size_t N>
+static QString name(const char* const (&names)[N], quint8 value)
+{
+    return (value < N) ? QString(names[value]) : QString::number(value);
+}
+
+static QString describe(const AuditRecord& record)
+{
+    switch(record._event)
+    {
+    case AuditLog::EVENT_STATE_CHANGE:
+        return QString("%1/%2 -> %3/%4").arg(name(STATE_NAMES, record._old_state),
+                                             name(MENU_STATE_NAMES, record._old_menu_state))
+                                        .arg(name(STATE_NAMES, record._new_state),
+                                             name(MENU_STATE_NAMES, record._new_menu_state));
+    case AuditLog::EVENT_DB_STATEMENT:
+        return QString("%1 %2 amount=%3").arg(AuditLog::statementName(record._statement),
+                                              record._result ? "ok" : "FAILED",
+                                              QString::number(record._amount));
+    case AuditLog::EVENT_TRANSACTION:
+        return QString("result=%1 amount=%2").arg(QString::number(record._result), QString::number(record._amount));
+    case AuditLog::EVENT_CASH_DISPENSED:
+        return QString("amount=%1").arg(QString::number(record._amount));
+    case AuditLog::EVENT_STARTUP_PHASE:
+        return QString("%1 %2 ms=%3").arg(AuditLog::startupPhaseName(record._statement),
+                                          record._result ? "ok" : "FAILED",
+                                          QString::number(record._amount));
+    case AuditLog::EVENT_READY:
+        return QString("ms=%1").arg(QString::number(record._amount));
+    case AuditLog::EVENT_MAINTENANCE:
+        return QString("%1 %2 amount=%3").arg(AuditLog::maintenanceTaskName(record._statement),
+                                              record._result ? "ok" : "FAILED",
+                                              QString::number(record._amount));
+    case AuditLog::EVENT_SESSION_RECOVERED:
+        return QString("%1 amount=%2").arg(AuditLog::recoveryName(record._result), QString::number(record._amount));
+    case AuditLog::EVENT_OUT_OF_SERVICE:
+        return QString("%1 FAILED ms=%2").arg(AuditLog::startupPhaseName(record._statement),
+                                              QString::number(record._amount));
+    default:
+        return QString("%1/%2").arg(name(STATE_NAMES, record._new_state), name(MENU_STATE_NAMES, record._new_menu_state));
+    }
+}
+
+static bool dump(const QString& path, QTextStream& out, QTextStream& err)
+{
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        err << path << ": " << file.errorString() << "\n";
+        return false;
+    }
+    char header[AuditLog::HEADER_SIZE];
+    quint32 version = 0;
+    quint32 recordSize = 0;
+    if(file.read(header, sizeof(header)) != static_cast<qint64>(sizeof(header)) ||
+       memcmp(header, AuditLog::FILE_MAGIC, sizeof(AuditLog::FILE_MAGIC)) != 0)
+    {
+        err << path << ": not an audit trail file\n";
+        return false;
+    }
+    memcpy(&version, header + 8, sizeof(version));
+    memcpy(&recordSize, header + 12, sizeof(recordSize));
+    if(version != AuditLog::FORMAT_VERSION || recordSize != sizeof(AuditRecord))
+    {
+        err << path << ": unsupported format version " << version << "\n";
+        return false;
+    }
+
+    AuditRecord record;
+    while(file.read(reinterpret_cast<char*>(&record), sizeof(record)) == static_cast<qint64>(sizeof(record)))
+    {
+        char card[sizeof(record._card_number) + 1];
+        memcpy(card, record._card_number, sizeof(record._card_number));
+        card[sizeof(record._card_number)] = '\0';
+
+        const QDateTime time = QDateTime::fromMSecsSinceEpoch(static_cast<qint64>(record._timestamp_ns / 1000000));
+        out << time.toString("yyyy-MM-dd hh:mm:ss.zzz") << QString(".%1").arg(QString::number(record._timestamp_ns % 1000000), 6, QChar('0'))
+            << " atm=" << record._atm_id
+            << " seq=" << record._sequence
+            << " " << AuditLog::eventName(record._event)
+            << " card=" << (card[0] ? card : "-");
+        if(record._card_token)
+        {
+            out << " token=" << QString("%1").arg(record._card_token, 16, 16, QChar('0'));
+        }
+        if(record._dropped_before)
+        {
+            out << " dropped=" << record._dropped_before;
+        }
+        out << " " << describe(record) << "\n";
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = QCoreApplication::arguments();
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    if(args.size() < 2)
+    {
+        err << "Usage: auditdump file.bin [file.bin ...]\n";
+        return 2;
+    }
+    bool ok = true;
+    for(int i = 1; i < args.size(); ++i)
+    {
+        ok = dump(args[i], out, err) && ok;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Offline replay of recorded traffic through FraudScorer
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = fraudreplay
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += $$PWD/../..
+
+SOURCES += main.cpp \
+    ../../FraudScorer.cpp
+
+HEADERS  += ../../FraudScorer.h
+
+QMAKE_CXXFLAGS += -std=c++11
@@ -0,0 +1,146 @@
+// Replays recorded traffic through FraudScorer and prints a verdict for every debit.
+//
+// Input is CSV, one event per line:
+//     time,card_number,event,amount,beneficiary,hour
+// where 'time' is seconds since epoch, 'hour' is local hour of day and
+// 'event' is one of: withdrawal, transfer, mobile, pin_fail.
+// Debits that are not denied are treated as committed, as the ATM would do.
+//
+// Usage: fraudreplay [input.csv] [budget_ns]   (reads stdin if no file given)
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QTextStream>
+#include <QStringList>
+#include <QVector>
+#include <algorithm>
+
+#include "FraudScorer.h"
+
+static bool parseOperation(const QString& name, FraudScorer::Operation& operation)
+{
+    if(name == "withdrawal")
+    {
+        operation = FraudScorer::OP_WITHDRAWAL;
+    }
+    else if(name == "transfer")
+    {
+        operation = FraudScorer::OP_TRANSFER;
+    }
+    else if(name == "mobile")
+    {
+        operation = FraudScorer::OP_MOBILE;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static qint64 percentile(const QVector<qint64>& sorted, double fraction)
+{
+    if(sorted.isEmpty())
+    {
+        return 0;
+    }
+    return sorted[qMin(sorted.size() - 1, static_cast<int>(sorted.size() * fraction))];
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = QCoreApplication::arguments();
+
+    QFile input;
+    if(args.size() > 1 && args[1] != "-")
+    {
+        input.setFileName(args[1]);
+        if(!input.open(QIODevice::ReadOnly | QIODevice::Text))
+        {
+            QTextStream(stderr) << "Cannot open " << args[1] << ": " << input.errorString() << "\n";
+            return 1;
+        }
+    }
+    else if(!input.open(stdin, QIODevice::ReadOnly | QIODevice::Text))
+    {
+        return 1;
+    }
+
+    FraudScorer scorer;
+    if(args.size() > 2)
+    {
+        scorer.setBudget(args[2].toLongLong());
+    }
+
+    QTextStream in(&input);
+    QTextStream out(stdout);
+    out << "time,card_number,event,amount,verdict,points,rules,elapsed_ns\n";
+
+    int verdicts[3] = {0, 0, 0};
+    int overBudget = 0;
+    int malformed = 0;
+    QVector<qint64> latencies;
+
+    while(!in.atEnd())
+    {
+        const QString line = in.readLine().trimmed();
+        if(line.isEmpty() || line.startsWith("#") || line.startsWith("time,"))
+        {
+            continue;
+        }
+        const QStringList fields = line.split(',');
+        if(fields.size() < 6)
+        {
+            ++malformed;
+            continue;
+        }
+        const qint64 time = fields[0].toLongLong();
+        const QString& card = fields[1];
+        if(fields[2] == "pin_fail")
+        {
+            scorer.onPinFailure(card, time);
+            continue;
+        }
+
+        FraudScorer::Transaction transaction;
+        if(!parseOperation(fields[2], transaction._operation))
+        {
+            ++malformed;
+            continue;
+        }
+        transaction._amount = fields[3].toDouble();
+        transaction._beneficiary = fields[4];
+        transaction._time = time;
+        transaction._hour = fields[5].toInt();
+
+        const FraudScorer::Score score = scorer.score(card, transaction);
+        if(score._verdict != FraudScorer::DENY)
+        {
+            scorer.onCommitted(card, transaction);
+        }
+        ++verdicts[score._verdict];
+        if(score._over_budget)
+        {
+            ++overBudget;
+        }
+        latencies.append(score._elapsed_ns);
+
+        out << time << ',' << card << ',' << fields[2] << ',' << fields[3] << ','
+            << FraudScorer::verdictName(score._verdict) << ',' << score._points << ','
+            << QString::number(score._rules, 16) << ',' << score._elapsed_ns << '\n';
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    QTextStream err(stderr);
+    err << "scored: " << latencies.size()
+        << "  allow: " << verdicts[FraudScorer::ALLOW]
+        << "  step-up: " << verdicts[FraudScorer::STEP_UP]
+        << "  deny: " << verdicts[FraudScorer::DENY]
+        << "  over budget: " << overBudget
+        << "  malformed: " << malformed << "\n";
+    err << "latency ns  p50: " << percentile(latencies, 0.50)
+        << "  p99: " << percentile(latencies, 0.99)
+        << "  max: " << (latencies.isEmpty() ? 0 : latencies.last()) << "\n";
+    return 0;
+}
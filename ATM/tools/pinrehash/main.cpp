@@ -0,0 +1,262 @@
+// Hashes card PINs into pin_hashes, for ATMs to check PINs against (see PinVerifier.h).
+//
+// Cards without a hash, or with one made at another cost, are hashed from
+// cards.pin on PinVerifier's worker pool, a batch at a time; every batch is
+// stored in one DB transaction, so an interrupted run resumes where it stopped.
+// Cards whose plaintext PIN has been cleared cannot be rehashed and are skipped.
+//
+// Reports KDF time and queue wait per hash: a check costs about what a hash
+// does at the same cost, and comes on top of every customer's time to menu.
+//
+// Usage:
+//     pinrehash [options]
+//         --db bank.db            bank database (default bank.db)
+//         --log2-n N              scrypt cost: N = 2^log2-n (default 14)
+//         --r N                   scrypt block size (default 8)
+//         --p N                   scrypt parallelism (default 1)
+//         --workers N             hashing threads (default: one per core)
+//         --batch N               cards per transaction (default 256)
+//         --clear-plaintext       blank cards.pin once the card's hash is stored
+//
+// Exit code: 0 on success, 2 on errors.
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QtSql>
+
+#include "PinVerifier.h"
+
+static const char* const SELECT_CARDS =
+    "SELECT cards.card_number, cards.pin, pin_hashes.hash "
+    "FROM cards LEFT JOIN pin_hashes ON pin_hashes.card_number = cards.card_number";
+static const char* const CLEAR_PLAINTEXT = "UPDATE cards SET pin = '' WHERE card_number = ?";
+
+struct Options
+{
+    QString _database;
+    PinVerifier::Cost _cost;
+    int _workers;
+    int _batch;
+    bool _clear_plaintext;
+};
+
+struct Card
+{
+    QString _card_number;
+    QString _pin;
+};
+
+static bool parseOptions(const QStringList& args, Options& options, QTextStream& err)
+{
+    options._database = "bank.db";
+    options._cost = PinVerifier::DEFAULT_COST;
+    options._workers = qMax(1, QThread::idealThreadCount());
+    options._batch = 256;
+    options._clear_plaintext = false;
+    for(int i = 1; i < args.size(); ++i)
+    {
+        const QString& arg = args[i];
+        if(arg == "--clear-plaintext")
+        {
+            options._clear_plaintext = true;
+            continue;
+        }
+        if(i + 1 >= args.size())
+        {
+            err << arg << ": value expected\n";
+            return false;
+        }
+        const QString& value = args[++i];
+        bool ok = true;
+        if(arg == "--db")
+        {
+            options._database = value;
+        }
+        else if(arg == "--log2-n")
+        {
+            options._cost._log2_n = value.toInt(&ok);
+        }
+        else if(arg == "--r")
+        {
+            options._cost._r = value.toInt(&ok);
+        }
+        else if(arg == "--p")
+        {
+            options._cost._p = value.toInt(&ok);
+        }
+        else if(arg == "--workers")
+        {
+            options._workers = value.toInt(&ok);
+            ok = ok && options._workers > 0;
+        }
+        else if(arg == "--batch")
+        {
+            options._batch = value.toInt(&ok);
+            ok = ok && options._batch > 0;
+        }
+        else
+        {
+            err << arg << ": unknown option\n";
+            return false;
+        }
+        if(!ok)
+        {
+            err << arg << " " << value << ": bad value\n";
+            return false;
+        }
+    }
+    const PinVerifier::Cost& cost = options._cost;
+    if(cost._log2_n < 1 || cost._log2_n > PinVerifier::MAX_LOG2_N ||
+       cost._r < 1 || cost._r > PinVerifier::MAX_R || cost._p < 1 || cost._p > PinVerifier::MAX_P)
+    {
+        err << "scrypt cost out of range: log2-n 1.." << PinVerifier::MAX_LOG2_N
+            << ", r 1.." << PinVerifier::MAX_R << ", p 1.." << PinVerifier::MAX_P << "\n";
+        return false;
+    }
+    return true;
+}
+
+// Cards that have no hash at 'cost' yet; 'skipped' counts those without a plaintext PIN to hash
+static bool selectCards(QSqlDatabase& database, const PinVerifier::Cost& cost, QVector<Card>& cards, int& skipped)
+{
+    QSqlQuery query(database);
+    query.setForwardOnly(true);
+    if(!query.exec(SELECT_CARDS))
+    {
+        return false;
+    }
+    skipped = 0;
+    while(query.next())
+    {
+        PinVerifier::Cost hashed;
+        const bool current = PinVerifier::costOf(query.value(2).toByteArray(), hashed) &&
+                             hashed._log2_n == cost._log2_n && hashed._r == cost._r && hashed._p == cost._p;
+        if(current)
+        {
+            continue;
+        }
+        Card card;
+        card._card_number = query.value(0).toString();
+        card._pin = query.value(1).toString().trimmed();
+        if(card._pin.isEmpty())
+        {
+            ++skipped;
+            continue;
+        }
+        cards.append(card);
+    }
+    return !query.lastError().isValid();
+}
+
+// Store one batch of hashes in one transaction
+static bool storeBatch(QSqlDatabase& database, const QVector<Card>& cards, int first,
+                       const QVector<QByteArray>& hashes, bool clearPlaintext)
+{
+    if(!database.transaction())
+    {
+        return false;
+    }
+    QSqlQuery store(database);
+    QSqlQuery clear(database);
+    bool succeeded = store.prepare(PinVerifier::STORE_HASH) && (!clearPlaintext || clear.prepare(CLEAR_PLAINTEXT));
+    for(int i = 0; succeeded && i < hashes.size(); ++i)
+    {
+        succeeded = !hashes[i].isEmpty();
+        if(succeeded)
+        {
+            store.bindValue(0, cards[first + i]._card_number);
+            store.bindValue(1, QString::fromLatin1(hashes[i]));
+            succeeded = store.exec();
+        }
+        if(succeeded && clearPlaintext)
+        {
+            clear.bindValue(0, cards[first + i]._card_number);
+            succeeded = clear.exec();
+        }
+    }
+    if(!succeeded || !database.commit())
+    {
+        database.rollback();
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = QCoreApplication::arguments();
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    Options options;
+    if(!parseOptions(args, options, err))
+    {
+        err << "Usage: pinrehash [--db bank.db] [--log2-n N] [--r N] [--p N] [--workers N] [--batch N]\n"
+               "                 [--clear-plaintext]\n";
+        return 2;
+    }
+
+    bool succeeded = false;
+    int hashed = 0;
+    int skipped = 0;
+    QElapsedTimer clock;
+    PinVerifier verifier;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", "pinrehash");
+        database.setDatabaseName(options._database);
+        QVector<Card> cards;
+        if(!database.open())
+        {
+            err << options._database << ": " << database.lastError().text() << "\n";
+        }
+        else if(!QSqlQuery(database).exec(PinVerifier::CREATE_TABLE) ||
+                !selectCards(database, options._cost, cards, skipped))
+        {
+            err << options._database << ": failed to list cards\n";
+        }
+        else
+        {
+            clock.start();
+            verifier.start(options._workers);
+            succeeded = true;
+            for(int first = 0; succeeded && first < cards.size(); first += options._batch)
+            {
+                const int count = qMin(options._batch, cards.size() - first);
+                QVector<QString> pins(count);
+                for(int i = 0; i < count; ++i)
+                {
+                    pins[i] = cards[first + i]._pin;
+                }
+                succeeded = storeBatch(database, cards, first, verifier.hashBatch(pins, options._cost),
+                                       options._clear_plaintext);
+                if(succeeded)
+                {
+                    hashed += count;
+                }
+                else
+                {
+                    err << options._database << ": failed to store hashes of cards " << first
+                        << ".." << (first + count - 1) << "\n";
+                }
+            }
+            verifier.stop();
+        }
+        database.close();
+    }
+    QSqlDatabase::removeDatabase("pinrehash");
+
+    const PinVerifier::Metrics metrics = verifier.metrics();
+    const double seconds = clock.isValid() ? clock.nsecsElapsed() / 1e9 : 0;
+    const double perHash = metrics._hashes ? 1.0 / metrics._hashes : 0;
+    out << "hashed " << hashed << " cards, skipped " << skipped << " without plaintext PIN"
+        << " (scrypt log2-n=" << options._cost._log2_n << " r=" << options._cost._r << " p=" << options._cost._p
+        << ", " << options._workers << " workers)\n";
+    out << "hashes/s " << QString::number(seconds > 0 ? hashed / seconds : 0, 'f', 1)
+        << "  KDF ms " << QString::number(metrics._hash_kdf_total_ns * perHash / 1e6, 'f', 2)
+        << "  queue wait ms " << QString::number(metrics._hash_wait_total_ns * perHash / 1e6, 'f', 2) << "\n";
+    return succeeded ? 0 : 2;
+}
@@ -0,0 +1,242 @@
+#include "Ledger.h"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+// Internal card numbers are this long, PANs are longer
+static const int INTERNAL_CARD_DIGITS = 8;
+static const quint64 INTERNAL_CARD_LIMIT = Q_UINT64_C(100000000);
+
+PartitionTotals::PartitionTotals():
+    _cards(0),
+    _opening(0),
+    _debits(0),
+    _credits(0),
+    _closing(0)
+{}
+
+void PartitionTotals::merge(const PartitionTotals& other)
+{
+    _cards += other._cards;
+    _opening += other._opening;
+    _debits += other._debits;
+    _credits += other._credits;
+    _closing += other._closing;
+    _discrepancies.insert(_discrepancies.end(), other._discrepancies.begin(), other._discrepancies.end());
+}
+
+bool Ledger::parseCard(const char* begin, const char* end, quint64& card)
+{
+    card = 0;
+    int digits = 0;
+    for(const char* c = begin; c != end && *c != '\0'; ++c)
+    {
+        if(*c < '0' || *c > '9' || ++digits > MAX_CARD_DIGITS)
+        {
+            return false;
+        }
+        card = card * 10 + static_cast<quint64>(*c - '0');
+    }
+    return digits > 0;
+}
+
+QString Ledger::formatCard(quint64 card)
+{
+    if(card < INTERNAL_CARD_LIMIT)
+    {
+        return QString("%1").arg(card, INTERNAL_CARD_DIGITS, 10, QChar('0'));
+    }
+    return QString::number(card);
+}
+
+qint64 Ledger::toCents(double amount)
+{
+    return qRound64(amount * 100.0);
+}
+
+QString Ledger::formatCents(qint64 cents)
+{
+    const quint64 absolute = (cents < 0) ? static_cast<quint64>(-cents) : static_cast<quint64>(cents);
+    return QString("%1%2.%3").arg((cents < 0) ? "-" : "")
+                             .arg(absolute / 100)
+                             .arg(absolute % 100, 2, 10, QChar('0'));
+}
+
+// Decimal amount to cents; does not depend on locale, unlike strtod()
+static bool parseCents(const char* begin, const char* end, qint64& cents)
+{
+    while(begin != end && (*begin == ' ' || *begin == '"'))
+    {
+        ++begin;
+    }
+    while(end != begin && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '"'))
+    {
+        --end;
+    }
+    bool negative = false;
+    if(begin != end && (*begin == '-' || *begin == '+'))
+    {
+        negative = (*begin == '-');
+        ++begin;
+    }
+    qint64 units = 0;
+    int digits = 0;
+    for(; begin != end && *begin >= '0' && *begin <= '9'; ++begin, ++digits)
+    {
+        units = units * 10 + (*begin - '0');
+    }
+    qint64 fraction = 0;
+    if(begin != end && *begin == '.')
+    {
+        ++begin;
+        int fractionDigits = 0;
+        for(; begin != end && *begin >= '0' && *begin <= '9'; ++begin, ++digits, ++fractionDigits)
+        {
+            if(fractionDigits < 3)
+            {
+                fraction = fraction * 10 + (*begin - '0');
+            }
+        }
+        for(; fractionDigits < 3; ++fractionDigits)
+        {
+            fraction *= 10;
+        }
+        fraction = (fraction + 5) / 10;     // Thousandths to cents, rounded
+    }
+    if(begin != end || digits == 0)
+    {
+        return false;
+    }
+    cents = units * 100 + fraction;
+    if(negative)
+    {
+        cents = -cents;
+    }
+    return true;
+}
+
+quint64 Ledger::parseBalances(const char* begin, const char* end, std::vector<LedgerEntries>& partitions)
+{
+    const int count = static_cast<int>(partitions.size());
+    quint64 malformed = 0;
+    for(const char* line = begin; line < end;)
+    {
+        const char* eol = static_cast<const char*>(memchr(line, '\n', end - line));
+        if(!eol)
+        {
+            eol = end;
+        }
+        const char* comma = static_cast<const char*>(memchr(line, ',', eol - line));
+        LedgerEntry entry;
+        if(comma && parseCard(line, comma, entry._card) && parseCents(comma + 1, eol, entry._cents))
+        {
+            partitions[partitionOf(entry._card, count)].push_back(entry);
+        }
+        else
+        {
+            const bool empty = (eol == line) || (eol == line + 1 && *line == '\r');
+            const bool header = (line == begin) && ((*line >= 'a' && *line <= 'z') || (*line >= 'A' && *line <= 'Z'));
+            if(!empty && !header)
+            {
+                ++malformed;
+            }
+        }
+        line = eol + 1;
+    }
+    return malformed;
+}
+
+static bool byCard(const LedgerEntry& left, const LedgerEntry& right)
+{
+    return left._card < right._card;
+}
+
+void Ledger::reconcile(LedgerEntries& opening,
+                       LedgerEntries& closing,
+                       LedgerEntries& movements,
+                       PartitionTotals& totals)
+{
+    std::sort(opening.begin(), opening.end(), byCard);
+    std::sort(closing.begin(), closing.end(), byCard);
+    std::sort(movements.begin(), movements.end(), byCard);
+
+    // Merge walk over the three sorted lists, one card at a time
+    const quint64 NONE = std::numeric_limits<quint64>::max();
+    size_t o = 0;
+    size_t c = 0;
+    size_t m = 0;
+    while(o < opening.size() || c < closing.size() || m < movements.size())
+    {
+        quint64 card = NONE;
+        if(o < opening.size())
+        {
+            card = opening[o]._card;
+        }
+        if(c < closing.size())
+        {
+            card = qMin(card, closing[c]._card);
+        }
+        if(m < movements.size())
+        {
+            card = qMin(card, movements[m]._card);
+        }
+
+        Discrepancy line;
+        line._card = card;
+        line._kind = Discrepancy::BALANCE_MISMATCH;
+        line._opening = line._debits = line._credits = line._closing = 0;
+        bool hasOpening = false;
+        bool hasClosing = false;
+        bool duplicate = false;
+        for(; o < opening.size() && opening[o]._card == card; ++o)
+        {
+            duplicate = duplicate || hasOpening;
+            line._opening = hasOpening ? line._opening : opening[o]._cents;
+            hasOpening = true;
+        }
+        for(; c < closing.size() && closing[c]._card == card; ++c)
+        {
+            duplicate = duplicate || hasClosing;
+            line._closing = hasClosing ? line._closing : closing[c]._cents;
+            hasClosing = true;
+        }
+        for(; m < movements.size() && movements[m]._card == card; ++m)
+        {
+            if(movements[m]._cents < 0)
+            {
+                line._debits -= movements[m]._cents;
+            }
+            else
+            {
+                line._credits += movements[m]._cents;
+            }
+        }
+
+        ++totals._cards;
+        totals._opening += line._opening;
+        totals._debits += line._debits;
+        totals._credits += line._credits;
+        totals._closing += line._closing;
+
+        const bool balanced = (line._opening + line._credits - line._debits == line._closing);
+        if(duplicate)
+        {
+            line._kind = Discrepancy::DUPLICATE;
+        }
+        else if(!hasClosing)
+        {
+            line._kind = Discrepancy::NO_CLOSING;
+        }
+        else if(balanced)
+        {
+            // Cards issued today with nothing but ATM movements balance from zero
+            continue;
+        }
+        else if(!hasOpening)
+        {
+            line._kind = Discrepancy::NO_OPENING;
+        }
+        totals._discrepancies.push_back(line);
+    }
+}
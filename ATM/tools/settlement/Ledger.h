@@ -0,0 +1,84 @@
+#ifndef LEDGER_H
+#define LEDGER_H
+
+#include <QString>
+#include <QtGlobal>
+#include <vector>
+
+// Building blocks of the end-of-day settlement.
+//
+// Money is kept in integer cents and card numbers as integers, so that
+// 10^7 cards fit in memory several times over and sort fast.
+// Card numbers are up to 19 digits; internal 8-digit numbers may have leading
+// zeros, PANs never do, so the integer maps back to exactly one number.
+
+// Balance or movement of one card
+struct LedgerEntry
+{
+    quint64 _card;
+    qint64 _cents;      // Movements: negative for debits, positive for credits
+};
+typedef std::vector<LedgerEntry> LedgerEntries;
+
+// Card whose closing balance does not follow from its opening balance and movements
+struct Discrepancy
+{
+    enum Kind
+    {
+        BALANCE_MISMATCH    = 0,    // opening + credits - debits != closing
+        NO_OPENING          = 1,    // Card has no opening balance (issued today?)
+        NO_CLOSING          = 2,    // Card is gone from the bank DB
+        DUPLICATE           = 3     // Card appears twice among opening or closing balances
+    };
+
+    quint64 _card;
+    Kind _kind;
+    qint64 _opening;
+    qint64 _debits;
+    qint64 _credits;
+    qint64 _closing;
+};
+
+// Result of reconciling one partition of cards
+struct PartitionTotals
+{
+    quint64 _cards;
+    qint64 _opening;
+    qint64 _debits;
+    qint64 _credits;
+    qint64 _closing;
+    std::vector<Discrepancy> _discrepancies;
+
+    PartitionTotals();
+    void merge(const PartitionTotals& other);
+};
+
+class Ledger
+{
+public:
+    enum { MAX_CARD_DIGITS = 19 };
+
+    // Digits only, NUL terminates early (audit records pad card numbers with NULs)
+    static bool parseCard(const char* begin, const char* end, quint64& card);
+    static QString formatCard(quint64 card);
+    static qint64 toCents(double amount);
+    static QString formatCents(qint64 cents);
+
+    // Same card always goes to the same partition
+    static inline int partitionOf(quint64 card, int partitions)
+    {
+        return static_cast<int>(((card * Q_UINT64_C(0x9E3779B97F4A7C15)) >> 32) % static_cast<quint64>(partitions));
+    }
+
+    // Parse "card_number,balance" lines in [begin, end) into per-partition vectors.
+    // A header line is skipped. Returns number of malformed lines.
+    static quint64 parseBalances(const char* begin, const char* end, std::vector<LedgerEntries>& partitions);
+
+    // Reconcile one partition. Inputs are sorted in place.
+    static void reconcile(LedgerEntries& opening,
+                          LedgerEntries& closing,
+                          LedgerEntries& movements,
+                          PartitionTotals& totals);
+};
+
+#endif // LEDGER_H
@@ -0,0 +1,1135 @@
+// End-of-day settlement and reconciliation.
+//
+// Money movements of the day are taken from the ATM audit trail: successful
+// WITHDRAW_FUNDS statements are debits, UPLOAD_FUNDS and APPEND_CREDIT statements
+// are credits, CASH_DISPENSED events are notes handed out. Records name cards by
+// token (see CardToken.h): the job tokenizes every card it has a balance for with
+// the terminals' key, and movements of cards it does not know count as malformed.
+// For every card the job checks
+//     opening balance + credits - debits == closing balance (cards.balance,
+//                                           plus hot account credits not merged yet)
+// and for every terminal it checks dispensed cash against cassette counts.
+//
+// Work is partitioned by card: input is parsed in parallel chunks, each chunk
+// sorting its entries into per-card partitions; partitions are then sorted and
+// reconciled in parallel, and per-partition and per-terminal totals are reduced.
+//
+// Usage:
+//     settlement [options] audit.bin [audit.bin ...]
+//         --opening file.csv      opening balances: card_number,balance
+//         --closing file.csv      closing balances; default is cards.balance from --db
+//         --db bank.db            bank database (default bank.db)
+//         --card-key file         key of card tokens, as provisioned to terminals (default card.key)
+//         --cassettes file.csv    cassette counts: atm_id,denomination,loaded,remaining;
+//                                 default is the cassettes table of --db, where terminals keep them
+//         --write-cassettes file  save the counts the job used, in --cassettes format
+//         --day yyyy-MM-dd        only take audit records of this day (UTC)
+//         --write-closing file    save closing balances, to be tomorrow's --opening
+//         --report file           write report there instead of stdout
+//         --threads N             default: number of cores
+//         --max-lines N           discrepancies listed in the report (default 1000)
+//     settlement --generate cards directory
+//         writes a consistent synthetic day (with a few planted discrepancies)
+//
+// Exit code: 0 if everything reconciles, 1 if there are discrepancies, 2 on errors.
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMap>
+#include <QMutex>
+#include <QScopedPointer>
+#include <QStringList>
+#include <QTextStream>
+#include <QThread>
+#include <QtSql>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <random>
+
+#include "AuditLog.h"
+#include "CardToken.h"
+#include "Ledger.h"
+
+// Partitions per thread: more than one, so that a thread that got
+// a heavy partition does not hold the whole job back
+static const int PARTITIONS_PER_THREAD = 8;
+static const int TERMINAL_COUNT = 65536;    // AuditRecord::_atm_id range
+static const qint64 NS_PER_DAY = Q_INT64_C(86400000000000);
+
+// Per-thread partitions: buckets[thread][partition]
+typedef std::vector<std::vector<LedgerEntries> > Buckets;
+// Card by its token
+typedef QHash<quint64, quint64> Tokens;
+
+struct TerminalTotals
+{
+    qint64 _debits;
+    qint64 _credits;
+    quint64 _debit_count;
+    quint64 _credit_count;
+    quint64 _failed_statements;
+    qint64 _dispensed;              // From the audit trail
+    qint64 _cassette_dispensed;     // From cassette counts
+    bool _has_cassettes;
+    quint32 _first_sequence;
+    quint32 _last_sequence;
+    quint64 _records;
+
+    TerminalTotals():
+        _debits(0), _credits(0), _debit_count(0), _credit_count(0), _failed_statements(0),
+        _dispensed(0), _cassette_dispensed(0), _has_cassettes(false),
+        _first_sequence(0xFFFFFFFF), _last_sequence(0), _records(0)
+    {}
+
+    void noteSequence(quint32 sequence)
+    {
+        _first_sequence = qMin(_first_sequence, sequence);
+        _last_sequence = qMax(_last_sequence, sequence);
+        ++_records;
+    }
+
+    // Records lost between the first and the last one seen
+    quint64 dropped() const
+    {
+        return _records ? (static_cast<quint64>(_last_sequence) - _first_sequence + 1 - _records) : 0;
+    }
+
+    bool cashMatches() const
+    {
+        return !_has_cassettes || _cassette_dispensed == _dispensed;
+    }
+
+    void merge(const TerminalTotals& other)
+    {
+        _debits += other._debits;
+        _credits += other._credits;
+        _debit_count += other._debit_count;
+        _credit_count += other._credit_count;
+        _failed_statements += other._failed_statements;
+        _dispensed += other._dispensed;
+        _cassette_dispensed += other._cassette_dispensed;
+        _has_cassettes = _has_cassettes || other._has_cassettes;
+        _first_sequence = qMin(_first_sequence, other._first_sequence);
+        _last_sequence = qMax(_last_sequence, other._last_sequence);
+        _records += other._records;
+    }
+};
+typedef QMap<quint16, TerminalTotals> Terminals;
+
+struct Options
+{
+    QString _opening;
+    QString _closing;
+    QString _database;
+    QString _card_key;
+    QString _cassettes;
+    QString _write_cassettes;
+    QString _write_closing;
+    QString _report;
+    QStringList _audit_files;
+    qint64 _from_ns;
+    qint64 _until_ns;
+    int _threads;
+    int _max_lines;
+};
+
+struct Timing
+{
+    const char* _phase;
+    qint64 _ms;
+};
+
+//==========
+// Running things in parallel
+
+class Worker : public QThread
+{
+public:
+    explicit Worker(const std::function<void()>& job): _job(job) {}
+
+protected:
+    void run()
+    {
+        _job();
+    }
+
+private:
+    std::function<void()> _job;
+};
+
+// Run job(thread) on 'threads' threads and wait for all of them
+static void runParallel(int threads, const std::function<void(int)>& job)
+{
+    std::vector<Worker*> workers;
+    for(int t = 0; t < threads; ++t)
+    {
+        workers.push_back(new Worker([&job, t]() { job(t); }));
+        workers.back()->start();
+    }
+    for(size_t t = 0; t < workers.size(); ++t)
+    {
+        workers[t]->wait();
+        delete workers[t];
+    }
+}
+
+static void prepareBuckets(Buckets& buckets, int threads, int partitions)
+{
+    buckets.assign(threads, std::vector<LedgerEntries>(partitions));
+}
+
+// Move everything one partition got from all threads into one vector
+static void gather(Buckets& buckets, int partition, LedgerEntries& result)
+{
+    size_t size = 0;
+    for(size_t t = 0; t < buckets.size(); ++t)
+    {
+        size += buckets[t][partition].size();
+    }
+    result.clear();
+    result.reserve(size);
+    for(size_t t = 0; t < buckets.size(); ++t)
+    {
+        LedgerEntries& bucket = buckets[t][partition];
+        result.insert(result.end(), bucket.begin(), bucket.end());
+        LedgerEntries().swap(bucket);
+    }
+}
+
+//==========
+// Input
+
+// Balances CSV, parsed in parallel chunks split at line boundaries
+static bool loadBalances(const QString& path, const Options& options, int partitions,
+                         Buckets& buckets, quint64& malformed, QTextStream& err)
+{
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly))
+    {
+        err << path << ": " << file.errorString() << "\n";
+        return false;
+    }
+    const qint64 size = file.size();
+    const int threads = options._threads;
+    prepareBuckets(buckets, threads, partitions);
+    malformed = 0;
+    if(size == 0)
+    {
+        return true;
+    }
+    const char* text = reinterpret_cast<const char*>(file.map(0, size));
+    if(!text)
+    {
+        err << path << ": " << file.errorString() << "\n";
+        return false;
+    }
+
+    std::vector<qint64> bounds(threads + 1, size);
+    bounds[0] = 0;
+    for(int t = 1; t < threads; ++t)
+    {
+        qint64 position = qMax(bounds[t - 1], size * t / threads);
+        while(position > 0 && position < size && text[position - 1] != '\n')
+        {
+            ++position;
+        }
+        bounds[t] = position;
+    }
+    std::vector<quint64> bad(threads, 0);
+    runParallel(threads, [&](int t) {
+        bad[t] = Ledger::parseBalances(text + bounds[t], text + bounds[t + 1], buckets[t]);
+    });
+    for(int t = 0; t < threads; ++t)
+    {
+        malformed += bad[t];
+    }
+    return true;
+}
+
+// Closing balances straight from the bank DB.
+// Credits to hot accounts the merger has not folded in yet count as well.
+static const char* const SELECT_BALANCES = "SELECT card_number, balance FROM cards";
+static const char* const SELECT_CASSETTES = "SELECT atm_id, denomination, loaded, remaining FROM cassettes";
+static const char* const SELECT_BALANCES_WITH_CREDITS =
+    "SELECT card_number, balance + COALESCE((SELECT SUM(amount) FROM hot_account_credits "
+    "WHERE hot_account_credits.card_number = cards.card_number), 0) FROM cards";
+
+static bool loadDatabaseBalances(const QString& path, int partitions, Buckets& buckets,
+                                 quint64& malformed, QTextStream& err)
+{
+    prepareBuckets(buckets, 1, partitions);
+    malformed = 0;
+    bool ok = false;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", "settlement");
+        database.setDatabaseName(path);
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            // DBs no ATM has migrated yet have no credits table
+            const bool hasCredits = query.exec("SELECT 1 FROM sqlite_master WHERE type='table' AND name='hot_account_credits'") &&
+                                    query.next();
+            query.finish();
+            ok = query.exec(hasCredits ? SELECT_BALANCES_WITH_CREDITS : SELECT_BALANCES);
+            while(ok && query.next())
+            {
+                const QByteArray number = query.value(0).toString().toLatin1();
+                LedgerEntry entry;
+                if(!Ledger::parseCard(number.constData(), number.constData() + number.size(), entry._card))
+                {
+                    ++malformed;
+                    continue;
+                }
+                entry._cents = Ledger::toCents(query.value(1).toDouble());
+                buckets[0][Ledger::partitionOf(entry._card, partitions)].push_back(entry);
+            }
+        }
+        if(!ok)
+        {
+            err << path << ": " << database.lastError().text() << "\n";
+        }
+        database.close();
+    }
+    QSqlDatabase::removeDatabase("settlement");
+    return ok;
+}
+
+struct AuditFile
+{
+    QFile* _file;
+    const AuditRecord* _records;
+    qint64 _count;
+};
+
+static bool openAuditFile(const QString& path, AuditFile& audit, QTextStream& err)
+{
+    audit._file = new QFile(path);
+    audit._records = NULL;
+    audit._count = 0;
+    if(!audit._file->open(QIODevice::ReadOnly))
+    {
+        err << path << ": " << audit._file->errorString() << "\n";
+        return false;
+    }
+    const qint64 size = audit._file->size();
+    const uchar* data = (size >= AuditLog::HEADER_SIZE) ? audit._file->map(0, size) : NULL;
+    quint32 version = 0;
+    quint32 recordSize = 0;
+    if(data)
+    {
+        memcpy(&version, data + 8, sizeof(version));
+        memcpy(&recordSize, data + 12, sizeof(recordSize));
+    }
+    if(!data || memcmp(data, AuditLog::FILE_MAGIC, sizeof(AuditLog::FILE_MAGIC)) != 0 ||
+       version != AuditLog::FORMAT_VERSION || recordSize != sizeof(AuditRecord))
+    {
+        err << path << ": not an audit trail file of version " << AuditLog::FORMAT_VERSION << "\n";
+        return false;
+    }
+    audit._records = reinterpret_cast<const AuditRecord*>(data + AuditLog::HEADER_SIZE);
+    // Incomplete last record (ATM died while writing it) is ignored
+    audit._count = (size - AuditLog::HEADER_SIZE) / static_cast<qint64>(sizeof(AuditRecord));
+    return true;
+}
+
+// Token of every card in the balances; threads take every threads-th partition
+static void tokenizeCards(const CardToken& cardToken, const Buckets& opening, const Buckets& closing,
+                          int threads, int partitions, Tokens& tokens)
+{
+    std::vector<std::vector<std::pair<quint64, quint64> > > local(threads);
+    runParallel(threads, [&](int t) {
+        const Buckets* const sources[] = {&opening, &closing};
+        for(int s = 0; s < 2; ++s)
+        {
+            const Buckets& buckets = *sources[s];
+            for(size_t b = 0; b < buckets.size(); ++b)
+            {
+                for(int p = t; p < partitions; p += threads)
+                {
+                    const LedgerEntries& entries = buckets[b][p];
+                    for(size_t i = 0; i < entries.size(); ++i)
+                    {
+                        const quint64 card = entries[i]._card;
+                        local[t].push_back(std::make_pair(cardToken.token(Ledger::formatCard(card)), card));
+                    }
+                }
+            }
+        }
+    });
+    for(int t = 0; t < threads; ++t)
+    {
+        for(size_t i = 0; i < local[t].size(); ++i)
+        {
+            tokens.insert(local[t][i].first, local[t][i].second);
+        }
+    }
+}
+
+// Turn the day's audit records into per-card movements and per-terminal totals.
+// Every thread takes an equal slice of all records, whichever files they are in.
+static bool loadMovements(const Options& options, const Tokens& tokens, int partitions, Buckets& buckets,
+                          Terminals& terminals, quint64& malformed, QTextStream& err)
+{
+    std::vector<AuditFile> files(options._audit_files.size());
+    bool ok = true;
+    qint64 total = 0;
+    for(int i = 0; i < options._audit_files.size(); ++i)
+    {
+        ok = openAuditFile(options._audit_files[i], files[i], err) && ok;
+        total += files[i]._count;
+    }
+
+    const int threads = options._threads;
+    prepareBuckets(buckets, threads, partitions);
+    std::vector<std::vector<TerminalTotals> > local(threads);
+    std::vector<quint64> bad(threads, 0);
+    if(ok)
+    {
+        runParallel(threads, [&](int t) {
+            std::vector<TerminalTotals>& mine = local[t];
+            mine.resize(TERMINAL_COUNT);
+            const qint64 first = total * t / threads;
+            const qint64 last = total * (t + 1) / threads;
+            qint64 base = 0;
+            for(size_t f = 0; f < files.size(); base += files[f]._count, ++f)
+            {
+                const qint64 begin = qMax(first, base) - base;
+                const qint64 end = qMin(last, base + files[f]._count) - base;
+                for(qint64 i = begin; i < end; ++i)
+                {
+                    const AuditRecord& record = files[f]._records[i];
+                    const qint64 time = static_cast<qint64>(record._timestamp_ns);
+                    if(time < options._from_ns || time >= options._until_ns)
+                    {
+                        continue;
+                    }
+                    TerminalTotals& terminal = mine[record._atm_id];
+                    terminal.noteSequence(record._sequence);
+                    if(record._event == AuditLog::EVENT_CASH_DISPENSED)
+                    {
+                        terminal._dispensed += Ledger::toCents(record._amount);
+                        continue;
+                    }
+                    if(record._event != AuditLog::EVENT_DB_STATEMENT ||
+                       (record._statement != AuditLog::STMT_WITHDRAW_FUNDS &&
+                        record._statement != AuditLog::STMT_UPLOAD_FUNDS &&
+                        record._statement != AuditLog::STMT_APPEND_CREDIT))
+                    {
+                        continue;
+                    }
+                    if(!record._result)
+                    {
+                        ++terminal._failed_statements;
+                        continue;
+                    }
+                    LedgerEntry entry;
+                    const Tokens::const_iterator card = tokens.constFind(record._card_token);
+                    if(card == tokens.constEnd())
+                    {
+                        ++bad[t];
+                        continue;
+                    }
+                    entry._card = card.value();
+                    const qint64 cents = Ledger::toCents(record._amount);
+                    if(record._statement == AuditLog::STMT_WITHDRAW_FUNDS)
+                    {
+                        terminal._debits += cents;
+                        ++terminal._debit_count;
+                        entry._cents = -cents;
+                    }
+                    else
+                    {
+                        terminal._credits += cents;
+                        ++terminal._credit_count;
+                        entry._cents = cents;
+                    }
+                    buckets[t][Ledger::partitionOf(entry._card, partitions)].push_back(entry);
+                }
+            }
+        });
+    }
+
+    malformed = 0;
+    for(int t = 0; t < threads; ++t)
+    {
+        malformed += bad[t];
+        for(int id = 0; id < static_cast<int>(local[t].size()); ++id)
+        {
+            if(local[t][id]._records)
+            {
+                terminals[static_cast<quint16>(id)].merge(local[t][id]);
+            }
+        }
+    }
+    for(size_t f = 0; f < files.size(); ++f)
+    {
+        delete files[f]._file;
+    }
+    return ok;
+}
+
+static void addCassette(Terminals& terminals, int atm, int denomination, int loaded, int remaining)
+{
+    TerminalTotals& terminal = terminals[static_cast<quint16>(atm)];
+    terminal._has_cassettes = true;
+    terminal._cassette_dispensed += static_cast<qint64>(loaded - remaining) * denomination * 100;
+}
+
+// atm_id,denomination,loaded,remaining
+static bool loadCassettes(const QString& path, Terminals& terminals, QTextStream& err)
+{
+    QFile file(path);
+    if(!file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        err << path << ": " << file.errorString() << "\n";
+        return false;
+    }
+    QTextStream in(&file);
+    int lineNumber = 0;
+    while(!in.atEnd())
+    {
+        const QString line = in.readLine().trimmed();
+        ++lineNumber;
+        const QStringList fields = line.split(',');
+        bool ok = (fields.size() == 4);
+        const int atm = ok ? fields[0].toInt(&ok) : 0;
+        const int denomination = ok ? fields[1].toInt(&ok) : 0;
+        const int loaded = ok ? fields[2].toInt(&ok) : 0;
+        const int remaining = ok ? fields[3].toInt(&ok) : 0;
+        if(!ok || atm < 0 || atm >= TERMINAL_COUNT)
+        {
+            if(!line.isEmpty() && lineNumber > 1)
+            {
+                err << path << ":" << lineNumber << ": malformed line skipped\n";
+            }
+            continue;
+        }
+        addCassette(terminals, atm, denomination, loaded, remaining);
+    }
+    return true;
+}
+
+// Counts terminals store with every dispense; copied to the CSV if one is given
+static bool loadDatabaseCassettes(const QString& path, const QString& copyPath, Terminals& terminals, QTextStream& err)
+{
+    QFile copy(copyPath);
+    if(!copyPath.isEmpty() && !copy.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+    {
+        err << copyPath << ": " << copy.errorString() << "\n";
+        return false;
+    }
+    QTextStream out(&copy);
+    if(copy.isOpen())
+    {
+        out << "atm_id,denomination,loaded,remaining\n";
+    }
+    bool ok = false;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", "settlement");
+        database.setDatabaseName(path);
+        if(database.open())
+        {
+            QSqlQuery query(database);
+            query.setForwardOnly(true);
+            // DBs no ATM has migrated yet have no cassettes: there is nothing to compare with
+            const bool hasCassettes = query.exec("SELECT 1 FROM sqlite_master WHERE type='table' AND name='cassettes'") &&
+                                      query.next();
+            query.finish();
+            ok = !hasCassettes || query.exec(SELECT_CASSETTES);
+            while(hasCassettes && ok && query.next())
+            {
+                const int atm = query.value(0).toInt();
+                const int denomination = query.value(1).toInt();
+                const int loaded = query.value(2).toInt();
+                const int remaining = query.value(3).toInt();
+                if(atm < 0 || atm >= TERMINAL_COUNT)
+                {
+                    continue;
+                }
+                addCassette(terminals, atm, denomination, loaded, remaining);
+                if(copy.isOpen())
+                {
+                    out << atm << "," << denomination << "," << loaded << "," << remaining << "\n";
+                }
+            }
+        }
+        if(!ok)
+        {
+            err << path << ": " << database.lastError().text() << "\n";
+        }
+        database.close();
+    }
+    QSqlDatabase::removeDatabase("settlement");
+    if(copy.isOpen())
+    {
+        out.flush();
+    }
+    if(copy.isOpen() && copy.error() != QFile::NoError)
+    {
+        err << copyPath << ": " << copy.errorString() << "\n";
+        return false;
+    }
+    return ok;
+}
+
+//==========
+// Output
+
+// Buffered writer for the large generated and closing files
+class OutputFile
+{
+public:
+    explicit OutputFile(const QString& path): _file(path)
+    {
+        _ok = _file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+        _buffer.reserve(BUFFER_SIZE);
+    }
+
+    ~OutputFile()
+    {
+        flush();
+    }
+
+    bool isOk() const
+    {
+        return _ok;
+    }
+
+    void write(const char* data, int size)
+    {
+        _buffer.append(data, size);
+        if(_buffer.size() >= BUFFER_SIZE)
+        {
+            flush();
+        }
+    }
+
+    void flush()
+    {
+        if(_ok && !_buffer.isEmpty())
+        {
+            _ok = (_file.write(_buffer) == _buffer.size());
+        }
+        _buffer.clear();
+    }
+
+private:
+    enum { BUFFER_SIZE = 1 << 20 };
+    QFile _file;
+    QByteArray _buffer;
+    bool _ok;
+};
+
+static int formatBalanceLine(char* line, size_t size, quint64 card, qint64 cents)
+{
+    const QByteArray number = Ledger::formatCard(card).toLatin1();
+    const quint64 absolute = (cents < 0) ? static_cast<quint64>(-cents) : static_cast<quint64>(cents);
+    return snprintf(line, size, "%s,%s%llu.%02llu\n", number.constData(), (cents < 0) ? "-" : "",
+                    static_cast<unsigned long long>(absolute / 100), static_cast<unsigned long long>(absolute % 100));
+}
+
+static const char* kindName(Discrepancy::Kind kind)
+{
+    switch(kind)
+    {
+    case Discrepancy::BALANCE_MISMATCH:
+        return "MISMATCH";
+    case Discrepancy::NO_OPENING:
+        return "NO_OPENING";
+    case Discrepancy::NO_CLOSING:
+        return "NO_CLOSING";
+    case Discrepancy::DUPLICATE:
+        return "DUPLICATE";
+    }
+    return "?";
+}
+
+static bool byCardNumber(const Discrepancy& left, const Discrepancy& right)
+{
+    return left._card < right._card;
+}
+
+static void writeReport(QTextStream& out, const Options& options, const PartitionTotals& totals,
+                        const Terminals& terminals, quint64 malformed, const std::vector<Timing>& timings)
+{
+    int cashMismatches = 0;
+    quint64 dropped = 0;
+    for(Terminals::const_iterator i = terminals.constBegin(); i != terminals.constEnd(); ++i)
+    {
+        cashMismatches += i.value().cashMatches() ? 0 : 1;
+        dropped += i.value().dropped();
+    }
+    const bool balanced = totals._discrepancies.empty() && cashMismatches == 0;
+
+    out << "SETTLEMENT REPORT\n";
+    out << "Generated:        " << QDateTime::currentDateTimeUtc().toString("yyyy-MM-dd hh:mm:ss") << " UTC\n";
+    out << "Threads:          " << options._threads << "\n";
+    out << "Cards:            " << totals._cards << "\n";
+    out << "Terminals:        " << terminals.size() << "\n";
+    out << "Opening total:    " << Ledger::formatCents(totals._opening) << "\n";
+    out << "Debits:           " << Ledger::formatCents(totals._debits) << "\n";
+    out << "Credits:          " << Ledger::formatCents(totals._credits) << "\n";
+    out << "Expected closing: " << Ledger::formatCents(totals._opening + totals._credits - totals._debits) << "\n";
+    out << "Closing total:    " << Ledger::formatCents(totals._closing) << "\n";
+    out << "Malformed input:  " << malformed << "\n";
+    out << "Dropped records:  " << dropped << (dropped ? "  (audit trail is incomplete!)" : "") << "\n";
+    out << "Status:           "
+        << (balanced ? QString("BALANCED")
+                     : QString("%1 card discrepancies, %2 terminal cash mismatches")
+                           .arg(static_cast<quint64>(totals._discrepancies.size())).arg(cashMismatches)) << "\n";
+
+    out << "\nTERMINALS\n";
+    out << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9\n")
+           .arg("atm", 5).arg("debits", 16).arg("count", 9).arg("credits", 16).arg("count", 9)
+           .arg("dispensed", 14).arg("cassettes", 14).arg("failed", 7).arg("dropped", 8);
+    for(Terminals::const_iterator i = terminals.constBegin(); i != terminals.constEnd(); ++i)
+    {
+        const TerminalTotals& terminal = i.value();
+        out << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9%10\n")
+               .arg(i.key(), 5)
+               .arg(Ledger::formatCents(terminal._debits), 16).arg(terminal._debit_count, 9)
+               .arg(Ledger::formatCents(terminal._credits), 16).arg(terminal._credit_count, 9)
+               .arg(Ledger::formatCents(terminal._dispensed), 14)
+               .arg(terminal._has_cassettes ? Ledger::formatCents(terminal._cassette_dispensed) : QString("-"), 14)
+               .arg(terminal._failed_statements, 7).arg(terminal.dropped(), 8)
+               .arg(terminal.cashMatches() ? "" : "  CASH MISMATCH");
+    }
+
+    out << "\nDISCREPANCIES\n";
+    out << QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+           .arg("card", 19).arg("kind", 10).arg("opening", 14).arg("debits", 14).arg("credits", 14)
+           .arg("expected", 14).arg("closing", 14).arg("difference", 14);
+    const int listed = qMin(static_cast<int>(totals._discrepancies.size()), options._max_lines);
+    for(int i = 0; i < listed; ++i)
+    {
+        const Discrepancy& line = totals._discrepancies[i];
+        const qint64 expected = line._opening + line._credits - line._debits;
+        out << QString("%1 %2 %3 %4 %5 %6 %7 %8\n")
+               .arg(Ledger::formatCard(line._card), 19).arg(kindName(line._kind), 10)
+               .arg(Ledger::formatCents(line._opening), 14).arg(Ledger::formatCents(line._debits), 14)
+               .arg(Ledger::formatCents(line._credits), 14).arg(Ledger::formatCents(expected), 14)
+               .arg(Ledger::formatCents(line._closing), 14).arg(Ledger::formatCents(line._closing - expected), 14);
+    }
+    if(static_cast<int>(totals._discrepancies.size()) > listed)
+    {
+        out << "... " << static_cast<quint64>(totals._discrepancies.size() - listed) << " more\n";
+    }
+
+    out << "\nTIMINGS\n";
+    qint64 total = 0;
+    for(size_t i = 0; i < timings.size(); ++i)
+    {
+        out << QString("%1 %2 ms\n").arg(timings[i]._phase, -20).arg(timings[i]._ms, 8);
+        total += timings[i]._ms;
+    }
+    out << QString("%1 %2 ms\n").arg("total", -20).arg(total, 8);
+}
+
+//==========
+// Synthetic day
+
+// Consistent day for 'cards' cards on 16 terminals. Every millionth card
+// gets its closing balance off by one cent, so a clean run reports exactly those.
+// Card as terminals put it in the audit trail
+static void setCard(AuditRecord& record, const CardToken& cardToken, quint64 card)
+{
+    const QString number = Ledger::formatCard(card);
+    const QByteArray masked = CardToken::mask(number).toLatin1();
+    memset(record._card_number, 0, sizeof(record._card_number));
+    memcpy(record._card_number, masked.constData(), qMin(masked.size(), static_cast<int>(sizeof(record._card_number)) - 1));
+    record._card_token = cardToken.token(number);
+}
+
+static int generate(quint64 cards, const QString& directory, QTextStream& out, QTextStream& err)
+{
+    const int TERMINALS = 16;
+    const int DENOMINATIONS[] = {500, 200, 100, 50};
+    const int DENOMINATION_COUNT = sizeof(DENOMINATIONS) / sizeof(DENOMINATIONS[0]);
+    const quint64 PLANTED_EVERY = 1000000;
+
+    QDir().mkpath(directory);
+    const QDir dir(directory);
+    // Terminals of the synthetic day share a key of their own
+    CardToken cardToken;
+    if(!cardToken.load(dir.filePath("card.key")))
+    {
+        err << dir.filePath("card.key") << ": failed to write card token key\n";
+        return 2;
+    }
+    std::mt19937_64 random(20161019);
+    std::vector<qint64> opening(cards);
+    std::vector<qint64> closing(cards);
+    for(quint64 i = 0; i < cards; ++i)
+    {
+        opening[i] = closing[i] = static_cast<qint64>(random() % 10000000);     // Up to 100000.00
+    }
+
+    std::vector<OutputFile*> audit(TERMINALS);
+    std::vector<quint32> sequence(TERMINALS, 0);
+    std::vector<std::vector<int> > notes(TERMINALS, std::vector<int>(DENOMINATION_COUNT, 0));
+    for(int t = 0; t < TERMINALS; ++t)
+    {
+        audit[t] = new OutputFile(dir.filePath(QString("audit-%1.0.bin").arg(t + 1)));
+        char header[AuditLog::HEADER_SIZE];
+        const quint32 recordSize = sizeof(AuditRecord);
+        memcpy(header, AuditLog::FILE_MAGIC, sizeof(AuditLog::FILE_MAGIC));
+        memcpy(header + 8, &AuditLog::FORMAT_VERSION, sizeof(quint32));
+        memcpy(header + 12, &recordSize, sizeof(recordSize));
+        audit[t]->write(header, sizeof(header));
+    }
+
+    const qint64 dayStart = QDateTime(QDateTime::currentDateTimeUtc().date(), QTime(0, 0), Qt::UTC).toMSecsSinceEpoch() * 1000000;
+    const quint64 operations = cards + cards / 2;
+    for(quint64 n = 0; n < operations; ++n)
+    {
+        const int t = static_cast<int>(random() % TERMINALS);
+        const quint64 card = random() % cards;
+        AuditRecord record;
+        memset(&record, 0, sizeof(record));
+        record._timestamp_ns = static_cast<quint64>(dayStart + static_cast<qint64>(n * (NS_PER_DAY / (operations + 1))));
+        record._atm_id = static_cast<quint16>(t + 1);
+        record._event = AuditLog::EVENT_DB_STATEMENT;
+        record._result = 1;
+        record._statement = AuditLog::STMT_WITHDRAW_FUNDS;
+        setCard(record, cardToken, card);
+
+        if(random() % 3)
+        {
+            // Cash withdrawal in whole notes
+            const qint64 amount = qMin<qint64>(closing[card] / 100, 50 * static_cast<qint64>(1 + random() % 40)) / 50 * 50;
+            if(amount == 0)
+            {
+                continue;
+            }
+            closing[card] -= amount * 100;
+            record._amount = static_cast<double>(amount);
+            record._sequence = sequence[t]++;
+            audit[t]->write(reinterpret_cast<const char*>(&record), sizeof(record));
+            qint64 left = amount;
+            for(int d = 0; d < DENOMINATION_COUNT; ++d)
+            {
+                notes[t][d] += static_cast<int>(left / DENOMINATIONS[d]);
+                left %= DENOMINATIONS[d];
+            }
+            record._event = AuditLog::EVENT_CASH_DISPENSED;
+            record._statement = AuditLog::STMT_OTHER;
+            record._result = 0;
+        }
+        else
+        {
+            // Transfer: debit here, credit to another card
+            const qint64 cents = qMin<qint64>(closing[card], static_cast<qint64>(random() % 100000));
+            const quint64 target = random() % cards;
+            closing[card] -= cents;
+            closing[target] += cents;
+            record._amount = cents / 100.0;
+            record._sequence = sequence[t]++;
+            audit[t]->write(reinterpret_cast<const char*>(&record), sizeof(record));
+            setCard(record, cardToken, target);
+            record._statement = AuditLog::STMT_UPLOAD_FUNDS;
+        }
+        record._sequence = sequence[t]++;
+        audit[t]->write(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+
+    OutputFile openingFile(dir.filePath("opening.csv"));
+    OutputFile closingFile(dir.filePath("closing.csv"));
+    char line[64];
+    for(quint64 i = 0; i < cards; ++i)
+    {
+        openingFile.write(line, formatBalanceLine(line, sizeof(line), i, opening[i]));
+        const qint64 planted = (i % PLANTED_EVERY == PLANTED_EVERY - 1) ? 1 : 0;
+        closingFile.write(line, formatBalanceLine(line, sizeof(line), i, closing[i] + planted));
+    }
+
+    OutputFile cassettes(dir.filePath("cassettes.csv"));
+    const char header[] = "atm_id,denomination,loaded,remaining\n";
+    cassettes.write(header, sizeof(header) - 1);
+    for(int t = 0; t < TERMINALS; ++t)
+    {
+        for(int d = 0; d < DENOMINATION_COUNT; ++d)
+        {
+            const int remaining = 100;
+            const int size = snprintf(line, sizeof(line), "%d,%d,%d,%d\n", t + 1, DENOMINATIONS[d],
+                                      notes[t][d] + remaining, remaining);
+            cassettes.write(line, size);
+        }
+    }
+
+    bool ok = openingFile.isOk() && closingFile.isOk() && cassettes.isOk();
+    for(int t = 0; t < TERMINALS; ++t)
+    {
+        audit[t]->flush();
+        ok = ok && audit[t]->isOk();
+        delete audit[t];
+    }
+    if(!ok)
+    {
+        err << directory << ": failed to write generated files\n";
+        return 2;
+    }
+    out << "Generated " << cards << " cards, " << TERMINALS << " terminals, "
+        << (cards / PLANTED_EVERY) << " planted discrepancies in " << directory << "\n"
+        << "Run: settlement --opening " << dir.filePath("opening.csv")
+        << " --closing " << dir.filePath("closing.csv")
+        << " --cassettes " << dir.filePath("cassettes.csv")
+        << " --card-key " << dir.filePath("card.key")
+        << " " << dir.filePath("audit-*.0.bin") << "\n";
+    return 0;
+}
+
+//==========
+
+static bool parseOptions(const QStringList& args, Options& options, QTextStream& err)
+{
+    options._database = "bank.db";
+    options._card_key = "card.key";
+    options._from_ns = 0;
+    options._until_ns = std::numeric_limits<qint64>::max();
+    options._threads = qMax(1, QThread::idealThreadCount());
+    options._max_lines = 1000;
+    for(int i = 1; i < args.size(); ++i)
+    {
+        const QString& arg = args[i];
+        const bool hasValue = (i + 1 < args.size());
+        if(!arg.startsWith("--"))
+        {
+            options._audit_files.append(arg);
+        }
+        else if(!hasValue)
+        {
+            err << arg << ": value expected\n";
+            return false;
+        }
+        else if(arg == "--opening")
+        {
+            options._opening = args[++i];
+        }
+        else if(arg == "--closing")
+        {
+            options._closing = args[++i];
+        }
+        else if(arg == "--db")
+        {
+            options._database = args[++i];
+        }
+        else if(arg == "--card-key")
+        {
+            options._card_key = args[++i];
+        }
+        else if(arg == "--cassettes")
+        {
+            options._cassettes = args[++i];
+        }
+        else if(arg == "--write-cassettes")
+        {
+            options._write_cassettes = args[++i];
+        }
+        else if(arg == "--write-closing")
+        {
+            options._write_closing = args[++i];
+        }
+        else if(arg == "--report")
+        {
+            options._report = args[++i];
+        }
+        else if(arg == "--threads")
+        {
+            options._threads = qMax(1, args[++i].toInt());
+        }
+        else if(arg == "--max-lines")
+        {
+            options._max_lines = qMax(0, args[++i].toInt());
+        }
+        else if(arg == "--day")
+        {
+            const QDate day = QDate::fromString(args[++i], "yyyy-MM-dd");
+            if(!day.isValid())
+            {
+                err << args[i] << ": date expected as yyyy-MM-dd\n";
+                return false;
+            }
+            options._from_ns = QDateTime(day, QTime(0, 0), Qt::UTC).toMSecsSinceEpoch() * 1000000;
+            options._until_ns = options._from_ns + NS_PER_DAY;
+        }
+        else
+        {
+            err << arg << ": unknown option\n";
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = QCoreApplication::arguments();
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    if(args.size() == 4 && args[1] == "--generate")
+    {
+        return generate(args[2].toULongLong(), args[3], out, err);
+    }
+    Options options;
+    if(args.size() < 2 || !parseOptions(args, options, err))
+    {
+        err << "Usage: settlement [--opening file.csv] [--closing file.csv | --db bank.db] [--card-key file]\n"
+               "                  [--cassettes file.csv]\n"
+               "                  [--day yyyy-MM-dd] [--write-closing file.csv] [--write-cassettes file.csv]\n"
+               "                  [--report file]\n"
+               "                  [--threads N] [--max-lines N] audit.bin [audit.bin ...]\n"
+               "       settlement --generate cards directory\n";
+        return 2;
+    }
+    if(options._opening.isEmpty())
+    {
+        err << "No opening balances given: every card will be reported as NO_OPENING unless it balances from zero\n";
+    }
+
+    const int partitions = options._threads * PARTITIONS_PER_THREAD;
+    std::vector<Timing> timings;
+    QElapsedTimer timer;
+    quint64 malformed = 0;
+    quint64 bad = 0;
+    bool ok = true;
+
+    Buckets opening;
+    timer.start();
+    if(!options._opening.isEmpty())
+    {
+        ok = loadBalances(options._opening, options, partitions, opening, bad, err) && ok;
+        malformed += bad;
+    }
+    else
+    {
+        prepareBuckets(opening, 1, partitions);
+    }
+    Timing loadOpening = {"opening balances", timer.restart()};
+    timings.push_back(loadOpening);
+
+    Buckets closing;
+    if(!options._closing.isEmpty())
+    {
+        ok = loadBalances(options._closing, options, partitions, closing, bad, err) && ok;
+    }
+    else
+    {
+        ok = loadDatabaseBalances(options._database, partitions, closing, bad, err) && ok;
+    }
+    malformed += bad;
+    Timing loadClosing = {"closing balances", timer.restart()};
+    timings.push_back(loadClosing);
+
+    CardToken cardToken;
+    if(!QFile::exists(options._card_key) || !cardToken.load(options._card_key))
+    {
+        err << options._card_key << ": no card token key; audit records cannot be matched with cards\n";
+        return 2;
+    }
+    Tokens tokens;
+    tokenizeCards(cardToken, opening, closing, options._threads, partitions, tokens);
+    Timing tokenize = {"card tokens", timer.restart()};
+    timings.push_back(tokenize);
+
+    Buckets movements;
+    Terminals terminals;
+    ok = loadMovements(options, tokens, partitions, movements, terminals, bad, err) && ok;
+    malformed += bad;
+    if(!options._cassettes.isEmpty())
+    {
+        ok = loadCassettes(options._cassettes, terminals, err) && ok;
+    }
+    else
+    {
+        ok = loadDatabaseCassettes(options._database, options._write_cassettes, terminals, err) && ok;
+    }
+    Timing loadAudit = {"audit trail", timer.restart()};
+    timings.push_back(loadAudit);
+    if(!ok)
+    {
+        return 2;
+    }
+
+    // Reconcile partitions in parallel; threads pick the next free partition
+    QScopedPointer<OutputFile> closingCopy(options._write_closing.isEmpty() ? NULL : new OutputFile(options._write_closing));
+    QMutex closingCopyMutex;
+    std::atomic<int> nextPartition(0);
+    std::vector<PartitionTotals> results(options._threads);
+    runParallel(options._threads, [&](int t) {
+        LedgerEntries openingEntries;
+        LedgerEntries closingEntries;
+        LedgerEntries movementEntries;
+        QByteArray text;
+        for(int p = nextPartition++; p < partitions; p = nextPartition++)
+        {
+            gather(opening, p, openingEntries);
+            gather(closing, p, closingEntries);
+            gather(movements, p, movementEntries);
+            Ledger::reconcile(openingEntries, closingEntries, movementEntries, results[t]);
+            if(closingCopy)
+            {
+                char line[64];
+                text.clear();
+                for(size_t i = 0; i < closingEntries.size(); ++i)
+                {
+                    text.append(line, formatBalanceLine(line, sizeof(line), closingEntries[i]._card, closingEntries[i]._cents));
+                }
+                QMutexLocker lock(&closingCopyMutex);
+                closingCopy->write(text.constData(), text.size());
+            }
+        }
+    });
+    PartitionTotals totals;
+    for(int t = 0; t < options._threads; ++t)
+    {
+        totals.merge(results[t]);
+    }
+    std::sort(totals._discrepancies.begin(), totals._discrepancies.end(), byCardNumber);
+    if(closingCopy)
+    {
+        closingCopy->flush();
+        if(!closingCopy->isOk())
+        {
+            err << options._write_closing << ": failed to write closing balances\n";
+            ok = false;
+        }
+    }
+    Timing reconcile = {"reconciliation", timer.restart()};
+    timings.push_back(reconcile);
+
+    QFile reportFile;
+    QTextStream report(stdout);
+    if(!options._report.isEmpty())
+    {
+        reportFile.setFileName(options._report);
+        if(!reportFile.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text))
+        {
+            err << options._report << ": " << reportFile.errorString() << "\n";
+            return 2;
+        }
+        report.setDevice(&reportFile);
+    }
+    writeReport(report, options, totals, terminals, malformed, timings);
+    report.flush();
+
+    if(!ok)
+    {
+        return 2;
+    }
+    bool cashOk = true;
+    for(Terminals::const_iterator i = terminals.constBegin(); i != terminals.constEnd(); ++i)
+    {
+        cashOk = cashOk && i.value().cashMatches();
+    }
+    return (totals._discrepancies.empty() && cashOk) ? 0 : 1;
+}
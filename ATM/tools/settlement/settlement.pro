@@ -0,0 +1,36 @@
+#-------------------------------------------------
+#
+# End-of-day settlement and reconciliation job
+#
+#-------------------------------------------------
+
+QT       += core sql
+QT       -= gui
+
+TARGET = settlement
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += $$PWD/../..
+
+SOURCES += main.cpp \
+    Ledger.cpp \
+    ../../AuditLog.cpp \
+    ../../CardToken.cpp
+
+HEADERS  += Ledger.h \
+    ../../AuditLog.h \
+    ../../CardToken.h
+
+QMAKE_CXXFLAGS += -std=c++11
+
+# Copy database file to target directory after linking
+win32 {
+    DB_SRC_LOCATION = $$replace(PWD,/,\\)
+    DB_DST_LOCATION = $$replace(OUT_PWD,/,\\)
+    QMAKE_POST_LINK += copy $$DB_SRC_LOCATION\\..\\..\\bank.db $$DB_DST_LOCATION\\
+}
+unix {
+    QMAKE_POST_LINK += cp $$PWD/../../bank.db $$OUT_PWD/
+}
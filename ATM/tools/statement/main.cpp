@@ -0,0 +1,221 @@
+// Statement of one card, straight from the bank DB.
+//
+// History is streamed: memory use does not depend on how many years
+// the statement covers, so it is fine to pull a card's whole life at once.
+//
+// Usage:
+//     statement [options] card_number
+//         --db bank.db            bank database (default bank.db)
+//         --format csv|print      CSV (default) or the fixed-width receipt layout
+//         --from yyyy-MM-dd       first day of the statement (UTC); default: first entry
+//         --to yyyy-MM-dd         last day of the statement (UTC); default: today
+//         --output file           write there instead of stdout
+//
+// Exit code: 0 on success, 2 on errors.
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QFile>
+#include <QStringList>
+#include <QTextStream>
+#include <QtSql>
+#include <cstdio>
+
+#include "CardHistory.h"
+
+static const qint64 SECONDS_PER_DAY = 24 * 3600;
+
+struct Options
+{
+    QString _card_number;
+    QString _database;
+    QString _output;
+    StatementExporter::Format _format;
+    qint64 _from;       // Seconds since epoch, inclusive
+    qint64 _to;         // Seconds since epoch, exclusive
+};
+
+// Encodes chunks as UTF-8 and writes them out as they come
+class FileSink : public StatementExporter::ISink
+{
+public:
+    explicit FileSink(QFile& file): _file(file), _failed(false) {}
+
+    void write(const QString& chunk)
+    {
+        const QByteArray bytes = chunk.toUtf8();
+        _failed = _failed || (_file.write(bytes) != bytes.size());
+    }
+
+    bool failed() const
+    {
+        return _failed;
+    }
+
+private:
+    QFile& _file;
+    bool _failed;
+};
+
+// Midnight UTC starting the given day
+static bool parseDay(const QString& text, qint64& seconds, QTextStream& err)
+{
+    const QDate day = QDate::fromString(text, "yyyy-MM-dd");
+    if(!day.isValid())
+    {
+        err << text << ": date expected as yyyy-MM-dd\n";
+        return false;
+    }
+    seconds = QDateTime(day, QTime(0, 0), Qt::UTC).toMSecsSinceEpoch() / 1000;
+    return true;
+}
+
+static bool parseOptions(const QStringList& args, Options& options, QTextStream& err)
+{
+    options._database = "bank.db";
+    options._format = StatementExporter::FORMAT_CSV;
+    options._from = 0;
+    // End of today
+    options._to = (QDateTime::currentMSecsSinceEpoch() / 1000 / SECONDS_PER_DAY + 1) * SECONDS_PER_DAY;
+    for(int i = 1; i < args.size(); ++i)
+    {
+        const QString& arg = args[i];
+        const bool hasValue = (i + 1 < args.size());
+        if(!arg.startsWith("--"))
+        {
+            if(!options._card_number.isEmpty())
+            {
+                err << arg << ": only one card per statement\n";
+                return false;
+            }
+            options._card_number = arg;
+        }
+        else if(!hasValue)
+        {
+            err << arg << ": value expected\n";
+            return false;
+        }
+        else if(arg == "--db")
+        {
+            options._database = args[++i];
+        }
+        else if(arg == "--output")
+        {
+            options._output = args[++i];
+        }
+        else if(arg == "--format")
+        {
+            const QString& format = args[++i];
+            if(format == "csv")
+            {
+                options._format = StatementExporter::FORMAT_CSV;
+            }
+            else if(format == "print")
+            {
+                options._format = StatementExporter::FORMAT_PRINT;
+            }
+            else
+            {
+                err << format << ": format is either csv or print\n";
+                return false;
+            }
+        }
+        else if(arg == "--from")
+        {
+            if(!parseDay(args[++i], options._from, err))
+            {
+                return false;
+            }
+        }
+        else if(arg == "--to")
+        {
+            if(!parseDay(args[++i], options._to, err))
+            {
+                return false;
+            }
+            options._to += SECONDS_PER_DAY;
+        }
+        else
+        {
+            err << arg << ": unknown option\n";
+            return false;
+        }
+    }
+    return !options._card_number.isEmpty();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+    const QStringList args = QCoreApplication::arguments();
+    QTextStream err(stderr);
+
+    Options options;
+    if(!parseOptions(args, options, err))
+    {
+        err << "Usage: statement [--db bank.db] [--format csv|print] [--from yyyy-MM-dd] [--to yyyy-MM-dd]\n"
+               "                 [--output file] card_number\n";
+        return 2;
+    }
+    if(options._from >= options._to)
+    {
+        err << "Statement period is empty\n";
+        return 2;
+    }
+
+    QFile output;
+    bool opened = false;
+    if(options._output.isEmpty())
+    {
+        opened = output.open(stdout, QIODevice::WriteOnly);
+    }
+    else
+    {
+        output.setFileName(options._output);
+        opened = output.open(QIODevice::WriteOnly | QIODevice::Truncate);
+    }
+    if(!opened)
+    {
+        err << options._output << ": " << output.errorString() << "\n";
+        return 2;
+    }
+
+    qint64 entries = -1;
+    QString error;
+    {
+        QSqlDatabase database = QSqlDatabase::addDatabase("QSQLITE", "statement");
+        database.setDatabaseName(options._database);
+        if(database.open())
+        {
+            FileSink sink(output);
+            StatementExporter exporter;
+            entries = exporter.exportStatement(database, options._card_number, options._from, options._to,
+                                               options._format, sink);
+            if(sink.failed())
+            {
+                error = output.errorString();
+                entries = -1;
+            }
+            else if(entries < 0)
+            {
+                // Also the case for a bank DB no ATM has been powered on against yet
+                error = "failed to read card history";
+            }
+            database.close();
+        }
+        else
+        {
+            error = database.lastError().text();
+        }
+    }
+    QSqlDatabase::removeDatabase("statement");
+    output.close();
+
+    if(entries < 0)
+    {
+        err << options._database << ": " << error << "\n";
+        return 2;
+    }
+    err << entries << " entries\n";
+    return 0;
+}
@@ -0,0 +1,32 @@
+#-------------------------------------------------
+#
+# Card statement export for branch staff
+#
+#-------------------------------------------------
+
+QT       += core sql
+QT       -= gui
+
+TARGET = statement
+CONFIG   += console
+CONFIG   -= app_bundle
+TEMPLATE = app
+
+INCLUDEPATH += $$PWD/../..
+
+SOURCES += main.cpp \
+    ../../CardHistory.cpp
+
+HEADERS  += ../../CardHistory.h
+
+QMAKE_CXXFLAGS += -std=c++11
+
+# Copy database file to target directory after linking
+win32 {
+    DB_SRC_LOCATION = $$replace(PWD,/,\\)
+    DB_DST_LOCATION = $$replace(OUT_PWD,/,\\)
+    QMAKE_POST_LINK += copy $$DB_SRC_LOCATION\\..\\..\\bank.db $$DB_DST_LOCATION\\
+}
+unix {
+    QMAKE_POST_LINK += cp $$PWD/../../bank.db $$OUT_PWD/
+}